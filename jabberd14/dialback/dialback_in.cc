@@ -469,6 +469,9 @@ void dialback_in_read(mio m, int flags, void *arg, xmlnode x, char* unused1, int
     /* reset to a dialback packet reader */
     mio_reset(m, dialback_in_read_db, (void *)c);
 
+    /* stanzas from other servers are mostly routed only, no need to parse their content */
+    mio_xml_envelope(m);
+
     /* write stream features */
     if (c->xmpp_version >= 1) {
 	xmlnode features = xmlnode_new_tag_ns("features", "stream", NS_STREAM);
@@ -40,50 +40,98 @@
 
 #include "jabberd.h"
 
-/* I really don't like having this as a global variable */
-extern xmlnode greymatter__;
+/**
+ * the grants of the ACL for a feature
+ */
+struct acl_grants {
+    xmppd::xhash<bool> domains;			/**< domains, whose users have access */
+    xmppd::xhash<xmppd::xhash<bool> > users;	/**< users, that have access: domain as key, hash of the nodes as value */
+    std::vector<std::pair<unsigned, std::string> > jids; /**< the users, that have access, with their position in the configuration file */
+};
 
-static int acl_check_access_domain(xdbcache xdb, const char* function, const jid user) {
-    static xht		namespaces = NULL;
-    xmlnode_vector	acl;
-    pool		p = NULL;
-    jid			result = NULL;
+static xmppd::xhash<acl_grants> acl__features;	/**< the compiled grants, feature as key */
+static acl_grants acl__all;			/**< the compiled grants without a feature attribute, they apply to all features */
+static unsigned acl__jids = 0;			/**< number of &lt;jid/&gt; elements compiled, used as their position */
 
-    /* sanity check */
-    if (xdb == NULL || function == NULL || user == NULL)
-	return 0;
+/**
+ * add a &lt;grant/&gt; element of the ACL to the compiled grants of a feature
+ *
+ * @param grants the compiled grants to add to
+ * @param grant the &lt;grant/&gt; element
+ * @param namespaces the namespace prefixes to use
+ */
+static void acl_compile_grant(acl_grants& grants, xmlnode grant, xht namespaces) {
+    xmlnode_vector domains = xmlnode_get_tags(grant, "acl:domain", namespaces);
+    for (xmlnode_vector::iterator p = domains.begin(); p != domains.end(); ++p) {
+	const char *domain = xmlnode_get_data(*p);
 
-    /* define namespace prefixes */
-    if (namespaces == NULL) {
-	namespaces = xhash_new(3);
-	xhash_put(namespaces, "", const_cast<char*>(NS_JABBERD_CONFIGFILE));
-	xhash_put(namespaces, "acl", const_cast<char*>(NS_JABBERD_ACL));
+	if (domain != NULL)
+	    grants.domains[domain] = true;
     }
 
-    /* get the acl */
-    acl = xmlnode_get_tags(greymatter__, "global/acl:acl/acl:grant", namespaces);
-
-    /* iterate the features */
-    xmlnode_vector::iterator iter;
-    for (iter = acl.begin(); iter != acl.end(); ++iter) {
-	const char *f = xmlnode_get_attrib_ns(*iter, "feature", NULL);
-
-	/* are we interested in this feature element? */
-	if (f == NULL || j_strcmp(f, function) == 0) {
-	    /* check for domain tags */
-	    xmlnode_vector domain = xmlnode_get_tags(*iter, "acl:domain", namespaces);
-	    xmlnode_vector::iterator p;
-	    for (p = domain.begin(); p != domain.end(); ++p) {
-		if (j_strcmp(user->get_domain().c_str(), xmlnode_get_data(*p)) == 0) {
-		    return 1;
-		}
-	    }
+    xmlnode_vector jids = xmlnode_get_tags(grant, "acl:jid", namespaces);
+    for (xmlnode_vector::iterator p = jids.begin(); p != jids.end(); ++p) {
+	const char *jid_str = xmlnode_get_data(*p);
+	if (jid_str == NULL)
+	    continue;
+
+	/* get the prepared node and domain */
+	pool temp_pool = pool_new();
+	jid user = jid_new(temp_pool, jid_str);
+	if (user != NULL) {
+	    grants.users[user->get_domain()][user->get_node()] = true;
+	    grants.jids.push_back(std::pair<unsigned, std::string>(acl__jids++, jid_str));
 	}
+	pool_free(temp_pool);
     }
+}
+
+/**
+ * check if a user has access by the compiled grants of a feature
+ *
+ * @param grants the compiled grants
+ * @param user the user to check
+ * @return 1 if access is granted, 0 else
+ */
+static int acl_check_grants(const acl_grants& grants, const jid user) {
+    if (grants.domains.find(user->get_domain().c_str()) != grants.domains.end())
+	return 1;
+
+    xmppd::xhash<xmppd::xhash<bool> >::const_iterator nodes = grants.users.find(user->get_domain().c_str());
+    if (nodes != grants.users.end() && nodes->second.find(user->get_node().c_str()) != nodes->second.end())
+	return 1;
 
     return 0;
 }
 
+/**
+ * compile the ACL of the configuration file
+ *
+ * This has to be called whenever the configuration file has been (re)loaded.
+ *
+ * @param greymatter the parsed configuration file
+ */
+void acl_config(xmlnode greymatter) {
+    xht namespaces = xhash_new(3);
+    xhash_put(namespaces, "", const_cast<char*>(NS_JABBERD_CONFIGFILE));
+    xhash_put(namespaces, "acl", const_cast<char*>(NS_JABBERD_ACL));
+
+    /* forget the previous ACL */
+    acl__features.clear();
+    acl__all = acl_grants();
+    acl__jids = 0;
+
+    /* compile the grants */
+    xmlnode_vector acl = xmlnode_get_tags(greymatter, "global/acl:acl/acl:grant", namespaces);
+    for (xmlnode_vector::iterator iter = acl.begin(); iter != acl.end(); ++iter) {
+	const char *feature = xmlnode_get_attrib_ns(*iter, "feature", NULL);
+
+	acl_compile_grant(feature == NULL ? acl__all : acl__features[feature], *iter, namespaces);
+    }
+
+    xhash_free(namespaces);
+}
+
 /**
  * check if a user has access to a given functionality
  *
@@ -93,31 +141,17 @@ static int acl_check_access_domain(xdbcache xdb, const char* function, const jid
  * @return 1 if access is granted, 0 if access is denied
  */
 int acl_check_access(xdbcache xdb, const char *function, const jid user) {
-    jid allowed_users = NULL;
-    jid iter = NULL;
+    /* sanity check */
+    if (xdb == NULL || function == NULL || user == NULL)
+	return 0;
 
-    /* first try if allowed by domain */
-    if (acl_check_access_domain(xdb, function, user))
+    /* grants for this feature, and grants for all features */
+    xmppd::xhash<acl_grants>::const_iterator grants = acl__features.find(function);
+    if ((grants != acl__features.end() && acl_check_grants(grants->second, user)) || acl_check_grants(acl__all, user)) {
+	log_debug2(ZONE, LOGT_AUTH, "user %s has access to %s", jid_full(user), function);
 	return 1;
-
-    /* get list of all allowed users */
-    allowed_users = acl_get_users(xdb, function);
-
-    /* is this user allowed? */
-    for (iter = allowed_users; iter != NULL; iter = iter->next) {
-	log_debug2(ZONE, LOGT_AUTH, "allowed for this feature is: %s", jid_full(iter));
-	if (jid_cmpx(iter, user, JID_USER|JID_SERVER) == 0) {
-	    /* match */
-	    pool_free(allowed_users->get_pool());
-	    log_debug2(ZONE, LOGT_AUTH, "user %s has access to %s", jid_full(user), function);
-	    return 1;
-	}
     }
 
-    /* cleanup */
-    if (allowed_users != NULL)
-	pool_free(allowed_users->get_pool());
-
     /* no match found */
     log_debug2(ZONE, LOGT_AUTH, "denied user %s access to %s", jid_full(user), function);
     return 0;
@@ -131,8 +165,6 @@ int acl_check_access(xdbcache xdb, const char *function, const jid user) {
  * @return list of jid_struct instances, that hold the users having access to the functionality; must be freed by the caller; NULL if no user has access
  */
 jid acl_get_users(xdbcache xdb, const char *function) {
-    static xht		namespaces = NULL;
-    xmlnode_vector	acl;
     pool		p = NULL;
     jid			result = NULL;
 
@@ -140,37 +172,23 @@ jid acl_get_users(xdbcache xdb, const char *function) {
     if (xdb == NULL || function == NULL)
 	return NULL;
 
-    /* define namespace prefixes */
-    if (namespaces == NULL) {
-	namespaces = xhash_new(3);
-	xhash_put(namespaces, "", const_cast<char*>(NS_JABBERD_CONFIGFILE));
-	xhash_put(namespaces, "acl", const_cast<char*>(NS_JABBERD_ACL));
-    }
-
-    /* get the acl */
-    acl = xmlnode_get_tags(greymatter__, "global/acl:acl/acl:grant", namespaces);
-
-    /* iterate the features */
-    xmlnode_vector::iterator feature;
-    for (feature = acl.begin(); feature != acl.end(); ++feature) {
-	const char *f = xmlnode_get_attrib_ns(*feature, "feature", NULL);
-
-	/* are we interested in this feature element? */
-	if (f == NULL || j_strcmp(f, function) == 0) {
-	    xmlnode_vector::iterator jid_iter;
-	    xmlnode_vector jids = xmlnode_get_tags(*feature, "acl:jid", namespaces);
-
-	    /* get all jids inside */
-	    for (jid_iter = jids.begin(); jid_iter != jids.end(); ++jid_iter) {
-		const char *jid_str = xmlnode_get_data(*jid_iter);
-
-		if (jid_str != NULL) {
-		    if (p == NULL)
-			p = pool_new();
-		    result = result == NULL ? jid_new(p, jid_str) : jid_append(result, jid_new(p, jid_str));
-		}
-	    }
-	}
+    /* merge the users granted access to this feature and to all features, in the order of the configuration file */
+    static const std::vector<std::pair<unsigned, std::string> > none;
+    xmppd::xhash<acl_grants>::const_iterator grants = acl__features.find(function);
+    const std::vector<std::pair<unsigned, std::string> >& feature_jids = grants != acl__features.end() ? grants->second.jids : none;
+    std::vector<std::pair<unsigned, std::string> >::const_iterator feature_iter = feature_jids.begin();
+    std::vector<std::pair<unsigned, std::string> >::const_iterator all_iter = acl__all.jids.begin();
+
+    while (feature_iter != feature_jids.end() || all_iter != acl__all.jids.end()) {
+	const char *jid_str = NULL;
+	if (all_iter == acl__all.jids.end() || (feature_iter != feature_jids.end() && feature_iter->first < all_iter->first))
+	    jid_str = (feature_iter++)->second.c_str();
+	else
+	    jid_str = (all_iter++)->second.c_str();
+
+	if (p == NULL)
+	    p = pool_new();
+	result = result == NULL ? jid_new(p, jid_str) : jid_append(result, jid_new(p, jid_str));
     }
 
     return result;
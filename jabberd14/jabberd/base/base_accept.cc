@@ -124,6 +124,9 @@ static void base_accept_process_xml(mio m, int state, void* arg, xmlnode x, char
             /* Save stream ID for auth'ing later */
             ai->id = pstrdup(ai->p, xmlnode_get_attrib_ns(cur, "id", NULL));
 	    mio_write_root(m, cur, 2);
+
+	    /* stanzas of the component are routed only, no need to parse their content */
+	    mio_xml_envelope(m);
             break;
 
         case MIO_XML_NODE:
@@ -366,6 +366,9 @@ int configurate(char *file, xht cmd_line, int is_restart) {
     // update the filter settings in the XML router
     deliver_config_filter(greymatter__);
 
+    // compile the access control lists
+    acl_config(greymatter__);
+
     return 0;
 }
 
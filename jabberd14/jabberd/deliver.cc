@@ -130,6 +130,13 @@ deliver()
 
 #include "jabberd.h"
 #include <set>
+#include <vector>
+#include <map>
+
+/**
+ * number of entries in the direct-mapped cache of routing results, has to be a power of two
+ */
+#define DELIVER_ROUTE_CACHE_SIZE 256
 
 extern xmlnode greymatter__;
 
@@ -267,6 +274,8 @@ instance deliver__uplink = NULL; /**< uplink instance, only one */
 pool global_routing_update_pool = NULL; /**< memory pool to hold the entries in the global_routing_update_callbacks list */
 register_notifier global_routing_update_callbacks; /**< list of callback functions, that should be called on all routing updates */
 
+unsigned long deliver__routes_generation = 1; /**< incremented on each change of the routing tables, invalidates the routing cache */
+
 /**
  * utility to find the right routing hashtable based on type of a stanza
  *
@@ -410,6 +419,258 @@ static instance deliver_intersect(ilist a, ilist b) {
     return i;
 }
 
+namespace xmppd {
+
+    /**
+     * compiled snapshot of the routing tables
+     *
+     * The destination of a packet depends on its type, its destination host and (for xdb and log
+     * packets) its namespace or log type. The snapshot contains the result of deliver_intersect()
+     * for each combination of keys in the routing tables. A packet can therefore be routed by
+     * looking up the host and the namespace, without walking and intersecting instance lists.
+     *
+     * If the routing of a single host changes (e.g. dialback registering a remote domain), only
+     * the results for this host are recompiled. Any other change of the routing tables discards
+     * the snapshot, and a new one is compiled when the next packet is routed.
+     */
+    class deliver_routes {
+	public:
+	    deliver_routes();
+	    instance lookup(ptype type, char const* host, char const* key) const;
+	    void update_host(ptype type, char const* host);
+
+	private:
+	    /**
+	     * routing results for one host (or for the hosts without explicit routing)
+	     */
+	    struct row {
+		instance other;				/**< result for namespaces/log types without explicit routing */
+		std::map<std::string, instance> by_key;	/**< results for the namespaces/log types with explicit routing */
+	    };
+
+	    /**
+	     * routing results for one packet type
+	     */
+	    struct table {
+		row other;				/**< results for hosts without explicit routing */
+		std::map<std::string, row> by_host;	/**< results for the hosts with explicit routing */
+		xht hosts;				/**< the routing table for the hosts */
+		xht keys;				/**< the routing table for namespaces/log types, NULL if not used */
+		std::vector<std::string> key_names;	/**< the keys in the routing table for namespaces/log types */
+	    };
+
+	    static void collect_key(xht h, char const* key, void* value, void* arg);
+	    static void compile_row(table const& t, row& r, ilist a);
+	    static void compile(table& t, xht hosts, xht keys);
+	    static int index(ptype type);
+
+	    table tables[3];			/**< tables for log, xdb and all other packets */
+    };
+
+    deliver_routes::deliver_routes() {
+	compile(tables[index(p_LOG)], deliver__hlog, deliver__logtype);
+	compile(tables[index(p_XDB)], deliver__hxdb, deliver__ns);
+	compile(tables[index(p_NORM)], deliver__hnorm, NULL);
+    }
+
+    /**
+     * get the index in tables for a packet type (same grouping as deliver_hashtable())
+     *
+     * @param type the packet type
+     * @return index in tables
+     */
+    int deliver_routes::index(ptype type) {
+	switch (type) {
+	    case p_LOG:
+		return 0;
+	    case p_XDB:
+		return 1;
+	    default:
+		return 2;
+	}
+    }
+
+    /**
+     * xhash_walker collecting the keys of a routing table
+     */
+    void deliver_routes::collect_key(xht h, char const* key, void* value, void* arg) {
+	if (key != NULL)
+	    static_cast<std::vector<std::string>*>(arg)->push_back(key);
+    }
+
+    /**
+     * compile the routing results for one host
+     *
+     * @param t the table the row belongs to
+     * @param r where to store the results
+     * @param a the instances routed for this host
+     */
+    void deliver_routes::compile_row(table const& t, row& r, ilist a) {
+	r.other = deliver_intersect(a, t.keys == NULL ? NULL : static_cast<ilist>(xhash_get(t.keys, "*")));
+	r.by_key.clear();
+	for (std::vector<std::string>::const_iterator key = t.key_names.begin(); key != t.key_names.end(); ++key) {
+	    r.by_key[*key] = deliver_intersect(a, static_cast<ilist>(xhash_get(t.keys, key->c_str())));
+	}
+    }
+
+    /**
+     * compile the routing results for one packet type
+     *
+     * @param t where to store the results
+     * @param hosts the routing table for the hosts
+     * @param keys the routing table for namespaces/log types, NULL if not used
+     */
+    void deliver_routes::compile(table& t, xht hosts, xht keys) {
+	std::vector<std::string> host_names;
+
+	t.hosts = hosts;
+	t.keys = keys;
+	xhash_walk(hosts, collect_key, &host_names);
+	xhash_walk(keys, collect_key, &t.key_names);
+
+	compile_row(t, t.other, static_cast<ilist>(xhash_get(hosts, "*")));
+	for (std::vector<std::string>::const_iterator host = host_names.begin(); host != host_names.end(); ++host) {
+	    compile_row(t, t.by_host[*host], static_cast<ilist>(xhash_get(hosts, host->c_str())));
+	}
+    }
+
+    /**
+     * recompile the routing results for a single host, after the routing for it changed
+     *
+     * @param type the type of packets, the routing changed for
+     * @param host the host (not "*"), the routing changed for
+     */
+    void deliver_routes::update_host(ptype type, char const* host) {
+	table& t = tables[index(type)];
+	ilist a = static_cast<ilist>(xhash_get(t.hosts, host));
+
+	if (a == NULL) {
+	    t.by_host.erase(host);
+	    return;
+	}
+
+	compile_row(t, t.by_host[host], a);
+    }
+
+    /**
+     * get the destination instance for a packet
+     *
+     * @param type the type of the packet
+     * @param host the destination host of the packet
+     * @param key the namespace (xdb packets) or log type (log packets), NULL for other packets
+     * @return the destination instance, NULL if there is no (or no unique) destination
+     */
+    instance deliver_routes::lookup(ptype type, char const* host, char const* key) const {
+	table const& t = tables[index(type)];
+	std::map<std::string, row>::const_iterator h = host == NULL ? t.by_host.end() : t.by_host.find(host);
+	row const& r = h == t.by_host.end() ? t.other : h->second;
+
+	if (key != NULL) {
+	    std::map<std::string, instance>::const_iterator k = r.by_key.find(key);
+	    if (k != r.by_key.end())
+		return k->second;
+	}
+
+	return r.other;
+    }
+}
+
+xmppd::deliver_routes* deliver__routes = NULL; /**< the current routing snapshot, NULL if it has to be compiled */
+
+/**
+ * update the routing snapshot and invalidate the routing cache
+ *
+ * Has to be called whenever one of the routing tables or the uplink is changed.
+ *
+ * @param type the type of packets, the routing changed for
+ * @param host the host, the routing changed for, NULL if the change is not specific to a host
+ */
+static void deliver_routes_changed(ptype type, char const* host) {
+    deliver__routes_generation++;
+
+    if (deliver__routes == NULL)
+	return;
+
+    if (host == NULL || j_strcmp(host, "*") == 0) {
+	delete deliver__routes;
+	deliver__routes = NULL;
+	return;
+    }
+
+    deliver__routes->update_host(type, host);
+}
+
+/**
+ * entry in the direct-mapped cache of routing results
+ */
+typedef struct deliver_route_cache_entry_struct {
+    unsigned long generation;	/**< routing generation this entry is valid for, 0 for an empty entry */
+    ptype type;			/**< packet type */
+    std::string host;		/**< destination host */
+    std::string key;		/**< namespace or log type */
+    bool has_key;		/**< false if there is no namespace or log type */
+    instance i;			/**< the destination instance */
+} _deliver_route_cache_entry;
+
+_deliver_route_cache_entry deliver__route_cache[DELIVER_ROUTE_CACHE_SIZE]; /**< direct-mapped cache of recent routing results */
+
+/**
+ * hash function used to select routing cache entries
+ *
+ * @param s the string to hash
+ * @return hash value
+ */
+static unsigned int deliver_hash(char const* s) {
+    unsigned int h = 0;
+
+    /* same hash function as used by the original xhash implementation */
+    for (; s != NULL && *s != '\0'; s++) {
+	unsigned int g = 0;
+
+	h = (h << 4) + static_cast<unsigned char>(*s);
+	if ((g = (h & 0xf0000000)) != 0)
+	    h ^= g >> 24;
+	h &= ~g;
+    }
+
+    return h;
+}
+
+/**
+ * get the destination instance for a packet
+ *
+ * Recently used destinations are answered from a direct-mapped cache, other lookups
+ * use the compiled routing snapshot, that is (re)compiled if the routing changed.
+ *
+ * @param type the type of the packet
+ * @param host the destination host of the packet
+ * @param key the namespace (xdb packets) or log type (log packets), NULL for other packets
+ * @return the destination instance, NULL if there is no (or no unique) destination
+ */
+static instance deliver_lookup(ptype type, char const* host, char const* key) {
+    unsigned int slot = (deliver_hash(host) ^ (deliver_hash(key) * 31) ^ type) & (DELIVER_ROUTE_CACHE_SIZE-1);
+    _deliver_route_cache_entry& entry = deliver__route_cache[slot];
+
+    /* cache hit? */
+    if (entry.generation == deliver__routes_generation && entry.type == type && entry.host == (host ? host : "") && entry.has_key == (key != NULL) && entry.key == (key ? key : ""))
+	return entry.i;
+
+    /* no routing snapshot? compile one */
+    if (deliver__routes == NULL) {
+	log_debug2(ZONE, LOGT_DELIVER, "compiling routing snapshot %lu", deliver__routes_generation);
+	deliver__routes = new xmppd::deliver_routes();
+    }
+
+    entry.generation = deliver__routes_generation;
+    entry.type = type;
+    entry.host = host ? host : "";
+    entry.key = key ? key : "";
+    entry.has_key = key != NULL;
+    entry.i = deliver__routes->lookup(type, host, key);
+
+    return entry.i;
+}
+
 // forward reference
 static void deliver_instance(instance i, dpacket p);
 
@@ -526,6 +787,7 @@ void register_instance(instance i, char const* host) {
     l = static_cast<ilist>(xhash_get(ht, host));
     l = ilist_add(l, i);
     xhash_put(ht, pstrdup(i->p,host), (void *)l);
+    deliver_routes_changed(i->type, host);
 }
 
 /**
@@ -554,6 +816,7 @@ void unregister_instance(instance i, char const* host) {
         xhash_zap(ht, host);
     else
         xhash_put(ht, pstrdup(i->p,host), (void *)l);
+    deliver_routes_changed(i->type, host);
 
     /* inform the instance about the domain, that is not routed anymore */
     for (notify_callback = i->routing_update_callbacks; notify_callback != NULL; notify_callback = notify_callback->next) {
@@ -630,6 +893,7 @@ static result deliver_config_ns(instance i, xmlnode x, void *arg) {
     l = static_cast<ilist>(xhash_get(deliver__ns, ns));
     l = ilist_add(l, i);
     xhash_put(deliver__ns, ns, (void *)l);
+    deliver_routes_changed(p_NONE, NULL);
 
     return r_DONE;
 }
@@ -664,6 +928,7 @@ static result deliver_config_logtype(instance i, xmlnode x, void *arg) {
     l = static_cast<ilist>(xhash_get(deliver__logtype, type));
     l = ilist_add(l, i);
     xhash_put(deliver__logtype, type, (void *)l);
+    deliver_routes_changed(p_NONE, NULL);
 
     return r_DONE;
 }
@@ -684,6 +949,7 @@ static result deliver_config_uplink(instance i, xmlnode x, void *arg) {
         return r_ERR;
 
     deliver__uplink = i;
+    deliver_routes_changed(p_NONE, NULL);
     return r_DONE;
 }
 
@@ -720,6 +986,23 @@ static void _deliver_notify_walker(xht h, const char *key, void *value, void *ar
     }
 }
 
+/**
+ * find the destination instance of a packet using the routing tables and deliver it
+ *
+ * @param p the packet that should be delivered (packet gets consumed)
+ */
+static void deliver_route(dpacket p) {
+    char const* key = NULL;
+
+    log_debug2(ZONE, LOGT_DELIVER, "DELIVER %d:%s %s", p->type, p->host, xmlnode_serialize_string(p->x, xmppd::ns_decl_list(), 0));
+
+    if (p->type == p_XDB)
+        key = xmlnode_get_attrib_ns(p->x, "ns", NULL);
+    else if(p->type == p_LOG)
+        key = xmlnode_get_attrib_ns(p->x, "type", NULL);
+    deliver_instance(deliver_lookup(p->type, p->host, key), p);
+}
+
 /**
  * deliver a ::dpacket to an ::instance using the configured XML routings
  *
@@ -727,7 +1010,6 @@ static void _deliver_notify_walker(xht h, const char *key, void *value, void *ar
  * @param i unused/ignored (was: the instance of the sender (!) of the packet)
  */
 void deliver(dpacket p, instance i) {
-    ilist a, b;
 
     if(deliver__flag == 1 && p == NULL && i == NULL) {
 	// server is up, get the null sources
@@ -812,15 +1094,7 @@ void deliver(dpacket p, instance i) {
 	}
     }
 
-    log_debug2(ZONE, LOGT_DELIVER, "DELIVER %d:%s %s", p->type, p->host, xmlnode_serialize_string(p->x, xmppd::ns_decl_list(), 0));
-
-    b = NULL;
-    a = deliver_hashmatch(deliver_hashtable(p->type), p->host);
-    if (p->type == p_XDB)
-        b = deliver_hashmatch(deliver__ns, xmlnode_get_attrib_ns(p->x, "ns", NULL));
-    else if(p->type == p_LOG)
-        b = deliver_hashmatch(deliver__logtype, xmlnode_get_attrib_ns(p->x, "type", NULL));
-    deliver_instance(deliver_intersect(a, b), p);
+    deliver_route(p);
 }
 
 
@@ -869,6 +1143,8 @@ void deliver_shutdown(void) {
 	xhash_free(deliver__ns);
     if (deliver__logtype)
 	xhash_free(deliver__logtype);
+    delete deliver__routes;
+    deliver__routes = NULL;
 }
 
 /**
@@ -1281,11 +1557,21 @@ dpacket dpacket_new(xmlnode x) {
 
 /**
  * create a clone of a deliverable packet
+ *
+ * The content of the stanza is shared with the clone and the jids are copied without preparing them again.
  */
 dpacket dpacket_copy(dpacket p) {
     dpacket p2;
-
-    p2 = dpacket_new(xmlnode_dup(p->x));
+    xmlnode x = xmlnode_dup_shared(p->x);
+
+    p2 = static_cast<dpacket>(pmalloco(xmlnode_pool(x), sizeof(_dpacket)));
+    p2->x = x;
+    p2->p = xmlnode_pool(x);
+    p2->type = p->type;
+    p2->to_jid = jid_copy(p2->p, p->to_jid);
+    p2->from_jid = jid_copy(p2->p, p->from_jid);
+    p2->id = p->id == p->from_jid ? p2->from_jid : p2->to_jid;
+    p2->host = pstrdup(p2->p, p->host);
     return p2;
 }
 
@@ -1394,6 +1680,10 @@ void deliver_pool_debug() {
     log_notice(own_pid, "%s", stats->getSummary().c_str());
 
     delete stats;
+
+    _pool_stats allocator_stats;
+    pool_get_stats(&allocator_stats);
+    log_notice(own_pid, "Pools: %u (max %u) / Mem in pools: %lu (max %lu) / Slab memory: %lu", allocator_stats.pools, allocator_stats.pools_high_water, static_cast<unsigned long>(allocator_stats.bytes), static_cast<unsigned long>(allocator_stats.bytes_high_water), static_cast<unsigned long>(allocator_stats.slab_bytes));
 }
 #else
 void deliver_pool_debug() {
@@ -63,6 +63,7 @@ int configo(int exec);
 int configurate(char *file, xht cmd_line, int is_restart);
 void deliver_init(pool p);
 void deliver_shutdown(void);
+void xdb_init(pool p);
 void heartbeat_birth(void);
 void heartbeat_death(void);
 void shutdown_callbacks(void);
@@ -308,6 +309,7 @@ int main (int argc, const char** argv) {
 
     base_init(jabberd.runtime_pool);
     deliver_init(jabberd.runtime_pool);
+    xdb_init(jabberd.runtime_pool);
 
     /* everything should be registered for the config pass, validate */
     deliver__flag = 0; /* pause deliver() while starting up */
@@ -397,6 +399,9 @@ static void _jabberd_restart(jabberd_struct *j) {
 static void _jabberd_shutdown(void) {
     log_notice(NULL,"shutting down server");
 
+    /* write the changes kept by write-behind xdb caches, while packets still get delivered */
+    xdb_cache_flush();
+
     /* pause deliver() this sucks, cuase we lose shutdown messages */
     deliver__flag = 0;
     shutdown_callbacks();
@@ -265,7 +265,25 @@ void log_generic(char const* logtype, char const* id, char const* type, char con
 
 /*** xdb utilities ***/
 
-/** Ring for handling cached structures */
+namespace xmppd {
+    class xdb_lru;
+    class xdb_requests;
+    class xdb_prefetched;
+}
+
+/** callback for asynchronous xdb queries, result is NULL if nothing found or failed, else it has to be freed by the callback */
+typedef void (*xdb_get_callback)(void *arg, xmlnode result);
+/** callback for asynchronous xdb actions, failed is non-zero if the action failed */
+typedef void (*xdb_act_callback)(void *arg, int failed);
+/** callback for asynchronous multi-queries, results[i] is the result for the i-th namespace (like for ::xdb_get_callback), failed is non-zero if at least one query failed */
+typedef void (*xdb_multi_callback)(void *arg, int count, xmlnode *results, int failed);
+
+/**
+ * handle for xdb requests of an instance, and the state of a single request
+ *
+ * The xdbcache returned by xdb_cache() holds the table of pending requests. Each pending request uses its own
+ * xdbcache structure, which is linked into a slot of the timer wheel using the prev and next pointers.
+ */
 typedef struct xdbcache_struct {
     instance i;
     int id;
@@ -278,18 +296,41 @@ typedef struct xdbcache_struct {
     xmlnode data; /**< for set */
     jid owner;
     int sent;
+    int due;			/**< when the request has to be resent or expires */
+    int slot;			/**< timer wheel slot the request is linked in, -1 if none */
     int preblock;		/**< thread that created the query is waiting for a pth_cond_notify() on ::cond */
     pth_cond_t cond;
     pth_mutex_t mutex;
+    xmppd::xdb_requests* requests; /**< pending requests (only used in the xdbcache returned by xdb_cache()) */
+    xmppd::xdb_lru* lru;	/**< cache of query results (only used in the xdbcache returned by xdb_cache()), NULL if not enabled */
+    xmppd::xdb_prefetched* prefetched; /**< results of xdb_prefetch() not used yet (only used in the xdbcache returned by xdb_cache()), NULL if never used */
+    pool p;			/**< memory pool of an asynchronous request, NULL for blocking requests */
+    struct xdbcache_struct *head; /**< the xdbcache an asynchronous request has been sent with */
+    xdb_get_callback get_cb;	/**< callback for an asynchronous query */
+    void (*get_status_cb)(void *arg, xmlnode result, int failed); /**< callback for an asynchronous query, that also gets if the query failed (instead of get_cb) */
+    xdb_act_callback act_cb;	/**< callback for an asynchronous action */
+    void *cb_arg;		/**< argument passed to the callback of an asynchronous request */
+    int cached;			/**< asynchronous query has been answered from the cache */
+    int direct;			/**< asynchronous request is completed by the thread that got the result instead of an mtq thread */
+    unsigned long cache_writes;	/**< modification counter of the cache when an asynchronous query has been sent */
     struct xdbcache_struct *prev;
     struct xdbcache_struct *next;
 } *xdbcache, _xdbcache;
 
 xdbcache xdb_cache(instance i); /**< create a new xdb cache for this instance */
+void xdb_cache_lru(xdbcache xc, int max_entries, int writebehind); /**< enable caching of xdb results in an xdbcache, writebehind is the flush interval in seconds or 0 for write-through */
+void xdb_cache_lru_ns(xdbcache xc, char const* ns); /**< add a namespace to the namespaces cached by an xdbcache */
+void xdb_cache_flush(void); /**< write the changes kept by write-behind result caches, blocks until done */
 xmlnode xdb_get(xdbcache xc,  jid owner, const char *ns); /**< blocks until namespace is retrieved, returns xmlnode or NULL if failed */
 int xdb_act(xdbcache xc, jid owner, const char *ns, char *act, char const* match, xmlnode data); /**< sends new xml action, returns non-zero if failure */
 int xdb_act_path(xdbcache xc, jid owner, const char *ns, char const *act, char const* matchpath, xht namespaces, xmlnode data); /**< sends new xml action, returns non-zero if failure */
 int xdb_set(xdbcache xc, jid owner, const char *ns, xmlnode data); /**< sends new xml to replace old, returns non-zero if failure */
+void xdb_get_async(xdbcache xc, jid owner, const char *ns, xdb_get_callback cb, void *arg); /**< sends a query, cb is called with the result */
+void xdb_act_async(xdbcache xc, jid owner, const char *ns, char const* act, char const* match, xmlnode data, xdb_act_callback cb, void *arg); /**< sends new xml action, cb is called with the result */
+void xdb_set_async(xdbcache xc, jid owner, const char *ns, xmlnode data, xdb_act_callback cb, void *arg); /**< sends new xml to replace old, cb is called with the result */
+void xdb_get_multi_async(xdbcache xc, jid owner, char const* const* ns, int count, xdb_multi_callback cb, void *arg); /**< sends queries for multiple namespaces at once, cb is called when all results are there */
+void xdb_get_multi(xdbcache xc, jid owner, char const* const* ns, int count, xmlnode *results, int *failed); /**< sends queries for multiple namespaces at once, blocks until all results are there, failed (may be NULL) gets if a query failed */
+void xdb_prefetch(xdbcache xc, jid owner, char const* const* ns, int count); /**< queries multiple namespaces at once, the next xdb_get() for each of them is answered with the result */
 
 /* Error messages */
 #define SERROR_NAMESPACE "<stream:error><invalid-namespace xmlns='urn:ietf:params:xml:ns:xmpp-streams'/><text xmlns='urn:ietf:params:xml:ns:xmpp-streams' xml:lang='en'>Invalid namespace specified.</text></stream:error>"
@@ -349,6 +390,18 @@ struct mio_handlers_st;
 typedef enum { state_ACTIVE, state_CLOSE } mio_state;
 typedef enum { type_LISTEN, type_NORMAL, type_NUL, type_HTTP } mio_type;
 
+/**
+ * state of envelope parsing on a connection (see mio_xml_envelope())
+ */
+struct mio_envelope_st {
+    std::string input;		/**< received data, that might still be needed to get the unparsed content of a stanza */
+    XML_Index input_start;	/**< stream byte index of the first byte in input */
+    XML_Index content_start;	/**< stream byte index where the content of the current stanza starts */
+    int depth;			/**< element depth inside the current stanza, 0 if the current stanza is parsed completely */
+    bool self_contained;	/**< the content of the current stanza does not use namespace prefixes declared outside of it */
+    bool prefix_declared;	/**< the start tag of the next stanza declares a namespace prefix */
+};
+
 /* standard i/o callback function definition */
 struct mio_st;
 typedef void (*mio_std_cb)(mio_st* m, int state, void *arg, xmlnode x, char *buffer, int bufsz);
@@ -366,6 +419,7 @@ typedef struct mio_st {
     mio_wbq tail;			/**< the last buffer queue item */
 
     struct mio_st *prev,*next;		/**< pointers to the previous and next item, if a list of mio_st elements is build */
+    struct mio_st *ready_prev,*ready_next; /**< pointers to the previous and next item in the list of sockets, the MIO loop has to process */
 
     void *cb_arg;			/**< MIO event callback argument (do not modify directly) */
     mio_std_cb cb;			/**< MIO event callback (do not modify directly) */
@@ -385,6 +439,9 @@ typedef struct mio_st {
 	int	recall_write_when_writeable:1;	/**< recall the write function, when the socket allows writing again */
 	int	recall_handshake_when_readable:1; /**< recall the handshake function, when the socket has data available for reading */
 	int	recall_handshake_when_writeable:1; /**< recall the handshake function, when the socket allows writing again */
+	int	readable:1;		/**< the readiness backend reported the socket readable, and we did not yet get EAGAIN when reading */
+	int	writeable:1;		/**< the readiness backend reported the socket writeable, and we did not yet get EAGAIN when writing */
+	int	ready_listed:1;		/**< the socket is in the list of sockets, the MIO loop has to process */
     } flags;
 
     struct karma k;			/**< karma for this socket, used to limit bandwidth of a connection */
@@ -400,8 +457,11 @@ typedef struct mio_st {
     xmppd::ns_decl_list* in_root;	/**< pointer to the namespaces declared on the incoming root element */
     xmppd::ns_decl_list* in_stanza;	/**< pointer to the namespaces declared on the currently recevied stanza */
     const char *root_lang;		/**< declared language of the incoming stream root element */
+    struct mio_envelope_st* envelope;	/**< state of envelope parsing, NULL if stanzas are parsed completely */
 } *mio, _mio;
 
+struct mio_backend_st;
+
 /**
  * @brief structure that holds the global mio data
  *
@@ -410,6 +470,11 @@ typedef struct mio_st {
 typedef struct mio_main_st {
     pool p;             /**< (memory-)pool to hold this data */
     mio master__list;   /**< a list of all the sockets */
+    mio ready__list;	/**< first socket that has to be processed by the MIO loop */
+    mio ready__tail;	/**< last socket that has to be processed by the MIO loop */
+    int ready__count;	/**< number of sockets in the ready__list */
+    struct mio_backend_st const* backend; /**< the readiness backend used to wait for socket events (select, epoll) */
+    int backend_fd;	/**< file descriptor used by the readiness backend (e.g. the epoll instance), -1 if none */
     pth_t t;            /**< a pointer to thread for signaling */
     int shutdown;	/**< flag that the select loop can be left (if value is 1) */
     int zzz[2];		/**< pipe used to send signals to the select loop */
@@ -419,6 +484,7 @@ typedef struct mio_main_st {
     char const* bounce_uri;	/**< where to bounce HTTP requests to */
     char const* webserver_path;	/**< location where small HTTP requests are handled from */
     char const* flash_policy;	/**< location of the flash policy file */
+    int envelope;	/**< if set to 1, connections may request to only parse the envelope of stanzas (see mio_xml_envelope()) */
 
 } _ios,*ios;
 
@@ -451,6 +517,7 @@ void _mio_raw_parser(mio m, const void *buf, size_t bufsz);
 #define MIO_RAW_PARSER   (mio_parser_func)&_mio_raw_parser
 
 void mio_xml_reset(mio m);
+void mio_xml_envelope(mio m);
 int  mio_xml_starttls(mio m, int originator, const char *identity);
 void _mio_xml_parser(mio m, const void *buf, size_t bufsz);
 #define MIO_XML_PARSER  (mio_parser_func)&_mio_xml_parser
@@ -529,6 +596,9 @@ void mio_connect(char *host, int port, mio_std_cb cb, void *cb_arg, int timeout,
 /* Starts listening on a port/ip, returns NULL if failed to listen */
 mio mio_listen(int port, char const* sourceip, mio_std_cb cb, void *cb_arg, mio_handlers mh);
 
+/* Blocks the calling thread until a file descriptor not managed by MIO is ready, 0 if ready, 1 if ev occurred, -1 on error */
+int mio_wait_fd(int fd, int writeable, pth_event_t ev);
+
 int _mio_write_dump(mio m);
 
 /* some nice api utilities */
@@ -543,6 +613,7 @@ int _mio_write_dump(mio m);
  * Access controll 
  *-----------------*/
 
+void acl_config(xmlnode greymatter);
 int acl_check_access(xdbcache xdb, const char *function, const jid user);
 jid acl_get_users(xdbcache xdb, const char *function);
 
@@ -44,6 +44,7 @@
  */
 
 #include <jabberdlib.h>
+#include <sys/uio.h>
 
 /**
  * structure used to pass information to the expat callbacks
@@ -52,6 +53,7 @@ typedef struct {
     xmlnode 		x;		/**< pointer to the xmlnode that is currently read */
     xmppd::ns_decl_list* ns;		/**< list of declared namespace prefixes */
     pool		parse_pool;	/**< memory pool used while parsing */
+    int			depth;		/**< element depth, only used by xmlnode_insert_xml() */
 } _expat_callback_data, *expat_callback_data;
 
 /**
@@ -205,7 +207,7 @@ static void expat_endNamespaceDecl(void *userdata, const XML_Char *prefix) {
  */
 xmlnode xmlnode_str(const char *str, int len) {
     XML_Parser p;
-    _expat_callback_data callback_data = { NULL, NULL, NULL };
+    _expat_callback_data callback_data = { NULL, NULL, NULL, 0 };
 
     if(NULL == str)
         return NULL;
@@ -227,6 +229,71 @@ xmlnode xmlnode_str(const char *str, int len) {
     return callback_data.x; /* return the xmlnode x points to */
 }
 
+/**
+ * callback function used for start elements by xmlnode_insert_xml()
+ *
+ * The wrapping element, that declares the namespaces is skipped.
+ *
+ * @param userdata the callback data
+ * @param name name of the starting element
+ * @param atts attributes that are contained in the start element
+ */
+static void expat_content_startElement(void* userdata, const char* name, const char** atts) {
+    expat_callback_data callback_data = static_cast<expat_callback_data>(userdata);
+
+    if (callback_data->depth++ > 0)
+	expat_startElement(userdata, name, atts);
+}
+
+/**
+ * callback function used for end elements by xmlnode_insert_xml()
+ *
+ * @param userdata the callback data
+ * @param name name of the ending element
+ */
+static void expat_content_endElement(void* userdata, const char* name) {
+    expat_callback_data callback_data = static_cast<expat_callback_data>(userdata);
+
+    if (--callback_data->depth > 0)
+	expat_endElement(userdata, name);
+}
+
+/**
+ * parse XML content and insert it as child nodes of an element
+ *
+ * @param parent the element where the parsed nodes are inserted
+ * @param content the content to parse (elements and text, not necessarily zero terminated)
+ * @param len the length of the content
+ * @param nslist the namespaces declared where the content is placed
+ * @return 0 on success, non-zero if the content could not be parsed (the nodes parsed so far are kept)
+ */
+int xmlnode_insert_xml(xmlnode parent, const char* content, int len, const xmppd::ns_decl_list& nslist) {
+    XML_Parser p;
+    _expat_callback_data callback_data = { parent, NULL, NULL, 0 };
+    int result = 0;
+
+    if (parent == NULL || content == NULL)
+	return 1;
+
+    // wrap the content in an element declaring the namespaces
+    std::string start_wrapper = "<c" + nslist.xmlns_attributes() + ">";
+
+    callback_data.parse_pool = pool_new();
+    callback_data.ns = new xmppd::ns_decl_list();
+    p = XML_ParserCreateNS(NULL, XMLNS_SEPARATOR);
+    XML_SetUserData(p, &callback_data);
+    XML_SetElementHandler(p, expat_content_startElement, expat_content_endElement);
+    XML_SetCharacterDataHandler(p, expat_charData);
+    XML_SetNamespaceDeclHandler(p, expat_startNamespaceDecl, expat_endNamespaceDecl);
+    if (!XML_Parse(p, start_wrapper.c_str(), start_wrapper.length(), 0) || !XML_Parse(p, content, len, 0) || !XML_Parse(p, "</c>", 4, 1)) {
+	result = 1;
+    }
+    XML_ParserFree(p);
+    pool_free(callback_data.parse_pool);
+    delete callback_data.ns;
+    return result;
+}
+
 /**
  * create an xmlnode instance (possibly including other xmlnode instances) by parsing a file
  *
@@ -237,7 +304,7 @@ xmlnode xmlnode_str(const char *str, int len) {
  */
 xmlnode xmlnode_file(const char *file) {
     XML_Parser p;
-    _expat_callback_data callback_data = { NULL, NULL, NULL };
+    _expat_callback_data callback_data = { NULL, NULL, NULL, 0 };
     char buf[BUFSIZ];
     int done, fd, len;
 
@@ -326,14 +393,22 @@ int xmlnode2file(char const* file, xmlnode node)
 /**
  * write an xmlnode to a file, limited by size
  *
+ * The document is written to a temporary file using a single writev() call, that replaces
+ * the file afterwards.
+ *
  * @param file the target file
  * @param node the xmlnode that should be written
  * @param sizelimit the maximum length of the file to be written
+ * @param sync if true, the temporary file is synced to disk before it replaces the file
  * @return 1 on success, 0 if failed due to size limit, -1 on failure
  */
-int xmlnode2file_limited(char const* file, xmlnode node, size_t sizelimit) {
+static int _xmlnode2file(char const* file, xmlnode node, size_t sizelimit, bool sync) {
+    static char xmldecl[] = "<?xml version='1.0'?>\n";
+    static char newline[] = "\n";
+    struct iovec iov[3];
     char *doc;
-    int fd, i;
+    int fd;
+    ssize_t i;
     size_t doclen;
 
     /* sanity checks */
@@ -346,7 +421,6 @@ int xmlnode2file_limited(char const* file, xmlnode node, size_t sizelimit) {
 
     /* is it to big? (23 is the size of the XML declaration and the trailing newline in the file) */
     if (sizelimit > 0 && (doclen + 23) > sizelimit) {
-	close(fd);
 	return 0;
     }
 
@@ -356,30 +430,22 @@ int xmlnode2file_limited(char const* file, xmlnode node, size_t sizelimit) {
     if (fd < 0)
         return -1;
 
-    /* write XML declaration, remove temp file on failure */
-    i = write(fd, "<?xml version='1.0'?>\n", 22);
-    if (i < 0) {
+    /* write XML declaration, XML content and a closing newline at once */
+    iov[0].iov_base = xmldecl;
+    iov[0].iov_len = sizeof(xmldecl) - 1;
+    iov[1].iov_base = doc;
+    iov[1].iov_len = doclen;
+    iov[2].iov_base = newline;
+    iov[2].iov_len = sizeof(newline) - 1;
+    i = writev(fd, iov, 3);
+
+    /* remove temp file on failure */
+    if (i != static_cast<ssize_t>(iov[0].iov_len + iov[1].iov_len + iov[2].iov_len) || (sync && fsync(fd) < 0)) {
 	close(fd);
 	unlink(ftmp.str().c_str());
 	return -1;
     }
 
-    /* write XML content, remove temp file on failure */
-    i = write(fd, doc, doclen);
-    if (i < 0) {
-	close(fd);
-	unlink(ftmp.str().c_str());
-        return -1;
-    }
-
-    /* write a closing newline */
-    i = write(fd, "\n", 1);
-    if (i < 0) {
-	close(fd);
-	unlink(ftmp.str().c_str());
-        return -1;
-    }
-
     /* close the file */
     close(fd);
 
@@ -393,6 +459,32 @@ int xmlnode2file_limited(char const* file, xmlnode node, size_t sizelimit) {
     return 1;
 }
 
+/**
+ * write an xmlnode to a file, limited by size
+ *
+ * @param file the target file
+ * @param node the xmlnode that should be written
+ * @param sizelimit the maximum length of the file to be written
+ * @return 1 on success, 0 if failed due to size limit, -1 on failure
+ */
+int xmlnode2file_limited(char const* file, xmlnode node, size_t sizelimit) {
+    return _xmlnode2file(file, node, sizelimit, false);
+}
+
+/**
+ * write an xmlnode to a file, limited by size, and sync the data to disk before the file gets replaced
+ *
+ * The caller has to sync the directory containing the file, if the rename has to be durable as well.
+ *
+ * @param file the target file
+ * @param node the xmlnode that should be written
+ * @param sizelimit the maximum length of the file to be written
+ * @return 1 on success, 0 if failed due to size limit, -1 on failure
+ */
+int xmlnode2file_durable(char const* file, xmlnode node, size_t sizelimit) {
+    return _xmlnode2file(file, node, sizelimit, true);
+}
+
 /**
  * append attributes in the expat format to an existing xmlnode
  *
@@ -390,6 +390,16 @@ struct pfree
     struct pfree *next;
 };
 
+#ifdef POOL_DEBUG
+/* pool_zone_stat - statistics of the pools created at
+   one place in the source */
+struct pool_zone_stat
+{
+    unsigned int pools, pools_high_water;
+    size_t bytes, bytes_high_water;
+};
+#endif
+
 /* pool - base node for a pool. Maintains a linked list
    of pool entries (pfree) */
 typedef struct pool_struct
@@ -400,6 +410,7 @@ typedef struct pool_struct
 #ifdef POOL_DEBUG
     char name[8], zone[32];
     int lsize;
+    struct pool_zone_stat *zone_stat;
 } _pool, *pool;
 #define pool_new() _pool_new(__FILE__,__LINE__)
 #define pool_heap(i) _pool_new_heap(i,__FILE__,__LINE__)
@@ -421,6 +432,15 @@ void pool_cleanup(pool p, pool_cleaner f, void *arg); /* calls f(arg) before the
 void pool_free(pool p); /* calls the cleanup functions, frees all the data on the pool, and deletes the pool itself */
 int pool_size(pool p); /* returns total bytes allocated in this pool */
 
+/* pool_stats - statistics of the pool allocator */
+typedef struct pool_stats_struct
+{
+    unsigned int pools, pools_high_water; /* number of existing pools */
+    size_t bytes, bytes_high_water; /* memory allocated in pools */
+    size_t slab_bytes, slab_free_bytes; /* memory allocated for slabs, and how much of it is not used */
+} _pool_stats, *pool_stats;
+void pool_get_stats(pool_stats stats); /* get the statistics of the pool allocator */
+
 
 
 
@@ -460,6 +480,8 @@ int j_strncmp(const char *a, const char *b, int i); /* provides NULL safe strncm
 int j_strncasecmp(const char *a, const char *b, int i); /* provides NULL safe strncasecmp wrapper */
 int j_strlen(const char *a); /* provides NULL safe strlen wrapper */
 int j_atoi(const char *a, int def); /* checks for NULL and uses default instead, convienence */
+char *j_atom(const char *str); /* get the interned copy of a well known name or namespace, NULL if not well known */
+int j_is_atom(const char *str); /* check if a string is an interned copy returned by j_atom() */
 void str_b64decode(char *str); /* what it says */
 
 namespace xmppd {
@@ -519,19 +541,90 @@ namespace xmppd {
      * This is a replacement for the xht structure in older versions of jabberd14 and the
      * xhash_...() functions are mapped to method calls on this object.
      *
-     * @todo This dynamically maps to either a map or an unordered_map if available.
-     * This depends on a test made in the configure script. But we should not depend on
-     * definitions in config.h (i.e. definitions made by the configure script) in files
-     * we do install. This should be fixed before this code gets released.
+     * The hash uses open addressing: a table of control bytes (empty, deleted, or 7 bits of the
+     * hash of the key) is probed linearly, the full hash of each key is stored as well, so that the
+     * keys have only to be compared for entries, that are very likely to match. Entries are allocated
+     * individually, so references to entries stay valid until they are erased. Erasing an entry does not
+     * move other entries, therefore it is safe to erase the current entry while iterating.
+     *
+     * Keys can be looked up as char const* without constructing a std::string.
+     *
+     * The interface is a subset of the interface of std::map.
      */
-    template <class value_type> class xhash :
-#ifdef HAS_TR1_UNORDERED_MAP
-	public std::tr1::unordered_map<std::string, value_type>
-#else
-	public std::map<std::string, value_type>
-#endif
-    {
+    template <class mapped_type_> class xhash {
 	public:
+	    typedef std::string key_type;					/**< type of the keys */
+	    typedef mapped_type_ mapped_type;					/**< type of the values */
+	    typedef std::pair<const std::string, mapped_type> value_type;	/**< type of the entries */
+	    typedef std::size_t size_type;					/**< type for sizes */
+
+	    /**
+	     * iterator over the entries of an xhash
+	     */
+	    template <class entry_type, class table_type> class basic_iterator {
+		public:
+		    basic_iterator() : table(NULL), slot(0) {}
+		    basic_iterator(table_type* table, size_type slot) : table(table), slot(slot) {}
+		    template <class other_entry_type, class other_table_type> basic_iterator(const basic_iterator<other_entry_type, other_table_type>& other) : table(other.table), slot(other.slot) {}
+
+		    entry_type& operator*() const { return *table->slots[slot].entry; }
+		    entry_type* operator->() const { return table->slots[slot].entry; }
+		    basic_iterator& operator++() { slot = table->next_used(slot+1); return *this; }
+		    basic_iterator operator++(int) { basic_iterator old(*this); ++*this; return old; }
+		    template <class other_entry_type, class other_table_type> bool operator==(const basic_iterator<other_entry_type, other_table_type>& other) const { return slot == other.slot; }
+		    template <class other_entry_type, class other_table_type> bool operator!=(const basic_iterator<other_entry_type, other_table_type>& other) const { return slot != other.slot; }
+
+		    table_type* table;	/**< the xhash the iterator belongs to */
+		    size_type slot;	/**< the slot the iterator points to, the capacity of the table for end() */
+	    };
+
+	    typedef basic_iterator<value_type, xhash> iterator;				/**< iterator over the entries */
+	    typedef basic_iterator<const value_type, const xhash> const_iterator;	/**< iterator over the entries, that cannot modify them */
+
+	    xhash();
+	    xhash(const xhash& other);
+	    ~xhash();
+	    xhash& operator=(const xhash& other);
+
+	    iterator begin() { return iterator(this, next_used(0)); }
+	    iterator end() { return iterator(this, slots.size()); }
+	    const_iterator begin() const { return const_iterator(this, next_used(0)); }
+	    const_iterator end() const { return const_iterator(this, slots.size()); }
+
+	    size_type size() const { return used; }
+	    bool empty() const { return used == 0; }
+	    void clear();
+
+	    /**
+	     * find an entry
+	     *
+	     * @param key the key of the entry
+	     * @return iterator to the entry, end() if there is no entry for this key
+	     */
+	    iterator find(char const* key) { return iterator(this, find_slot(key, std::strlen(key), hash(key, std::strlen(key)))); }
+	    iterator find(const std::string& key) { return iterator(this, find_slot(key.data(), key.length(), hash(key.data(), key.length()))); }
+	    const_iterator find(char const* key) const { return const_iterator(this, find_slot(key, std::strlen(key), hash(key, std::strlen(key)))); }
+	    const_iterator find(const std::string& key) const { return const_iterator(this, find_slot(key.data(), key.length(), hash(key.data(), key.length()))); }
+
+	    /**
+	     * get the value for a key, an entry is created if there is no entry for this key yet
+	     *
+	     * @param key the key of the entry
+	     * @return reference to the value of the entry
+	     */
+	    mapped_type& operator[](char const* key) { return insert_slot(key, std::strlen(key))->second; }
+	    mapped_type& operator[](const std::string& key) { return insert_slot(key.data(), key.length())->second; }
+
+	    /**
+	     * erase an entry
+	     *
+	     * @param key the key of the entry
+	     * @return number of erased entries (0 or 1)
+	     */
+	    size_type erase(char const* key) { return erase_slot(find_slot(key, std::strlen(key), hash(key, std::strlen(key)))); }
+	    size_type erase(const std::string& key) { return erase_slot(find_slot(key.data(), key.length(), hash(key.data(), key.length()))); }
+	    void erase(iterator position) { erase_slot(position.slot); }
+
 	    /**
 	     * get an entry from the hash but consider the key to be a domain
 	     *
@@ -539,10 +632,51 @@ namespace xmppd {
 	     * If there are multiple matches, the most specific one is returned. If no match can be found,
 	     * "*" is tried as a default key.
 	     *
+	     * The domain is read once from right to left: as keys are hashed starting with their last
+	     * character, the hash of each parent domain is extended to the hash of the next subdomain.
+	     *
 	     * @param domainkey the key that should be considered as a domain
 	     * @return iterator to the found value
 	     */
-	    typename xhash<value_type>::iterator get_by_domain(std::string domainkey);
+	    iterator get_by_domain(char const* domainkey);
+	    iterator get_by_domain(const std::string& domainkey) { return get_by_domain(domainkey.c_str()); }
+
+	    /**
+	     * calculate the hash of a key
+	     *
+	     * The characters of the key are hashed starting with the last one.
+	     *
+	     * @param key the key
+	     * @param len length of the key
+	     * @return the hash value
+	     */
+	    static size_type hash(char const* key, size_type len);
+	private:
+	    /**
+	     * a slot of the table
+	     */
+	    struct slot_type {
+		size_type hash;		/**< the hash of the key of the entry */
+		value_type* entry;	/**< the entry, NULL for empty or deleted slots */
+	    };
+
+	    static const unsigned char ctrl_empty = 0x80;	/**< control byte of a slot never used */
+	    static const unsigned char ctrl_deleted = 0xFE;	/**< control byte of a slot, whose entry has been erased */
+
+	    static unsigned long long hash_step(unsigned long long state, char c) { return (state ^ static_cast<unsigned char>(c)) * 1099511628211ULL; }
+	    static size_type hash_final(unsigned long long state);
+	    static unsigned char ctrl_byte(size_type hash) { return static_cast<unsigned char>(hash >> (sizeof(size_type)*8 - 7)); }
+
+	    size_type find_slot(char const* key, size_type len, size_type hash) const;
+	    value_type* insert_slot(char const* key, size_type len);
+	    size_type erase_slot(size_type slot);
+	    size_type next_used(size_type slot) const;
+	    void rehash(size_type capacity);
+
+	    std::vector<unsigned char> ctrl;	/**< control bytes of the slots */
+	    std::vector<slot_type> slots;	/**< the slots */
+	    size_type used;			/**< number of entries */
+	    size_type deleted;			/**< number of deleted slots */
     };
 }
 
@@ -592,6 +726,7 @@ typedef struct xmlnode_t {
      unsigned short     type;		/**< type of the xmlnode, one of ::NTYPE_TAG, ::NTYPE_ATTRIB, ::NTYPE_CDATA, or ::NTYPE_UNDEF */
      char*              data;		/**< data of the xmlnode, for attributes this is the value, for text nodes this is the text */
      int                data_sz;	/**< length of the data in the xmlnode */
+     int                data_capacity;	/**< for text nodes: size of the memory allocated for data, further text can be appended up to this size */
 /*     int                 complete; */
      pool               p;		/**< memory pool used by this xmlnode (the same as for all other xmlnode in a tree) */
      struct xmlnode_t*  parent;		/**< parent node for this node, or NULL for the root element */
@@ -605,10 +740,13 @@ typedef struct xmlnode_t {
 
 namespace xmppd {
 
+    class xmlnode_serializer;
+
     /**
      * This class represents and manages a list of bindings from namespace prefixes to namespace IRIs
      */
     class ns_decl_list : private std::list<std::pair<std::string, std::string> > {
+	friend class xmlnode_serializer;
 	public:
 	    ns_decl_list();
 	    ns_decl_list(const xmlnode node);
@@ -618,6 +756,7 @@ namespace xmppd {
 	    char const* get_nsprefix(const std::string& iri, bool accept_default_prefix) const;
 	    char const* get_nsiri(const std::string& prefix) const;
 	    bool check_prefix(const std::string& prefix, const std::string& ns_iri) const;
+	    std::string xmlns_attributes() const;
 	private:
     };
 
@@ -633,6 +772,66 @@ namespace xmppd {
  */
 typedef std::vector<xmlnode> xmlnode_vector;
 
+namespace xmppd {
+
+    /**
+     * a path as accepted by xmlnode_get_tags(), parsed and with its namespace prefixes resolved
+     *
+     * Selecting nodes using a compiled path does not need to parse the path again and does not create
+     * any temporary strings or vectors.
+     */
+    class compiled_path {
+	public:
+	    compiled_path(pool p, char const* path, xht namespaces);
+	    void select(xmlnode context_node, xmlnode_vector& result) const;
+	    xmlnode select_first(xmlnode context_node) const;
+	    bool same_namespaces(xht namespaces) const;
+	private:
+	    /**
+	     * what a step matches
+	     */
+	    enum step_test {
+		test_name,		/**< elements or attributes with a given name */
+		test_any,		/**< '*', any node */
+		test_text		/**< 'text()', text nodes */
+	    };
+
+	    /**
+	     * one location step of the path
+	     */
+	    struct step {
+		int axis;			/**< 0 = child, 1 = parent, 2 = attribute */
+		step_test test;			/**< what the step matches */
+		bool never_matches;		/**< unsupported predicate or syntax error, the step cannot match anything */
+		bool has_prefix;		/**< if the node test has a namespace prefix */
+		char const* name;		/**< local name to match for test_name */
+		char const* ns_iri;		/**< namespace IRI to match, NULL for no namespace */
+		bool has_predicate;		/**< if there is a predicate on the attribute ::attrib_name */
+		char const* attrib_name;	/**< local name of the attribute in the predicate */
+		char const* attrib_ns_iri;	/**< namespace IRI of the attribute in the predicate */
+		char const* attrib_value;	/**< value the attribute has to have, NULL to only check for existence */
+	    };
+
+	    /**
+	     * a namespace prefix that has been resolved when compiling the path
+	     */
+	    struct binding {
+		char const* prefix;		/**< the namespace prefix */
+		char const* ns_iri;		/**< the namespace IRI it resolved to, NULL if it was not declared */
+	    };
+
+	    char const* resolve(char const* prefix, xht namespaces);
+	    bool predicate_matches(step const& s, xmlnode node) const;
+	    xmlnode evaluate(std::vector<step>::size_type n, xmlnode context_node, xmlnode_vector* result) const;
+
+	    pool p;				/**< memory pool the strings of the steps are allocated from */
+	    std::vector<step> steps;		/**< the steps of the path */
+	    std::vector<binding> bindings;	/**< the namespace prefixes the path depends on */
+    };
+}
+
+typedef xmppd::compiled_path* xmlnode_path;
+
 /* Node creation routines */
 xmlnode  xmlnode_wrap(xmlnode x,const char* wrapper);
 xmlnode  xmlnode_wrap_ns(xmlnode x,const char* name, const char *prefix, const char *ns_iri);
@@ -646,10 +845,13 @@ xmlnode  xmlnode_insert_cdata(xmlnode parent, const char* CDATA, unsigned int si
 xmlnode  xmlnode_insert_tag_node(xmlnode parent, xmlnode node);
 void     xmlnode_insert_node(xmlnode parent, xmlnode node);
 xmlnode  xmlnode_str(const char *str, int len);
+int      xmlnode_insert_xml(xmlnode parent, const char* content, int len, const xmppd::ns_decl_list& nslist);
+void     xmlnode_put_unparsed(xmlnode node, const char* content, int len);
 xmlnode  xmlnode_file(const char *file);
 char const*    xmlnode_file_borked(char const *file); /* same as _file but returns the parsing error */
 xmlnode  xmlnode_dup(xmlnode x); /* duplicate x */
 xmlnode  xmlnode_dup_pool(pool p, xmlnode x);
+xmlnode  xmlnode_dup_shared(xmlnode x); /* duplicate x, sharing the content with further duplicates */
 
 /* Node Memory Pool */
 pool xmlnode_pool(xmlnode node);
@@ -666,6 +868,10 @@ void xmlnode_free(xmlnode node);
 xmlnode  xmlnode_get_tag(xmlnode parent, const char* name);
 char* xmlnode_get_tag_data(xmlnode parent, const char* name);
 xmlnode_vector xmlnode_get_tags(xmlnode context_node, const char *path, xht namespaces);
+xmlnode xmlnode_get_first_tag(xmlnode context_node, const char *path, xht namespaces);
+xmlnode_path xmlnode_path_compile(pool p, const char *path, xht namespaces);
+xmlnode_vector xmlnode_path_select(xmlnode_path path, xmlnode context_node);
+xmlnode xmlnode_path_select_first(xmlnode_path path, xmlnode context_node);
 xmlnode xmlnode_get_list_item(const xmlnode_vector& first, unsigned int i);
 char* xmlnode_get_list_item_data(const xmlnode_vector& first, unsigned int i);
 xmlnode xmlnode_select_by_lang(const xmlnode_vector& nodes, const char* lang);
@@ -703,6 +909,7 @@ char*	 xmlnode_serialize_string(xmlnode_t const* node, const xmppd::ns_decl_list
 
 int      xmlnode2file(char const* file, xmlnode node); /* writes node to file */
 int	 xmlnode2file_limited(char const* file, xmlnode node, size_t sizelimit);
+int	 xmlnode2file_durable(char const* file, xmlnode node, size_t sizelimit); /* like xmlnode2file_limited(), but syncs the data to disk before the file gets replaced */
 
 /* Expat callbacks */
 void expat_startElement(void* userdata, const char* name, const char** atts);
@@ -964,6 +1171,15 @@ namespace xmppd {
 	     */
 	    jabberid_pool(const Glib::ustring& jid, ::pool p);
 
+	    /**
+	     * construct a jabberid_pool as a copy of an other jabberid (it is not prepared again)
+	     *
+	     * @param jid the jabberid to copy
+	     * @param p the pool to assign
+	     * @throws std::invalid_argument if the pool is NULL
+	     */
+	    jabberid_pool(const jabberid& jid, ::pool p);
+
 	    /**
 	     * get the textual representation of a jabberid (allocated in pooled memory
 	     *
@@ -1035,6 +1251,7 @@ namespace xmppd {
 typedef xmppd::jabberid_pool* jid;
 
 jid     jid_new(pool p, const char *idstr);	       /* Creates a jabber id from the idstr */
+jid	jid_copy(pool p, jid id);		       /* Copies a jabber id to another pool (without preparing it again) */
 void    jid_set(jid id, const char *str, int item);  /* Individually sets jid components */
 char*   jid_full(jid id);		       /* Builds a string type=user/resource@server from the jid data */
 int     jid_cmp(jid a, jid b);		       /* Compares two jid's, returns 0 for perfect match */
@@ -1624,5 +1841,6 @@ namespace xmppd {
 }
 
 #include <pointer.tcc>
+#include <xhash.tcc>
 
 #endif	/* INCL_LIB_H */
@@ -52,6 +52,21 @@ jid jid_new(pool p, const char *idstr) {
     }
 }
 
+/**
+ * copy a jid to another pool
+ *
+ * the parts of the jid are already prepared, they are not prepared again
+ */
+jid jid_copy(pool p, jid id) {
+    // sanity check
+    if (!p || !id)
+	return NULL;
+
+    jid copy = new xmppd::jabberid_pool(*id, p);
+    pool_cleanup(p, jid_pool_cleaner, copy);
+    return copy;
+}
+
 /**
  * set part of a jabberid
  */
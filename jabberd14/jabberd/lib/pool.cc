@@ -44,12 +44,36 @@
  * struct myotherstruct *allocation2 = pmalloc(sizeof(struct myotherstruct));
  * ...
  * pool_free(p);
+ *
+ * Pool headers, heap blocks and the bookkeeping structures of pools are
+ * not allocated with malloc() one by one, but are taken from slabs, that
+ * are split into blocks of a fixed size class. Freed blocks are kept on a
+ * free list of their size class and are reused by the next pools. Only
+ * allocations bigger than the biggest size class are passed to malloc().
  */
 
 #include <jabberdlib.h>
 
+#ifdef POOL_HUGEPAGES
+#   include <sys/mman.h>
+#endif
+#ifdef POOL_DEBUG
+#   include <map>
+#endif
+
 #define MAX_MALLOC_TRIES 10 /**< how many seconds we try to allocate memory */
 
+#define POOL_SLAB_MIN_SHIFT 4	/**< the smallest size class are blocks of 1<<POOL_SLAB_MIN_SHIFT bytes */
+#define POOL_SLAB_CLASSES 12	/**< number of size classes, each one doubles the block size, i.e. the biggest are 32 KiB */
+#define POOL_SLAB_MAX_SIZE (1 << (POOL_SLAB_MIN_SHIFT + POOL_SLAB_CLASSES - 1)) /**< size of the biggest size class */
+#ifdef POOL_HUGEPAGES
+#   define POOL_SLAB_SIZE (2*1024*1024)	/**< size of a slab, one huge page */
+#else
+#   define POOL_SLAB_SIZE (256*1024)	/**< size of a slab, that gets split into blocks of one size class */
+#endif
+
+void log_notice(const char *host, const char *msgfmt, ...);
+
 #ifdef POOL_DEBUG
 int pool__total = 0;		/**< how many memory blocks are allocated */
 int pool__ltotal = 0;
@@ -110,6 +134,189 @@ inline void *_retried__malloc(size_t size) {
     return allocated_memory;
 }
 
+/**
+ * a free block of the slab allocator, they are linked to the free list of their size class
+ */
+struct pool_slab_free_block {
+    struct pool_slab_free_block *next;	/**< next free block of the same size class */
+};
+
+/**
+ * state of one size class of the slab allocator
+ */
+struct pool_slab_class {
+    struct pool_slab_free_block *free_list;	/**< blocks, that have been freed and can be reused */
+    char *unused;		/**< start of the part of the last slab, that has not been split into blocks yet */
+    char *unused_end;		/**< end of the last slab */
+    size_t slabs;		/**< number of slabs allocated for this size class */
+    size_t used;		/**< number of blocks currently in use */
+    size_t used_high_water;	/**< maximum number of blocks, that have been in use at the same time */
+};
+
+static struct pool_slab_class pool__slab_classes[POOL_SLAB_CLASSES]; /**< the size classes of the slab allocator */
+static unsigned int pool__live = 0;		/**< number of existing pools */
+static unsigned int pool__live_high_water = 0;	/**< maximum number of pools, that existed at the same time */
+static size_t pool__bytes = 0;			/**< sum of the sizes of all existing pools */
+static size_t pool__bytes_high_water = 0;	/**< maximum of pool__bytes */
+
+/**
+ * get the size class for an allocation
+ *
+ * @param size the size of the allocation (at most POOL_SLAB_MAX_SIZE)
+ * @return index of the smallest size class with blocks of at least size bytes
+ */
+inline int _pool_slab_class(size_t size) {
+    int size_class = 0;
+
+    for (size = (size - 1) >> POOL_SLAB_MIN_SHIFT; size > 0; size >>= 1)
+	size_class++;
+
+    return size_class;
+}
+
+/**
+ * get the size of the blocks of a size class
+ *
+ * @param size_class the index of the size class
+ * @return size of the blocks of this size class
+ */
+inline size_t _pool_slab_class_size(int size_class) {
+    return static_cast<size_t>(1) << (POOL_SLAB_MIN_SHIFT + size_class);
+}
+
+/**
+ * allocate a new slab
+ *
+ * If jabberd14 has been compiled with support for huge pages, the slab is mapped as a huge page if possible.
+ *
+ * @return pointer to POOL_SLAB_SIZE bytes of memory
+ */
+static void *_pool_slab_new() {
+#if defined(POOL_HUGEPAGES) && defined(MAP_HUGETLB)
+    void *slab = mmap(NULL, POOL_SLAB_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    if (slab != MAP_FAILED)
+	return slab;
+#endif
+    void *slab = _retried__malloc(POOL_SLAB_SIZE);
+#ifdef POOL_DEBUG
+    pool__total--; /* slabs are never freed, do not report them as missed */
+#endif
+    return slab;
+}
+
+/**
+ * allocate a block of memory for a pool
+ *
+ * Blocks up to POOL_SLAB_MAX_SIZE bytes are taken from the slab allocator, bigger blocks are allocated using malloc().
+ *
+ * @param size how many bytes to allocate
+ * @return pointer to the allocated memory
+ */
+static void *_pool_block_new(size_t size) {
+    if (size > POOL_SLAB_MAX_SIZE || size == 0)
+	return _retried__malloc(size);
+
+    struct pool_slab_class *size_class = &pool__slab_classes[_pool_slab_class(size)];
+    size_t block_size = _pool_slab_class_size(size_class - pool__slab_classes);
+    void *block = NULL;
+
+    if (size_class->free_list != NULL) {
+	/* reuse a block that has been freed */
+	block = size_class->free_list;
+	size_class->free_list = size_class->free_list->next;
+    } else {
+	/* split the next block from the last slab, or get a new slab */
+	if (size_class->unused == NULL || size_class->unused_end - size_class->unused < static_cast<ptrdiff_t>(block_size)) {
+	    size_class->unused = static_cast<char*>(_pool_slab_new());
+	    size_class->unused_end = size_class->unused + POOL_SLAB_SIZE;
+	    size_class->slabs++;
+	}
+	block = size_class->unused;
+	size_class->unused += block_size;
+    }
+
+    if (++size_class->used > size_class->used_high_water)
+	size_class->used_high_water = size_class->used;
+
+    return block;
+}
+
+/**
+ * free a block of memory, that has been allocated using _pool_block_new()
+ *
+ * Blocks of the slab allocator are not returned to the operating system, but kept on the free list of their size class.
+ *
+ * @param block the block to free
+ * @param size the size, that has been passed to _pool_block_new()
+ */
+static void _pool_block_free(void *block, size_t size) {
+    if (block == NULL)
+	return;
+
+    if (size > POOL_SLAB_MAX_SIZE || size == 0) {
+	_pool__free(block);
+	return;
+    }
+
+    struct pool_slab_class *size_class = &pool__slab_classes[_pool_slab_class(size)];
+    struct pool_slab_free_block *free_block = static_cast<struct pool_slab_free_block*>(block);
+
+    free_block->next = size_class->free_list;
+    size_class->free_list = free_block;
+    size_class->used--;
+}
+
+/**
+ * account for memory, that has been added to a pool
+ *
+ * @param p the pool
+ * @param size how many bytes have been added
+ */
+inline void _pool_grow(pool p, int size) {
+    p->size += size;
+    pool__bytes += size;
+    if (pool__bytes > pool__bytes_high_water)
+	pool__bytes_high_water = pool__bytes;
+
+#ifdef POOL_DEBUG
+    p->zone_stat->bytes += size;
+    if (p->zone_stat->bytes > p->zone_stat->bytes_high_water)
+	p->zone_stat->bytes_high_water = p->zone_stat->bytes;
+#endif
+}
+
+#ifdef POOL_DEBUG
+/**
+ * get the statistics of all places in the source, where pools are created
+ *
+ * @return map from the place in the source ("file:line") to the statistics of its pools
+ */
+static std::map<std::string, struct pool_zone_stat> *_pool_zone_stats() {
+    /* never deleted, pools might still be freed after static destructors */
+    static std::map<std::string, struct pool_zone_stat> *zones = new std::map<std::string, struct pool_zone_stat>();
+
+    return zones;
+}
+
+/**
+ * get the statistics for the pools created at a place in the source
+ *
+ * @param zone the place in the source ("file:line")
+ * @return the statistics for this zone
+ */
+static struct pool_zone_stat *_pool_zone_stat(char const* zone) {
+    std::map<std::string, struct pool_zone_stat> *zones = _pool_zone_stats();
+
+    std::map<std::string, struct pool_zone_stat>::iterator zone_stat = zones->find(zone);
+    if (zone_stat == zones->end()) {
+	struct pool_zone_stat new_zone_stat = { 0, 0, 0, 0 };
+	zone_stat = zones->insert(std::make_pair(std::string(zone), new_zone_stat)).first;
+    }
+
+    return &zone_stat->second;
+}
+#endif
+
 /**
  * make an empty pool
  *
@@ -127,12 +334,15 @@ pool _pool_new(char *zone, int line)
     int old__pool__total;
 #endif
 
-    pool p = static_cast<pool>(_retried__malloc(sizeof(_pool)));
+    pool p = static_cast<pool>(_pool_block_new(sizeof(_pool)));
     
     p->cleanup = NULL;
     p->heap = NULL;
     p->size = 0;
 
+    if (++pool__live > pool__live_high_water)
+	pool__live_high_water = pool__live;
+
 #ifdef POOL_DEBUG
     p->lsize = -1;
     p->zone[0] = '\0';
@@ -140,6 +350,10 @@ pool _pool_new(char *zone, int line)
     snprintf(p->zone, sizeof(p->zone), "%s:%i", zone, line);
     snprintf(p->name, sizeof(p->name), "%X", p);
 
+    p->zone_stat = _pool_zone_stat(p->zone);
+    if (++p->zone_stat->pools > p->zone_stat->pools_high_water)
+	p->zone_stat->pools_high_water = p->zone_stat->pools;
+
     if(pool__disturbed == NULL)
     {
         pool__disturbed = (xht)1; /* reentrancy flag! */
@@ -163,8 +377,8 @@ void _pool_heap_free(void *arg)
 {
     struct pheap *h = (struct pheap *)arg;
 
-    _pool__free(h->block);
-    _pool__free(h);
+    _pool_block_free(h->block, h->size);
+    _pool_block_free(h, sizeof(struct pheap));
 }
 
 /**
@@ -209,7 +423,7 @@ struct pfree *_pool_free(pool p, pool_cleaner f, void *arg)
     struct pfree *ret;
 
     /* make the storage for the tracker */
-    ret = static_cast<struct pfree*>(_retried__malloc(sizeof(struct pfree)));
+    ret = static_cast<struct pfree*>(_pool_block_new(sizeof(struct pfree)));
     ret->f = f;
     ret->arg = arg;
     ret->next = NULL;
@@ -222,6 +436,8 @@ struct pfree *_pool_free(pool p, pool_cleaner f, void *arg)
  *
  * pheaps are used by memory pools internally to handle the memory allocations
  *
+ * If the heap is served by the slab allocator, its size is rounded up to the size of the size class.
+ *
  * @note the macro pool_heap calls _pool_new_heap and NOT _pool_heap
  *
  * @param p for which pool the heap should be created
@@ -233,11 +449,15 @@ struct pheap *_pool_heap(pool p, int size)
     struct pheap *ret;
     struct pfree *clean;
 
+    /* use the complete block we get from the slab allocator */
+    if (size > 0 && size <= POOL_SLAB_MAX_SIZE)
+	size = _pool_slab_class_size(_pool_slab_class(size));
+
     /* make the return heap */
-    ret = static_cast<struct pheap*>(_retried__malloc(sizeof(struct pheap)));
-    ret->block = _retried__malloc(size);
+    ret = static_cast<struct pheap*>(_pool_block_new(sizeof(struct pheap)));
+    ret->block = _pool_block_new(size);
     ret->size = size;
-    p->size += size;
+    _pool_grow(p, size);
     ret->used = 0;
 
     /* append to the cleanup list */
@@ -283,13 +503,12 @@ void *pmalloc(pool p, int size)
         abort();
     }
 
-    /* if there is no heap for this pool or it's a big request, just raw, I like how we clean this :) */
+    /* if there is no heap for this pool or it's a big request, use a heap of its own, that is not used for other requests */
     if(p->heap == NULL || size > (p->heap->size / 2))
     {
-	block = _retried__malloc(size);
-        p->size += size;
-        _pool_cleanup_append(p, _pool_free(p, _pool__free, block));
-        return block;
+	struct pheap *raw = _pool_heap(p, size);
+	raw->used = raw->size;
+        return raw->block;
     }
 
     /* we have to preserve boundaries, long story :) */
@@ -399,15 +618,20 @@ void pool_free(pool p)
     {
         (*cur->f)(cur->arg);
         stub = cur->next;
-        _pool__free(cur);
+        _pool_block_free(cur, sizeof(struct pfree));
         cur = stub;
     }
 
+    pool__live--;
+    pool__bytes -= p->size;
+
 #ifdef POOL_DEBUG
     xhash_zap(pool__disturbed,p->name);
+    p->zone_stat->pools--;
+    p->zone_stat->bytes -= p->size;
 #endif
 
-    _pool__free(p);
+    _pool_block_free(p, sizeof(_pool));
 
 }
 
@@ -423,6 +647,51 @@ void pool_cleanup(pool p, pool_cleaner f, void *arg)
     p->cleanup = clean;
 }
 
+/**
+ * get the statistics of the pool allocator
+ *
+ * @param stats where to store the statistics
+ */
+void pool_get_stats(pool_stats stats)
+{
+    if (stats == NULL)
+	return;
+
+    stats->pools = pool__live;
+    stats->pools_high_water = pool__live_high_water;
+    stats->bytes = pool__bytes;
+    stats->bytes_high_water = pool__bytes_high_water;
+    stats->slab_bytes = 0;
+    stats->slab_free_bytes = 0;
+
+    for (int size_class = 0; size_class < POOL_SLAB_CLASSES; size_class++) {
+	size_t block_size = _pool_slab_class_size(size_class);
+
+	stats->slab_bytes += pool__slab_classes[size_class].slabs * POOL_SLAB_SIZE;
+	stats->slab_free_bytes += pool__slab_classes[size_class].slabs * POOL_SLAB_SIZE - pool__slab_classes[size_class].used * block_size;
+    }
+}
+
+/**
+ * log the statistics of the slab allocator
+ *
+ * @param own_pid the "host" to use for log_notice()
+ */
+static void _pool_stat_slabs(char const* own_pid)
+{
+    _pool_stats stats;
+    pool_get_stats(&stats);
+
+    log_notice(own_pid, "Pools: %u (max %u) / bytes in pools: %lu (max %lu) / slab memory: %lu (unused %lu)", stats.pools, stats.pools_high_water, static_cast<unsigned long>(stats.bytes), static_cast<unsigned long>(stats.bytes_high_water), static_cast<unsigned long>(stats.slab_bytes), static_cast<unsigned long>(stats.slab_free_bytes));
+
+    for (int size_class = 0; size_class < POOL_SLAB_CLASSES; size_class++) {
+	if (pool__slab_classes[size_class].slabs == 0)
+	    continue;
+
+	log_notice(own_pid, "Size class %lu B: %lu slabs / blocks used: %lu (max %lu)", static_cast<unsigned long>(_pool_slab_class_size(size_class)), static_cast<unsigned long>(pool__slab_classes[size_class].slabs), static_cast<unsigned long>(pool__slab_classes[size_class].used), static_cast<unsigned long>(pool__slab_classes[size_class].used_high_water));
+    }
+}
+
 #ifdef POOL_DEBUG
 
 typedef struct pool_debug_info_st {
@@ -433,7 +702,6 @@ typedef struct pool_debug_info_st {
 } *pool_debug_info, _pool_debug_info;
 
 void debug_log(char *zone, const char *msgfmt, ...);
-void log_notice(const char *host, const char *msgfmt, ...);
 
 void _pool_stat(xht h, const char *key, void *data, void *arg)
 {
@@ -482,17 +750,32 @@ void pool_stat(int full)
     pool__ltotal = pool__total;
 
     log_notice(own_pid, "Used memory by pools: %i / biggest pool: %i / number of pools: %i", debug_data.used_memory, debug_data.biggest_pool, debug_data.count);
+    _pool_stat_slabs(own_pid);
+
+    /* statistics by the place where pools are created, zones without pools only on a full report */
+    std::map<std::string, struct pool_zone_stat>::const_iterator zone_stat;
+    for (zone_stat = _pool_zone_stats()->begin(); zone_stat != _pool_zone_stats()->end(); ++zone_stat) {
+	if (zone_stat->second.pools == 0 && !full)
+	    continue;
+	debug_log("pool_debug", "%s: %u pools (max %u) / %lu bytes (max %lu)", zone_stat->first.c_str(), zone_stat->second.pools, zone_stat->second.pools_high_water, static_cast<unsigned long>(zone_stat->second.bytes), static_cast<unsigned long>(zone_stat->second.bytes_high_water));
+    }
 
     return;
 }
 #else
 /**
- * dummy implementation: print memory pool statistics (for debugging purposes, real implementation if POOL_DEBUG is defined)
+ * print the statistics of the pool allocator (more statistics are available if POOL_DEBUG is defined)
  *
  * @param full make a full report? (0 = no, 1 = yes)
  */
 void pool_stat(int full)
 {
-    return;
+    static char own_pid[32] = "";
+
+    if (own_pid[0] == '\0') {
+	snprintf(own_pid, sizeof(own_pid), "%i pool_debug", getpid());
+    }
+
+    _pool_stat_slabs(own_pid);
 }
 #endif
@@ -83,6 +83,7 @@ char *j_strcat(char *dest, char *txt)
  * NULL pointer save version of strcmp
  *
  * If one of the parameters contains a NULL pointer, the string is considered to be unequal.
+ * If both strings are atoms (see j_atom()), only the pointers are compared.
  *
  * @note the return value is not compatible with strcmp()
  *
@@ -95,6 +96,12 @@ int j_strcmp(const char *a, const char *b)
     if(a == NULL || b == NULL)
         return -1;
 
+    if(a == b)
+        return 0;
+
+    if(j_is_atom(a) && j_is_atom(b))
+        return -1;
+
     while(*a == *b && *a != '\0' && *b != '\0'){ a++; b++; }
 
     if(*a == *b) return 0;
@@ -179,6 +186,135 @@ int j_atoi(const char *a, int def)
         return atoi(a);
 }
 
+/**
+ * well known strings, that are interned as atoms
+ *
+ * These are the names of elements and attributes, and the namespace IRIs, that are used in most stanzas.
+ */
+static char const* const j_atom_strings[] = {
+    NS_STREAM, NS_CLIENT, NS_SERVER, NS_DIALBACK, NS_COMPONENT_ACCEPT, NS_AUTH, NS_AUTH_CRYPT,
+    NS_REGISTER, NS_ROSTER, NS_OFFLINE, NS_DELAY, NS_VERSION, NS_TIME, NS_VCARD, NS_PRIVATE,
+    NS_SEARCH, NS_OOB, NS_XOOB, NS_BROWSE, NS_EVENT, NS_LAST, NS_EXPIRE, NS_PRIVACY, NS_XHTML,
+    NS_DISCO_INFO, NS_DISCO_ITEMS, NS_DATA, NS_FLEXIBLE_OFFLINE, NS_IQ_AUTH, NS_REGISTER_FEATURE,
+    NS_MSGOFFLINE, NS_BYTESTREAMS, NS_COMMAND, NS_XMPP_STANZAS, NS_XMPP_TLS, NS_XMPP_STREAMS,
+    NS_XMPP_SASL, NS_XMPP_PING, NS_JABBERD_STOREDPRESENCE, NS_JABBERD_STOREDPEERPRESENCE,
+    NS_JABBERD_STOREDREQUEST, NS_JABBERD_STOREDSTATE, NS_JABBERD_HISTORY, NS_JABBERD_HASH,
+    NS_JABBERD_XDB, NS_JABBERD_WRAPPER, NS_JABBERD_XDBSQL, NS_JABBERD_ACL, NS_JABBERD_LOOPCHECK,
+    NS_JABBERD_ERRMSG, NS_SESSION, NS_XMLNS, NS_XML,
+    "stream", "features", "error", "message", "presence", "iq", "route", "xdb", "log", "body",
+    "subject", "thread", "html", "query", "x", "show", "status", "priority", "item", "group", "c",
+    "delay", "to", "from", "type", "id", "xmlns", "lang", "jid", "name", "subscription", "ask",
+    "node", "var", "code", "stamp", "ns", "action", "match", "matchpath", "result", "get", "set",
+    "chat", "groupchat", "headline", "normal", "available", "unavailable", "probe", "subscribe",
+    "subscribed", "unsubscribe", "unsubscribed", "invisible", "away", "xa", "dnd", "starttls",
+    "proceed", "mechanisms", "mechanism", "auth", "response", "challenge", "success", "failure",
+    "bind", "session", "resource", "username", "password", "digest", "hash", "text", "db", "sc",
+    "user", "host", "sid", "version",
+    NULL
+};
+
+#define J_ATOM_SLOTS 512	/**< number of slots in the hash table of atoms, has to be a power of two and bigger than the number of atoms */
+
+static char *j_atom_buffer = NULL;	/**< memory holding all atoms, NULL if not yet initialized */
+static char *j_atom_buffer_end = NULL;	/**< first byte after the atoms */
+static char *j_atom_table[J_ATOM_SLOTS];	/**< open addressing hash table of the atoms */
+
+/**
+ * hash function for the atom table (same as used by the original xhash implementation)
+ *
+ * @param str the string to hash
+ * @return the slot to start searching in
+ */
+static unsigned int j_atom_hash(const char *str)
+{
+    unsigned int h = 0, g;
+
+    for(; *str != '\0'; str++)
+    {
+        h = (h << 4) + static_cast<unsigned char>(*str);
+        if((g = (h & 0xf0000000)) != 0)
+            h ^= g >> 24;
+        h &= ~g;
+    }
+
+    return h & (J_ATOM_SLOTS-1);
+}
+
+/**
+ * copy the well known strings to the atom buffer and build the hash table
+ *
+ * The atoms are never freed.
+ */
+static void j_atom_init()
+{
+    size_t size = 0;
+    char *pos = NULL;
+
+    for(char const* const* str = j_atom_strings; *str != NULL; str++)
+        size += strlen(*str) + 1;
+
+    pos = j_atom_buffer = new char[size];
+    for(char const* const* str = j_atom_strings; *str != NULL; str++)
+    {
+        unsigned int slot = j_atom_hash(*str);
+
+        while(j_atom_table[slot] != NULL && strcmp(j_atom_table[slot], *str) != 0)
+            slot = (slot + 1) & (J_ATOM_SLOTS-1);
+        if(j_atom_table[slot] != NULL)
+            continue; /* listed twice */
+
+        strcpy(pos, *str);
+        j_atom_table[slot] = pos;
+        pos += strlen(pos) + 1;
+    }
+    j_atom_buffer_end = pos;
+}
+
+/**
+ * get the interned copy of a well known string
+ *
+ * Element names, attribute names and namespace IRIs used in most stanzas are stored only once
+ * in the process. An xmlnode using an atom does not need a copy of the string in its pool, and
+ * atoms can be compared by comparing the pointers.
+ *
+ * @note atoms must not be modified
+ *
+ * @param str the string to get the atom for
+ * @return the atom, NULL if str is not a well known string
+ */
+char *j_atom(const char *str)
+{
+    unsigned int slot;
+
+    if(str == NULL)
+        return NULL;
+
+    if(j_is_atom(str))
+        return const_cast<char*>(str);
+
+    if(j_atom_buffer == NULL)
+        j_atom_init();
+
+    for(slot = j_atom_hash(str); j_atom_table[slot] != NULL; slot = (slot + 1) & (J_ATOM_SLOTS-1))
+    {
+        if(strcmp(j_atom_table[slot], str) == 0)
+            return j_atom_table[slot];
+    }
+
+    return NULL;
+}
+
+/**
+ * check if a string is an atom, i.e. a pointer returned by j_atom()
+ *
+ * @param str the string to check
+ * @return 1 if str is an atom, 0 else
+ */
+int j_is_atom(const char *str)
+{
+    return str >= j_atom_buffer && str < j_atom_buffer_end;
+}
+
 
 char *strunescape(pool p, char *buf)
 {
@@ -30,27 +30,11 @@
 
 /**
  * @file xhash.cc
- * @brief implements a hashmap using STL containers
+ * @brief the xhash_...() functions mapped to xmppd::xhash (implemented in xhash.tcc)
  */
 
 #include <jabberdlib.h>
 
-namespace xmppd {
-    template<class value_type> typename xmppd::xhash<value_type>::iterator xhash<value_type>::get_by_domain(std::string domainkey) {
-	while (true) {
-	    typename xmppd::xhash<value_type>::iterator result = xhash<value_type>::find(domainkey);
-	    if (result != xhash<value_type>::end())
-		return result;
-
-	    std::string::size_type dot_pos = domainkey.find(".");
-	    if (dot_pos == std::string::npos)
-		return xhash<value_type>::find("*");
-
-	    domainkey.erase(0, dot_pos+1);
-	}
-    }
-}
-
 /**
  * create a new xhash hash collection
  *
@@ -0,0 +1,204 @@
+/*
+ * Copyrights
+ *
+ * Copyright (c) 2006-2007 Matthias Wimmer
+ *
+ * This file is part of jabberd14.
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+/**
+ * @file xhash.tcc
+ * @brief hash with string keys
+ *
+ * This file implements the xhash<mapped_type> template class.
+ */
+
+#include <cstring>
+#include <vector>
+
+namespace xmppd {
+    template<class mapped_type_> const unsigned char xhash<mapped_type_>::ctrl_empty;
+    template<class mapped_type_> const unsigned char xhash<mapped_type_>::ctrl_deleted;
+
+    template<class mapped_type_> xhash<mapped_type_>::xhash() : used(0), deleted(0) {
+    }
+
+    template<class mapped_type_> xhash<mapped_type_>::xhash(const xhash<mapped_type_>& other) : used(0), deleted(0) {
+	*this = other;
+    }
+
+    template<class mapped_type_> xhash<mapped_type_>::~xhash() {
+	clear();
+    }
+
+    template<class mapped_type_> xhash<mapped_type_>& xhash<mapped_type_>::operator=(const xhash<mapped_type_>& other) {
+	if (&other == this)
+	    return *this;
+
+	clear();
+	for (const_iterator p = other.begin(); p != other.end(); ++p) {
+	    (*this)[p->first] = p->second;
+	}
+
+	return *this;
+    }
+
+    template<class mapped_type_> void xhash<mapped_type_>::clear() {
+	for (typename std::vector<slot_type>::iterator p = slots.begin(); p != slots.end(); ++p) {
+	    delete p->entry;
+	}
+
+	ctrl.clear();
+	slots.clear();
+	used = 0;
+	deleted = 0;
+    }
+
+    template<class mapped_type_> typename xhash<mapped_type_>::size_type xhash<mapped_type_>::hash(char const* key, size_type len) {
+	// FNV-1a, from the last to the first character ...
+	unsigned long long state = 14695981039346656037ULL;
+	for (size_type i = len; i > 0; i--) {
+	    state = hash_step(state, key[i-1]);
+	}
+
+	return hash_final(state);
+    }
+
+    template<class mapped_type_> typename xhash<mapped_type_>::size_type xhash<mapped_type_>::hash_final(unsigned long long state) {
+	// ... and mixing the bits, as the highest bits are used for the control bytes
+	state ^= state >> 33;
+	state *= 0xff51afd7ed558ccdULL;
+	state ^= state >> 33;
+
+	return static_cast<size_type>(state);
+    }
+
+    template<class mapped_type_> typename xhash<mapped_type_>::size_type xhash<mapped_type_>::find_slot(char const* key, size_type len, size_type hash) const {
+	if (slots.empty())
+	    return 0;
+
+	size_type mask = slots.size() - 1;
+	unsigned char wanted = ctrl_byte(hash);
+
+	for (size_type slot = hash & mask; ; slot = (slot + 1) & mask) {
+	    if (ctrl[slot] == ctrl_empty)
+		return slots.size();
+
+	    if (ctrl[slot] == wanted && slots[slot].hash == hash) {
+		const std::string& entry_key = slots[slot].entry->first;
+		if (entry_key.length() == len && std::memcmp(entry_key.data(), key, len) == 0)
+		    return slot;
+	    }
+	}
+    }
+
+    template<class mapped_type_> typename xhash<mapped_type_>::value_type* xhash<mapped_type_>::insert_slot(char const* key, size_type len) {
+	size_type key_hash = hash(key, len);
+
+	// already an entry?
+	size_type slot = find_slot(key, len, key_hash);
+	if (slot < slots.size())
+	    return slots[slot].entry;
+
+	// keep at least a quarter of the slots empty, so that probing stays short
+	if ((used + deleted + 1) * 4 > slots.size() * 3)
+	    rehash((used + 1) * 2 > slots.size() ? (slots.size() < 8 ? 16 : slots.size() * 2) : slots.size());
+
+	// use the first slot, that is not used (a deleted slot can be reused, the key is not in the table)
+	size_type mask = slots.size() - 1;
+	for (slot = key_hash & mask; ctrl[slot] != ctrl_empty && ctrl[slot] != ctrl_deleted; slot = (slot + 1) & mask)
+	    ;
+
+	if (ctrl[slot] == ctrl_deleted)
+	    deleted--;
+	ctrl[slot] = ctrl_byte(key_hash);
+	slots[slot].hash = key_hash;
+	slots[slot].entry = new value_type(std::string(key, len), mapped_type());
+	used++;
+
+	return slots[slot].entry;
+    }
+
+    template<class mapped_type_> typename xhash<mapped_type_>::size_type xhash<mapped_type_>::erase_slot(size_type slot) {
+	if (slot >= slots.size() || slots[slot].entry == NULL)
+	    return 0;
+
+	delete slots[slot].entry;
+	slots[slot].entry = NULL;
+	ctrl[slot] = ctrl_deleted;
+	used--;
+	deleted++;
+
+	return 1;
+    }
+
+    template<class mapped_type_> typename xhash<mapped_type_>::size_type xhash<mapped_type_>::next_used(size_type slot) const {
+	while (slot < slots.size() && slots[slot].entry == NULL)
+	    slot++;
+
+	return slot;
+    }
+
+    template<class mapped_type_> void xhash<mapped_type_>::rehash(size_type capacity) {
+	std::vector<unsigned char> old_ctrl(capacity, ctrl_empty);
+	std::vector<slot_type> old_slots(capacity);
+	old_ctrl.swap(ctrl);
+	old_slots.swap(slots);
+	deleted = 0;
+
+	// the entries are moved to their new slots, the hashes are not calculated again
+	size_type mask = capacity - 1;
+	for (typename std::vector<slot_type>::const_iterator p = old_slots.begin(); p != old_slots.end(); ++p) {
+	    if (p->entry == NULL)
+		continue;
+
+	    size_type slot = p->hash & mask;
+	    while (ctrl[slot] != ctrl_empty)
+		slot = (slot + 1) & mask;
+
+	    ctrl[slot] = ctrl_byte(p->hash);
+	    slots[slot] = *p;
+	}
+    }
+
+    template<class mapped_type_> typename xhash<mapped_type_>::iterator xhash<mapped_type_>::get_by_domain(char const* domainkey) {
+	size_type len = std::strlen(domainkey);
+	size_type match = slots.size();
+
+	// walk the domain from right to left, looking up each parent domain when its hash is complete
+	unsigned long long state = 14695981039346656037ULL;
+	for (size_type start = len; ; start--) {
+	    if (start == 0 || domainkey[start-1] == '.') {
+		// a more specific match replaces the previous one
+		size_type slot = find_slot(domainkey+start, len-start, hash_final(state));
+		if (slot < slots.size())
+		    match = slot;
+	    }
+
+	    if (start == 0)
+		break;
+	    state = hash_step(state, domainkey[start-1]);
+	}
+
+	if (match < slots.size())
+	    return iterator(this, match);
+
+	return find("*");
+    }
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyrights
+ * 
+ * Portions created by or assigned to Jabber.com, Inc. are 
+ * Copyright (c) 1999-2002 Jabber.com, Inc.  All Rights Reserved.  Contact
+ * information for Jabber.com, Inc. is available at http://www.jabber.com/.
+ *
+ * Portions Copyright (c) 1998-1999 Jeremie Miller.
+ *
+ * Portions Copyright (c) 2006-2007 Matthias Wimmer
+ *
+ * This file is part of jabberd14.
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+/**
+ * @file xhash_bench.cc
+ * @brief microbenchmark comparing xmppd::xhash to the std::tr1::unordered_map it replaced
+ *
+ * This program is not built by default. Build and run it using:
+ *
+ * <pre>
+ * make -C jabberd/lib xhash_bench CXXFLAGS=-O2
+ * jabberd/lib/xhash_bench [keys [lookups]]
+ * </pre>
+ *
+ * It fills both tables with the same keys (JabberIDs of different lengths) and looks up random
+ * existing keys given as char const*, as xhash_get() does. The former implementation had to build
+ * a std::string for each lookup. Before measuring, the results of xmppd::xhash are checked against
+ * std::map for random put/zap/get operations.
+ */
+
+#include <jabberdlib.h>
+#include <tr1/unordered_map>
+#include <map>
+#include <iostream>
+#include <sys/time.h>
+
+/**
+ * get the current time in microseconds
+ *
+ * @return the current time
+ */
+static double xhash_bench_now() {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+/**
+ * check xmppd::xhash against std::map using random operations
+ *
+ * @param operations number of operations to do
+ * @return true if both always had the same content
+ */
+static bool xhash_bench_verify(int operations) {
+    xmppd::xhash<int> h;
+    std::map<std::string, int> reference;
+
+    for (int n = 0; n < operations; n++) {
+	std::ostringstream key;
+	key << "user" << std::rand() % 1000 << "@example.com";
+
+	switch (std::rand() % 3) {
+	    case 0:
+		h[key.str().c_str()] = n;
+		reference[key.str()] = n;
+		break;
+	    case 1:
+		if (h.erase(key.str().c_str()) != reference.erase(key.str()))
+		    return false;
+		break;
+	    default:
+		xmppd::xhash<int>::iterator i = h.find(key.str().c_str());
+		std::map<std::string, int>::iterator r = reference.find(key.str());
+		if ((i == h.end()) != (r == reference.end()) || (i != h.end() && i->second != r->second))
+		    return false;
+	}
+
+	if (h.size() != reference.size())
+	    return false;
+    }
+
+    return true;
+}
+
+/**
+ * time random lookups of existing keys
+ *
+ * @param table the table to look the keys up in
+ * @param keys the keys in the table
+ * @param order indexes of the keys to look up
+ * @return nanoseconds per lookup
+ */
+template <class table_type> static double xhash_bench_lookups(table_type& table, std::vector<std::string> const& keys, std::vector<int> const& order) {
+    unsigned long found = 0;
+    double start = xhash_bench_now();
+
+    for (std::vector<int>::const_iterator i = order.begin(); i != order.end(); ++i)
+	found += table.find(keys[*i].c_str()) != table.end();
+
+    /* the lookups must not be optimized away */
+    if (found != order.size())
+	std::cerr << "lookups failed" << std::endl;
+
+    return (xhash_bench_now() - start) * 1000.0 / order.size();
+}
+
+int main(int argc, char const** argv) {
+    int count = argc > 1 ? std::atoi(argv[1]) : 10000;
+    int lookups = argc > 2 ? std::atoi(argv[2]) : 5000000;
+    std::vector<std::string> keys;
+    std::vector<int> order;
+    xmppd::xhash<void*> h;
+    std::tr1::unordered_map<std::string, void*> u;
+
+    if (count <= 0 || lookups <= 0) {
+	std::cerr << "usage: " << argv[0] << " [keys [lookups]]" << std::endl;
+	return 1;
+    }
+
+    std::srand(1);
+    if (!xhash_bench_verify(200000)) {
+	std::cerr << "xmppd::xhash returned other results than std::map" << std::endl;
+	return 1;
+    }
+
+    for (int n = 0; n < count; n++) {
+	std::ostringstream key;
+	key << "user" << n << std::string(n % 16, 'x') << "@host" << n % 7 << ".example.com";
+	keys.push_back(key.str());
+	h[keys.back()] = &keys;
+	u[keys.back()] = &keys;
+    }
+    for (int n = 0; n < lookups; n++)
+	order.push_back(std::rand() % count);
+
+    std::cout << count << " keys, " << lookups << " lookups" << std::endl;
+    std::cout << "xmppd::xhash:            " << xhash_bench_lookups(h, keys, order) << " ns per lookup" << std::endl;
+    std::cout << "std::tr1::unordered_map: " << xhash_bench_lookups(u, keys, order) << " ns per lookup" << std::endl;
+
+    return 0;
+}
@@ -36,9 +36,15 @@
 #include <jabberdlib.h>
 #include <map>
 #include <list>
+#include <set>
+#include <deque>
+#include <vector>
 #include <sstream>
 #include <stdexcept>
 
+/** number of compiled paths kept by xmlnode_get_tags() */
+#define XMLNODE_PATH_CACHE_SIZE 1024
+
 #ifdef POOL_DEBUG
     std::map<pool, std::list< xmlnode > > existing_xmlnodes;
 #endif
@@ -50,6 +56,92 @@ static xmlnode_t const* xmlnode_get_nextsibling_const(xmlnode_t const* sibling);
 
 /* Internal routines */
 
+/**
+ * get a copy of a name, prefix or namespace IRI for an xmlnode
+ *
+ * Well known strings are not copied, the atom (see j_atom()) is used instead.
+ *
+ * @param p the memory pool to copy other strings to
+ * @param str the string to copy
+ * @return the atom or the copy of the string
+ */
+static char* _xmlnode_strdup(pool p, const char* str) {
+    char* atom = j_atom(str);
+
+    return atom != NULL ? atom : pstrdup(p, str);
+}
+
+/**
+ * unparsed content of elements (see xmlnode_put_unparsed())
+ *
+ * The content is not copied, if an element is copied, but shared by all copies. It is freed
+ * when the pools of all elements, that reference it, are freed.
+ */
+struct xmlnode_shared_content {
+    unsigned int references;	/**< number of pools, that reference this content */
+    int len;			/**< length of the content */
+    char content[1];		/**< the content itself (allocated as long as needed) */
+};
+
+/**
+ * get the shared content for the unparsed content of an element
+ *
+ * @param data the data of the element, that has unparsed content
+ * @return the shared content containing data
+ */
+inline xmlnode_shared_content* _xmlnode_shared_content(char* data) {
+    return reinterpret_cast<xmlnode_shared_content*>(data - offsetof(xmlnode_shared_content, content));
+}
+
+/**
+ * release the reference of a pool to shared content
+ *
+ * @param arg the shared content
+ */
+static void _xmlnode_shared_content_release(void* arg) {
+    xmlnode_shared_content* shared = static_cast<xmlnode_shared_content*>(arg);
+
+    if (--shared->references == 0)
+	free(shared);
+}
+
+/**
+ * let an element reference shared content as its unparsed content
+ *
+ * @param node the element (without child nodes)
+ * @param shared the shared content
+ */
+static void _xmlnode_share_content(xmlnode node, xmlnode_shared_content* shared) {
+    shared->references++;
+    pool_cleanup(node->p, _xmlnode_shared_content_release, shared);
+
+    node->data = shared->content;
+    node->data_sz = shared->len;
+}
+
+/**
+ * parse the unparsed content of an element (see xmlnode_put_unparsed()) to child nodes
+ *
+ * The content is parsed with the namespace of the element as the default namespace.
+ *
+ * @param node the element, that might have unparsed content
+ */
+static void _xmlnode_expand(xmlnode node) {
+    if (node == NULL || node->type != NTYPE_TAG || node->data == NULL)
+	return;
+
+    char const* content = node->data;
+    int content_len = node->data_sz;
+
+    // reset first, as parsing inserts the child nodes
+    node->data = NULL;
+    node->data_sz = 0;
+
+    xmppd::ns_decl_list nslist;
+    nslist.update("", node->ns_iri ? node->ns_iri : "");
+    xmlnode_insert_xml(node, content, content_len, nslist);
+}
+
 /**
  * create a new xmlnode element
  *
@@ -77,9 +169,9 @@ static xmlnode _xmlnode_new(pool p, const char* name, const char *prefix, const
 
     /* Initialize fields */
     if (type != NTYPE_CDATA) {
-	result->name   = pstrdup(p, name);
-	result->prefix = pstrdup(p, prefix);
-	result->ns_iri = pstrdup(p, ns_iri);
+	result->name   = _xmlnode_strdup(p, name);
+	result->prefix = _xmlnode_strdup(p, prefix);
+	result->ns_iri = _xmlnode_strdup(p, ns_iri);
     }
     result->type = type;
     result->p = p;
@@ -128,6 +220,8 @@ static xmlnode _xmlnode_insert(xmlnode parent, const char* name, const char *pre
     if (parent == NULL || (type != NTYPE_CDATA && name == NULL))
 	return NULL;
 
+    _xmlnode_expand(parent);
+
     /* If parent->firstchild is NULL, simply create a new node for the first child */
     if (parent->firstchild == NULL) {
 	result = _xmlnode_new(parent->p, name, prefix, ns_iri, type);
@@ -198,6 +292,7 @@ static void _xmlnode_merge(xmlnode data) {
     /* reset data */
     data->data = merge;
     data->data_sz = imerge;
+    data->data_capacity = imerge + 1;
 }
 
 /**
@@ -215,150 +310,370 @@ static void _xmlnode_hide_sibling(xmlnode child) {
 	child->next->prev = child->prev;
 }
 
-/**
- * print an xmlnode and its childs to an ostream
- *
- * This is a recursive function.
- *
- * @param s the ostream to print the xmlnode to
- * @param x the xmlnode to print
- * @param nslist the list of declared namespaces
- * @param ns_replace 0 for no namespace IRI replacing, 1 for replacing 'jabber:server' ns with 'jabber:client', 2 for replacing 'jabber:server' ns with 'jabber:component:accept'
- * @param ns_number the number of the namespace, that should be declared next if needed
- */
-static void _xmlnode_serialize(std::ostream& s, xmlnode_t const* x, xmppd::ns_decl_list nslist, int ns_replace, int ns_number = 0) {
-    // print out NTYPE_CDATA?
-    if (x->type == NTYPE_CDATA) {
-	s << strescape(xmlnode_get_data(const_cast<xmlnode>(x)));
-	return;
+namespace xmppd {
+    /**
+     * serializer for xmlnode trees
+     *
+     * The serializer writes to a growable output buffer and keeps the namespace declarations that are in scope on
+     * a stack, that is truncated again when an element has been written. Buffer and stack keep their capacity between
+     * serializations, so a single instance is reused for all serializations done by xmlnode_serialize_string().
+     * This is safe as serializing never yields control to an other pth thread.
+     */
+    class xmlnode_serializer {
+	public:
+	    char* serialize(xmlnode_t const* node, const ns_decl_list& nslist, int ns_replace);
+	    std::string const& serialize_content(xmlnode_t const* node);
+	private:
+	    /**
+	     * a namespace prefix bound to a namespace IRI
+	     */
+	    struct binding {
+		char const* prefix;	/**< the namespace prefix, "" for the default namespace */
+		char const* ns_iri;	/**< the namespace IRI */
+	    };
+
+	    void write(xmlnode_t const* x, int ns_number);
+	    void append(char const* str);
+	    void append_escaped(char const* str);
+	    void declare(char const* prefix, char const* ns_iri);
+	    char const* get_nsiri(char const* prefix) const;
+	    char const* get_nsprefix(char const* ns_iri) const;
+	    bool check_prefix(char const* prefix, char const* ns_iri) const;
+	    static char const* generated_prefix(int ns_number);
+
+	    std::string out;			/**< the output buffer */
+	    std::vector<binding> bindings;	/**< namespace declarations currently in scope, latest last */
+	    int ns_replace;			/**< replacing of 'jabber:server', see xmlnode_serialize_string() */
+    };
+
+    /**
+     * serialize an xmlnode tree
+     *
+     * @param node the xmlnode to serialize
+     * @param nslist list of already declared namespaces (has to be valid until this method returns)
+     * @param ns_replace 0 for no namespace IRI replacing, 1 for replacing 'jabber:server' ns with 'jabber:client', 2 for replacing 'jabber:server' ns with 'jabber:component:accept'
+     * @return the serialized tree, allocated from the pool of the node
+     */
+    char* xmlnode_serializer::serialize(xmlnode_t const* node, const ns_decl_list& nslist, int ns_replace) {
+	out.clear();
+	bindings.clear();
+	this->ns_replace = ns_replace;
+
+	// the bindings of nslist are kept in the list, we only point to them
+	for (ns_decl_list::const_iterator p = nslist.begin(); p != nslist.end(); ++p) {
+	    declare(p->first.c_str(), p->second.c_str());
+	}
+
+	write(node, 0);
+
+	char* result = static_cast<char*>(pmalloc(xmlnode_pool(const_cast<xmlnode>(node)), out.length()+1));
+	memcpy(result, out.c_str(), out.length()+1);
+	return result;
     }
 
-    // print out NTYPE_ATTRIB?
-    if (x->type == NTYPE_ATTRIB) {
-	// do we have to print a prefix? (if yes: hopefully it is defined, else we get an exception)
-	if (x->ns_iri) {
-	    s << nslist.get_nsprefix(x->ns_iri, false) << ':';
+    /**
+     * serialize the child nodes of an element
+     *
+     * The result can be parsed again with the namespace of the element as the default namespace.
+     *
+     * @param node the element
+     * @return the serialized child nodes (valid until the serializer is used again)
+     */
+    std::string const& xmlnode_serializer::serialize_content(xmlnode_t const* node) {
+	out.clear();
+	bindings.clear();
+	ns_replace = 0;
+
+	declare("xml", NS_XML);
+	declare("xmlns", NS_XMLNS);
+	declare("", node->ns_iri ? node->ns_iri : "");
+
+	for (xmlnode_t const* cur = xmlnode_get_firstchild_const(node); cur != NULL; cur = xmlnode_get_nextsibling_const(cur)) {
+	    write(cur, 0);
 	}
 
-	// print local name and value
-	s << x->name << "='" << strescape(xmlnode_get_data(const_cast<xmlnode>(x))) << "'";
+	return out;
+    }
 
-	// we are done with the attribute
-	return;
+    /**
+     * append a string to the output buffer
+     *
+     * @param str the string to append
+     */
+    inline void xmlnode_serializer::append(char const* str) {
+	if (str != NULL)
+	    out.append(str);
     }
 
-    // It's NTYPE_TAG if we reach here ...
-    s << '<';
-
-    // We use the default namespace for everything but NS_STREAM, and NS_DIALBACK
-    bool stream_ns = false;
-    bool dialback_ns = false;
-    bool sc_ns = false;
-    if (x->ns_iri && std::string(NS_STREAM) == x->ns_iri) {
-	s << "stream:";
-	stream_ns = true;
-    } else if (x->ns_iri && std::string(NS_DIALBACK) == x->ns_iri) {
-	s << "db:";
-	dialback_ns = true;
-    } else if (x->ns_iri && std::string(NS_SESSION) == x->ns_iri) {
-	s << "sc:";
-	sc_ns = true;
-    }
-
-    // write the local name
-    s << x->name;
-
-    // do we have to redeclare a namespace?
-    if (stream_ns) {
-	// NS_STREAM already bound to the stream prefix?
-	if (!nslist.check_prefix("stream", NS_STREAM)) {
-	    s << " xmlns:stream='" NS_STREAM "'";
-	    nslist.update("stream", NS_STREAM);
+    /**
+     * append a string to the output buffer, escaping the characters that cannot be written literally
+     *
+     * Most strings do not contain any of these characters. They are appended with a single strcspn() scan, which
+     * is vectorized by the C library on most platforms.
+     *
+     * @param str the string to append
+     */
+    void xmlnode_serializer::append_escaped(char const* str) {
+	if (str == NULL)
+	    return;
+
+	for (;;) {
+	    std::size_t len = std::strcspn(str, "&'\"<>");
+	    out.append(str, len);
+	    str += len;
+
+	    switch (*str) {
+		case '&':
+		    out.append("&amp;", 5);
+		    break;
+		case '\'':
+		    out.append("&apos;", 6);
+		    break;
+		case '"':
+		    out.append("&quot;", 6);
+		    break;
+		case '<':
+		    out.append("&lt;", 4);
+		    break;
+		case '>':
+		    out.append("&gt;", 4);
+		    break;
+		default:
+		    // end of string
+		    return;
+	    }
+	    str++;
 	}
-    } else if (dialback_ns) {
-	// NS_DIALBACK already bound to the db prefix?
-	if (!nslist.check_prefix("db", NS_DIALBACK)) {
-	    s << " xmlns:db='" NS_DIALBACK "'";
-	    nslist.update("db", NS_DIALBACK);
+    }
+
+    /**
+     * add a namespace declaration to the declarations in scope
+     *
+     * @param prefix the namespace prefix (has to stay valid until the serialization is done)
+     * @param ns_iri the namespace IRI (has to stay valid until the serialization is done)
+     */
+    inline void xmlnode_serializer::declare(char const* prefix, char const* ns_iri) {
+	binding new_binding = { prefix, ns_iri };
+	bindings.push_back(new_binding);
+    }
+
+    /**
+     * get the namespace IRI, that is currently bound to a namespace prefix
+     *
+     * @param prefix the namespace prefix to check
+     * @return the namespace IRI, NULL if the prefix is not bound
+     */
+    char const* xmlnode_serializer::get_nsiri(char const* prefix) const {
+	for (std::vector<binding>::const_reverse_iterator p = bindings.rbegin(); p != bindings.rend(); ++p) {
+	    if (j_strcmp(p->prefix, prefix) == 0)
+		return p->ns_iri;
 	}
-    } else if (sc_ns) {
-	// NS_SESSION already bound to the sc prefix?
-	if (!nslist.check_prefix("sc", NS_SESSION)) {
-	    s << " xmlns:sc='" NS_SESSION "'";
-	    nslist.update("sc", NS_SESSION);
+	return NULL;
+    }
+
+    /**
+     * get the latest non-default prefix, that is currently bound to a namespace IRI
+     *
+     * @param ns_iri the namespace IRI to search for
+     * @return the prefix, NULL if no prefix is bound to this namespace IRI
+     */
+    char const* xmlnode_serializer::get_nsprefix(char const* ns_iri) const {
+	for (std::vector<binding>::const_reverse_iterator p = bindings.rbegin(); p != bindings.rend(); ++p) {
+	    if (p->prefix[0] != '\0' && j_strcmp(p->ns_iri, ns_iri) == 0 && check_prefix(p->prefix, ns_iri))
+		return p->prefix;
 	}
-    } else {
-	// use the default namespace, check if it has to be redeclared
-	if (!nslist.check_prefix("", x->ns_iri ? x->ns_iri : "")) {
-	    char const* ns_iri = x->ns_iri ? x->ns_iri : "";
-	    if (ns_replace && std::string(ns_iri) == NS_SERVER) {
-		ns_iri = ns_replace == 1 ? NS_CLIENT : ns_replace == 2 ? NS_COMPONENT_ACCEPT : NS_SERVER;
-	    }
-	    s << " xmlns='" << strescape(ns_iri) << "'";
-	    nslist.update("", x->ns_iri ? x->ns_iri : "");
+	return NULL;
+    }
+
+    /**
+     * check if a namespace prefix is currently bound to a namespace IRI
+     *
+     * @param prefix the prefix to check
+     * @param ns_iri the namespace IRI we expect the prefix to be bound to
+     * @return true if the prefix is bound to this IRI
+     */
+    inline bool xmlnode_serializer::check_prefix(char const* prefix, char const* ns_iri) const {
+	return j_strcmp(get_nsiri(prefix), ns_iri) == 0;
+    }
+
+    /**
+     * get the generated namespace prefix for a number
+     *
+     * The generated prefixes are kept for the lifetime of the process, so they can be referenced on the namespace stack.
+     *
+     * @param ns_number the number of the namespace
+     * @return the prefix "ns" followed by the number
+     */
+    char const* xmlnode_serializer::generated_prefix(int ns_number) {
+	static std::deque<std::string> prefixes;
+
+	while (prefixes.size() <= static_cast<std::deque<std::string>::size_type>(ns_number)) {
+	    std::ostringstream prefix;
+	    prefix << "ns" << prefixes.size();
+	    prefixes.push_back(prefix.str());
 	}
+
+	return prefixes[ns_number].c_str();
     }
 
-    // serialize attributes on this element
-    for (xmlnode_t const* cur = xmlnode_get_firstattrib_const(x); cur != NULL; cur = xmlnode_get_nextsibling_const(cur)) {
-	// does the attribute have a namespace IRI?
-	if (cur->ns_iri) {
-	    // attributes that are just namespace declarations are not serialized, they are created as needed automatically
-	    if (std::string(NS_XMLNS) == cur->ns_iri)
-		continue;
+    /**
+     * write an xmlnode and its childs to the output buffer
+     *
+     * This is a recursive function. Namespaces declared by the node are removed from the stack when it returns.
+     *
+     * @param x the xmlnode to write
+     * @param ns_number the number of the namespace, that should be declared next if needed
+     */
+    void xmlnode_serializer::write(xmlnode_t const* x, int ns_number) {
+	// write out NTYPE_CDATA?
+	if (x->type == NTYPE_CDATA) {
+	    append_escaped(xmlnode_get_data(const_cast<xmlnode>(x)));
+	    return;
+	}
 
-	    // check if we need to declare a namespace prefix for this attribute
-	    try {
-		nslist.get_nsprefix(cur->ns_iri, false);
-	    } catch (std::invalid_argument) {
-		// we have to declare a new prefix, create one
-		std::ostringstream ns;
-
-		if (std::string(NS_STREAM) == cur->ns_iri) {
-		    ns << "stream";
-		} else if (std::string(NS_DIALBACK) == cur->ns_iri) {
-		    ns << "db";
-		} else if (std::string(NS_SESSION) == cur->ns_iri) {
-		    ns << "sc";
-		} else {
-		    ns << "ns" << ns_number++;
+	// write out NTYPE_ATTRIB?
+	if (x->type == NTYPE_ATTRIB) {
+	    // do we have to write a prefix? (it has been declared by the element)
+	    if (x->ns_iri) {
+		append(get_nsprefix(x->ns_iri));
+		out += ':';
+	    }
+
+	    // write local name and value
+	    append(x->name);
+	    out.append("='", 2);
+	    append_escaped(xmlnode_get_data(const_cast<xmlnode>(x)));
+	    out += '\'';
+
+	    // we are done with the attribute
+	    return;
+	}
+
+	// namespaces we handle specially, as atoms they can be compared by pointer
+	static char const* const atom_stream = j_atom(NS_STREAM);
+	static char const* const atom_dialback = j_atom(NS_DIALBACK);
+	static char const* const atom_session = j_atom(NS_SESSION);
+	static char const* const atom_server = j_atom(NS_SERVER);
+	static char const* const atom_xmlns = j_atom(NS_XMLNS);
+
+	// remember which declarations are in scope of our parent
+	std::vector<binding>::size_type parent_bindings = bindings.size();
+
+	// It's NTYPE_TAG if we reach here ...
+	out += '<';
+
+	// We use the default namespace for everything but NS_STREAM, NS_DIALBACK, and NS_SESSION
+	char const* prefix = NULL;
+	if (j_strcmp(x->ns_iri, atom_stream) == 0) {
+	    prefix = "stream";
+	} else if (j_strcmp(x->ns_iri, atom_dialback) == 0) {
+	    prefix = "db";
+	} else if (j_strcmp(x->ns_iri, atom_session) == 0) {
+	    prefix = "sc";
+	}
+
+	// write the qualified name
+	if (prefix != NULL) {
+	    append(prefix);
+	    out += ':';
+	}
+	append(x->name);
+
+	// do we have to redeclare a namespace?
+	if (prefix != NULL) {
+	    // namespace already bound to the prefix?
+	    if (!check_prefix(prefix, x->ns_iri)) {
+		out.append(" xmlns:", 7);
+		append(prefix);
+		out.append("='", 2);
+		append(x->ns_iri);
+		out += '\'';
+		declare(prefix, x->ns_iri);
+	    }
+	} else {
+	    // use the default namespace, check if it has to be redeclared
+	    char const* ns_iri = x->ns_iri ? x->ns_iri : "";
+	    if (!check_prefix("", ns_iri)) {
+		char const* written_ns_iri = ns_iri;
+		if (ns_replace && j_strcmp(ns_iri, atom_server) == 0) {
+		    written_ns_iri = ns_replace == 1 ? NS_CLIENT : ns_replace == 2 ? NS_COMPONENT_ACCEPT : NS_SERVER;
 		}
-		s << " xmlns:" << ns.str() << "='" << strescape(cur->ns_iri) << "'";
-		nslist.update(ns.str(), cur->ns_iri);
+		out.append(" xmlns='", 8);
+		append_escaped(written_ns_iri);
+		out += '\'';
+		declare("", ns_iri);
 	    }
 	}
 
-	// serialize the attribute
-	s << ' ';
-	_xmlnode_serialize(s, cur, nslist, ns_replace, ns_number);
-    }
+	// write attributes on this element
+	for (xmlnode_t const* cur = xmlnode_get_firstattrib_const(x); cur != NULL; cur = xmlnode_get_nextsibling_const(cur)) {
+	    // does the attribute have a namespace IRI?
+	    if (cur->ns_iri) {
+		// attributes that are just namespace declarations are not serialized, they are created as needed automatically
+		if (j_strcmp(cur->ns_iri, atom_xmlns) == 0)
+		    continue;
 
-    // serialize child nodes
-    bool has_childs = false;
-    for (xmlnode_t const* cur = xmlnode_get_firstchild_const(x); cur != NULL; cur = xmlnode_get_nextsibling_const(cur)) {
-	// first child? then close the opening tag
-	if (!has_childs) {
-	    s << ">";
+		// check if we need to declare a namespace prefix for this attribute
+		if (get_nsprefix(cur->ns_iri) == NULL) {
+		    char const* attrib_prefix = NULL;
+
+		    if (j_strcmp(cur->ns_iri, atom_stream) == 0) {
+			attrib_prefix = "stream";
+		    } else if (j_strcmp(cur->ns_iri, atom_dialback) == 0) {
+			attrib_prefix = "db";
+		    } else if (j_strcmp(cur->ns_iri, atom_session) == 0) {
+			attrib_prefix = "sc";
+		    } else {
+			attrib_prefix = generated_prefix(ns_number++);
+		    }
+		    out.append(" xmlns:", 7);
+		    append(attrib_prefix);
+		    out.append("='", 2);
+		    append_escaped(cur->ns_iri);
+		    out += '\'';
+		    declare(attrib_prefix, cur->ns_iri);
+		}
+	    }
+
+	    // write the attribute
+	    out += ' ';
+	    write(cur, ns_number);
+	}
+
+	// write child nodes
+	bool has_childs = false;
+	if (x->data != NULL) {
+	    // unparsed content is written as it has been received
+	    out += '>';
+	    out.append(x->data, x->data_sz);
 	    has_childs = true;
 	}
+	for (xmlnode_t const* cur = xmlnode_get_firstchild_const(x); cur != NULL; cur = xmlnode_get_nextsibling_const(cur)) {
+	    // first child? then close the opening tag
+	    if (!has_childs) {
+		out += '>';
+		has_childs = true;
+	    }
 
-	// serialize the child
-	_xmlnode_serialize(s, cur, nslist, ns_replace, ns_number);
-    }
+	    // write the child
+	    write(cur, ns_number);
+	}
 
-    // write the end tag
-    if (has_childs) {
-	s << "</";
-	if (stream_ns) {
-	    s << "stream:";
-	} else if (dialback_ns) {
-	    s << "db:";
-	} else if (sc_ns) {
-	    s << "sc:";
+	// write the end tag
+	if (has_childs) {
+	    out.append("</", 2);
+	    if (prefix != NULL) {
+		append(prefix);
+		out += ':';
+	    }
+	    append(x->name);
+	    out += '>';
+	} else {
+	    out.append("/>", 2);
 	}
-	s << x->name << ">";
-    } else {
-	s << "/>";
+
+	// our declarations go out of scope
+	bindings.resize(parent_bindings);
     }
 }
 
@@ -390,113 +705,422 @@ static int _xmlnode_get_datasz(xmlnode node) {
     return node->data_sz;
 }
 
-/**
- * helper function for xmlnode_get_tags()
- *
- * Appends xmlnode node, if the predicate matches. If there is a next_step, not the xmlnode is added itself,
- * but the result of an xmlnode_get_tags() recursion is added
- *
- * @param result_first pointer to the pointer to the first list element of the result (gets modified)
- * @param result_last pointer to the pointer to the first list element of the result (gets modified)
- * @param node the node, that should be appended if there is no next_step, or which should be the parent node for the next_step
- * @param _predicate the predicate for this step
- * @param next_step the next step for recursion
- */
-static void _xmlnode_append_if_predicate(xmlnode_vector& result_vector, xmlnode node, char const* _predicate, const char *next_step, xht namespaces) {
-    /* sanity checks */
-    if (node == NULL || namespaces == NULL)
-	return;
+namespace xmppd {
+    /**
+     * compile a path
+     *
+     * The valid paths are the same as for xmlnode_get_tags().
+     *
+     * @param p memory pool used to allocate the strings of the compiled path
+     * @param path the path to compile
+     * @param namespaces hashtable mapping namespace prefixes to namespace IRIs
+     */
+    compiled_path::compiled_path(pool p, char const* path, xht namespaces) : p(p) {
+	std::string rest = path;
+
+	do {
+	    step this_step_compiled = { 0, test_name, false, false, NULL, NULL, false, NULL, NULL, NULL };
+	    std::string path = rest;
+	    rest.erase();
+
+	    /* check if there is an axis */
+	    if (path.substr(0, 7) == "child::") {
+		path.erase(0, 7);
+	    } else if (path.substr(0, 8) == "parent::") {
+		this_step_compiled.axis = 1;
+		path.erase(0, 8);
+	    } else if (path.substr(0, 11) == "attribute::") {
+		this_step_compiled.axis = 2;
+		path.erase(0, 11);
+	    }
 
-    /* check the predicate */
-    if (_predicate != NULL) {
-	char *attrib_ns_iri = NULL;
-	xmlnode iter = NULL;
-	int predicate_matched = 0;
+	    /* separate this step from the next one, and check for a predicate in this step */
+	    std::string::size_type start_predicate = path.find("[");
+	    std::string::size_type start_next_step = path.find("/");
+	    std::string this_step;
+	    std::string predicate;
+	    if (start_predicate == std::string::npos && start_next_step == std::string::npos) {
+		// there is neither a predicate nor a next step in the path
+		this_step = path;
+	    } else if (start_predicate == std::string::npos || start_next_step != std::string::npos && start_predicate > start_next_step) {
+		this_step = path.substr(0, start_next_step);
+		rest = path.substr(start_next_step+1);
+	    } else {
+		std::string::size_type end_predicate = path.find("]", start_predicate);
+		if (end_predicate == std::string::npos) {
+		    // error in predicate syntax, nothing can match
+		    this_step_compiled.never_matches = true;
+		    steps.push_back(this_step_compiled);
+		    break;
+		}
 
-	/* we only support checking for attribute existence or attribute values for now */
-	if (_predicate[0] != '@') {
-	    /* do not add, we do not support the predicate :-( */
-	    return;
-	}
+		if (start_next_step != std::string::npos) {
+		    if (start_next_step < end_predicate)
+			start_next_step = path.find("/", end_predicate);
+		    if (start_next_step != std::string::npos)
+			rest = path.substr(start_next_step+1);
+		}
+
+		predicate = path.substr(start_predicate+1, end_predicate-start_predicate-1);
+		this_step = path.substr(0, start_predicate);
+	    }
 
-	/* skip the '@' */
-	_predicate++;
+	    /* check for the namespace IRI we have to match the node */
+	    std::string::size_type end_prefix = this_step.find(":");
+	    if (end_prefix == std::string::npos) {
+		// default prefix or NULL if axis is an attribute
+		this_step_compiled.ns_iri = this_step_compiled.axis == 2 ? NULL : resolve("", namespaces);
+	    } else {
+		this_step_compiled.has_prefix = true;
+		this_step_compiled.ns_iri = resolve(this_step.substr(0, end_prefix).c_str(), namespaces);
+		this_step.erase(0, end_prefix+1);
+	    }
 
-	/* make predicate a string, so we can better work with it */
-	std::string predicate(_predicate);
+	    /* what does the step match? */
+	    if (this_step == "*") {
+		this_step_compiled.test = test_any;
+	    } else if (this_step == "text()") {
+		this_step_compiled.test = test_text;
+	    } else {
+		this_step_compiled.name = j_atom(this_step.c_str());
+		if (this_step_compiled.name == NULL)
+		    this_step_compiled.name = pstrdup(p, this_step.c_str());
+	    }
 
-	/* is there a value we have to match? */
-	std::string attrib_value;
-	std::string attrib_name;
-	bool attrib_value_present = false;
-	std::string::size_type pos = predicate.find("=");
-	if (pos != std::string::npos) {
-	    attrib_value_present = true;
-	    attrib_value = predicate.substr(pos+1);
+	    /* compile the predicate */
+	    if (predicate.length() > 0) {
+		this_step_compiled.has_predicate = true;
 
-	    // remove quotes
-	    attrib_value.erase(0, 1);
-	    if (attrib_value.length() > 1)
-		attrib_value.erase(attrib_value.length()-1);
+		/* we only support checking for attribute existence or attribute values for now */
+		if (predicate[0] != '@') {
+		    this_step_compiled.never_matches = true;
+		} else {
+		    std::string attrib_name = predicate.substr(1);
+
+		    /* is there a value we have to match? */
+		    std::string::size_type pos = attrib_name.find("=");
+		    if (pos != std::string::npos) {
+			std::string attrib_value = attrib_name.substr(pos+1);
+
+			// remove quotes
+			attrib_value.erase(0, 1);
+			if (attrib_value.length() > 1)
+			    attrib_value.erase(attrib_value.length()-1);
+			this_step_compiled.attrib_value = pstrdup(p, attrib_value.c_str());
+
+			attrib_name.erase(pos);
+		    }
+
+		    // does the attribute have a namespace prefix?
+		    pos = attrib_name.find(":");
+		    if (pos != std::string::npos) {
+			this_step_compiled.attrib_ns_iri = resolve(attrib_name.substr(0, pos).c_str(), namespaces);
+			attrib_name.erase(0, pos+1);
+		    }
+
+		    this_step_compiled.attrib_name = j_atom(attrib_name.c_str());
+		    if (this_step_compiled.attrib_name == NULL)
+			this_step_compiled.attrib_name = pstrdup(p, attrib_name.c_str());
+		}
+	    }
 
-	    // get the name of the attribute (including the prefix for now)
-	    attrib_name = predicate.substr(0, pos);
-	} else {
-	    attrib_name = predicate;
+	    steps.push_back(this_step_compiled);
+	} while (rest.length() > 0);
+    }
+
+    /**
+     * resolve a namespace prefix, and remember that the path depends on it
+     *
+     * @param prefix the namespace prefix to resolve
+     * @param namespaces hashtable mapping namespace prefixes to namespace IRIs
+     * @return the namespace IRI (atom or copy in the pool of the path), NULL if the prefix is not declared
+     */
+    char const* compiled_path::resolve(char const* prefix, xht namespaces) {
+	std::vector<binding>::const_iterator b;
+
+	for (b = bindings.begin(); b != bindings.end(); ++b) {
+	    if (j_strcmp(b->prefix, prefix) == 0)
+		return b->ns_iri;
 	}
 
-	// does the attribute have a namespace prefix?
-	pos = attrib_name.find(":");
-	if (pos != std::string::npos) {
-	    attrib_ns_iri = static_cast<char*>(xhash_get(namespaces, attrib_name.substr(0, pos).c_str()));
-	    attrib_name.erase(0, pos+1);
+	char const* ns_iri = static_cast<char const*>(xhash_get(namespaces, prefix));
+	if (ns_iri != NULL) {
+	    char const* atom = j_atom(ns_iri);
+	    ns_iri = atom != NULL ? atom : pstrdup(p, ns_iri);
 	}
 
-	/* iterate over the namespace attributes */
-	for (iter = xmlnode_get_firstattrib(node); iter != NULL; iter = xmlnode_get_nextsibling(iter)) {
+	binding new_binding = { pstrdup(p, prefix), ns_iri };
+	bindings.push_back(new_binding);
+	return ns_iri;
+    }
+
+    /**
+     * check if the namespace prefixes used by the path resolve to the same namespace IRIs as when it was compiled
+     *
+     * @param namespaces hashtable mapping namespace prefixes to namespace IRIs
+     * @return true if the compiled path is valid for this namespace mapping
+     */
+    bool compiled_path::same_namespaces(xht namespaces) const {
+	std::vector<binding>::const_iterator b;
+
+	for (b = bindings.begin(); b != bindings.end(); ++b) {
+	    char const* ns_iri = static_cast<char const*>(xhash_get(namespaces, b->prefix));
 
+	    if (ns_iri == NULL && b->ns_iri == NULL)
+		continue;
+	    if (j_strcmp(ns_iri, b->ns_iri) != 0)
+		return false;
+	}
+
+	return true;
+    }
+
+    /**
+     * check if the predicate of a step matches a node
+     *
+     * @param s the step
+     * @param node the node to check
+     * @return true if the predicate matches
+     */
+    bool compiled_path::predicate_matches(step const& s, xmlnode node) const {
+	/* iterate over the attributes */
+	for (xmlnode iter = xmlnode_get_firstattrib(node); iter != NULL; iter = xmlnode_get_nextsibling(iter)) {
 	    /* attribute differs in name? */
-	    if (j_strcmp(attrib_name.c_str(), iter->name) != 0) {
+	    if (j_strcmp(s.attrib_name, iter->name) != 0)
 		continue;
-	    }
 
 	    /* attribute differs in namespace IRI? */
-	    if (j_strcmp(attrib_ns_iri, iter->ns_iri) != 0 && !(attrib_ns_iri == NULL && iter->ns_iri == NULL)) {
+	    if (j_strcmp(s.attrib_ns_iri, iter->ns_iri) != 0 && !(s.attrib_ns_iri == NULL && iter->ns_iri == NULL))
 		continue;
-	    }
 
 	    /* we have to check the value and it differs */
-	    if (attrib_value_present && j_strcmp(attrib_value.c_str(), xmlnode_get_data(iter)) != 0) {
+	    if (s.attrib_value != NULL && j_strcmp(s.attrib_value, xmlnode_get_data(iter)) != 0)
 		continue;
-	    }
 
 	    /* predicate matches! */
-	    predicate_matched = 1;
-	    break;
-	    
+	    return true;
+	}
+
+	return false;
+    }
+
+    /**
+     * select the nodes matching the path starting at a given step
+     *
+     * This is a recursive function.
+     *
+     * @param n the index of the step to start with
+     * @param context_node the context node for this step
+     * @param result where to append the matching nodes, NULL to only look for the first matching node
+     * @return the first matching node if result is NULL, NULL else
+     */
+    xmlnode compiled_path::evaluate(std::vector<step>::size_type n, xmlnode context_node, xmlnode_vector* result) const {
+	step const& s = steps[n];
+	bool last_step = n+1 == steps.size();
+
+	if (s.never_matches)
+	    return NULL;
+
+	/* iterate over all nodes in the axis, checking if this step matches them */
+	for (
+		xmlnode iter = s.axis == 0 ? xmlnode_get_firstchild(context_node) :
+		    s.axis == 1 ? xmlnode_get_parent(context_node) :
+		    xmlnode_get_firstattrib(context_node);
+		iter != NULL;
+		iter = s.axis == 1 ? NULL : xmlnode_get_nextsibling(iter)) {
+
+	    switch (s.test) {
+		case test_any:
+		    /* match ns_iri if prefix has been specified */
+		    if (s.has_prefix && (iter->type == NTYPE_CDATA || j_strcmp(s.ns_iri, iter->ns_iri) != 0))
+			continue;
+
+		    /* merging if it is a text node */
+		    if (iter->type == NTYPE_CDATA)
+			_xmlnode_merge(iter);
+		    break;
+		case test_text:
+		    if (iter->type != NTYPE_CDATA)
+			continue;
+
+		    /* merge all text nodes, that are direct siblings with this one */
+		    _xmlnode_merge(iter);
+		    break;
+		default:
+		    /* matching element or attribute */
+		    if (iter->type == NTYPE_CDATA)
+			continue;
+		    if (!(s.ns_iri == NULL && iter->ns_iri == NULL) && j_strcmp(s.ns_iri, iter->ns_iri) != 0)
+			continue;
+		    if (j_strcmp(s.name, iter->name) != 0)
+			continue;
+	    }
+
+	    /* check the predicate */
+	    if (s.has_predicate && !predicate_matches(s, iter))
+		continue;
+
+	    /* if there is no next step, the node is a result */
+	    if (last_step) {
+		if (result == NULL)
+		    return iter;
+		result->push_back(iter);
+		continue;
+	    }
+
+	    /* there is a next step, we have to recurse */
+	    xmlnode first = evaluate(n+1, iter, result);
+	    if (first != NULL)
+		return first;
 	}
 
-	/* return without adding anything if the predicate did not match */
-	if (!predicate_matched)
+	return NULL;
+    }
+
+    /**
+     * select all nodes matching the path
+     *
+     * @param context_node the xmlnode where to start the path
+     * @param result where to append the matching nodes
+     */
+    void compiled_path::select(xmlnode context_node, xmlnode_vector& result) const {
+	if (context_node == NULL)
 	    return;
+	evaluate(0, context_node, &result);
+    }
+
+    /**
+     * select the first node matching the path
+     *
+     * The search is stopped as soon as the first node is found.
+     *
+     * @param context_node the xmlnode where to start the path
+     * @return the first matching node, NULL if no node matches
+     */
+    xmlnode compiled_path::select_first(xmlnode context_node) const {
+	if (context_node == NULL)
+	    return NULL;
+	return evaluate(0, context_node, NULL);
     }
 
-    /* when we are here: no predicate, or predicate matched */
+    /**
+     * LRU cache of compiled paths, used by xmlnode_get_tags() and xmlnode_get_first_tag()
+     *
+     * Paths are keyed by the path string. As the same path might be used with different namespace mappings,
+     * there can be more than one entry for a path, the one resolving the prefixes the same way is used.
+     */
+    class compiled_path_cache {
+	public:
+	    compiled_path_cache(std::size_t max_entries);
+	    ~compiled_path_cache();
+	    compiled_path const* get(char const* path, xht namespaces);
+	private:
+	    /**
+	     * one cached compiled path
+	     */
+	    struct entry {
+		pool p;				/**< memory pool of the entry */
+		char const* path;		/**< the path (allocated from the pool) */
+		compiled_path* compiled;	/**< the compiled path */
+	    };
+
+	    /**
+	     * strcmp() based ordering of paths, so that we do not need to create strings for lookups
+	     */
+	    struct path_less {
+		bool operator()(char const* a, char const* b) const {
+		    return std::strcmp(a, b) < 0;
+		}
+	    };
+
+	    void release(std::list<entry>::iterator e);
 
-    /* if no next_step, than add the node to the list and return */
-    if (next_step == NULL) {
-	result_vector.push_back(node);
-	return;
+	    std::size_t max_entries;	/**< maximum number of cached paths */
+	    std::list<entry> entries;			/**< the cached paths, most recently used first */
+	    std::multimap<char const*, std::list<entry>::iterator, path_less> index;	/**< path to entry mapping */
+    };
+
+    compiled_path_cache::compiled_path_cache(std::size_t max_entries) : max_entries(max_entries) {
     }
 
-    /* there is a next_step, we have to recurse */
-    xmlnode_vector sub_result = xmlnode_get_tags(node, next_step, namespaces);
+    compiled_path_cache::~compiled_path_cache() {
+	while (!entries.empty()) {
+	    release(--entries.end());
+	}
+    }
+
+    /**
+     * get the compiled version of a path, compile it if it is not in the cache
+     *
+     * @param path the path
+     * @param namespaces hashtable mapping namespace prefixes to namespace IRIs
+     * @return the compiled path, only valid until the next call of this method
+     */
+    compiled_path const* compiled_path_cache::get(char const* path, xht namespaces) {
+	typedef std::multimap<char const*, std::list<entry>::iterator, path_less>::iterator index_iterator;
+
+	std::pair<index_iterator, index_iterator> range = index.equal_range(path);
+	for (index_iterator i = range.first; i != range.second; ++i) {
+	    if (i->second->compiled->same_namespaces(namespaces)) {
+		entries.splice(entries.begin(), entries, i->second);
+		return i->second->compiled;
+	    }
+	}
+
+	entry new_entry;
+	new_entry.p = pool_new();
+	new_entry.path = pstrdup(new_entry.p, path);
+	new_entry.compiled = new compiled_path(new_entry.p, path, namespaces);
+	entries.push_front(new_entry);
+	index.insert(std::pair<char const*, std::list<entry>::iterator>(new_entry.path, entries.begin()));
 
-    /* did we get a result we have to add? */
-    xmlnode_vector::iterator iter;
-    for (iter=sub_result.begin(); iter!=sub_result.end(); ++iter) {
-	result_vector.push_back(*iter);
+	while (entries.size() > max_entries) {
+	    release(--entries.end());
+	}
+
+	return new_entry.compiled;
     }
+
+    /**
+     * remove an entry from the cache
+     *
+     * @param e the entry to remove
+     */
+    void compiled_path_cache::release(std::list<entry>::iterator e) {
+	typedef std::multimap<char const*, std::list<entry>::iterator, path_less>::iterator index_iterator;
+
+	std::pair<index_iterator, index_iterator> range = index.equal_range(e->path);
+	for (index_iterator i = range.first; i != range.second; ++i) {
+	    if (i->second == e) {
+		index.erase(i);
+		break;
+	    }
+	}
+
+	delete e->compiled;
+	pool_free(e->p);
+	entries.erase(e);
+    }
+}
+
+/**
+ * get the cache of compiled paths used by xmlnode_get_tags()
+ *
+ * @return the cache
+ */
+static xmppd::compiled_path_cache& _xmlnode_path_cache() {
+    static xmppd::compiled_path_cache cache(XMLNODE_PATH_CACHE_SIZE);
+
+    return cache;
+}
+
+/**
+ * pool cleanup handler, that deletes a compiled path
+ *
+ * @param arg the compiled path
+ */
+static void _xmlnode_path_free(void *arg) {
+    delete static_cast<xmlnode_path>(arg);
 }
 
 /* External routines */
@@ -695,10 +1319,13 @@ xmlnode xmlnode_insert_tag_ns(xmlnode parent, const char* name, const char* pref
 /**
  * insert a text node as child to an existing xmlnode
  *
+ * If the last child of the parent is a text node already, the text is appended to this node instead
+ * of creating a new sibling.
+ *
  * @param parent where to insert the new text node
  * @param CDATA content of the text node to insert
  * @param size size of the string in CDATA, or -1 for auto-detection on null-terminated strings
- * @return a pointer to the new child node, or NULL if it was unsuccessfull
+ * @return a pointer to the text node containing the text, or NULL if it was unsuccessfull
  */
 xmlnode xmlnode_insert_cdata(xmlnode parent, const char* CDATA, unsigned int size) {
     xmlnode result;
@@ -709,12 +1336,34 @@ xmlnode xmlnode_insert_cdata(xmlnode parent, const char* CDATA, unsigned int siz
     if (size == -1)
 	size = strlen(CDATA);
 
+    _xmlnode_expand(parent);
+
+    /* append to the last child if it is a text node already, the parser delivers text in multiple fragments */
+    result = parent->lastchild;
+    if (result != NULL && result->type == NTYPE_CDATA) {
+	/* grow the buffer geometrically, so that many fragments do not result in many copies */
+	if (result->data_sz + size + 1 > result->data_capacity) {
+	    int new_capacity = 2 * (result->data_sz + size + 1);
+	    char* new_data = static_cast<char*>(pmalloc(result->p, new_capacity));
+
+	    memcpy(new_data, result->data, result->data_sz);
+	    result->data = new_data;
+	    result->data_capacity = new_capacity;
+	}
+
+	memcpy(result->data + result->data_sz, CDATA, size);
+	result->data_sz += size;
+	result->data[result->data_sz] = '\0';
+	return result;
+    }
+
     result = _xmlnode_insert(parent, NULL, NULL, NULL, NTYPE_CDATA);
     if (result != NULL) {
 	result->data = (char*)pmalloc(result->p, size + 1);
 	memcpy(result->data, CDATA, size);
 	result->data[size] = '\0';
 	result->data_sz = size;
+	result->data_capacity = size + 1;
     }
 
     return result;
@@ -734,6 +1383,8 @@ xmlnode xmlnode_get_tag(xmlnode parent, const char* name) {
     xmlnode step, ret;
 
 
+    _xmlnode_expand(parent);
+
     if (parent == NULL || parent->firstchild == NULL || name == NULL || name == '\0')
 	return NULL;
 
@@ -839,133 +1490,89 @@ xmlnode xmlnode_get_tag(xmlnode parent, const char* name) {
  * - foobar[\@attribute]
  * - *[\@attribute='value']
  *
+ * Paths are compiled once and kept in an LRU cache, use xmlnode_path_compile() to manage a compiled path yourself.
+ *
  * @param context_node the xmlnode where to start the path
  * @param path the path (xpath like syntax, but only a small subset)
  * @param namespaces hashtable mapping namespace prefixes to namespace IRIs
- * @param p memory pool to use
- * @return first item in the list of xmlnodes, or NULL if no xmlnode matched the path
+ * @return the matching xmlnodes
  */
-xmlnode_vector xmlnode_get_tags(xmlnode context_node, const char *_path, xht namespaces) {
-    int axis = 0;	/* 0 = child, 1 = parent, 2 = attribute */
-    char const* ns_iri = NULL;
+xmlnode_vector xmlnode_get_tags(xmlnode context_node, const char *path, xht namespaces) {
     xmlnode_vector result_vector;
-    xmlnode iter = NULL;
 
     /* sanity check */
-    if (context_node == NULL || _path == NULL || namespaces == NULL)
-	return xmlnode_vector();
-
-    // make path a string we can better work with
-    std::string path = _path;
-
-    /* check if there is an axis */
-    if (path.substr(0, 7) == "child::") {
-	path.erase(0, 7);
-    } else if (path.substr(0, 8) == "parent::") {
-	axis = 1;
-	path.erase(0, 8);
-    } else if (path.substr(0, 11) == "attribute::") {
-	axis = 2;
-	path.erase(0, 11);
-    }
-
-    /* separate this step from the next one, and check for a predicate in this step */
-    std::string::size_type start_predicate = path.find("[");
-    std::string::size_type start_next_step = path.find("/");
-    std::string this_step;
-    std::string next_step;
-    std::string predicate;
-    if (start_predicate == std::string::npos && start_next_step == std::string::npos) {
-	// there is neither a predicate nor a next step in the path
-	this_step = path;
-    } else if (start_predicate == std::string::npos || start_next_step != std::string::npos && start_predicate > start_next_step) {
-	this_step = path.substr(0, start_next_step);
-	next_step = path.substr(start_next_step+1);
-    } else {
-	std::string::size_type end_predicate = path.find("]", start_predicate);
-	if (end_predicate == std::string::npos) {
-	    // error in predicate syntax, return empty vector
-	    return xmlnode_vector();
-	}
-
-	if (start_next_step != std::string::npos) {
-	    if (start_next_step < end_predicate)
-		start_next_step = path.find("/", end_predicate);
-	    if (start_next_step != std::string::npos)
-		next_step = path.substr(start_next_step+1);
-	}
-
-	predicate = path.substr(start_predicate+1, end_predicate-start_predicate-1);
-	this_step = path.substr(0, start_predicate);
-    }
-
-    /* check for the namespace IRI we have to match the node */
-    std::string::size_type end_prefix = this_step.find(":");
-    if (end_prefix == std::string::npos) {
-	// default prefix or NULL if axis is an attribute
-	ns_iri = axis == 2 ? NULL : static_cast<const char*>(xhash_get(namespaces, ""));
-    } else {
-	ns_iri = static_cast<const char*>(xhash_get(namespaces, this_step.substr(0, end_prefix).c_str()));
-	this_step.erase(0, end_prefix+1);
-    }
-
-    /* iterate over all child nodes, checking if this step matches them */
-    for (
-	    iter = axis == 0 ? xmlnode_get_firstchild(context_node) :
-		axis == 1 ? xmlnode_get_parent(context_node) :
-		axis == 2 ? xmlnode_get_firstattrib(context_node) :
-		NULL;
-	    iter != NULL;
-	    iter = axis == 0 ? xmlnode_get_nextsibling(iter) :
-		axis == 1 ? NULL :
-		axis == 2 ? xmlnode_get_nextsibling(iter) :
-		NULL) {
-
-	if (this_step == "*") {
-	    /* matching all nodes */
-
-	    /* match ns_iri if prefix has been specified */
-	    if (end_prefix != std::string::npos) {
-		if (iter->type == NTYPE_CDATA || j_strcmp(ns_iri, iter->ns_iri) != 0) {
-		    continue;
-		}
-	    }
-
-	    /* merging if it is a text node */
-	    if (iter->type == NTYPE_CDATA)
-		_xmlnode_merge(iter);
-
-	    /* append to the result */
-	    _xmlnode_append_if_predicate(result_vector, iter, predicate.length() > 0 ? predicate.c_str() : NULL, next_step.length() > 0 ? next_step.c_str() : NULL, namespaces);
-
-	    continue;
-	}
-
-	if (iter->type == NTYPE_CDATA && this_step == "text()") {
-	    /* matching text node */
+    if (context_node == NULL || path == NULL || namespaces == NULL)
+	return result_vector;
 
-	    /* merge all text nodes, that are direct siblings with this one */
-	    _xmlnode_merge(iter);
+    _xmlnode_path_cache().get(path, namespaces)->select(context_node, result_vector);
+    return result_vector;
+}
 
-	    /* append to the result */
-	    _xmlnode_append_if_predicate(result_vector, iter, predicate.length() > 0 ? predicate.c_str() : NULL, next_step.length() > 0 ? next_step.c_str() : NULL, namespaces);
+/**
+ * get the first xmlnode that matches a path
+ *
+ * This is the same as xmlnode_get_list_item(xmlnode_get_tags(context_node, path, namespaces), 0), but stops
+ * searching when the first node has been found.
+ *
+ * @param context_node the xmlnode where to start the path
+ * @param path the path (see xmlnode_get_tags())
+ * @param namespaces hashtable mapping namespace prefixes to namespace IRIs
+ * @return the first matching xmlnode, NULL if no xmlnode matched the path
+ */
+xmlnode xmlnode_get_first_tag(xmlnode context_node, const char *path, xht namespaces) {
+    /* sanity check */
+    if (context_node == NULL || path == NULL || namespaces == NULL)
+	return NULL;
 
-	    continue;
-	}
+    return _xmlnode_path_cache().get(path, namespaces)->select_first(context_node);
+}
 
-	if (iter->type != NTYPE_CDATA && (ns_iri == NULL && iter->ns_iri == NULL || j_strcmp(ns_iri, iter->ns_iri) == 0) && j_strcmp(this_step.c_str(), iter->name) == 0) {
-	    /* matching element or attribute */
+/**
+ * compile a path, that should be evaluated more than once
+ *
+ * The namespace prefixes in the path are resolved when compiling. The compiled path is freed with the pool.
+ *
+ * @param p the memory pool the compiled path is allocated from
+ * @param path the path (see xmlnode_get_tags())
+ * @param namespaces hashtable mapping namespace prefixes to namespace IRIs
+ * @return the compiled path, NULL on error
+ */
+xmlnode_path xmlnode_path_compile(pool p, const char *path, xht namespaces) {
+    /* sanity check */
+    if (p == NULL || path == NULL || namespaces == NULL)
+	return NULL;
 
-	    /* append to the result */
-	    _xmlnode_append_if_predicate(result_vector, iter, predicate.length() > 0 ? predicate.c_str() : NULL, next_step.length() > 0 ? next_step.c_str() : NULL, namespaces);
+    xmlnode_path compiled = new xmppd::compiled_path(p, path, namespaces);
+    pool_cleanup(p, _xmlnode_path_free, compiled);
+    return compiled;
+}
 
-	    continue;
-	}
-    }
+/**
+ * get all xmlnodes that match a compiled path
+ *
+ * @param path the compiled path
+ * @param context_node the xmlnode where to start the path
+ * @return the matching xmlnodes
+ */
+xmlnode_vector xmlnode_path_select(xmlnode_path path, xmlnode context_node) {
+    xmlnode_vector result_vector;
 
+    if (path != NULL)
+	path->select(context_node, result_vector);
     return result_vector;
 }
 
+/**
+ * get the first xmlnode that matches a compiled path
+ *
+ * @param path the compiled path
+ * @param context_node the xmlnode where to start the path
+ * @return the first matching xmlnode, NULL if no xmlnode matched the path
+ */
+xmlnode xmlnode_path_select_first(xmlnode_path path, xmlnode context_node) {
+    return path != NULL ? path->select_first(context_node) : NULL;
+}
+
 /**
  * return the text wrapped inside the element found by the name parameter
  *
@@ -1015,7 +1622,7 @@ void xmlnode_change_namespace(xmlnode node, const char *ns_iri) {
 	return;
 
     /* update the namespace */
-    node->ns_iri = ns_iri ? pstrdup(xmlnode_pool(node), ns_iri) : NULL;
+    node->ns_iri = ns_iri ? _xmlnode_strdup(xmlnode_pool(node), ns_iri) : NULL;
 
     /* is there an attribute declaring this namespace? */
     if (node->prefix == NULL) {
@@ -1052,7 +1659,7 @@ void xmlnode_put_attrib(xmlnode owner, const char* name, const char* value) {
 
 	/* namespace prefix of the tag? */
 	if (j_strcmp(name+6, owner->prefix) == 0) {
-	    owner->ns_iri = pstrdup(owner->p, value);
+	    owner->ns_iri = _xmlnode_strdup(owner->p, value);
 	}
 	return xmlnode_put_attrib_ns(owner, name+6, "xmlns", NS_XMLNS, value);
     }
@@ -1066,7 +1673,7 @@ void xmlnode_put_attrib(xmlnode owner, const char* name, const char* value) {
 	    value = NS_SERVER;
 
 	if (owner->prefix == NULL) {
-	    owner->ns_iri = pstrdup(owner->p, value);
+	    owner->ns_iri = _xmlnode_strdup(owner->p, value);
 	}
 	return xmlnode_put_attrib_ns(owner, name, NULL, NS_XMLNS, value);
     }
@@ -1189,11 +1796,19 @@ static xmlnode_t const* xmlnode_get_firstattrib_const(xmlnode_t const* parent) {
  * @return child node
  */
 xmlnode xmlnode_get_firstchild(xmlnode parent) {
+    _xmlnode_expand(parent);
+
     if (parent != NULL)
 	return parent->firstchild;
     return NULL;
 }
 
+/**
+ * get the first child node of a node, without parsing unparsed content
+ *
+ * @param parent element for which the first child should be returned
+ * @return child node
+ */
 static xmlnode_t const* xmlnode_get_firstchild_const(xmlnode_t const* parent) {
     return parent ? parent->firstchild : NULL;
 }
@@ -1207,6 +1822,8 @@ static xmlnode_t const* xmlnode_get_firstchild_const(xmlnode_t const* parent) {
  * @return last child node
  */
 xmlnode xmlnode_get_lastchild(xmlnode parent) {
+    _xmlnode_expand(parent);
+
     if (parent != NULL)
 	return parent->lastchild;
     return NULL;
@@ -1361,9 +1978,54 @@ int xmlnode_get_type(xmlnode node) {
 int xmlnode_has_children(xmlnode node) {
     if ((node != NULL) && (node->firstchild != NULL))
 	return 1;
+    if (node != NULL && node->type == NTYPE_TAG && node->data != NULL)
+	return 1;
     return 0;
 }
 
+/**
+ * keep the content of an element unparsed
+ *
+ * The content is parsed when the child nodes of the element are accessed for the first time.
+ * Until then, it is serialized as it is. The content is parsed with the namespace of the element
+ * as the default namespace, and has to declare all other namespace prefixes it uses.
+ *
+ * @param node the element (must not have child nodes yet)
+ * @param content the content of the element (not zero terminated)
+ * @param len the length of the content
+ */
+void xmlnode_put_unparsed(xmlnode node, const char* content, int len) {
+    if (node == NULL || node->type != NTYPE_TAG || node->firstchild != NULL || content == NULL || len <= 0)
+	return;
+
+    xmlnode_shared_content* shared = static_cast<xmlnode_shared_content*>(malloc(offsetof(xmlnode_shared_content, content) + len));
+    if (shared == NULL)
+	return;
+    shared->references = 0;
+    shared->len = len;
+    memcpy(shared->content, content, len);
+
+    _xmlnode_share_content(node, shared);
+}
+
+/**
+ * copy the child nodes of an element to an other element
+ *
+ * Unparsed content is not copied, it is shared by both elements.
+ *
+ * @param to where to copy the child nodes to
+ * @param from where to copy the child nodes from
+ */
+static void _xmlnode_copy_children(xmlnode to, xmlnode from) {
+    if (from->type == NTYPE_TAG && from->data != NULL) {
+	_xmlnode_share_content(to, _xmlnode_shared_content(from->data));
+	return;
+    }
+
+    if (xmlnode_has_children(from))
+	xmlnode_insert_node(to, xmlnode_get_firstchild(from));
+}
+
 /**
  * get the memory pool of an xmlnode
  *
@@ -1451,6 +2113,17 @@ void xmlnode_hide_attrib_ns(xmlnode parent, const char *name, const char *ns_iri
 	parent->lastattrib = attrib->prev;
 }
 
+/**
+ * get the serializer used for xmlnode trees
+ *
+ * @return the serializer (one serializer is reused, so its buffers only have to grow once)
+ */
+static xmppd::xmlnode_serializer& _xmlnode_serializer() {
+    static xmppd::xmlnode_serializer serializer;
+
+    return serializer;
+}
+
 /**
  * serialize a given xmlnode to a string
  *
@@ -1482,14 +2155,7 @@ char* xmlnode_serialize_string(xmlnode_t const* node, const xmppd::ns_decl_list&
     if (!node)
 	return NULL;
 
-    // create an ostream where we can write the serialization to
-    std::ostringstream s;
-
-    // serialize
-    _xmlnode_serialize(s, node, nslist, stream_type);
-
-    // return result
-    return pstrdup(xmlnode_pool(const_cast<xmlnode>(node)), s.str().c_str());
+    return _xmlnode_serializer().serialize(node, nslist, stream_type);
 }
 
 /**
@@ -1508,8 +2174,7 @@ xmlnode xmlnode_insert_tag_node(xmlnode parent, xmlnode node) {
     child = xmlnode_insert_tag_ns(parent, node->name, node->prefix, node->ns_iri);
     if (_xmlnode_has_attribs(node))
 	xmlnode_insert_node(child, xmlnode_get_firstattrib(node));
-    if (xmlnode_has_children(node))
-	xmlnode_insert_node(child, xmlnode_get_firstchild(node));
+    _xmlnode_copy_children(child, node);
 
     return child;
 }
@@ -1558,8 +2223,35 @@ xmlnode xmlnode_dup(xmlnode x) {
 
     if (_xmlnode_has_attribs(x))
 	xmlnode_insert_node(x2, xmlnode_get_firstattrib(x));
-    if (xmlnode_has_children(x))
-	xmlnode_insert_node(x2, xmlnode_get_firstchild(x));
+    _xmlnode_copy_children(x2, x);
+
+    return x2;
+}
+
+/**
+ * duplicate an element, that shares its content with the duplicate
+ *
+ * The element and its attributes are copied, but the child nodes are serialized once
+ * and kept as unparsed content by the duplicate. Duplicates of the duplicate share this
+ * content as well, so a stanza can be sent to many recipients with only the attributes
+ * being copied. A duplicate gets its own child nodes when its content is accessed.
+ *
+ * @param x the element to duplicate (it is not modified)
+ * @return the duplicate in a new memory pool, NULL on error
+ */
+xmlnode xmlnode_dup_shared(xmlnode x) {
+    // content already shared, or nothing to share?
+    if (x == NULL || x->type != NTYPE_TAG || x->data != NULL || x->firstchild == NULL)
+	return xmlnode_dup(x);
+
+    xmlnode x2 = xmlnode_new_tag_ns(x->name, x->prefix, x->ns_iri);
+    if (_xmlnode_has_attribs(x))
+	xmlnode_insert_node(x2, xmlnode_get_firstattrib(x));
+
+    std::string const& content = _xmlnode_serializer().serialize_content(x);
+    if (content.empty())
+	return x2;
+    xmlnode_put_unparsed(x2, content.data(), content.length());
 
     return x2;
 }
@@ -1583,8 +2275,7 @@ xmlnode xmlnode_dup_pool(pool p, xmlnode x) {
 
     if (_xmlnode_has_attribs(x))
 	xmlnode_insert_node(x2, xmlnode_get_firstattrib(x));
-    if (xmlnode_has_children(x))
-	xmlnode_insert_node(x2, xmlnode_get_firstchild(x));
+    _xmlnode_copy_children(x2, x);
 
     return x2;
 }
@@ -1918,6 +2609,33 @@ namespace xmppd {
 	    return false;
 	}
     }
+
+    /**
+     * get the namespace declarations currently in scope as attributes for a start tag
+     *
+     * The 'xml' and 'xmlns' prefixes are not included, as they are always declared.
+     *
+     * @return the declarations, each one prefixed by a space character
+     */
+    std::string ns_decl_list::xmlns_attributes() const {
+	std::set<std::string> seen_prefixes;
+	std::string result;
+
+	seen_prefixes.insert("xml");
+	seen_prefixes.insert("xmlns");
+
+	for (ns_decl_list::const_reverse_iterator p = rbegin(); p != rend(); ++p) {
+	    // only the latest declaration of a prefix is in scope
+	    if (!seen_prefixes.insert(p->first).second)
+		continue;
+
+	    result += p->first == "" ? " xmlns='" : " xmlns:" + p->first + "='";
+	    result += strescape(p->second);
+	    result += "'";
+	}
+
+	return result;
+    }
 }
 
 #ifdef POOL_DEBUG
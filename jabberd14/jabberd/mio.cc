@@ -45,6 +45,11 @@
 #include <jabberd.h>
 
 #include <errno.h>
+#include <set>
+
+#ifdef HAVE_EPOLL
+#  include <sys/epoll.h>
+#endif
 
 /********************************************************
  *************  Internal MIO Functions  *****************
@@ -64,6 +69,23 @@ typedef struct mio_connect_st {
     int connected;	/**< flag if the socket is connected */
 } _connect_data,  *connect_data;
 
+/**
+ * @brief a readiness backend: the mechanism MIO uses to wait for socket events
+ *
+ * The backend does not process sockets itself. It only updates the readable/writeable flags of
+ * the sockets it got events for, and puts them on the ready__list using _mio_mark_ready().
+ */
+typedef struct mio_backend_st {
+    char const* name;		/**< name of the backend, as used in the configuration file */
+    int fd_limit;		/**< sockets with a file descriptor of at least this value cannot be handled, 0 for no limit */
+    int (*init)(void);		/**< initialize the backend, returns 0 on success */
+    void (*stop)(void);		/**< release resources of the backend */
+    void (*add)(mio m);		/**< start watching a socket */
+    void (*remove)(mio m);	/**< stop watching a socket */
+    void (*wait)(int block);	/**< wait for events (or only poll if block is 0) and mark sockets with events as ready */
+    int (*wait_fd)(int fd, int writeable, pth_event_t ev); /**< block the calling thread until a file descriptor, that is not a managed socket, is ready (see mio_wait_fd()) */
+} _mio_backend;
+
 /* global object */
 ios mio__data = NULL;	/**< global data for mio */
 extern xmlnode greymatter__;
@@ -231,6 +253,57 @@ static int _mio_access_check(const char *address, int check_allow) {
     return 0;
 }
 
+/**
+ * put a socket on the list of sockets, that have to be processed by the MIO loop
+ *
+ * Sockets get put on this list if the readiness backend reported an event for them,
+ * if there is something new to write, if they should get closed, or if they are
+ * allowed to read again after karma punishment. The MIO loop only processes sockets
+ * on this list.
+ *
+ * @param m the socket that should be processed
+ */
+static void _mio_mark_ready(mio m) {
+    if (mio__data == NULL || m == NULL || m->flags.ready_listed)
+	return;
+
+    m->flags.ready_listed = 1;
+    m->ready_next = NULL;
+    m->ready_prev = mio__data->ready__tail;
+
+    if (mio__data->ready__tail != NULL)
+	mio__data->ready__tail->ready_next = m;
+    else
+	mio__data->ready__list = m;
+    mio__data->ready__tail = m;
+    mio__data->ready__count++;
+}
+
+/**
+ * remove a socket from the list of sockets, that have to be processed by the MIO loop
+ *
+ * @param m the socket that should be removed from the list
+ */
+static void _mio_unmark_ready(mio m) {
+    if (mio__data == NULL || m == NULL || !m->flags.ready_listed)
+	return;
+
+    if (m->ready_prev != NULL)
+	m->ready_prev->ready_next = m->ready_next;
+    else
+	mio__data->ready__list = m->ready_next;
+
+    if (m->ready_next != NULL)
+	m->ready_next->ready_prev = m->ready_prev;
+    else
+	mio__data->ready__tail = m->ready_prev;
+
+    m->ready_prev = NULL;
+    m->ready_next = NULL;
+    m->flags.ready_listed = 0;
+    mio__data->ready__count--;
+}
+
 /**
  * callback for Heartbeat, increments karma, and signals the
  * select loop, whenever a socket's punishment is over
@@ -240,6 +313,7 @@ static int _mio_access_check(const char *address, int check_allow) {
  */
 static result _karma_heartbeat(void*arg) {
     mio cur;
+    int wakeup = 0;
 
     /* if there is nothing to do, just return */
     if (mio__data == NULL || mio__data->master__list == NULL) 
@@ -250,28 +324,39 @@ static result _karma_heartbeat(void*arg) {
         if (cur->k.dec != 0) {
 	    /* Karma is enabled for this connection */
             int was_negative = 0;
+	    int was_throttled = 0;
             /* don't update if we are closing, or pre-initilized */
             if (cur->state == state_CLOSE) 
                 continue;
      
             /* if we are being punished, set the flag */
             if (cur->k.val < 0) was_negative = 1; 
+	    if (cur->k.val <= 0) was_throttled = 1;
      
             /* possibly increment the karma */
             karma_increment( &cur->k );
+
+	    /* we may read again: data may be pending, that we did not get a new event for */
+	    if (was_throttled && cur->k.val > 0) {
+		_mio_mark_ready(cur);
+		wakeup = 1;
+	    }
      
             /* punishment is over */
             if (was_negative && cur->k.val >= 0)  {
                log_debug2(ZONE, LOGT_IO, "Punishment Over for socket %d: ", cur->fd);
-	       /* we don't have to signal again, if a signal is pending */
-	       if (mio__data->zzz_active <= 0) {
-		   mio__data->zzz_active++;
-		   pth_write(mio__data->zzz[1]," ",1);
-	       }
+	       wakeup = 1;
             }
         }
     }
 
+    /* signal the select loop, it has to process the sockets, that may read again */
+    /* we don't have to signal again, if a signal is pending */
+    if (wakeup && mio__data->zzz_active <= 0) {
+	mio__data->zzz_active++;
+	pth_write(mio__data->zzz[1]," ",1);
+    }
+
     /* always return r_DONE, to keep getting heartbeats */
     return r_DONE;
 }
@@ -287,6 +372,10 @@ static void _mio_unlink(mio m) {
     if (mio__data == NULL) 
         return;
 
+    /* the readiness backend does not have to watch this socket anymore */
+    (*mio__data->backend->remove)(m);
+    _mio_unmark_ready(m);
+
     if (mio__data->master__list == m)
        mio__data->master__list = mio__data->master__list->next;
 
@@ -315,6 +404,390 @@ static void _mio_link(mio m) {
         mio__data->master__list->prev = m;
 
     mio__data->master__list = m;
+
+    /* let the readiness backend watch this socket */
+    (*mio__data->backend->add)(m);
+}
+
+/**
+ * consume the signals, that have been sent to the MIO loop using the zzz pipe
+ */
+static void _mio_zzz_drain() {
+    char buf[8192];
+
+    log_debug2(ZONE, LOGT_EXECFLOW, "got a notify on zzz");
+    pth_read(mio__data->zzz[0], buf, sizeof(buf));
+    mio__data->zzz_active = 0;
+}
+
+/**
+ * select backend: nothing to initialize
+ *
+ * @return always 0
+ */
+static int _mio_select_init() {
+    return 0;
+}
+
+/**
+ * select backend: nothing to release
+ */
+static void _mio_select_stop() {
+}
+
+/**
+ * select backend: the sockets are taken from the master__list on each call to _mio_select_wait()
+ *
+ * @param m the socket (ignored)
+ */
+static void _mio_select_add(mio m) {
+}
+
+/**
+ * select backend: the sockets are taken from the master__list on each call to _mio_select_wait()
+ *
+ * @param m the socket (ignored)
+ */
+static void _mio_select_remove(mio m) {
+}
+
+/**
+ * select backend: build the fd_sets from the master__list, call pth_select() and mark the sockets having events
+ *
+ * This is the traditional MIO loop. It has to iterate the complete master__list twice for
+ * each call and can only handle file descriptors below FD_SETSIZE.
+ *
+ * @param block 0 if pth_select() should only poll, else pth_select() is waiting for events
+ */
+static void _mio_select_wait(int block) {
+    fd_set	wfds;	/* fd set containing fds that should be checked for/had a write event */
+    fd_set	rfds;	/* fd set containing fds that should be checked for/had a read event */
+    struct timeval zero_timeout = {0, 0};
+    int		maxfd = mio__data->zzz[0];
+    int		retval = 0;
+    mio		cur = NULL;
+
+    /* init the sockets we want to check */
+    FD_ZERO(&wfds);
+    FD_ZERO(&rfds);
+    for (cur = mio__data->master__list; cur != NULL; cur = cur->next) {
+	int wanted = 0;
+
+	/* check if we want to get write events for this socket */
+	if (cur->queue != NULL || cur->flags.recall_write_when_writeable || cur->flags.recall_read_when_writeable || cur->flags.recall_handshake_when_writeable) {
+	    FD_SET(cur->fd, &wfds);
+	    wanted = 1;
+	}
+
+	/* check if we want to get read events for this socket */
+	if (cur->k.val > 0 || cur->flags.recall_write_when_readable || cur->flags.recall_read_when_readable || cur->flags.recall_handshake_when_readable) {
+	    FD_SET(cur->fd, &rfds);
+	    wanted = 1;
+	}
+
+	if (wanted && cur->fd > maxfd)
+	    maxfd = cur->fd;
+    }
+
+    /* wait for a socket event */
+    FD_SET(mio__data->zzz[0],&rfds); /* include our wakeup socket */
+    retval = pth_select(maxfd+1, &rfds, &wfds, NULL, block ? NULL : &zero_timeout);
+
+    /* if retval is -1, fd sets are undefined across all platforms */
+    if (retval <= 0)
+	return;
+
+    /* check our zzz */
+    if (FD_ISSET(mio__data->zzz[0], &rfds)) {
+	_mio_zzz_drain();
+    }
+
+    /* mark the sockets, that had events */
+    for (cur = mio__data->master__list; cur != NULL; cur = cur->next) {
+	int had_event = 0;
+
+	if (FD_ISSET(cur->fd, &rfds)) {
+	    cur->flags.readable = 1;
+	    had_event = 1;
+	}
+	if (FD_ISSET(cur->fd, &wfds)) {
+	    cur->flags.writeable = 1;
+	    had_event = 1;
+	}
+
+	if (had_event)
+	    _mio_mark_ready(cur);
+    }
+}
+
+/**
+ * select backend: wait for a file descriptor using a pth event
+ *
+ * @param fd the file descriptor to wait for
+ * @param writeable 0 to wait until fd is readable, else to wait until it is writeable
+ * @param ev additional event, that stops waiting, may be NULL
+ * @return 0 if fd is ready, 1 if ev occurred, -1 on error (fd cannot be handled)
+ */
+static int _mio_select_wait_fd(int fd, int writeable, pth_event_t ev) {
+    pth_event_t wevt = NULL;
+    int ready = 0;
+
+    /* pth uses select() as well */
+    if (fd < 0 || fd >= FD_SETSIZE) {
+	errno = EMFILE;
+	return -1;
+    }
+
+    wevt = pth_event(PTH_EVENT_FD|(writeable ? PTH_UNTIL_FD_WRITEABLE : PTH_UNTIL_FD_READABLE), fd);
+    if (ev != NULL)
+	pth_event_concat(wevt, ev, NULL);
+    pth_wait(wevt);
+    ready = pth_event_occurred(wevt);
+    if (ev != NULL)
+	pth_event_isolate(wevt);
+    pth_event_free(wevt, PTH_FREE_THIS);
+
+    return ready ? 0 : 1;
+}
+
+/** the traditional select() based readiness backend */
+static _mio_backend const _mio_backend_select = {
+    "select",
+    FD_SETSIZE,
+    _mio_select_init,
+    _mio_select_stop,
+    _mio_select_add,
+    _mio_select_remove,
+    _mio_select_wait,
+    _mio_select_wait_fd
+};
+
+#ifdef HAVE_EPOLL
+/** maximum number of events fetched from the epoll instance at once */
+#define MIO_EPOLL_MAXEVENTS 256
+
+/**
+ * a thread waiting in _mio_epoll_wait_fd()
+ */
+typedef struct mio_epoll_fd_wait_st {
+    int ready;			/**< flag that the file descriptor got ready */
+    pth_mutex_t mutex;		/**< mutex protecting ready */
+    pth_cond_t cond;		/**< signalled by the MIO thread when the file descriptor got ready */
+} _mio_epoll_fd_wait, *mio_epoll_fd_wait;
+
+/** threads waiting in _mio_epoll_wait_fd(), used to tell their events apart from events of managed sockets */
+static std::set<mio_epoll_fd_wait> _mio_epoll_fd_waits;
+
+/**
+ * epoll backend: create the epoll instance and watch the zzz pipe
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int _mio_epoll_init() {
+    struct epoll_event ev;
+
+    mio__data->backend_fd = epoll_create(MIO_EPOLL_MAXEVENTS);
+    if (mio__data->backend_fd < 0) {
+	log_warn(NULL, "Could not create epoll instance: %s", strerror(errno));
+	return -1;
+    }
+    fcntl(mio__data->backend_fd, F_SETFD, FD_CLOEXEC);
+
+    /* the zzz pipe is level-triggered: it stays readable until _mio_zzz_drain() is called */
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(mio__data->backend_fd, EPOLL_CTL_ADD, mio__data->zzz[0], &ev) < 0) {
+	log_warn(NULL, "Could not add signal pipe to epoll instance: %s", strerror(errno));
+	close(mio__data->backend_fd);
+	mio__data->backend_fd = -1;
+	return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * epoll backend: close the epoll instance
+ */
+static void _mio_epoll_stop() {
+    if (mio__data->backend_fd >= 0)
+	close(mio__data->backend_fd);
+    mio__data->backend_fd = -1;
+}
+
+/**
+ * epoll backend: start watching a socket (edge-triggered)
+ *
+ * We always watch for both directions. As the socket is edge-triggered, this does not cause
+ * additional events as long as we do not consume the readiness. The readiness we got reported
+ * is kept in the readable/writeable flags of the socket until an operation returns EAGAIN.
+ *
+ * @param m the socket to watch
+ */
+static void _mio_epoll_add(mio m) {
+    struct epoll_event ev;
+
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    if (m->type != type_LISTEN)
+	ev.events |= EPOLLOUT;
+    ev.data.ptr = m;
+
+    if (epoll_ctl(mio__data->backend_fd, EPOLL_CTL_ADD, m->fd, &ev) < 0) {
+	log_warn(NULL, "Could not add socket %i to epoll instance: %s", m->fd, strerror(errno));
+	mio_close(m);
+    }
+}
+
+/**
+ * epoll backend: stop watching a socket
+ *
+ * @param m the socket to stop watching
+ */
+static void _mio_epoll_remove(mio m) {
+    struct epoll_event ev;
+
+    /* pre 2.6.9 kernels require a non-NULL event */
+    bzero(&ev, sizeof(ev));
+    epoll_ctl(mio__data->backend_fd, EPOLL_CTL_DEL, m->fd, &ev);
+}
+
+/**
+ * epoll backend: wait for events and mark the sockets, that had events
+ *
+ * Waiting is done using a pth event on the epoll file descriptor, so that other pth threads
+ * can continue while we are waiting. Only the sockets, that had events are visited.
+ *
+ * @param block 0 if we should only poll, else we are waiting for events
+ */
+static void _mio_epoll_wait(int block) {
+    struct epoll_event events[MIO_EPOLL_MAXEVENTS];
+    int count = 0;
+
+    if (block) {
+	pth_event_t wevt = pth_event(PTH_EVENT_FD|PTH_UNTIL_FD_READABLE, mio__data->backend_fd);
+	pth_wait(wevt);
+	pth_event_free(wevt, PTH_FREE_THIS);
+    }
+
+    count = epoll_wait(mio__data->backend_fd, events, MIO_EPOLL_MAXEVENTS, 0);
+    for (int i = 0; i < count; i++) {
+	mio cur = static_cast<mio>(events[i].data.ptr);
+
+	/* the zzz pipe */
+	if (cur == NULL) {
+	    _mio_zzz_drain();
+	    continue;
+	}
+
+	/* a thread waiting in _mio_epoll_wait_fd() */
+	if (!_mio_epoll_fd_waits.empty() && _mio_epoll_fd_waits.count(static_cast<mio_epoll_fd_wait>(events[i].data.ptr)) > 0) {
+	    mio_epoll_fd_wait w = static_cast<mio_epoll_fd_wait>(events[i].data.ptr);
+
+	    pth_mutex_acquire(&(w->mutex), FALSE, NULL);
+	    w->ready = 1;
+	    pth_cond_notify(&(w->cond), FALSE);
+	    pth_mutex_release(&(w->mutex));
+	    continue;
+	}
+
+	if (events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+	    cur->flags.readable = 1;
+	if (events[i].events & (EPOLLOUT|EPOLLHUP|EPOLLERR))
+	    cur->flags.writeable = 1;
+	_mio_mark_ready(cur);
+    }
+}
+
+/**
+ * epoll backend: wait for a file descriptor using the epoll instance of the MIO thread
+ *
+ * The file descriptor is added to the epoll instance for a single event, the MIO thread
+ * wakes us up when it gets it. This works for any file descriptor number.
+ *
+ * @param fd the file descriptor to wait for
+ * @param writeable 0 to wait until fd is readable, else to wait until it is writeable
+ * @param ev additional event, that stops waiting, may be NULL
+ * @return 0 if fd is ready, 1 if ev occurred, -1 on error
+ */
+static int _mio_epoll_wait_fd(int fd, int writeable, pth_event_t ev) {
+    _mio_epoll_fd_wait w;
+    struct epoll_event epev;
+
+    w.ready = 0;
+    pth_mutex_init(&(w.mutex));
+    pth_cond_init(&(w.cond));
+
+    bzero(&epev, sizeof(epev));
+    epev.events = (writeable ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+    epev.data.ptr = &w;
+    if (epoll_ctl(mio__data->backend_fd, EPOLL_CTL_ADD, fd, &epev) < 0)
+	return -1;
+    _mio_epoll_fd_waits.insert(&w);
+
+    pth_mutex_acquire(&(w.mutex), FALSE, NULL);
+    while (!w.ready) {
+	if (!pth_cond_await(&(w.cond), &(w.mutex), ev) && ev != NULL && pth_event_occurred(ev))
+	    break;
+    }
+    pth_mutex_release(&(w.mutex));
+
+    _mio_epoll_fd_waits.erase(&w);
+    bzero(&epev, sizeof(epev));
+    epoll_ctl(mio__data->backend_fd, EPOLL_CTL_DEL, fd, &epev);
+
+    return w.ready ? 0 : 1;
+}
+
+/** the epoll based readiness backend (edge-triggered) */
+static _mio_backend const _mio_backend_epoll = {
+    "epoll",
+    0,
+    _mio_epoll_init,
+    _mio_epoll_stop,
+    _mio_epoll_add,
+    _mio_epoll_remove,
+    _mio_epoll_wait,
+    _mio_epoll_wait_fd
+};
+#endif
+
+/**
+ * select the readiness backend to use and initialize it
+ *
+ * @param name name of the configured backend, NULL to use the default
+ */
+static void _mio_backend_init(char const* name) {
+#ifdef HAVE_EPOLL
+    _mio_backend const* backends[] = { &_mio_backend_epoll, &_mio_backend_select, NULL };
+#else
+    _mio_backend const* backends[] = { &_mio_backend_select, NULL };
+#endif
+
+    mio__data->backend = backends[0];
+    if (name != NULL) {
+	int i = 0;
+
+	for (i = 0; backends[i] != NULL; i++) {
+	    if (j_strcmp(backends[i]->name, name) == 0)
+		break;
+	}
+
+	if (backends[i] != NULL) {
+	    mio__data->backend = backends[i];
+	} else {
+	    log_warn(NULL, "Unsupported MIO backend '%s' configured, using '%s'", name, mio__data->backend->name);
+	}
+    }
+
+    if ((*mio__data->backend->init)() != 0 && mio__data->backend != &_mio_backend_select) {
+	log_warn(NULL, "Could not initialize MIO backend '%s', falling back to 'select'", mio__data->backend->name);
+	mio__data->backend = &_mio_backend_select;
+	(*mio__data->backend->init)();
+    }
+
+    log_debug2(ZONE, LOGT_INIT, "MIO is using the '%s' backend", mio__data->backend->name);
 }
 
 /** 
@@ -351,6 +824,7 @@ int _mio_write_dump(mio m) {
 
 	/* just nothing could be written? */
 	if (len == 0) {
+	    m->flags.writeable = 0;
 	    return 1;
 	}
 
@@ -358,6 +832,7 @@ int _mio_write_dump(mio m) {
 	if (len < cur->len) {
 	    cur->cur = static_cast<char*>(cur->cur) + len;
 	    cur->len -= len;
+	    m->flags.writeable = 0;
 	    return 1;
 	}
 
@@ -457,12 +932,14 @@ static mio _mio_accept(mio m) {
     fd = pth_accept(m->fd, (struct sockaddr*)&serv_addr, (socklen_t*)&addrlen);
     if (fd <= 0) {
 	log_debug2(ZONE, LOGT_IO, "pth_accept() failed to accept on socket #%i", m->fd);
+	/* the accept queue is empty, wait for the next event */
+	m->flags.readable = 0;
         return NULL;
     }
 
-    /* do not accept a higher fd than FD_SET, or FD_CLR can handle */
-    if (fd >= FD_SETSIZE) {
-	log_warn(NULL, "could not accept incoming connection, maximum number of connections reached (%i)", FD_SETSIZE);
+    /* do not accept a higher fd than the readiness backend can handle (e.g. FD_SETSIZE for select) */
+    if (mio__data->backend->fd_limit > 0 && fd >= mio__data->backend->fd_limit) {
+	log_warn(NULL, "could not accept incoming connection, maximum number of connections reached (%i)", mio__data->backend->fd_limit);
 	close(fd);
 	return NULL;
     }
@@ -565,18 +1042,49 @@ static result _mio_connect_timeout(void *arg) {
 
 /**
  * helper function for _mio_connect()
+ *
+ * Connects the socket non-blocking and waits using the readiness backend until the connection
+ * is established, or _mio_connect_timeout() signals a timeout. (pth_connect_ev() would reject
+ * file descriptors not below FD_SETSIZE.) The socket is left non-blocking.
+ *
+ * @return 0 on success, -1 on failure (errno is set)
  */
 static int _mio_connect_helper(mio m, struct sockaddr* serv_addr, socklen_t  addrlen) {
     sigset_t set;
     int sig;
     pth_event_t wevt;
+    int waited = 0;
+    int error = 0;
+    socklen_t errlen = sizeof(error);
+
+    fcntl(m->fd, F_SETFL, fcntl(m->fd, F_GETFL, 0) | O_NONBLOCK);
+
+    if (connect(m->fd, serv_addr, addrlen) == 0)
+	return 0;
+    if (errno != EINPROGRESS && errno != EINTR)
+	return -1;
 
     sigemptyset(&set);
     sigaddset(&set, SIGUSR2);
 
     wevt = pth_event(PTH_EVENT_SIGS, &set, &sig);
-    pth_fdmode(m->fd, PTH_FDMODE_BLOCK);
-    return pth_connect_ev(m->fd, serv_addr, addrlen, wevt);
+    waited = mio_wait_fd(m->fd, 1, wevt);
+    pth_event_free(wevt, PTH_FREE_THIS);
+
+    if (waited != 0) {
+	if (waited > 0)
+	    errno = ETIMEDOUT;
+	return -1;
+    }
+
+    /* the socket is writeable: check if the connection has been established */
+    if (getsockopt(m->fd, SOL_SOCKET, SO_ERROR, &error, &errlen) < 0)
+	return -1;
+    if (error != 0) {
+	errno = error;
+	return -1;
+    }
+    return 0;
 }
 
 /**
@@ -593,8 +1101,7 @@ static void* _mio_connect(void *arg) {
     struct sockaddr_in	sa;
     struct in_addr*	saddr;
 #endif
-    int			flag = 1,
-			flags;
+    int			flag = 1;
     mio			newm;
     pool		p;
     sigset_t		set;
@@ -724,11 +1231,6 @@ static void* _mio_connect(void *arg) {
 
     newm->connect_errmsg = "";
 
-    /* set the socket to non-blocking */
-    flags =  fcntl(newm->fd, F_GETFL, 0);
-    flags |= O_NONBLOCK;
-    fcntl(newm->fd, F_SETFL, flags);
-
     /* XXX pthreads race condition.. cd->connected may be checked in the timeout, and cd freed before these calls */
 
     /* set the default karma values */
@@ -771,6 +1273,10 @@ static void _mio_read_from_socket(mio m) {
 	if (maxlen > sizeof(buf)-1)
 	    maxlen = sizeof(buf)-1;
 
+	/* no karma left to read anything (data stays pending, the karma heartbeat will mark us ready again) */
+	if (maxlen == 0)
+	    return;
+
 	/* read from the socket */
 	len = (*(m->mh->read))(m, buf, maxlen);
 	log_debug2(ZONE, LOGT_BYTES, "IN (%i of max %i, fd#%i): %.*s", len, maxlen, m->fd, len, buf);
@@ -781,7 +1287,10 @@ static void _mio_read_from_socket(mio m) {
 	    mio_close(m);
 	    return;
 	} else if (len == 0) {
-	    /* no more data to read (but connection still there) */
+	    /* the read handlers retry on EINTR, so this is EAGAIN: wait for the next readiness event,
+	     * unless the TLS layer has to write first (the socket might still have data then) */
+	    if (!m->flags.recall_read_when_writeable)
+		m->flags.readable = 0;
 	    return;
 	}
 
@@ -832,7 +1341,7 @@ static void _mio_do_handshake(mio m) {
 }
 
 /**
- * helper function to process a single socket inside the mio select() loop
+ * helper function to process a single socket inside the mio loop
  *
  * Steps:
  * - Karma handling
@@ -842,39 +1351,24 @@ static void _mio_do_handshake(mio m) {
  *
  * If one of these steps fails, the processing of this socket is stopped and the function returns
  *
- * @param cur the mio that should be processed
- * @param maxfd the maximum file descriptor (gets updated by this function)
- * @param rfds sockets that had read events
- * @param wfds sockets that had write events
- * @param select_retval the return value of the last pth_select() call
+ * The readiness of the socket is taken from m->flags.readable and m->flags.writeable, as they
+ * have been set by the readiness backend.
+ *
+ * @param m the mio that should be processed
  */
-static void _mio_loop_process_a_socket(mio m, int *maxfd, fd_set *rfds, fd_set *wfds, int select_retval) {
+static void _mio_loop_process_a_socket(mio m) {
 
     log_debug2(ZONE, LOGT_IO, "processing mio %X (state %i)", m, m->state);
 
-    /* find the max fd: during a full interation on the master__list we always update maxfd as long as we find a higher fd  */
-    if (m->fd > *maxfd)
-	*maxfd = m->fd;
-
     /* pause while the rest of jabberd catches up */
     pth_yield(NULL);
 
-    /* we cannot continue processing this socket, if pth_select() failed */
-    if (select_retval == -1) {
-	return;
-    }
-
     /* listening sockets are a bit different, we only check for new connections */
     if (m->type == type_LISTEN) {
-	if (FD_ISSET(m->fd, rfds)) {
+	if (m->flags.readable) {
 	    mio accepted_m = _mio_accept(m);
 
 	    log_debug2(ZONE, LOGT_IO, "Accepted socket on MIO object %X, fd %i", accepted_m, accepted_m != NULL ? accepted_m->fd : -1);
-
-	    if(accepted_m != NULL) {
-		if(accepted_m->fd > *maxfd)
-		    *maxfd=accepted_m->fd;
-	    }
 	}
 	return;
     }
@@ -883,7 +1377,7 @@ static void _mio_loop_process_a_socket(mio m, int *maxfd, fd_set *rfds, fd_set *
     if (m->flags.recall_write_when_writeable) {
 	int write_return = 0;
 
-	if (!FD_ISSET(m->fd, wfds)) {
+	if (!m->flags.writeable) {
 	    log_debug2(ZONE, LOGT_IO, "socket %i waits to become writeable again ...", m->fd);
 	    return;
 	}
@@ -898,7 +1392,7 @@ static void _mio_loop_process_a_socket(mio m, int *maxfd, fd_set *rfds, fd_set *
     if (m->flags.recall_write_when_readable) {
 	int write_return = 0;
 
-	if (!FD_ISSET(m->fd, rfds)) {
+	if (!m->flags.readable) {
 	    log_debug2(ZONE, LOGT_IO, "socket %i waits to become readable again for being able to write ...", m->fd);
 	    return;
 	}
@@ -911,7 +1405,7 @@ static void _mio_loop_process_a_socket(mio m, int *maxfd, fd_set *rfds, fd_set *
 	return;
     }
     if (m->flags.recall_read_when_writeable) {
-	if (!FD_ISSET(m->fd, wfds)) {
+	if (!m->flags.writeable) {
 	    log_debug2(ZONE, LOGT_IO, "socket %i waits to become writeable again for being able to read ...", m->fd);
 	    return;
 	}
@@ -921,7 +1415,7 @@ static void _mio_loop_process_a_socket(mio m, int *maxfd, fd_set *rfds, fd_set *
 	return;
     }
     if (m->flags.recall_read_when_readable) {
-	if (!FD_ISSET(m->fd, rfds)) {
+	if (!m->flags.readable) {
 	    log_debug2(ZONE, LOGT_IO, "socket %i waits to become readable again ...", m->fd);
 	    return;
 	}
@@ -931,7 +1425,7 @@ static void _mio_loop_process_a_socket(mio m, int *maxfd, fd_set *rfds, fd_set *
 	return;
     }
     if (m->flags.recall_handshake_when_writeable) {
-	if (!FD_ISSET(m->fd, wfds)) {
+	if (!m->flags.writeable) {
 	    log_debug2(ZONE, LOGT_IO, "socket %i waits to become writeable again for being able to handshake ...", m->fd);
 	    return;
 	}
@@ -941,7 +1435,7 @@ static void _mio_loop_process_a_socket(mio m, int *maxfd, fd_set *rfds, fd_set *
 	return;
     }
     if (m->flags.recall_handshake_when_readable) {
-	if (!FD_ISSET(m->fd, rfds)) {
+	if (!m->flags.readable) {
 	    log_debug2(ZONE, LOGT_IO, "socket %i waits to become readable again for being able to handshake ...", m->fd);
 	    return;
 	}
@@ -954,7 +1448,7 @@ static void _mio_loop_process_a_socket(mio m, int *maxfd, fd_set *rfds, fd_set *
     /* no outstanding recalls */
 
     /* anything to read? */
-    if (FD_ISSET(m->fd, rfds)) {
+    if (m->flags.readable && m->k.val > 0) {
 	log_debug2(ZONE, LOGT_IO, "Trying to read on socket %i", m->fd);
 	_mio_read_from_socket(m);
     }
@@ -965,7 +1459,7 @@ static void _mio_loop_process_a_socket(mio m, int *maxfd, fd_set *rfds, fd_set *
     }
 
     /* try to write */
-    if (FD_ISSET(m->fd, wfds)) {
+    if (m->flags.writeable && m->queue != NULL) {
 	int write_return = 0;
 	write_return = _mio_write_dump(m);
 
@@ -975,31 +1469,58 @@ static void _mio_loop_process_a_socket(mio m, int *maxfd, fd_set *rfds, fd_set *
     }
 }
 
+/**
+ * check if processing a socket again could make progress
+ *
+ * A recall flag being set means, that the last operation got EAGAIN in the given direction,
+ * therefore the readiness we got reported for this direction has been consumed. This mirrors
+ * the order in which _mio_loop_process_a_socket() checks the flags.
+ *
+ * @param m the socket to check
+ * @return 1 if the socket should be processed again, 0 if we have to wait for a new event
+ */
+static int _mio_needs_processing(mio m) {
+    /* the readiness in the direction we are waiting for has been consumed */
+    if (m->flags.recall_read_when_readable || m->flags.recall_write_when_readable || m->flags.recall_handshake_when_readable)
+	m->flags.readable = 0;
+    if (m->flags.recall_read_when_writeable || m->flags.recall_write_when_writeable || m->flags.recall_handshake_when_writeable)
+	m->flags.writeable = 0;
+
+    if (m->state == state_CLOSE)
+	return 1;
+    if (m->type == type_LISTEN)
+	return m->flags.readable ? 1 : 0;
+
+    if (m->flags.recall_write_when_writeable)
+	return m->flags.writeable ? 1 : 0;
+    if (m->flags.recall_write_when_readable)
+	return m->flags.readable ? 1 : 0;
+    if (m->flags.recall_read_when_writeable)
+	return m->flags.writeable ? 1 : 0;
+    if (m->flags.recall_read_when_readable)
+	return m->flags.readable ? 1 : 0;
+    if (m->flags.recall_handshake_when_writeable)
+	return m->flags.writeable ? 1 : 0;
+    if (m->flags.recall_handshake_when_readable)
+	return m->flags.readable ? 1 : 0;
+
+    return (m->flags.readable && m->k.val > 0) || (m->flags.writeable && m->queue != NULL);
+}
+
 /** 
- * main select loop thread 
+ * main loop thread 
+ *
+ * Waits for events using the configured readiness backend, and processes only the sockets,
+ * that have been put on the ready__list.
  *
  * @param arg unused/ignored
  */
 static void* _mio_main(void *arg) {
-    fd_set      wfds;       /* fd set containing fds that should be checked for/had a write event */
-    fd_set      rfds;       /* fd set containing fds that should be checked for/had a write event */
-    mio         cur = NULL,
-		next = NULL;
-    char        buf[8192]; /* max socket read buffer      */
-    int         retval,
-                maxfd=0;
-    static xht	namespaces = NULL;
-
-    if (namespaces == NULL) {
-	namespaces = xhash_new(3);
-	xhash_put(namespaces, "", const_cast<char*>(NS_JABBERD_CONFIGFILE));
-    }
+    mio         cur = NULL;
+    int         to_process = 0;
 
     log_debug2(ZONE, LOGT_INIT, "MIO is starting up");
 
-    /* init the socket junk */
-    maxfd = mio__data->zzz[0];
-
     /* loop forever -- will only exit when mio__data->master__list is NULL and mio__data->shutdown is 1*/
     while (1) {
         log_debug2(ZONE, LOGT_EXECFLOW, "mio while loop top");
@@ -1008,55 +1529,58 @@ static void* _mio_main(void *arg) {
         if (mio__data->shutdown == 1 && mio__data->master__list == NULL)
             break;
 
-	/* init the sockets we want to check */
-	FD_ZERO(&wfds);
-	FD_ZERO(&rfds);
-        for (cur = mio__data->master__list; cur != NULL; cur = cur->next) {
-	    /* check if we want to get write events for this socket */
-            if (cur->queue != NULL || cur->flags.recall_write_when_writeable || cur->flags.recall_read_when_writeable || cur->flags.recall_handshake_when_writeable)
-		FD_SET(cur->fd, &wfds);
-
-	    /* check if we want to get read events for this socket */
-	    if (cur->k.val > 0 || cur->flags.recall_write_when_readable || cur->flags.recall_read_when_readable || cur->flags.recall_handshake_when_readable)
-		FD_SET(cur->fd, &rfds);
-	}
-
-        /* wait for a socket event */
-        FD_SET(mio__data->zzz[0],&rfds); /* include our wakeup socket */
-        retval = pth_select(maxfd+1, &rfds, &wfds, NULL, NULL);
-        /* if retval is -1, fd sets are undefined across all platforms */
+	/* wait for socket events, but only poll if there are still sockets to process */
+	(*mio__data->backend->wait)(mio__data->ready__list == NULL);
 
         log_debug2(ZONE, LOGT_EXECFLOW, "mio while loop, working");
 
-        /* reset maxfd, in case it changes (more updates in _mio_loop_process_a_socket() is it's updated when pth_select is called again) */
-        maxfd=mio__data->zzz[0];
+	/* process the sockets, that are ready - sockets getting ready while we process are handled in the next round */
+	for (to_process = mio__data->ready__count; to_process > 0 && mio__data->ready__list != NULL; to_process--) {
+	    cur = mio__data->ready__list;
+	    _mio_unmark_ready(cur);
 
-        /* check our zzz */
-        if (FD_ISSET(mio__data->zzz[0],&rfds)) {
-	    log_debug2(ZONE, LOGT_EXECFLOW, "got a notify on zzz");
-            pth_read(mio__data->zzz[0], buf, sizeof(buf));
-	    mio__data->zzz_active = 0;
-        }
-
-        /* loop through the sockets, check for stuff to do */
-        for (cur = mio__data->master__list; cur != NULL; cur = next) {
-	    next = cur->next;		/* a mio might get deleted inside _mio_loop_process_a_socket() so that we cannot access cur afterwards! */
 	    /* if the mio socket is not closed, process it */
 	    if (cur->state != state_CLOSE) {
-		_mio_loop_process_a_socket(cur, &maxfd, &rfds, &wfds, retval);
+		_mio_loop_process_a_socket(cur);
 	    }
+
 	    /* if the mio socket is closed, close it on the socket layer */
 	    if (cur->state == state_CLOSE) {
 		_mio_close(cur);
+		continue;
+	    }
+
+	    /* something left, that can be done without waiting for a new event? */
+	    if (_mio_needs_processing(cur)) {
+		_mio_mark_ready(cur);
 	    }
 	}
     }
+
+    return NULL;
 }
 
 /***************************************************\
 *      E X T E R N A L   F U N C T I O N S          *
 \***************************************************/
 
+/**
+ * block the calling thread until a file descriptor, that is not managed by MIO, is ready
+ *
+ * The wait is done using the readiness backend of MIO, so that file descriptors above
+ * FD_SETSIZE can be waited for if the backend supports this.
+ *
+ * @param fd the file descriptor to wait for
+ * @param writeable 0 to wait until fd is readable, else to wait until it is writeable
+ * @param ev additional pth event, that stops waiting (e.g. a timeout or signal), may be NULL
+ * @return 0 if fd is ready, 1 if ev occurred, -1 on error (errno is set)
+ */
+int mio_wait_fd(int fd, int writeable, pth_event_t ev) {
+    if (mio__data == NULL)
+	return _mio_select_wait_fd(fd, writeable, ev);
+    return (*mio__data->backend->wait_fd)(fd, writeable, ev);
+}
+
 /**
  * Initialize manged I/O handling
  *
@@ -1094,8 +1618,12 @@ void mio_init(void) {
         mio__data    = static_cast<ios>(pmalloco(p, sizeof(_ios)));
         mio__data->p = p;
         mio__data->k = karma_new(p);
+        mio__data->backend_fd = -1;
         pipe(mio__data->zzz);
 
+	/* initialize the readiness backend */
+	_mio_backend_init(xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(io, "backend", namespaces), 0)));
+
         /* start main accept/read/write thread */
         attr = pth_attr_new();
         pth_attr_set(attr,PTH_ATTR_JOINABLE,FALSE);
@@ -1114,6 +1642,9 @@ void mio_init(void) {
     mio__data->webserver_path = pstrdup(mio__data->p, xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(io, "mini-webserver", namespaces), 0)));
     mio__data->flash_policy = pstrdup(mio__data->p, xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(io, "flash-policy", namespaces), 0)));
 
+    // only parse the envelope of stanzas on connections that request it?
+    mio__data->envelope = xmlnode_get_first_tag(io, "envelope", namespaces) != NULL ? 1 : 0;
+
     if (karma != NULL) {
         mio__data->k->val	  = j_atoi(xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(karma, "init", namespaces), 0)), KARMA_INIT);
         mio__data->k->max         = j_atoi(xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(karma, "max", namespaces), 0)), KARMA_MAX);
@@ -1156,6 +1687,8 @@ void mio_stop(void) {
     /* signal the loop to end */
     pth_abort(mio__data->t);
 
+    (*mio__data->backend->stop)();
+
     pool_free(mio__data->p);
     mio__data = NULL;
 }
@@ -1247,6 +1780,7 @@ void mio_close(mio m) {
         return;
 
     m->state = state_CLOSE;
+    _mio_mark_ready(m);
     if (mio__data != NULL) {
 	log_debug2(ZONE, LOGT_EXECFLOW, "sending zzz notify to the select loop in mio_close()");
 	/* there needs to be only one pending signal */
@@ -1341,6 +1875,7 @@ void mio_write(mio m, xmlnode stanza, char const* buffer, int len) {
 
     log_debug2(ZONE, LOGT_IO, "mio_write called on stanza: %X buffer: %.*s", stanza, len, buffer);
     /* notify the select loop that a packet needs writing */
+    _mio_mark_ready(m);
     if (mio__data != NULL) {
 	log_debug2(ZONE, LOGT_EXECFLOW, "sending zzz notify to the select loop in mio_write()");
 	/* there only needs to be one pending signal */
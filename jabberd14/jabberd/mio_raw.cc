@@ -63,13 +63,19 @@ void _mio_raw_parser(mio m, const void *buf, size_t bufsz) {
 ssize_t _mio_raw_read(mio m, void *buf, size_t count) {
     ssize_t read_return = 0;
 
-    read_return = pth_read(m->fd, buf, count);
+    m->flags.recall_read_when_writeable = 0;
+
+    /* the socket is non-blocking, and pth_read() would reject file descriptors not below FD_SETSIZE */
+    do {
+	read_return = read(m->fd, buf, count);
+    } while (read_return == -1 && errno == EINTR);
 
     if (read_return > 0) {
 	return read_return;
     }
 
-    if (read_return == -1 && (errno == EINTR || errno == EAGAIN)) {
+    /* nothing to read for now: only returned on EAGAIN, as the caller waits for the next readiness event then */
+    if (read_return == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
 	return 0;
     }
 
@@ -89,13 +95,16 @@ ssize_t _mio_raw_read(mio m, void *buf, size_t count) {
 ssize_t _mio_raw_write(mio m, void *buf, size_t count) {
     ssize_t write_return = 0;
 
-    write_return = pth_write(m->fd, buf, count);
+    /* the socket is non-blocking, and pth_write() would reject file descriptors not below FD_SETSIZE */
+    do {
+	write_return = write(m->fd, buf, count);
+    } while (write_return == -1 && errno == EINTR);
 
     if (write_return > 0) {
 	return write_return;
     }
 
-    if (write_return == -1 && (errno == EINTR || errno == EAGAIN)) {
+    if (write_return == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
 	return 0;
     }
 
@@ -1077,8 +1077,10 @@ ssize_t _mio_ssl_read(mio m, void *buf, size_t count) {
     m->flags.recall_read_when_readable = 0;
     m->flags.recall_read_when_writeable = 0;
 
-    /* trying to read */
-    read_return = gnutls_record_recv(static_cast<gnutls_session_t>(m->ssl), (char*)buf, count);
+    /* trying to read (an interrupted read has to be repeated, the caller only gets 0 if the socket would block) */
+    do {
+	read_return = gnutls_record_recv(static_cast<gnutls_session_t>(m->ssl), (char*)buf, count);
+    } while (read_return == GNUTLS_E_INTERRUPTED);
 
     if (read_return > 0) {
 	log_debug2(ZONE, LOGT_IO, "Read %i B on socket %i", read_return, m->fd);
@@ -1127,8 +1129,10 @@ ssize_t _mio_ssl_write(mio m, const void *buf, size_t count) {
     m->flags.recall_write_when_readable = 0;
     m->flags.recall_write_when_writeable = 0;
 
-    /* trying to write data */
-    write_return = gnutls_record_send(static_cast<gnutls_session_t>(m->ssl), buf, count);
+    /* trying to write data (an interrupted write has to be repeated) */
+    do {
+	write_return = gnutls_record_send(static_cast<gnutls_session_t>(m->ssl), buf, count);
+    } while (write_return == GNUTLS_E_INTERRUPTED);
 
     if (write_return > 0) {
 	log_debug2(ZONE, LOGT_IO, "Wrote %i B on socket %i", write_return, m->fd);
@@ -45,6 +45,48 @@
 /* defined in mio.c */
 extern ios mio__data;
 
+/**
+ * forget received data, that is not needed anymore to get the unparsed content of stanzas
+ *
+ * @param envelope the envelope parsing state of the connection
+ * @param index stream byte index of the first byte, that has to be kept
+ */
+static void _mio_envelope_consume(mio_envelope_st* envelope, XML_Index index) {
+    if (index <= envelope->input_start)
+	return;
+
+    std::string::size_type consumed = index - envelope->input_start;
+    envelope->input.erase(0, consumed < envelope->input.length() ? consumed : envelope->input.length());
+    envelope->input_start = index;
+}
+
+/**
+ * check if an (expanded) element or attribute name can be kept in unparsed content
+ *
+ * This is the case if the namespace IRI is not bound to a prefix on the stream root element, as the unparsed
+ * content has to be parsed again without the declarations of the stream root element.
+ *
+ * @param m the mio
+ * @param name the name as passed by expat
+ * @return true if the name does not depend on prefixes declared on the stream root element
+ */
+static bool _mio_envelope_self_contained(mio m, char const* name) {
+    char const* separator = name ? std::strchr(name, XMLNS_SEPARATOR) : NULL;
+
+    // expat could not expand the name, we have to parse it now to guess the namespace
+    if (separator == NULL)
+	return name == NULL || std::strchr(name, ':') == NULL;
+
+    if (m->in_root == NULL)
+	return true;
+
+    try {
+	return j_strcmp(m->in_root->get_nsprefix(std::string(name, separator - name), false), "xml") == 0;
+    } catch (std::invalid_argument const&) {
+	return true;
+    }
+}
+
 /**
  * internal expat callback for start tags
  *
@@ -57,6 +99,19 @@ static void _mio_xstream_startElement(void* _m, const char* name, const char** a
     std::string prefix;
     std::string ns_iri;
     std::string local_name;
+
+    // content of a stanza, that is kept unparsed: just check that it can be parsed again on its own
+    if (m->envelope != NULL && m->envelope->depth > 0) {
+	m->envelope->depth++;
+	if (m->envelope->self_contained) {
+	    m->envelope->self_contained = _mio_envelope_self_contained(m, name);
+	    for (int i = 0; m->envelope->self_contained && attribs != NULL && attribs[i] != NULL; i += 2) {
+		m->envelope->self_contained = _mio_envelope_self_contained(m, attribs[i]);
+	    }
+	}
+	return;
+    }
+
     std::string qname(name ? name : "");
 
     // create a new list of declated namespaces if necessary
@@ -145,6 +200,17 @@ static void _mio_xstream_startElement(void* _m, const char* name, const char** a
 		xmlnode_free(m->stacknode);
 	    m->stacknode = NULL;
 	    m->flags.root = 1;
+	} else if (m->envelope != NULL) {
+	    _mio_envelope_consume(m->envelope, XML_GetCurrentByteIndex(m->parser));
+
+	    // keep the content unparsed, if its default namespace is the namespace of the stanza and it declares no prefixes on the
+	    // stanza element (NS_STREAM and NS_DIALBACK get serialized with a prefix, and are no routed stanzas anyway)
+	    if (!m->envelope->prefix_declared && m->in_stanza->check_prefix("", ns_iri) && ns_iri != NS_STREAM && ns_iri != NS_DIALBACK) {
+		m->envelope->depth = 1;
+		m->envelope->self_contained = true;
+		m->envelope->content_start = XML_GetCurrentByteIndex(m->parser) + XML_GetCurrentByteCount(m->parser);
+	    }
+	    m->envelope->prefix_declared = false;
 	}
     } else {
 	m->stacknode = xmlnode_insert_tag_ns(m->stacknode, local_name.c_str(), prefix == "" ? NULL : prefix.c_str(), ns_iri.c_str());
@@ -161,6 +227,30 @@ static void _mio_xstream_startElement(void* _m, const char* name, const char** a
 static void _mio_xstream_endElement(void* _m, const char* name) {
     mio m = static_cast<mio>(_m);
 
+    // end of content, that is kept unparsed?
+    if (m->envelope != NULL && m->envelope->depth > 0) {
+	if (--m->envelope->depth > 0)
+	    return;
+
+	// end tag of the stanza: pass the content we skipped to the stanza
+	mio_envelope_st* envelope = m->envelope;
+	XML_Index content_end = XML_GetCurrentByteIndex(m->parser);
+	if (content_end > envelope->content_start && envelope->content_start >= envelope->input_start && content_end - envelope->input_start <= static_cast<XML_Index>(envelope->input.length())) {
+	    char const* content = envelope->input.data() + (envelope->content_start - envelope->input_start);
+	    int content_len = content_end - envelope->content_start;
+
+	    if (envelope->self_contained) {
+		xmlnode_put_unparsed(m->stacknode, content, content_len);
+	    } else {
+		// the content uses prefixes of the stream root, parse it now with the declarations in scope
+		xmlnode_insert_xml(m->stacknode, content, content_len, *m->in_stanza);
+	    }
+	} else if (content_end > envelope->content_start) {
+	    log_warn(m->our_ip, "lost content of a stanza: received data not available anymore");
+	}
+	_mio_envelope_consume(envelope, content_end + XML_GetCurrentByteCount(m->parser));
+    }
+
     /* If the stacknode is already NULL, then this closing element
        must be the closing ROOT tag, so notify and exit */
     if (m->stacknode == NULL) {
@@ -209,6 +299,10 @@ static void _mio_xstream_endElement(void* _m, const char* name) {
 void _mio_xstream_CDATA(void* _m, const char* cdata, int len) {
     mio m = static_cast<mio>(_m);
 
+    // content of a stanza, that is kept unparsed?
+    if (m->envelope != NULL && m->envelope->depth > 0)
+	return;
+
     if (m->stacknode != NULL)
 	    xmlnode_insert_cdata(m->stacknode, cdata, len);
 }
@@ -232,6 +326,10 @@ static void _mio_xstream_startNamespaceDecl(void *arg, const XML_Char *prefix, c
 
     /* store the new prefix in the list */
     m->in_stanza->update(prefix ? prefix : "", iri ? iri : "");
+
+    /* prefixes declared on the stanza element cannot be used in content, that is kept unparsed */
+    if (prefix != NULL && m->envelope != NULL && m->envelope->depth == 0 && m->stacknode == NULL && m->flags.root)
+	m->envelope->prefix_declared = true;
 }
 
 /**
@@ -285,6 +383,59 @@ void _mio_xstream_cleanup(void* arg) {
 	delete m->out_ns;
 	m->out_ns = NULL;
     }
+
+    // a new stream starts a new byte index (envelope parsing stays enabled after STARTTLS)
+    if (m->envelope) {
+	m->envelope->input.erase();
+	m->envelope->input_start = 0;
+	m->envelope->depth = 0;
+	m->envelope->prefix_declared = false;
+    }
+}
+
+/**
+ * destructor for the envelope parsing state of a mio
+ *
+ * @param arg the mio
+ */
+static void _mio_envelope_free(void* arg) {
+    mio m = static_cast<mio>(arg);
+
+    delete m->envelope;
+    m->envelope = NULL;
+}
+
+/**
+ * only parse the envelope of stanzas received on a connection
+ *
+ * The element of a stanza is parsed as before (so that its attributes are available), but its content is kept
+ * unparsed (see xmlnode_put_unparsed()) and only parsed when it is accessed. Stanzas that are only routed
+ * are forwarded with their content as it has been received. This has no effect, if envelope parsing
+ * has not been enabled in the io section of the configuration.
+ *
+ * Has to be called while the stream root element is processed (i.e. from the callback getting MIO_XML_ROOT).
+ *
+ * @param m the connection
+ */
+void mio_xml_envelope(mio m) {
+    char const* context = NULL;
+    int offset = 0;
+    int size = 0;
+
+    if (m == NULL || m->envelope != NULL || !mio__data || !mio__data->envelope)
+	return;
+
+    /* we are called while expat parses the stream root: the rest of the data passed to expat is not appended by _mio_xml_parser() anymore */
+    context = m->parser != NULL ? XML_GetInputContext(m->parser, &offset, &size) : NULL;
+    if (context == NULL || XML_GetCurrentByteIndex(m->parser) < 0) {
+	log_debug2(ZONE, LOGT_XML, "cannot access the data parsed by expat, not using envelope parsing");
+	return;
+    }
+
+    m->envelope = new mio_envelope_st();
+    m->envelope->input.assign(context + offset, size - offset);
+    m->envelope->input_start = XML_GetCurrentByteIndex(m->parser);
+    pool_cleanup(m->p, _mio_envelope_free, m);
 }
 
 /**
@@ -517,6 +668,11 @@ void _mio_xml_parser(mio m, const void *vbuf, size_t bufsz) {
             bufsz--;
         }
 
+    /* keep the received data, we might need it as the unparsed content of a stanza */
+    mio_envelope_st* envelope = m->envelope;
+    if (envelope != NULL)
+	envelope->input.append(buf, bufsz);
+
     if (XML_Parse(m->parser, buf, bufsz, 0) == 0) {
 	log_debug2(ZONE, LOGT_XML, "[%s] XML Parsing Error: %s", ZONE, XML_ErrorString(XML_GetErrorCode(m->parser)));
         if (m->cb != NULL) {
@@ -524,6 +680,10 @@ void _mio_xml_parser(mio m, const void *vbuf, size_t bufsz) {
             mio_write(m, NULL, "<stream:error><invalid-xml xmlns='urn:ietf:params:xml:ns:xmpp-streams'/><text xmlns='urn:ietf:params:xml:ns:xmpp-streams' xml:lang='en'>Invalid XML</text></stream:error>", -1);
             mio_close(m);
         }
+    } else if (envelope != NULL && m->envelope == envelope && envelope->depth == 0) {
+	/* not inside a stanza, that is kept unparsed: we only need what starts with the last (incomplete) tag */
+	std::string::size_type last_tag = envelope->input.rfind('<');
+	_mio_envelope_consume(envelope, envelope->input_start + (last_tag == std::string::npos ? envelope->input.length() : last_tag));
     }
 }
 
@@ -35,6 +35,520 @@
 
 #include "jabberd.h"
 
+/**
+ * number of seconds a result of xdb_prefetch() is kept for the query it has been fetched for
+ */
+#define XDB_PREFETCH_TTL 30
+
+namespace xmppd {
+
+    /**
+     * one entry in the ::xmppd::xdb_lru cache
+     */
+    struct xdb_lru_entry {
+	std::string key;	/**< namespace and owner of the entry, as built by xdb_lru::make_key() */
+	std::string ns;		/**< namespace of the cached data */
+	std::string owner;	/**< full JID of the owner of the cached data */
+	xmlnode data;		/**< cached data (own pool), NULL if the xdb returned no data */
+	bool dirty;		/**< data has been set locally but not been written to the xdb yet */
+	unsigned long version;	/**< incremented each time data is updated locally */
+	int failures;		/**< number of failed attempts to write the entry since it has been written the last time */
+    };
+
+    /**
+     * size-bounded LRU cache of xdb results keyed by owner and namespace
+     *
+     * The cache is only accessed from pth threads and never blocks while modifying its
+     * structures, therefore it does not need any locking.
+     */
+    class xdb_lru {
+	public:
+	    xdb_lru(int max_entries, int writebehind);
+	    ~xdb_lru();
+
+	    static std::string make_key(jid owner, char const* ns);
+
+	    bool caches(char const* ns) const;
+	    void add_ns(char const* ns);
+
+	    xdb_lru_entry* lookup(std::string const& key);
+	    void store(jid owner, char const* ns, std::string const& key, xmlnode data, bool dirty);
+	    void invalidate(std::string const& key);
+	    xdb_lru_entry* next_dirty();
+	    void mark_clean(std::string const& key, unsigned long version);
+	    bool write_failed(std::string const& key, int max_failures);
+	    int size() const { return index.size(); }
+
+	    int max_entries;	/**< maximum number of clean entries kept in the cache */
+	    int writebehind;	/**< interval in seconds dirty entries get flushed, 0 for write-through */
+	    bool flushing;	/**< a flush thread is currently running */
+	    pool flush_pool;	/**< memory pool of the currently running flush thread */
+	    unsigned long writes;	/**< incremented on each local modification, used to detect races with running queries */
+	    unsigned long hits;	/**< number of gets served from the cache */
+	    unsigned long misses;	/**< number of gets that had to query the xdb */
+	    unsigned long evictions;	/**< number of entries dropped to keep the cache in its size limit */
+	    unsigned long coalesced;	/**< number of sets that replaced data that had not been written yet */
+	    time_t last_report;	/**< when the counters have been logged the last time */
+
+	private:
+	    void release(std::list<xdb_lru_entry>::iterator entry);
+	    void trim();
+
+	    std::set<std::string> namespaces;	/**< the namespaces that are cached */
+	    std::list<xdb_lru_entry> entries;	/**< the cached entries, most recently used first */
+	    std::map<std::string, std::list<xdb_lru_entry>::iterator> index;	/**< key to entry mapping */
+    };
+
+    xdb_lru::xdb_lru(int max_entries, int writebehind) :
+	max_entries(max_entries), writebehind(writebehind), flushing(false), flush_pool(NULL), writes(0),
+	hits(0), misses(0), evictions(0), coalesced(0), last_report(time(NULL)) {
+    }
+
+    xdb_lru::~xdb_lru() {
+	while (!entries.empty())
+	    release(entries.begin());
+    }
+
+    /**
+     * build the key an entry is stored with in the cache
+     *
+     * @param owner owner of the data
+     * @param ns namespace of the data
+     * @return key for the entry
+     */
+    std::string xdb_lru::make_key(jid owner, char const* ns) {
+	std::string key(ns);
+	key += ' ';
+	key += jid_full(owner);
+	return key;
+    }
+
+    /**
+     * check if data in a namespace gets cached
+     *
+     * @param ns the namespace to check
+     * @return true if the namespace gets cached
+     */
+    bool xdb_lru::caches(char const* ns) const {
+	return ns != NULL && namespaces.find(ns) != namespaces.end();
+    }
+
+    void xdb_lru::add_ns(char const* ns) {
+	namespaces.insert(ns);
+    }
+
+    /**
+     * find an entry in the cache and mark it as most recently used
+     *
+     * @param key the key of the entry
+     * @return the entry, NULL if not cached
+     */
+    xdb_lru_entry* xdb_lru::lookup(std::string const& key) {
+	std::map<std::string, std::list<xdb_lru_entry>::iterator>::iterator i = index.find(key);
+	if (i == index.end())
+	    return NULL;
+
+	entries.splice(entries.begin(), entries, i->second);
+	return &*(i->second);
+    }
+
+    /**
+     * put data into the cache, replacing a previous entry with the same key
+     *
+     * @param owner owner of the data
+     * @param ns namespace of the data
+     * @param key the key of the entry (as returned by make_key())
+     * @param data the data to cache (the cache keeps a copy), NULL to cache the absence of data
+     * @param dirty true if the data has not been written to the xdb yet
+     */
+    void xdb_lru::store(jid owner, char const* ns, std::string const& key, xmlnode data, bool dirty) {
+	xdb_lru_entry* entry = lookup(key);
+
+	if (entry == NULL) {
+	    entries.push_front(xdb_lru_entry());
+	    entry = &entries.front();
+	    entry->key = key;
+	    entry->ns = ns;
+	    entry->owner = jid_full(owner);
+	    entry->data = NULL;
+	    entry->dirty = false;
+	    entry->version = 0;
+	    entry->failures = 0;
+	    index[key] = entries.begin();
+	} else {
+	    if (entry->dirty && dirty)
+		coalesced++;
+	    xmlnode_free(entry->data);
+	}
+
+	entry->data = data == NULL ? NULL : xmlnode_dup(data);
+	entry->dirty = entry->dirty || dirty;
+	entry->version++;
+
+	trim();
+    }
+
+    /**
+     * remove an entry from the cache (if it is cached)
+     *
+     * Entries with changes, that have not been written yet, are kept: they are the only copy of
+     * these changes, and as they replace the complete data they are newer than the xdb content.
+     *
+     * @param key the key of the entry
+     */
+    void xdb_lru::invalidate(std::string const& key) {
+	std::map<std::string, std::list<xdb_lru_entry>::iterator>::iterator i = index.find(key);
+	if (i == index.end() || i->second->dirty)
+	    return;
+	release(i->second);
+    }
+
+    /**
+     * get the least recently used entry that still has to be written
+     *
+     * @return the entry, NULL if there are no dirty entries
+     */
+    xdb_lru_entry* xdb_lru::next_dirty() {
+	for (std::list<xdb_lru_entry>::reverse_iterator i = entries.rbegin(); i != entries.rend(); ++i) {
+	    if (i->dirty)
+		return &*i;
+	}
+	return NULL;
+    }
+
+    /**
+     * flag an entry as written to the xdb, if it has not been modified since
+     *
+     * @param key the key of the entry
+     * @param version the version of the entry that has been written
+     */
+    void xdb_lru::mark_clean(std::string const& key, unsigned long version) {
+	std::map<std::string, std::list<xdb_lru_entry>::iterator>::iterator i = index.find(key);
+	if (i == index.end())
+	    return;
+	i->second->failures = 0;
+	if (i->second->version != version)
+	    return;
+	i->second->dirty = false;
+	trim();
+    }
+
+    /**
+     * count a failed attempt to write an entry, drop the entry if it failed too often
+     *
+     * @param key the key of the entry
+     * @param max_failures number of failed attempts after which the entry is dropped, 0 to keep it
+     * @return true if the entry has been dropped (its changes are lost)
+     */
+    bool xdb_lru::write_failed(std::string const& key, int max_failures) {
+	std::map<std::string, std::list<xdb_lru_entry>::iterator>::iterator i = index.find(key);
+	if (i == index.end())
+	    return false;
+	if (++i->second->failures < max_failures || max_failures <= 0)
+	    return false;
+	release(i->second);
+	return true;
+    }
+
+    void xdb_lru::release(std::list<xdb_lru_entry>::iterator entry) {
+	xmlnode_free(entry->data);
+	index.erase(entry->key);
+	entries.erase(entry);
+    }
+
+    /**
+     * drop the least recently used clean entries until the cache is in its size limit
+     *
+     * Dirty entries are never dropped, they stay in the cache until they got flushed.
+     */
+    void xdb_lru::trim() {
+	std::list<xdb_lru_entry>::iterator i = entries.end();
+	int size = index.size();
+
+	while (size > max_entries && i != entries.begin()) {
+	    --i;
+	    if (i->dirty)
+		continue;
+	    release(i++);
+	    size--;
+	    evictions++;
+	}
+    }
+
+    /**
+     * the requests of an xdbcache, that are waiting for their result
+     *
+     * Requests are indexed by their id and scheduled on a hierarchical timer wheel for
+     * resending and expiry: 64 slots of one second and 64 slots of 64 seconds. Requests
+     * in the second level are cascaded to the first level when their slot is reached.
+     * Inside a slot the requests are linked using their prev and next pointers.
+     */
+    class xdb_requests {
+	public:
+	    xdb_requests(int resend, int timeout);
+
+	    void add(xdbcache r);
+	    xdbcache remove(int id);
+	    void reschedule(xdbcache r, int now);
+	    void advance(int now, std::vector<xdbcache>& due);
+
+	    int resend;		/**< seconds after which an unanswered request is sent again, 0 to never resend */
+	    int timeout;	/**< seconds after which an unanswered request fails */
+
+	private:
+	    static int const slots = 64;	/**< number of slots per level of the timer wheel */
+
+	    void link(xdbcache r);
+	    void unlink(xdbcache r);
+	    void fire_slot(int slot, std::vector<xdbcache>* due);
+
+#ifdef HAS_TR1_UNORDERED_MAP
+	    std::tr1::unordered_map<int, xdbcache> by_id;	/**< pending requests by id */
+#else
+	    std::map<int, xdbcache> by_id;	/**< pending requests by id */
+#endif
+	    xdbcache wheel[2*slots];	/**< first the slots of the seconds level, then the slots of the second level */
+	    int current;		/**< the last second the timer wheel has been advanced to */
+    };
+
+    xdb_requests::xdb_requests(int resend, int timeout) : resend(resend), timeout(timeout), current(time(NULL)) {
+	for (int n = 0; n < 2*slots; n++)
+	    wheel[n] = NULL;
+    }
+
+    /**
+     * add a request, that has just been sent
+     *
+     * @param r the request, id and sent have to be set
+     */
+    void xdb_requests::add(xdbcache r) {
+	by_id[r->id] = r;
+	r->slot = -1;
+	reschedule(r, r->sent);
+    }
+
+    /**
+     * remove a request by its id
+     *
+     * @param id the id of the request
+     * @return the request, NULL if there is no pending request with this id
+     */
+    xdbcache xdb_requests::remove(int id) {
+#ifdef HAS_TR1_UNORDERED_MAP
+	std::tr1::unordered_map<int, xdbcache>::iterator i = by_id.find(id);
+#else
+	std::map<int, xdbcache>::iterator i = by_id.find(id);
+#endif
+	xdbcache r = NULL;
+
+	if (i == by_id.end())
+	    return NULL;
+
+	r = i->second;
+	by_id.erase(i);
+	unlink(r);
+	return r;
+    }
+
+    /**
+     * schedule the next resend or the expiry of a request
+     *
+     * @param r the request
+     * @param now the time the request has been sent the last time
+     */
+    void xdb_requests::reschedule(xdbcache r, int now) {
+	unlink(r);
+	r->due = r->sent + timeout;
+	if (resend > 0 && now + resend < r->due)
+	    r->due = now + resend;
+	link(r);
+    }
+
+    /**
+     * advance the timer wheel
+     *
+     * @param now the current time
+     * @param due gets the requests, that have to be resent or expired (they are not scheduled anymore)
+     */
+    void xdb_requests::advance(int now, std::vector<xdbcache>& due) {
+	/* after a long pause, each slot has to be visited only once */
+	if (now - current > slots*slots)
+	    current = now - slots*slots;
+
+	while (current < now) {
+	    current++;
+
+	    /* entering a new block of the seconds level: cascade the second level slot */
+	    if (current % slots == 0)
+		fire_slot(slots + (current / slots) % slots, &due);
+
+	    fire_slot(current % slots, &due);
+	}
+    }
+
+    /**
+     * take all requests out of a slot, requests that are due are returned, the others are linked again
+     */
+    void xdb_requests::fire_slot(int slot, std::vector<xdbcache>* due) {
+	xdbcache r = wheel[slot];
+	wheel[slot] = NULL;
+
+	while (r != NULL) {
+	    xdbcache next = r->next;
+
+	    r->slot = -1;
+	    if (r->due <= current)
+		due->push_back(r);
+	    else
+		link(r);
+	    r = next;
+	}
+    }
+
+    void xdb_requests::link(xdbcache r) {
+	int at = r->due <= current ? current + 1 : r->due;
+
+	if (at - current < slots)
+	    r->slot = at % slots;
+	else if (at - current < slots*slots)
+	    r->slot = slots + (at / slots) % slots;
+	else
+	    r->slot = slots + ((current + slots*slots - 1) / slots) % slots; /* gets rescheduled when the slot is reached */
+
+	r->prev = NULL;
+	r->next = wheel[r->slot];
+	if (r->next != NULL)
+	    r->next->prev = r;
+	wheel[r->slot] = r;
+    }
+
+    void xdb_requests::unlink(xdbcache r) {
+	if (r->slot < 0)
+	    return;
+
+	if (r->prev != NULL)
+	    r->prev->next = r->next;
+	else
+	    wheel[r->slot] = r->next;
+	if (r->next != NULL)
+	    r->next->prev = r->prev;
+	r->slot = -1;
+    }
+
+    /**
+     * results of xdb_prefetch(), each of them is used by a single xdb_get()
+     *
+     * Results are kept at most XDB_PREFETCH_TTL seconds and are dropped when the data is
+     * modified using the same xdbcache. Like the xdb_lru, this is only accessed from pth threads
+     * and never blocks, so it does not need any locking.
+     */
+    class xdb_prefetched {
+	public:
+	    xdb_prefetched() : writes(0) {}
+	    ~xdb_prefetched();
+
+	    void put(std::string const& key, xmlnode data, time_t now);
+	    bool take(std::string const& key, xmlnode& data, time_t now);
+	    void invalidate(std::string const& key);
+
+	    unsigned long writes;	/**< incremented on each modification, used to detect results outdated while they were queried */
+
+	private:
+	    /** a single prefetched result */
+	    struct entry {
+		std::string key;	/**< namespace and owner, as built by xdb_lru::make_key() */
+		xmlnode data;		/**< the result (own pool), NULL if the xdb returned no data */
+		time_t stored;		/**< when the result has been stored */
+	    };
+
+	    void release(std::list<entry>::iterator i);
+	    void expire(time_t now);
+
+	    std::list<entry> entries;	/**< the results, oldest first */
+	    std::map<std::string, std::list<entry>::iterator> index;	/**< key to result mapping */
+    };
+
+    xdb_prefetched::~xdb_prefetched() {
+	while (!entries.empty())
+	    release(entries.begin());
+    }
+
+    /**
+     * keep a result for the next query of the same data
+     *
+     * @param key the key of the data (as returned by xdb_lru::make_key())
+     * @param data the result, ownership is taken over
+     * @param now the current time
+     */
+    void xdb_prefetched::put(std::string const& key, xmlnode data, time_t now) {
+	std::map<std::string, std::list<entry>::iterator>::iterator i = index.find(key);
+
+	expire(now);
+	if (i != index.end())
+	    release(i->second);
+
+	entries.push_back(entry());
+	entries.back().key = key;
+	entries.back().data = data;
+	entries.back().stored = now;
+	index[key] = --entries.end();
+    }
+
+    /**
+     * get and remove a result
+     *
+     * @param key the key of the data
+     * @param data where to store the result (ownership is passed to the caller)
+     * @param now the current time
+     * @return true if there has been a result
+     */
+    bool xdb_prefetched::take(std::string const& key, xmlnode& data, time_t now) {
+	std::map<std::string, std::list<entry>::iterator>::iterator i;
+
+	expire(now);
+	i = index.find(key);
+	if (i == index.end())
+	    return false;
+
+	data = i->second->data;
+	i->second->data = NULL;
+	release(i->second);
+	return true;
+    }
+
+    /**
+     * drop a result, because the data is modified
+     *
+     * @param key the key of the data
+     */
+    void xdb_prefetched::invalidate(std::string const& key) {
+	std::map<std::string, std::list<entry>::iterator>::iterator i = index.find(key);
+
+	writes++;
+	if (i != index.end())
+	    release(i->second);
+    }
+
+    void xdb_prefetched::release(std::list<entry>::iterator i) {
+	xmlnode_free(i->data);
+	index.erase(i->key);
+	entries.erase(i);
+    }
+
+    /**
+     * drop the results, that have not been used in time
+     *
+     * @param now the current time
+     */
+    void xdb_prefetched::expire(time_t now) {
+	while (!entries.empty() && now - entries.front().stored >= XDB_PREFETCH_TTL)
+	    release(entries.begin());
+    }
+}
+
+
+static void _xdb_async_done(void *arg);
+
 /**
  * ::o_PRECOND packet handler that filters the packets incoming for the instance to look for xdb packets
  *
@@ -61,10 +575,10 @@ static result xdb_results(instance id, dpacket p, void *arg) {
     idnum = atoi(idstr);
 
     pth_mutex_acquire(&(xc->mutex), FALSE, NULL);
-    for(curx = xc->next; curx->id != idnum && curx != xc; curx = curx->next); /* spin till we are where we started or find our id# */
+    curx = xc->requests->remove(idnum);
 
     /* we got an id we didn't have cached, could be a dup, ignore and move on */
-    if(curx->id != idnum)
+    if(curx == NULL)
     {
         pool_free(p->p);
         pth_mutex_release(&(xc->mutex));
@@ -77,10 +591,15 @@ static result xdb_results(instance id, dpacket p, void *arg) {
     else
         curx->data = p->x;
 
-    /* remove from ring */
-    curx->prev->next = curx->next;
-    curx->next->prev = curx->prev;
-
+    /* asynchronous requests get their callback called in a different thread (or directly, if a blocked thread waits for it) */
+    if (curx->p != NULL) {
+	pth_mutex_release(&(xc->mutex));
+	if (curx->direct)
+	    _xdb_async_done(curx);
+	else
+	    mtq_send(NULL, curx->p, _xdb_async_done, (void*)curx);
+	return r_DONE;
+    }
 
     /* set the flag to not block, and signal */
     curx->preblock = 0;
@@ -135,65 +654,116 @@ static void xdb_deliver(instance i, xdbcache xc) {
 /**
  * beat handler for an xdbcache
  *
- * resends unresponded xdb queries after 10 seconds and removes unresponded xdb queries after 30 seconds.
+ * resends unresponded xdb queries and removes unresponded xdb queries when they timed out.
  *
  * @param arg the xdbcache this function is called for
  * @return always r_DONE
  */
 static result xdb_thump(void *arg) {
     xdbcache xc = (xdbcache)arg;
-    xdbcache cur, next;
+    std::vector<xdbcache> due;
+    std::vector<xdbcache> failed;
     int now = time(NULL);
 
     pth_mutex_acquire(&(xc->mutex), FALSE, NULL);
-    /* spin through the cache looking for stale requests */
-    cur = xc->next;
-    while (cur != xc) {
-        next = cur->next;
-
-        /* really old ones get wacked */
-        if ((now - cur->sent) > 30) {
-            /* remove from ring */
-            cur->prev->next = cur->next;
-            cur->next->prev = cur->prev;
-
-            /* make sure it's null as a flag for xdb_set's */
-            cur->data = NULL;
-
-            /* free the thread! */
-            if (cur->preblock) {
-                cur->preblock = 0;
-                pth_cond_notify(&(cur->cond), FALSE);
-            }
-
-            cur = next;
-            continue;
-        }
+    xc->requests->advance(now, due);
+
+    for (std::vector<xdbcache>::iterator i = due.begin(); i != due.end(); ++i) {
+	xdbcache cur = *i;
 
         /* resend the waiting ones every so often */
-        if ((now - cur->sent) > 10)
-            xdb_deliver(xc->i, cur);
+	if (now - cur->sent < xc->requests->timeout) {
+	    xdb_deliver(xc->i, cur);
+	    xc->requests->reschedule(cur, now);
+	    continue;
+	}
+
+	/* really old ones get wacked */
+	xc->requests->remove(cur->id);
 
-        /* cur could have been free'd already on it's thread */
-        cur = next;
+	/* make sure it's null as a flag for xdb_set's */
+	cur->data = NULL;
+
+	/* report the failure of asynchronous requests */
+	if (cur->p != NULL && cur->direct)
+	    failed.push_back(cur);
+	else if (cur->p != NULL)
+	    mtq_send(NULL, cur->p, _xdb_async_done, (void*)cur);
+
+	/* free the thread! */
+	if (cur->preblock) {
+	    cur->preblock = 0;
+	    pth_cond_notify(&(cur->cond), FALSE);
+	}
     }
 
     pth_mutex_release(&(xc->mutex));
+
+    /* requests, that a blocked thread waits for, are completed without the mutex */
+    for (std::vector<xdbcache>::iterator i = failed.begin(); i != failed.end(); ++i)
+	_xdb_async_done(*i);
+
     return r_DONE;
 }
 
+/**
+ * pool cleaner that deletes the table of pending requests of an xdbcache
+ *
+ * @param arg the ::xmppd::xdb_requests to delete
+ */
+static void _xdb_requests_free(void *arg) {
+    delete static_cast<xmppd::xdb_requests*>(arg);
+}
+
+/**
+ * handler for the &lt;xdbtimeout/&gt; configuration element
+ *
+ * The element is read by xdb_cache(), here it only gets validated.
+ *
+ * @param i the instance the element is read for
+ * @param x the configuration element
+ * @param arg unused/ignored
+ * @return r_PASS on the validation pass, r_DONE if the element is valid, r_ERR on error
+ */
+static result xdb_config_timeout(instance i, xmlnode x, void *arg) {
+    int resend = j_atoi(xmlnode_get_attrib_ns(x, "resend", NULL), 10);
+    int expire = j_atoi(xmlnode_get_attrib_ns(x, "expire", NULL), 30);
+
+    if (resend < 0 || expire <= 0) {
+	xmlnode_put_attrib_ns(x, "error", NULL, NULL, "'xdbtimeout' needs a positive 'expire' attribute and a non-negative 'resend' attribute");
+	return r_ERR;
+    }
+
+    return i == NULL ? r_PASS : r_DONE;
+}
+
+/**
+ * init the xdb interface
+ *
+ * register that we want to handle the &lt;xdbtimeout/&gt; element in the configuration
+ *
+ * @param p memory pool used to register the config handler
+ */
+void xdb_init(pool p) {
+    register_config(p, "xdbtimeout", xdb_config_timeout, NULL);
+}
+
 /**
  * create an xdbcache for the specified instance
  *
  * This creates the ::_xdbcache structure from the memory pool of the instance, and registers two handlers:
  * One handler is registered to get/handle the xdb responses that are delivered to the instance. The other
- * handler is registered to get called regularily every 10 seconds.
+ * handler is registered to get called every second to resend and expire requests.
+ *
+ * The timeouts for requests are read from the &lt;xdbtimeout/&gt; element in the configuration of the instance.
  *
  * @param id the ::instance to create the ::_xdbcache for.
  * @return the newly created xdbcache
  */
 xdbcache xdb_cache(instance id) {
     xdbcache newx;
+    xht namespaces;
+    xmlnode timeout;
 
     // sanity check
     if (id == NULL) {
@@ -201,41 +771,40 @@ xdbcache xdb_cache(instance id) {
         return NULL;
     }
 
+    // get the configured timeouts
+    namespaces = xhash_new(3);
+    xhash_put(namespaces, "", const_cast<char*>(NS_JABBERD_CONFIGFILE));
+    timeout = xmlnode_get_list_item(xmlnode_get_tags(id->x, "xdbtimeout", namespaces), 0);
+    xhash_free(namespaces);
+
     // allocate the structure and init it
     newx = static_cast<xdbcache>(pmalloco(id->p, sizeof(_xdbcache)));
-    newx->i = id; /* flags it as the top of the ring too */
-    newx->next = newx->prev = newx; /* init ring */
+    newx->i = id;
+    newx->requests = new xmppd::xdb_requests(j_atoi(xmlnode_get_attrib_ns(timeout, "resend", NULL), 10), j_atoi(xmlnode_get_attrib_ns(timeout, "expire", NULL), 30));
+    pool_cleanup(id->p, _xdb_requests_free, newx->requests);
     pth_mutex_init(&(newx->mutex)); // init mutex that protects the access to the xdbcache
 
     /* register the handler in the instance to filter out xdb results */
     register_phandler(id, o_PRECOND, xdb_results, (void *)newx);
 
     /* heartbeat to keep a watchful eye on xdb_cache */
-    register_beat(10,xdb_thump,(void *)newx);
+    register_beat(1,xdb_thump,(void *)newx);
 
     return newx;
 }
 
 /**
- * query data from the xdb
- *
- * blocks until namespace is retrieved, host must map back to this service!
+ * send a query to the xdb and wait for the result
  *
  * @param xc the xdbcache used for this query
  * @param owner for which JID the query should be made
  * @param ns which namespace to query
- * @return NULL if nothing found, result else (has to be freed by the caller!)
+ * @return the &lt;xdb/&gt; result packet, NULL if the query failed (has to be freed by the caller!)
  */
-xmlnode xdb_get(xdbcache xc, jid owner, const char *ns) {
+static xmlnode _xdb_get(xdbcache xc, jid owner, const char *ns) {
     _xdbcache newx;
-    xmlnode x;
     /* pth_cond_t cond = PTH_COND_INIT; */
 
-    if (xc == NULL || owner == NULL || ns == NULL) {
-        fprintf(stderr, "Programming Error: xdb_get() called with NULL\n");
-        return NULL;
-    }
-
     /* init this newx */
     newx.i = NULL;
     newx.set = 0;
@@ -244,15 +813,13 @@ xmlnode xdb_get(xdbcache xc, jid owner, const char *ns) {
     newx.owner = owner;
     newx.sent = time(NULL);
     newx.preblock = 1; /* flag */
+    newx.p = NULL; /* blocking request */
     pth_cond_init(&(newx.cond));
 
-    /* in the future w/ real threads, would need to lock xc to make these changes to the ring */
+    /* in the future w/ real threads, would need to lock xc to make these changes to the table */
     pth_mutex_acquire(&(xc->mutex), FALSE, NULL);
     newx.id = xc->id++;
-    newx.next = xc->next;
-    newx.prev = xc;
-    newx.next->prev = &newx;
-    xc->next = &newx;
+    xc->requests->add(&newx);
 
     /* send it on it's way, holding the lock */
     xdb_deliver(xc->i, &newx);
@@ -266,14 +833,7 @@ xmlnode xdb_get(xdbcache xc, jid owner, const char *ns) {
     log_debug2(ZONE, LOGT_STORAGE|LOGT_THREAD, "xdb_get() done waiting for %s %s",jid_full(owner),ns);
 
     /* newx.data is now the returned xml packet */
-    /* return the xmlnode inside <xdb>...</xdb> */
-    for(x = xmlnode_get_firstchild(newx.data); x != NULL && xmlnode_get_type(x) != NTYPE_TAG; x = xmlnode_get_nextsibling(x));
-
-    /* there were no children (results) to the xdb request, free the packet */
-    if(x == NULL)
-        xmlnode_free(newx.data);
-
-    return x;
+    return newx.data;
 }
 
 /* sends new xml xdb action, data is NOT freed, app responsible for freeing it */
@@ -300,15 +860,13 @@ static int _xdb_act(xdbcache xc, jid owner, const char *ns, char const* act, cha
     newx.owner = owner;
     newx.sent = time(NULL);
     newx.preblock = 1; /* flag */
+    newx.p = NULL; /* blocking request */
     pth_cond_init(&(newx.cond));
 
-    /* in the future w/ real threads, would need to lock xc to make these changes to the ring */
+    /* in the future w/ real threads, would need to lock xc to make these changes to the table */
     pth_mutex_acquire(&(xc->mutex), FALSE, NULL);
     newx.id = xc->id++;
-    newx.next = xc->next;
-    newx.prev = xc;
-    newx.next->prev = &newx;
-    xc->next = &newx;
+    xc->requests->add(&newx);
 
     /* send it on it's way */
     xdb_deliver(xc->i, &newx);
@@ -332,15 +890,778 @@ static int _xdb_act(xdbcache xc, jid owner, const char *ns, char const* act, cha
     return 0;
 }
 
+/**
+ * number of failed attempts to write a changed cache entry, after which the changes are dropped
+ */
+#define XDB_LRU_MAX_FAILURES 5
+
+/**
+ * the xdbcaches with a write-behind result cache, that have to be flushed on shutdown (see xdb_cache_flush())
+ */
+static std::map<xmppd::xdb_lru*, xdbcache> xdb__writebehind_caches;
+
+/**
+ * write a cache entry, that has been set locally, to the xdb
+ *
+ * @param xc the xdbcache the entry is cached in
+ * @param entry the entry to write
+ * @param max_failures number of failed attempts after which the entry is dropped, 0 to never drop it
+ * @return 0 on success, non-zero on failure
+ */
+static int _xdb_lru_write(xdbcache xc, xmppd::xdb_lru_entry* entry, int max_failures) {
+    std::string key = entry->key;
+    std::string ns = entry->ns;
+    unsigned long version = entry->version;
+    pool p = pool_new();
+    jid owner = jid_new(p, entry->owner.c_str());
+    xmlnode data = entry->data == NULL ? NULL : xmlnode_dup(entry->data); /* entry->data may be replaced while we are waiting */
+    int ret;
+
+    log_debug2(ZONE, LOGT_STORAGE, "xdb cache: writing %s data of %s", ns.c_str(), jid_full(owner));
+    ret = _xdb_act(xc, owner, ns.c_str(), NULL, NULL, NULL, NULL, data);
+
+    /* the entry may have been updated or removed in the meantime, use the key */
+    if (ret == 0)
+	xc->lru->mark_clean(key, version);
+    else if (xc->lru->write_failed(key, max_failures))
+	log_error(xc->i->id, "xdb cache: could not write %s data of %s, dropping the changes", ns.c_str(), jid_full(owner));
+    else
+	log_warn(xc->i->id, "xdb cache: could not write %s data of %s, will retry", ns.c_str(), jid_full(owner));
+
+    xmlnode_free(data);
+    pool_free(p);
+    return ret;
+}
+
+/**
+ * mtq callback that writes all dirty entries of a write-behind cache to the xdb
+ *
+ * @param arg the ::xdbcache to flush
+ */
+static void _xdb_lru_flush(void *arg) {
+    xdbcache xc = (xdbcache)arg;
+    xmppd::xdb_lru_entry* entry = NULL;
+
+    /* stop at the first failure, the next beat will retry */
+    while ((entry = xc->lru->next_dirty()) != NULL) {
+	if (_xdb_lru_write(xc, entry, XDB_LRU_MAX_FAILURES) != 0)
+	    break;
+    }
+
+    xc->lru->flushing = false;
+    pool_free(xc->lru->flush_pool);
+    xc->lru->flush_pool = NULL;
+}
+
+/**
+ * write the changes kept by all write-behind result caches to the xdb
+ *
+ * This has to be called on shutdown while packets are still delivered, the shutdown callbacks
+ * are too late for this: delivery is paused and the xdb instances might be gone already.
+ * Blocks until all changes have been written, changes that cannot be written are dropped.
+ */
+void xdb_cache_flush(void) {
+    for (std::map<xmppd::xdb_lru*, xdbcache>::iterator i = xdb__writebehind_caches.begin(); i != xdb__writebehind_caches.end(); ++i) {
+	xdbcache xc = i->second;
+	xmppd::xdb_lru_entry* entry = NULL;
+
+	/* let a running flush finish first */
+	while (xc->lru->flushing)
+	    pth_sleep(1);
+
+	log_notice(xc->i->id, "xdb cache: writing changes before shutdown");
+	while ((entry = xc->lru->next_dirty()) != NULL)
+	    _xdb_lru_write(xc, entry, 1);
+    }
+}
+
+/**
+ * beat handler for the result cache of an xdbcache
+ *
+ * starts writing dirty entries (write-behind mode only) and logs the cache counters every five minutes
+ *
+ * @param arg the ::xdbcache this function is called for
+ * @return always r_DONE
+ */
+static result _xdb_lru_beat(void *arg) {
+    xdbcache xc = (xdbcache)arg;
+    xmppd::xdb_lru* lru = xc->lru;
+    time_t now = time(NULL);
+
+    /* writing might block, do not do it in the heartbeat thread */
+    if (lru->writebehind > 0 && !lru->flushing && lru->next_dirty() != NULL) {
+	lru->flushing = true;
+	lru->flush_pool = pool_new();
+	mtq_send(NULL, lru->flush_pool, _xdb_lru_flush, (void*)xc);
+    }
+
+    if (now - lru->last_report >= 300) {
+	log_notice(xc->i->id, "xdb cache: %i entries, %lu hits, %lu misses, %lu evictions, %lu coalesced writes", lru->size(), lru->hits, lru->misses, lru->evictions, lru->coalesced);
+	lru->last_report = now;
+    }
+
+    return r_DONE;
+}
+
+/**
+ * pool cleaner that deletes the result cache of an xdbcache
+ *
+ * @param arg the ::xmppd::xdb_lru to delete
+ */
+static void _xdb_lru_free(void *arg) {
+    xdb__writebehind_caches.erase(static_cast<xmppd::xdb_lru*>(arg));
+    delete static_cast<xmppd::xdb_lru*>(arg);
+}
+
+/**
+ * enable caching of query results in an xdbcache
+ *
+ * Only namespaces added using xdb_cache_lru_ns() are cached. Only use this for namespaces,
+ * that are not modified by any other component as the cache is not notified of these modifications.
+ *
+ * @param xc the xdbcache to enable caching for
+ * @param max_entries maximum number of cached results
+ * @param writebehind 0 to write xdb_set() requests immediately, else the interval in seconds in which changed data gets written
+ */
+void xdb_cache_lru(xdbcache xc, int max_entries, int writebehind) {
+    if (xc == NULL || xc->lru != NULL || max_entries <= 0)
+	return;
+
+    log_debug2(ZONE, LOGT_INIT|LOGT_STORAGE, "xdb cache for %s: %i entries, writebehind %i", xc->i->id, max_entries, writebehind);
+
+    xc->lru = new xmppd::xdb_lru(max_entries, writebehind < 0 ? 0 : writebehind);
+    pool_cleanup(xc->i->p, _xdb_lru_free, xc->lru);
+    if (writebehind > 0)
+	xdb__writebehind_caches[xc->lru] = xc;
+    register_beat(writebehind > 0 ? writebehind : 60, _xdb_lru_beat, (void *)xc);
+}
+
+/**
+ * add a namespace to the namespaces cached by an xdbcache
+ *
+ * @param xc the xdbcache (caching must have been enabled with xdb_cache_lru() before)
+ * @param ns the namespace to cache
+ */
+void xdb_cache_lru_ns(xdbcache xc, char const* ns) {
+    if (xc == NULL || xc->lru == NULL || ns == NULL)
+	return;
+
+    xc->lru->add_ns(ns);
+}
+
+/**
+ * query data from the xdb
+ *
+ * blocks until namespace is retrieved, host must map back to this service!
+ *
+ * If the namespace is cached, the result may be served from the cache without querying the xdb.
+ *
+ * @param xc the xdbcache used for this query
+ * @param owner for which JID the query should be made
+ * @param ns which namespace to query
+ * @return NULL if nothing found, result else (has to be freed by the caller!)
+ */
+xmlnode xdb_get(xdbcache xc, jid owner, const char *ns) {
+    xmlnode result = NULL;
+    xmlnode x = NULL;
+    std::string key;
+    unsigned long writes = 0;
+
+    if (xc == NULL || owner == NULL || ns == NULL) {
+        fprintf(stderr, "Programming Error: xdb_get() called with NULL\n");
+        return NULL;
+    }
+
+    /* can we answer from the cache? */
+    if (xc->lru != NULL && xc->lru->caches(ns)) {
+	xmppd::xdb_lru_entry* entry = NULL;
+
+	key = xmppd::xdb_lru::make_key(owner, ns);
+	entry = xc->lru->lookup(key);
+	if (entry != NULL) {
+	    xc->lru->hits++;
+	    log_debug2(ZONE, LOGT_STORAGE, "xdb_get() cache hit for %s %s", jid_full(owner), ns);
+	    return entry->data == NULL ? NULL : xmlnode_dup(entry->data);
+	}
+	xc->lru->misses++;
+	writes = xc->lru->writes;
+    }
+
+    /* has the result been fetched in advance? */
+    if (xc->prefetched != NULL && xc->prefetched->take(xmppd::xdb_lru::make_key(owner, ns), x, time(NULL))) {
+	log_debug2(ZONE, LOGT_STORAGE, "xdb_get() using prefetched result for %s %s", jid_full(owner), ns);
+	return x;
+    }
+
+    result = _xdb_get(xc, owner, ns);
+
+    /* return the xmlnode inside <xdb>...</xdb> */
+    for(x = xmlnode_get_firstchild(result); x != NULL && xmlnode_get_type(x) != NTYPE_TAG; x = xmlnode_get_nextsibling(x));
+
+    /* cache the result, but not if it could be outdated by a local modification while we waited */
+    if (result != NULL && !key.empty() && xc->lru->writes == writes)
+	xc->lru->store(owner, ns, key, x, false);
+
+    /* there were no children (results) to the xdb request, free the packet */
+    if(x == NULL)
+        xmlnode_free(result);
+
+    return x;
+}
+
+/**
+ * send an xdb action, keeping the result cache of the xdbcache consistent
+ *
+ * Parameters are the same as for _xdb_act().
+ *
+ * @return non-zero on failure
+ */
+static int _xdb_act_cached(xdbcache xc, jid owner, const char *ns, char const* act, char const* match, char const* matchpath, xht namespaces, xmlnode data) {
+    std::string key;
+    xmppd::xdb_lru_entry* entry = NULL;
+    int ret = 0;
+
+    /* a prefetched result is outdated by the modification */
+    if (xc != NULL && owner != NULL && xc->prefetched != NULL && j_strcmp(act, "check") != 0)
+	xc->prefetched->invalidate(xmppd::xdb_lru::make_key(owner, ns));
+
+    /* not cached, or a check that does not modify anything */
+    if (xc == NULL || owner == NULL || xc->lru == NULL || !xc->lru->caches(ns) || j_strcmp(act, "check") == 0)
+	return _xdb_act(xc, owner, ns, act, match, matchpath, namespaces, data);
+
+    key = xmppd::xdb_lru::make_key(owner, ns);
+
+    /* replacing the complete data: we know the new content */
+    if (act == NULL && match == NULL && matchpath == NULL) {
+	xc->lru->writes++;
+
+	/* write-behind: just remember, the beat will write it */
+	if (xc->lru->writebehind > 0) {
+	    xc->lru->store(owner, ns, key, data, true);
+	    return 0;
+	}
+
+	xc->lru->invalidate(key);
+	ret = _xdb_act(xc, owner, ns, NULL, NULL, NULL, NULL, data);
+	xc->lru->writes++;
+	if (ret == 0)
+	    xc->lru->store(owner, ns, key, data, false);
+	else
+	    xc->lru->invalidate(key);
+	return ret;
+    }
+
+    /* partial modification: pending data has to be written first (again, if it has been replaced while we were writing) */
+    while ((entry = xc->lru->lookup(key)) != NULL && entry->dirty) {
+	/* the changes stay in the cache for the next flush, but this action cannot be applied on top of them */
+	if (_xdb_lru_write(xc, entry, 0) != 0) {
+	    log_warn(xc->i->id, "xdb cache: cannot modify %s data of %s, pending changes could not be written", ns, jid_full(owner));
+	    return 1;
+	}
+    }
+
+    /* then we do not know the result anymore */
+    xc->lru->writes++;
+    xc->lru->invalidate(key);
+    ret = _xdb_act(xc, owner, ns, act, match, matchpath, namespaces, data);
+    xc->lru->writes++;
+    xc->lru->invalidate(key);
+    return ret;
+}
+
 int xdb_act(xdbcache xc, jid owner, char const* ns, char const* act, char const* match, xmlnode data) {
-    return _xdb_act(xc, owner, ns, act, match, NULL, NULL, data);
+    return _xdb_act_cached(xc, owner, ns, act, match, NULL, NULL, data);
 }
 
 int xdb_act_path(xdbcache xc, jid owner, char const* ns, char const* act, char const* matchpath, xht namespaces, xmlnode data) {
-    return _xdb_act(xc, owner, ns, act, NULL, matchpath, namespaces, data);
+    return _xdb_act_cached(xc, owner, ns, act, NULL, matchpath, namespaces, data);
 }
 
 /* sends new xml to replace old, data is NOT freed, app responsible for freeing it */
 int xdb_set(xdbcache xc, jid owner, const char *ns, xmlnode data) {
-    return _xdb_act(xc, owner, ns, NULL, NULL, NULL, NULL, data);
+    return _xdb_act_cached(xc, owner, ns, NULL, NULL, NULL, NULL, data);
+}
+
+/**
+ * create an asynchronous request
+ *
+ * The request gets its own memory pool, that is freed after the callback has been called.
+ *
+ * @param xc the xdbcache used for the request
+ * @param owner for which JID the request is made
+ * @param ns which namespace is accessed
+ * @param arg argument passed to the callback
+ * @return the new request
+ */
+static xdbcache _xdb_async_new(xdbcache xc, jid owner, const char *ns, void *arg) {
+    pool p = pool_new();
+    xdbcache r = static_cast<xdbcache>(pmalloco(p, sizeof(_xdbcache)));
+
+    r->p = p;
+    r->head = xc;
+    r->ns = pstrdup(p, ns);
+    r->owner = jid_new(p, jid_full(owner));
+    r->cb_arg = arg;
+    r->sent = time(NULL);
+    return r;
+}
+
+/**
+ * put an asynchronous request in the table of its xdbcache and deliver it
+ *
+ * @param r the request
+ */
+static void _xdb_async_send(xdbcache r) {
+    xdbcache xc = r->head;
+
+    pth_mutex_acquire(&(xc->mutex), FALSE, NULL);
+    r->id = xc->id++;
+    xc->requests->add(r);
+
+    xdb_deliver(xc->i, r);
+    pth_mutex_release(&(xc->mutex));
+}
+
+/**
+ * mtq callback that completes an asynchronous request
+ *
+ * Updates the result cache, calls the callback of the request and frees the request.
+ *
+ * @param arg the request
+ */
+static void _xdb_async_done(void *arg) {
+    xdbcache r = (xdbcache)arg;
+    xdbcache xc = r->head;
+    xmppd::xdb_lru* lru = xc->lru != NULL && xc->lru->caches(r->ns) ? xc->lru : NULL;
+    xmlnode x = NULL;
+
+    if (r->set) {
+	int failed = 0;
+
+	/* answered by a write-behind cache, r->data is still our copy of the request */
+	if (!r->cached) {
+	    failed = r->data == NULL ? 1 : 0;
+	    xmlnode_free(r->data);
+
+	    if (lru != NULL && j_strcmp(r->act, "check") != 0) {
+		lru->writes++;
+		lru->invalidate(xmppd::xdb_lru::make_key(r->owner, r->ns));
+	    }
+	}
+
+	log_debug2(ZONE, LOGT_STORAGE, "xdb_act_async() done for %s %s: %s", jid_full(r->owner), r->ns, failed ? "failed" : "success");
+	if (r->act_cb != NULL)
+	    (r->act_cb)(r->cb_arg, failed);
+	pool_free(r->p);
+	return;
+    }
+
+    if (r->cached) {
+	x = r->data;
+    } else {
+	/* return the xmlnode inside <xdb>...</xdb> */
+	for(x = xmlnode_get_firstchild(r->data); x != NULL && xmlnode_get_type(x) != NTYPE_TAG; x = xmlnode_get_nextsibling(x));
+
+	if (r->data != NULL && lru != NULL && lru->writes == r->cache_writes)
+	    lru->store(r->owner, r->ns, xmppd::xdb_lru::make_key(r->owner, r->ns), x, false);
+
+	/* there were no children (results) to the xdb request, free the packet */
+	if (x == NULL)
+	    xmlnode_free(r->data);
+    }
+
+    log_debug2(ZONE, LOGT_STORAGE, "xdb_get_async() done for %s %s: %s", jid_full(r->owner), r->ns, r->data == NULL && !r->cached ? "failed" : "success");
+    if (r->get_status_cb != NULL)
+	(r->get_status_cb)(r->cb_arg, x, r->data == NULL && !r->cached ? 1 : 0);
+    else if (r->get_cb != NULL)
+	(r->get_cb)(r->cb_arg, x);
+    else
+	xmlnode_free(x);
+    pool_free(r->p);
+}
+
+/**
+ * send an asynchronous query
+ *
+ * @param xc the xdbcache used for this query
+ * @param owner for which JID the query should be made
+ * @param ns which namespace to query
+ * @param cb function called with the result, may be NULL
+ * @param status_cb function called with the result and if the query failed (used instead of cb), may be NULL
+ * @param arg argument passed to the callback
+ * @param direct 0 to call the callback in an mtq thread, 1 to call it in the thread getting the result (possibly before this function returned)
+ */
+static void _xdb_get_async(xdbcache xc, jid owner, const char *ns, xdb_get_callback cb, void (*status_cb)(void *arg, xmlnode result, int failed), void *arg, int direct) {
+    xdbcache r = _xdb_async_new(xc, owner, ns, arg);
+
+    r->get_cb = cb;
+    r->get_status_cb = status_cb;
+    r->direct = direct;
+
+    /* can we answer from the cache? */
+    if (xc->lru != NULL && xc->lru->caches(ns)) {
+	xmppd::xdb_lru_entry* entry = xc->lru->lookup(xmppd::xdb_lru::make_key(owner, ns));
+
+	if (entry != NULL) {
+	    xc->lru->hits++;
+	    r->cached = 1;
+	    r->data = entry->data == NULL ? NULL : xmlnode_dup(entry->data);
+	    if (direct)
+		_xdb_async_done(r);
+	    else
+		mtq_send(NULL, r->p, _xdb_async_done, (void*)r);
+	    return;
+	}
+	xc->lru->misses++;
+	r->cache_writes = xc->lru->writes;
+    }
+
+    log_debug2(ZONE, LOGT_STORAGE, "xdb_get_async() sending query for %s %s", jid_full(owner), ns);
+    _xdb_async_send(r);
+}
+
+/**
+ * query data from the xdb without blocking the calling thread
+ *
+ * The callback is called in a different thread, never before this function returned.
+ *
+ * @param xc the xdbcache used for this query
+ * @param owner for which JID the query should be made
+ * @param ns which namespace to query
+ * @param cb function called with the result (the same as xdb_get() would return), may be NULL
+ * @param arg argument passed to the callback
+ */
+void xdb_get_async(xdbcache xc, jid owner, const char *ns, xdb_get_callback cb, void *arg) {
+    if (xc == NULL || owner == NULL || ns == NULL) {
+        fprintf(stderr, "Programming Error: xdb_get_async() called with NULL\n");
+        return;
+    }
+
+    _xdb_get_async(xc, owner, ns, cb, NULL, arg, 0);
+}
+
+/**
+ * mtq callback that processes an asynchronous action, that has to wait for other requests to finish first
+ *
+ * @param arg the request
+ */
+static void _xdb_act_async_blocking(void *arg) {
+    xdbcache r = (xdbcache)arg;
+    int failed = _xdb_act_cached(r->head, r->owner, r->ns, r->act, r->match, NULL, NULL, r->data);
+
+    if (r->act_cb != NULL)
+	(r->act_cb)(r->cb_arg, failed);
+    pool_free(r->p);
+}
+
+/**
+ * send an xdb action without blocking the calling thread
+ *
+ * The callback is called in a different thread, never before this function returned.
+ * Parameters are the same as for xdb_act(), the data is copied and may be freed by the caller
+ * after this function returned.
+ *
+ * @param cb function called with the result (non-zero if the action failed), may be NULL
+ * @param arg argument passed to the callback
+ */
+void xdb_act_async(xdbcache xc, jid owner, const char *ns, char const* act, char const* match, xmlnode data, xdb_act_callback cb, void *arg) {
+    xdbcache r = NULL;
+
+    if (xc == NULL || owner == NULL || ns == NULL) {
+        fprintf(stderr, "Programming Error: xdb_act_async() called with NULL\n");
+        return;
+    }
+
+    r = _xdb_async_new(xc, owner, ns, arg);
+    r->set = 1;
+    r->act_cb = cb;
+    r->act = pstrdup(r->p, act);
+    r->match = pstrdup(r->p, match);
+    r->data = data == NULL ? NULL : xmlnode_dup_pool(r->p, data); /* needed for resends */
+
+    /* a prefetched result is outdated by the modification */
+    if (xc->prefetched != NULL && j_strcmp(act, "check") != 0)
+	xc->prefetched->invalidate(xmppd::xdb_lru::make_key(owner, ns));
+
+    /* keep the result cache consistent */
+    if (xc->lru != NULL && xc->lru->caches(ns) && j_strcmp(act, "check") != 0) {
+	std::string key = xmppd::xdb_lru::make_key(owner, ns);
+	xmppd::xdb_lru_entry* entry = xc->lru->lookup(key);
+
+	/* write-behind: just remember, the beat will write it */
+	if (act == NULL && match == NULL && xc->lru->writebehind > 0) {
+	    xc->lru->writes++;
+	    xc->lru->store(owner, ns, key, data, true);
+	    r->cached = 1;
+	    mtq_send(NULL, r->p, _xdb_async_done, (void*)r);
+	    return;
+	}
+
+	/* pending changes have to be written first, this has to be done in order */
+	if (entry != NULL && entry->dirty) {
+	    mtq_send(NULL, r->p, _xdb_act_async_blocking, (void*)r);
+	    return;
+	}
+
+	xc->lru->writes++;
+	xc->lru->invalidate(key);
+    }
+
+    log_debug2(ZONE, LOGT_STORAGE, "xdb_act_async() sending action for %s %s", jid_full(owner), ns);
+    _xdb_async_send(r);
+}
+
+/**
+ * replace data in the xdb without blocking the calling thread
+ *
+ * Same as xdb_act_async() with neither act nor match.
+ */
+void xdb_set_async(xdbcache xc, jid owner, const char *ns, xmlnode data, xdb_act_callback cb, void *arg) {
+    xdb_act_async(xc, owner, ns, NULL, NULL, data, cb, arg);
+}
+
+/**
+ * state of a multi-query sent with xdb_get_multi_async()
+ */
+typedef struct xdb_multi_struct {
+    pool p;			/**< memory pool of the multi-query */
+    int count;			/**< number of namespaces queried */
+    int pending;		/**< number of queries that have not been answered yet */
+    xmlnode *results;		/**< the results collected so far */
+    int failed;			/**< flag that at least one query failed */
+    xdb_multi_callback cb;	/**< function to call when all results are there */
+    void *arg;			/**< argument to pass to cb */
+} *xdb_multi, _xdb_multi;
+
+/**
+ * one query of a multi-query
+ */
+typedef struct xdb_multi_part_struct {
+    xdb_multi m;		/**< the multi-query this is part of */
+    int n;			/**< index of the query */
+} *xdb_multi_part, _xdb_multi_part;
+
+/**
+ * callback for the single queries of a multi-query
+ *
+ * @param arg the ::xdb_multi_part
+ * @param result the result of the query
+ * @param failed non-zero if the query failed (error or timeout)
+ */
+static void _xdb_multi_result(void *arg, xmlnode result, int failed) {
+    xdb_multi_part part = (xdb_multi_part)arg;
+    xdb_multi m = part->m;
+
+    m->results[part->n] = result;
+    if (failed)
+	m->failed = 1;
+    if (--m->pending > 0)
+	return;
+
+    (m->cb)(m->arg, m->count, m->results, m->failed);
+    pool_free(m->p);
+}
+
+/**
+ * send the queries of a multi-query
+ *
+ * @param xc the xdbcache used for this query
+ * @param owner for which JID the query should be made
+ * @param ns array of the namespaces to query
+ * @param count number of namespaces in ns
+ * @param cb function called with all results, each result has to be freed by the callback
+ * @param arg argument passed to the callback
+ * @param direct 0 to call the callback in an mtq thread, 1 to call it in the thread getting the last result (possibly before this function returned)
+ */
+static void _xdb_get_multi_async(xdbcache xc, jid owner, char const* const* ns, int count, xdb_multi_callback cb, void *arg, int direct) {
+    pool p = NULL;
+    xdb_multi m = NULL;
+    int n = 0;
+
+    p = pool_new();
+    m = static_cast<xdb_multi>(pmalloco(p, sizeof(_xdb_multi)));
+    m->p = p;
+    m->count = count;
+    m->pending = count;
+    m->results = static_cast<xmlnode*>(pmalloco(p, count*sizeof(xmlnode)));
+    m->cb = cb;
+    m->arg = arg;
+
+    for (n = 0; n < count; n++) {
+	xdb_multi_part part = static_cast<xdb_multi_part>(pmalloco(p, sizeof(_xdb_multi_part)));
+	part->m = m;
+	part->n = n;
+	_xdb_get_async(xc, owner, ns[n], NULL, _xdb_multi_result, (void*)part, direct);
+    }
+}
+
+/**
+ * query multiple namespaces of a user at once without blocking the calling thread
+ *
+ * All queries are sent before any result is waited for.
+ *
+ * @param xc the xdbcache used for this query
+ * @param owner for which JID the query should be made
+ * @param ns array of the namespaces to query
+ * @param count number of namespaces in ns
+ * @param cb function called with all results, each result has to be freed by the callback
+ * @param arg argument passed to the callback
+ */
+void xdb_get_multi_async(xdbcache xc, jid owner, char const* const* ns, int count, xdb_multi_callback cb, void *arg) {
+    if (xc == NULL || owner == NULL || ns == NULL || cb == NULL || count <= 0) {
+        fprintf(stderr, "Programming Error: xdb_get_multi_async() called with NULL\n");
+        return;
+    }
+
+    _xdb_get_multi_async(xc, owner, ns, count, cb, arg, 0);
+}
+
+/**
+ * state of a thread blocking in xdb_get_multi()
+ */
+typedef struct xdb_multi_wait_struct {
+    pth_mutex_t mutex;		/**< mutex protecting done */
+    pth_cond_t cond;		/**< condition signalled when the results are there */
+    int done;			/**< flag that the results are there */
+    xmlnode *results;		/**< where to place the results */
+    int failed;			/**< flag that at least one query failed */
+} *xdb_multi_wait, _xdb_multi_wait;
+
+/**
+ * ::xdb_multi_callback that wakes up the thread waiting in xdb_get_multi()
+ */
+static void _xdb_multi_wakeup(void *arg, int count, xmlnode *results, int failed) {
+    xdb_multi_wait w = (xdb_multi_wait)arg;
+    int n = 0;
+
+    for (n = 0; n < count; n++)
+	w->results[n] = results[n];
+    w->failed = failed;
+
+    pth_mutex_acquire(&(w->mutex), FALSE, NULL);
+    w->done = 1;
+    pth_cond_notify(&(w->cond), FALSE);
+    pth_mutex_release(&(w->mutex));
+}
+
+/**
+ * query multiple namespaces of a user at once
+ *
+ * blocks until all results are there, but the queries are processed in parallel.
+ *
+ * @param xc the xdbcache used for this query
+ * @param owner for which JID the query should be made
+ * @param ns array of the namespaces to query
+ * @param count number of namespaces in ns
+ * @param results array of count elements, that gets the results (the same as xdb_get() would return for each namespace, to be freed by the caller)
+ * @param failed where to store if at least one query failed (error or timeout), as opposed to a namespace that has no data, may be NULL
+ */
+void xdb_get_multi(xdbcache xc, jid owner, char const* const* ns, int count, xmlnode *results, int *failed) {
+    _xdb_multi_wait w;
+    int n = 0;
+
+    if (xc == NULL || owner == NULL || ns == NULL || results == NULL || count <= 0) {
+        fprintf(stderr, "Programming Error: xdb_get_multi() called with NULL\n");
+	for (n = 0; results != NULL && n < count; n++)
+	    results[n] = NULL;
+	if (failed != NULL)
+	    *failed = 1;
+	return;
+    }
+
+    w.done = 0;
+    w.failed = 0;
+    w.results = results;
+    pth_mutex_init(&(w.mutex));
+    pth_cond_init(&(w.cond));
+
+    /* the results are processed by the thread getting them: waiting for an mtq thread could deadlock, if all of them block here */
+    pth_mutex_acquire(&(w.mutex), FALSE, NULL);
+    _xdb_get_multi_async(xc, owner, ns, count, _xdb_multi_wakeup, (void*)&w, 1);
+    while (!w.done)
+	pth_cond_await(&(w.cond), &(w.mutex), NULL);
+    pth_mutex_release(&(w.mutex));
+
+    if (failed != NULL)
+	*failed = w.failed;
+}
+
+/**
+ * pool cleaner that deletes the prefetched results of an xdbcache
+ *
+ * @param arg the ::xmppd::xdb_prefetched to delete
+ */
+static void _xdb_prefetched_free(void *arg) {
+    delete static_cast<xmppd::xdb_prefetched*>(arg);
+}
+
+/**
+ * fetch data, that is about to be queried, from multiple namespaces at once
+ *
+ * The queries are sent in parallel, and this blocks until all results are there. The next
+ * xdb_get() for one of the namespaces is answered with the result instead of querying the
+ * xdb again, if it is done within XDB_PREFETCH_TTL seconds and the data has not been
+ * modified using this xdbcache in the meantime. Failed queries are not remembered.
+ *
+ * Namespaces, that are held in the result cache of the xdbcache, are put into that cache
+ * instead, and are not queried at all if they are already cached.
+ *
+ * @param xc the xdbcache used for this query
+ * @param owner for which JID the queries should be made
+ * @param ns array of the namespaces to query
+ * @param count number of namespaces in ns
+ */
+void xdb_prefetch(xdbcache xc, jid owner, char const* const* ns, int count) {
+    std::vector<char const*> query;
+    xmlnode *results = NULL;
+    unsigned long writes = 0;
+    unsigned long lru_writes = 0;
+    time_t now = 0;
+    int failed = 0;
+    int n = 0;
+
+    if (xc == NULL || owner == NULL || ns == NULL || count <= 0)
+	return;
+
+    /* nothing to do for what the result cache already has */
+    for (n = 0; n < count; n++) {
+	if (xc->lru != NULL && xc->lru->caches(ns[n]) && xc->lru->lookup(xmppd::xdb_lru::make_key(owner, ns[n])) != NULL)
+	    continue;
+	query.push_back(ns[n]);
+    }
+    if (query.empty())
+	return;
+
+    if (xc->prefetched == NULL) {
+	xc->prefetched = new xmppd::xdb_prefetched();
+	pool_cleanup(xc->i->p, _xdb_prefetched_free, xc->prefetched);
+    }
+
+    results = new xmlnode[query.size()];
+    writes = xc->prefetched->writes;
+    lru_writes = xc->lru == NULL ? 0 : xc->lru->writes;
+    xdb_get_multi(xc, owner, &query[0], query.size(), results, &failed);
+
+    now = time(NULL);
+    for (n = 0; n < static_cast<int>(query.size()); n++) {
+	/* no result might be an error */
+	if (failed && results[n] == NULL)
+	    continue;
+
+	if (xc->lru != NULL && xc->lru->caches(query[n])) {
+	    /* not if it could be outdated by a local modification while we waited */
+	    if (xc->lru->writes == lru_writes)
+		xc->lru->store(owner, query[n], xmppd::xdb_lru::make_key(owner, query[n]), results[n], false);
+	    xmlnode_free(results[n]);
+	    continue;
+	}
+
+	/* a result might be outdated by a modification while we waited */
+	if (xc->prefetched->writes != writes) {
+	    xmlnode_free(results[n]);
+	    continue;
+	}
+	xc->prefetched->put(xmppd::xdb_lru::make_key(owner, query[n]), results[n], now);
+    }
+    delete[] results;
 }
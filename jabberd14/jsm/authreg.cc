@@ -129,7 +129,7 @@ void _js_authreg_register(jpacket p) {
 	    return;
 	log_debug2(ZONE, LOGT_AUTH, "registration set request acceptable");
 
-	if (!p->to->has_node() || xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(p->iq, "register:password", namespaces), 0)) == NULL) {
+	if (!p->to->has_node() || xmlnode_get_data(xmlnode_get_first_tag(p->iq, "register:password", namespaces)) == NULL) {
 	    log_debug2(ZONE, LOGT_AUTH, "registration set request without a password ...");
 	    jutil_error_xmpp(p->x, XTERROR_NOTACCEPTABLE);
 	} else if (js_user(si, p->to, NULL) != NULL) {
@@ -163,6 +163,9 @@ void _js_authreg_register(jpacket p) {
 	    if (!js_mapi_call(si, e_REGISTER, p, NULL, NULL)) {
 		jutil_error_xmpp(p->x, XTERROR_UNAVAIL);
 	    }
+
+	    /* we checked above, that the user does not exist yet */
+	    js_user_known(si, p->to);
 	}
     }
 }
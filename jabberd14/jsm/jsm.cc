@@ -206,8 +206,10 @@ extern "C" void jsm(instance i, xmlnode x) {
     config = js_config(si, NULL, NULL);
     si->hosts = xhash_new(j_atoi(xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(config, "jsm:maxhosts", si->std_namespace_prefixes), 0)), HOSTS_PRIME));
     si->sc_sessions = xhash_new(j_atoi(xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(config, "jsm:maxusers", si->std_namespace_prefixes), 0)), USERS_PRIME));
-    for (n=0; n<e_LAST; n++)
+    for (n=0; n<e_LAST; n++) {
         si->events[n] = NULL;
+	si->dispatch[n] = NULL;
+    }
 
     /* using an external authentication component? */
     si->auth = pstrdup(si->p, xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(config, "jsm:auth", si->std_namespace_prefixes), 0)));
@@ -225,6 +227,33 @@ extern "C" void jsm(instance i, xmlnode x) {
 	}
     }
 
+    /* cache results of xdb queries? */
+    cur = xmlnode_get_list_item(xmlnode_get_tags(config, "jsm:xdbcache", si->std_namespace_prefixes), 0);
+    if (cur != NULL) {
+	xmlnode_vector cached_ns;
+
+	xdb_cache_lru(si->xc, j_atoi(xmlnode_get_attrib_ns(cur, "max", NULL), 1000), j_atoi(xmlnode_get_attrib_ns(cur, "writebehind", NULL), 0));
+
+	cached_ns = xmlnode_get_tags(cur, "jsm:ns", si->std_namespace_prefixes);
+	if (cached_ns.empty()) {
+	    /* default: namespaces that are only modified by the session manager */
+	    xdb_cache_lru_ns(si->xc, NS_ROSTER);
+	    xdb_cache_lru_ns(si->xc, NS_PRIVACY);
+	    xdb_cache_lru_ns(si->xc, NS_VCARD);
+	}
+	for (xmlnode_vector::iterator iter = cached_ns.begin(); iter != cached_ns.end(); ++iter) {
+	    xdb_cache_lru_ns(si->xc, xmlnode_get_data(*iter));
+	}
+    }
+
+    /* cache which users do not exist? */
+    cur = xmlnode_get_list_item(xmlnode_get_tags(config, "jsm:unknownusers", si->std_namespace_prefixes), 0);
+    if (cur != NULL) {
+	si->unknown_users.users = new xmppd::xhash<time_t>();
+	si->unknown_users.ttl = j_atoi(xmlnode_get_attrib_ns(cur, "ttl", NULL), 60);
+	si->unknown_users.max = j_atoi(xmlnode_get_attrib_ns(cur, "max", NULL), 10000);
+    }
+
     /* enable history storage? */
     cur = xmlnode_get_list_item(xmlnode_get_tags(config, "jsm:history", si->std_namespace_prefixes), 0);
     if (cur != NULL) {
@@ -274,8 +303,13 @@ extern "C" void jsm(instance i, xmlnode x) {
     /* XXX do we still need this? we have the pool_stat() call in jabberd/jabberd.c now */
     /* register_beat(5,jsm_stat,NULL); */
    
-    /* register js_users_gc() to be called frequently, once per minute by default */
-    register_beat(j_atoi(xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(config, "usergc", si->std_namespace_prefixes), 0)), 60), js_users_gc, (void *)si);
+    /* register js_users_gc() to be called every second, users are kept in memory for a minute by default */
+    cur = xmlnode_get_list_item(xmlnode_get_tags(config, "jsm:usercache", si->std_namespace_prefixes), 0);
+    si->users.idle = j_atoi(xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(config, "usergc", si->std_namespace_prefixes), 0)), 60);
+    si->users.max = j_atoi(xmlnode_get_attrib_ns(cur, "max", NULL), 0);
+    si->users.batch = j_atoi(xmlnode_get_attrib_ns(cur, "batch", NULL), 1000);
+    si->users.stats_logged = time(NULL);
+    register_beat(1, js_users_gc, (void *)si);
 
     /* free the configuration xmlnode */
     xmlnode_free(config);
@@ -491,6 +491,8 @@ typedef struct mlist_struct
     mcall c;			/**< function to call */
     void *arg;			/**< argument to pass to the function */
     unsigned char mask;		/**< bitmask with packet-types the function requested to ignore (JPACKET_* constants) */
+    unsigned char types;	/**< bitmask with packet-types the function declared to handle (JPACKET_* constants) */
+    const char *ns;		/**< namespace of the iq queries the function declared to handle, NULL for all */
     struct mlist_struct *next;	/**< pointer to the next entry, NULL for last entry */
 } *mlist, _mlist;
 
@@ -501,6 +503,29 @@ struct history_storage_conf {
     int special:1;		/**< store special messages? JPACKET__HEADLINE, JPACKET__GROUPCHAT, JPACKET_ERROR */
 };
 
+/** cache of users, that have been looked up in xdb but do not exist (see js_user()) */
+struct unknown_users_cache {
+    xmppd::xhash<time_t>* users;	/**< bare JIDs of users, that do not exist, the value is when the entry expires; NULL if the cache is disabled */
+    int ttl;				/**< number of seconds an entry is kept */
+    int max;				/**< maximum number of entries */
+};
+
+/** the users loaded to memory, ordered by their last use (see js_user() and js_users_gc()) */
+struct user_cache {
+    udata newest;		/**< the most recently used user */
+    udata oldest;		/**< the least recently used user, the next to check for eviction */
+    int idle;			/**< number of seconds an unused user is kept in memory */
+    unsigned long max;		/**< maximum number of users in memory, before idle time is not waited for anymore (0 for no limit) */
+    int batch;			/**< maximum number of users checked for eviction per run of js_users_gc() */
+    unsigned long resident;	/**< number of users in memory */
+    unsigned long loads;	/**< number of users loaded from xdb */
+    unsigned long evictions;	/**< number of users removed from memory */
+    time_t stats_logged;	/**< when the statistics have been logged the last time */
+};
+
+/** callbacks registered for an event, ordered by the packets they handle (defined in modules.cc) */
+struct mapi_dispatch;
+
 /** Globals for this instance of jsm (Jabber Session Manager) */
 struct jsmi_struct {
     instance i;			/**< jabberd's instance data for the jsm component */
@@ -510,11 +535,15 @@ struct jsmi_struct {
     xht std_namespace_prefixes;	/**< standard prefixes used for xmlnode_get_tags() */
     xdbcache xc;		/**< xdbcache used to query xdb */
     mlist events[e_LAST];	/**< list of registered modules for the existing event types */
+    struct mapi_dispatch *dispatch[e_LAST]; /**< dispatch tables built from events, NULL if not yet built (see js_mapi_call2()) */
     pool p;			/**< memory pool for the instance */
     struct history_storage_conf history_sent; /**< store history for messages sent by the user? */
     struct history_storage_conf history_recv; /**< store history for messages received by the user? */
     char *statefile;		/**< to which file to store serialization data */
     char *auth;			/**< forward authentication request to this component, if not NULL */
+    struct unknown_users_cache unknown_users; /**< users, that are known not to exist */
+    struct user_cache users;	/**< the users loaded to memory */
+    std::vector<char const*>* session_ns; /**< namespaces read by modules when a session starts (see js_session_prefetch_ns()), NULL if none */
 };
 
 /** User data structure/list. See js_user(). */
@@ -523,11 +552,16 @@ struct udata_struct
     jid id;                    /**< the user's JID */
     jid utrust;                /**< list of JIDs the user trusts to send presence to (s10n==both or from). Do not access directly, use js_trustees() instead. */
     jid useen;		/**< list of JIDs a user wants to accept presences from (s10n==both or to). Do not access directly, use js_seen_users() instead. */
+    xht utrust_index;		/**< index of utrust for js_trust(), keys are the domain for JIDs without node, the JID else */
+    xht useen_index;		/**< index of useen for js_seen(), keys as for utrust_index */
     jsmi si;                   /**< the session manager instance the user is associated with */
     session sessions;          /**< the user's session */
     int ref;                   /**< reference counter */
     pool p;
     xht aux_data;		/**< additional data stored by modules */
+    udata newer;		/**< next more recently used user in jsmi_struct::users */
+    udata older;		/**< next less recently used user in jsmi_struct::users */
+    time_t last_used;		/**< when the user has been used the last time */
 };
 
 xmlnode js_config(jsmi si, const char* query, const char* lang);
@@ -535,6 +569,8 @@ xmlnode js_config(jsmi si, const char* query, const char* lang);
 udata js_user(jsmi si, jid id, xht ht);
 int js_user_create(jsmi si, jid id);
 int js_user_delete(jsmi si, jid id);
+void js_user_known(jsmi si, jid id);
+void js_user_sessions_changed(udata u);
 void js_deliver(jsmi si, jpacket p, session sending_s);
 
 
@@ -545,7 +581,8 @@ struct session_struct {
     char *res;			/**< the resource of this session */
     jid id;			/**< JabberID of the user who owns this session */
     udata u;			/**< user data structure of the user */
-    xmlnode presence;		/**< the current global presence of this session */
+    xmlnode presence;		/**< the current global presence of this session, read-only: copies share its content, replace it using js_session_set_presence() */
+    xmlnode presence_shared;	/**< copy of presence sharing its content with the copies sent out (see js_session_presence()), NULL if not created yet */
     int priority;		/**< the current priority of this session */
     int roster;
     int c_in;			/**< counter for packets received for a client */
@@ -586,6 +623,9 @@ session js_session_primary(udata user);
 void js_session_to(session s, jpacket p);
 void js_session_from(session s, jpacket p);
 void js_session_free_aux_data(void* arg);
+void js_session_set_presence(session s, xmlnode presence);
+xmlnode js_session_presence(session s, jid to);
+void js_session_prefetch_ns(jsmi si, char const* ns);
 
 void js_server_main(void *arg);
 void js_offline_main(void *arg);
@@ -602,6 +642,7 @@ void js_psend(jsmi si, jpacket p, mtq_callback f); /* sends p to a function */
 void js_bounce_xmpp(jsmi si, session s, xmlnode x, xterror xterr); /* logic to bounce packets w/o looping, eats x and delivers error */
 
 void js_mapi_register(jsmi si, event e, mcall c, void *arg);
+void js_mapi_register_filtered(jsmi si, event e, unsigned char types, const char *ns, mcall c, void *arg);
 void js_mapi_session(event e, session s, mcall c, void *arg);
 int js_mapi_call(jsmi si, event e, jpacket packet, udata user, session s);
 int js_mapi_call2(jsmi si, event e, jpacket packet, udata user, session s, xmlnode serialization_node);
@@ -618,6 +659,8 @@ int js_islocal(jsmi si, jid id);
 int js_trust(udata u, jid id); /* checks if id is trusted by user u */
 jid js_trustees(udata u); /* returns list of trusted jids */
 jid js_seen_jids(udata u); /* returns list of trusted jids */
+void js_add_trustee(udata u, jid id); /* adds a user to the list of trustees */
+void js_add_seen(udata u, jid id); /* adds a user to the list of seen JIDs */
 void js_remove_trustee(udata u, jid id); /* removes a user from the list of trustees */
 int js_seen(udata u, jid id); /* checks if a ID is seen by user u */
 void js_remove_seen(udata u, jid id); /* removes a user from the list of seen JIDs */
@@ -35,18 +35,150 @@
  * @brief jsm module API
  */
 
+/**
+ * dispatch table for an event
+ *
+ * Built by _js_mapi_dispatch() from the list of callbacks registered for the event, so that
+ * js_mapi_call2() only has to call the callbacks, that declared to handle the type of the
+ * packet (and the namespace of the query for iq packets). The tables are not changed after
+ * they have been built, registering a new callback lets a new table be built.
+ */
+struct mapi_dispatch {
+    std::vector<mlist> no_packet;	/**< callbacks to call for events without a packet: all */
+    std::vector<mlist> by_type[4];	/**< callbacks for JPACKET_MESSAGE, JPACKET_PRESENCE, JPACKET_IQ, and JPACKET_S10N packets */
+    xmppd::xhash<std::vector<mlist> > iq_ns; /**< callbacks for iq packets, key is the namespace of the query, only for namespaces declared at registration */
+};
+
+/**
+ * free a dispatch table, when the instance's memory pool gets freed
+ *
+ * @param arg the dispatch table to free
+ */
+static void _js_mapi_dispatch_free(void *arg) {
+    delete static_cast<struct mapi_dispatch*>(arg);
+}
+
+/**
+ * get the index in mapi_dispatch::by_type for a packet type
+ *
+ * @param type the packet type (one of the JPACKET_* constants)
+ * @return the index, -1 for JPACKET_UNKNOWN
+ */
+static int _js_mapi_type_index(int type) {
+    switch (type) {
+	case JPACKET_MESSAGE:
+	    return 0;
+	case JPACKET_PRESENCE:
+	    return 1;
+	case JPACKET_IQ:
+	    return 2;
+	case JPACKET_S10N:
+	    return 3;
+	default:
+	    return -1;
+    }
+}
+
+/**
+ * get the callbacks, that have to be called for a packet on an event
+ *
+ * Builds the dispatch table for the event, if it has not been built yet.
+ *
+ * @param si the session manager instance data
+ * @param e the event
+ * @param packet the packet, may be NULL
+ * @return the callbacks in the order they have been registered, NULL if there are none to call
+ */
+static const std::vector<mlist>* _js_mapi_dispatch(jsmi si, event e, jpacket packet) {
+    struct mapi_dispatch *table = si->dispatch[e];
+    int index = 0;
+    mlist l = NULL;
+
+    if (table == NULL) {
+	table = new struct mapi_dispatch;
+	pool_cleanup(si->p, _js_mapi_dispatch_free, table);
+
+	/* the namespaces callbacks declared to handle */
+	for (l = si->events[e]; l != NULL; l = l->next) {
+	    if (l->ns != NULL)
+		table->iq_ns[l->ns];
+	}
+
+	for (l = si->events[e]; l != NULL; l = l->next) {
+	    table->no_packet.push_back(l);
+
+	    for (index = 0; index < 4; index++) {
+		if (l->types & (1 << index) && (l->ns == NULL || index != 2))
+		    table->by_type[index].push_back(l);
+	    }
+
+	    if (!(l->types & JPACKET_IQ))
+		continue;
+	    for (xmppd::xhash<std::vector<mlist> >::iterator p = table->iq_ns.begin(); p != table->iq_ns.end(); ++p) {
+		if (l->ns == NULL || p->first == l->ns)
+		    p->second.push_back(l);
+	    }
+	}
+
+	si->dispatch[e] = table;
+	log_debug2(ZONE, LOGT_INIT, "mapi dispatch table for event %d: %d callbacks, %d iq namespaces", e, static_cast<int>(table->no_packet.size()), static_cast<int>(table->iq_ns.size()));
+    }
+
+    if (packet == NULL)
+	return &table->no_packet;
+
+    index = _js_mapi_type_index(packet->type);
+    if (index < 0)
+	return NULL;
+
+    /* iq queries in a namespace, that some callbacks declared to handle? */
+    if (packet->type == JPACKET_IQ && packet->iq != NULL && !table->iq_ns.empty()) {
+	const char *ns = xmlnode_get_namespace(packet->iq);
+
+	if (ns != NULL) {
+	    xmppd::xhash<std::vector<mlist> >::const_iterator p = table->iq_ns.find(ns);
+	    if (p != table->iq_ns.end())
+		return &p->second;
+	}
+    }
+
+    return &table->by_type[index];
+}
+
 /**
  * let a module register a new callback for a specified phase
  *
  * Takes a function pointer and argument and stores them in the
  * callback list for the event e
  *
+ * The callback gets called for all packets, use js_mapi_register_filtered() if the
+ * module only handles some types of packets.
+ *
  * @param si the session manager instance data
  * @param e the event type for which to register the callback
  * @param c pointer to the function, that gets registered
  * @param arg an argument to pass to c when it is called
  */
 void js_mapi_register(jsmi si, event e, mcall c, void *arg) {
+    js_mapi_register_filtered(si, e, JPACKET_MESSAGE|JPACKET_PRESENCE|JPACKET_IQ|JPACKET_S10N, NULL, c, arg);
+}
+
+/**
+ * let a module register a new callback for a specified phase, that only handles some packets
+ *
+ * Like js_mapi_register(), but the callback is only called for packets of the given types
+ * (and for events without a packet). If ns is not NULL, the callback is only called for
+ * iq packets containing a query in this namespace. A module handling queries in several
+ * namespaces can register the same callback once for each namespace.
+ *
+ * @param si the session manager instance data
+ * @param e the event type for which to register the callback
+ * @param types bitmask of the packet types the callback handles (JPACKET_* constants), ignored if ns is not NULL
+ * @param ns namespace of the iq queries the callback handles, NULL to not filter by namespace
+ * @param c pointer to the function, that gets registered
+ * @param arg an argument to pass to c when it is called
+ */
+void js_mapi_register_filtered(jsmi si, event e, unsigned char types, const char *ns, mcall c, void *arg) {
     mlist newl, curl;
 
     if(c == NULL || si == NULL || e >= e_LAST) return;
@@ -56,6 +188,8 @@ void js_mapi_register(jsmi si, event e, mcall c, void *arg) {
     newl->c = c;
     newl->arg = arg;
     newl->mask = 0x00;
+    newl->types = ns == NULL ? types : JPACKET_IQ;
+    newl->ns = ns == NULL ? NULL : pstrdup(si->p, ns);
     newl->next = NULL;
 
     /* append */
@@ -67,7 +201,11 @@ void js_mapi_register(jsmi si, event e, mcall c, void *arg) {
 	    /* do nothing special */;
         curl->next = newl;
     }
-    log_debug2(ZONE, LOGT_INIT, "mapi_register %d %X",e,newl);
+
+    /* the dispatch table has to be built again (the old one might still be in use, it is freed with the instance) */
+    si->dispatch[e] = NULL;
+
+    log_debug2(ZONE, LOGT_INIT, "mapi_register %d %X (types %X, namespace %s)", e, newl, newl->types, ns == NULL ? "*" : ns);
 }
 
 /**
@@ -91,6 +229,8 @@ void js_mapi_session(event e, session s, mcall c, void *arg) {
     newl->c = c;
     newl->arg = arg;
     newl->mask = 0x00;
+    newl->types = JPACKET_MESSAGE|JPACKET_PRESENCE|JPACKET_IQ|JPACKET_S10N;
+    newl->ns = NULL;
     newl->next = NULL;
 
     /* append */
@@ -161,6 +301,35 @@ static int _js_mapi_process_additional_result(mapi m) {
     return 1;
 }
 
+/**
+ * call a single module callback
+ *
+ * Skips the callback if it does not handle the packet's type, or if it ignored this type before.
+ * Adds the packet type to the ignore mask of the callback if it returns M_IGNORE.
+ *
+ * @param m the mapi structure to pass to the callback
+ * @param l the callback to call
+ * @return the result of the callback, M_IGNORE if it has been skipped
+ */
+static mreturn _js_mapi_call_callback(mapi m, mlist l) {
+    jpacket packet = m->packet;
+    mreturn ret;
+
+    /* skip call-back if it does not handle this packet type or the packet type mask matches */
+    if (packet != NULL && (!(packet->type & l->types) || (packet->type & l->mask) == packet->type))
+	return M_IGNORE;
+    log_debug2(ZONE, LOGT_EXECFLOW, "MAPI %X",l);
+
+    /* call the function and handle the result */
+    ret = (*(l->c))(m, l->arg);
+
+    /* this module is ignoring this packet->type: add the packet type to the mask */
+    if (ret == M_IGNORE && packet != NULL)
+	l->mask |= packet->type;
+
+    return ret;
+}
+
 /**
  * call all the module callbacks for a phase
  *
@@ -182,6 +351,8 @@ int js_mapi_call(jsmi si, event e, jpacket packet, udata user, session s) {
  *
  * Only needed for the events es_SERIALIZE and es_DESERIALIZE. Other events can use the shorter interface of js_mapi_call()
  *
+ * For events of the instance only the callbacks, that declared to handle the packet, are called (see js_mapi_register_filtered()).
+ *
  * Addes callbacks to the ignore mask for a given packet type if they return M_IGNORE.
  *
  * @param si the session manager instance data (MUST be NULL for a es_* event)
@@ -193,7 +364,8 @@ int js_mapi_call(jsmi si, event e, jpacket packet, udata user, session s) {
  * @return 1 if the call was handled by a module, 0 if it wasn't handled
  */
 int js_mapi_call2(jsmi si, event e, jpacket packet, udata user, session s, xmlnode serialization_node) {
-    mlist l;
+    mlist l = NULL;
+    const std::vector<mlist>* callbacks = NULL;
     _mapi m;		/* mapi structure to be passed to the call back */
 
     log_debug2(ZONE, LOGT_EXECFLOW, "mapi_call %d",e);
@@ -203,7 +375,7 @@ int js_mapi_call2(jsmi si, event e, jpacket packet, udata user, session s, xmlno
         si = s->si;
         l = s->events[e];
     } else {
-        l = si->events[e];
+	callbacks = _js_mapi_dispatch(si, e, packet);
     }
 
     /* fill in the mapi structure */
@@ -215,28 +387,20 @@ int js_mapi_call2(jsmi si, event e, jpacket packet, udata user, session s, xmlno
     m.serialization_node = serialization_node;
     m.additional_result = NULL;
 
-    /* traverse the list of call backs */
-    for (;l != NULL; l = l->next) {
-        /* skip call-back if the packet type mask matches */
-        if(packet != NULL && (packet->type & l->mask) == packet->type)
-	    continue;
-	log_debug2(ZONE, LOGT_EXECFLOW, "MAPI %X",l);
-	
-        /* call the function and handle the result */
-        switch((*(l->c))(&m, l->arg)) {
-	    /* this module is ignoring this packet->type */
-	    case M_IGNORE:
-		/* add the packet type to the mask */
-		if (packet)
-		    l->mask |= packet->type;
-		break;
-	    /* this module handled the packet */
-	    case M_HANDLED:
+    /* traverse the call backs: the dispatch table for instance events, the list for session events */
+    if (callbacks != NULL) {
+	for (std::vector<mlist>::const_iterator p = callbacks->begin(); p != callbacks->end(); ++p) {
+	    if (_js_mapi_call_callback(&m, *p) == M_HANDLED) {
 		_js_mapi_process_additional_result(&m);
 		return 1;
-	    default:
-		;
-        }
+	    }
+	}
+    }
+    for (; l != NULL; l = l->next) {
+	if (_js_mapi_call_callback(&m, l) == M_HANDLED) {
+	    _js_mapi_process_additional_result(&m);
+	    return 1;
+	}
     }
 
     log_debug2(ZONE, LOGT_EXECFLOW, "mapi_call returning unhandled");
@@ -276,4 +276,5 @@ extern "C" void mod_announce(jsmi si) {
     a = static_cast<motd>(pmalloco(si->p, sizeof(_motd)));
     js_mapi_register(si, e_SERVER, mod_announce_dispatch, (void *)a);
     js_mapi_register(si, e_SESSION, mod_announce_sess, (void *)a);
+    js_session_prefetch_ns(si, NS_LAST);
 }
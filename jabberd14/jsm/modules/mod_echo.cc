@@ -81,5 +81,5 @@ static mreturn mod_echo_reply(mapi m, void *arg) {
  * @param si the session manager instance
  */
 extern "C" void mod_echo(jsmi si) {
-    js_mapi_register(si, e_SERVER, mod_echo_reply, NULL);
+    js_mapi_register_filtered(si, e_SERVER, JPACKET_MESSAGE, NULL, mod_echo_reply, NULL);
 }
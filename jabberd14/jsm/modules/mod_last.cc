@@ -298,7 +298,8 @@ extern "C" void mod_last(jsmi si) {
     /* set up the server responce, giving the startup time :) */
     ttmp = static_cast<time_t*>(pmalloco(si->p, sizeof(time_t)));
     time(ttmp);
-    js_mapi_register(si, e_SERVER, mod_last_server, (void *)ttmp);
+    js_mapi_register_filtered(si, e_SERVER, JPACKET_IQ, NS_LAST, mod_last_server, (void *)ttmp);
+    js_mapi_register_filtered(si, e_SERVER, JPACKET_IQ, NS_DISCO_INFO, mod_last_server, (void *)ttmp);
     js_mapi_register(si, e_DELETE, mod_last_delete, NULL);
     xmlnode_free(register_config);
 }
@@ -103,16 +103,16 @@ static mreturn mod_offline_message(mapi m, modoffline_conf conf) {
     /* look for event messages */
     for (cur = xmlnode_get_firstchild(m->packet->x); cur != NULL; cur = xmlnode_get_nextsibling(cur)) {
         if (NSCHECK(cur,NS_EVENT)) {
-            if (xmlnode_get_list_item(xmlnode_get_tags(cur, "event:id", m->si->std_namespace_prefixes), 0) != NULL)
+            if (xmlnode_get_first_tag(cur, "event:id", m->si->std_namespace_prefixes) != NULL)
                 return M_PASS; /* bah, we don't want to store events offline (XXX: do we?) */
-            if (xmlnode_get_list_item(xmlnode_get_tags(cur, "event:offline", m->si->std_namespace_prefixes), 0) != NULL)
+            if (xmlnode_get_first_tag(cur, "event:offline", m->si->std_namespace_prefixes) != NULL)
                 break; /* cur remaining set is the flag */
         }
     }
 
     log_debug2(ZONE, LOGT_DELIVER, "handling message for %s", m->user->id->get_node().c_str());
 
-    if ((cur2 = xmlnode_get_list_item(xmlnode_get_tags(m->packet->x,"expire:x", m->si->std_namespace_prefixes), 0)) != NULL) {
+    if ((cur2 = xmlnode_get_first_tag(m->packet->x,"expire:x", m->si->std_namespace_prefixes)) != NULL) {
         if (j_atoi(xmlnode_get_attrib_ns(cur2, "seconds", NULL), 0) == 0)
             return M_PASS; 
         
@@ -245,7 +245,7 @@ static int mod_offline_check_expired(mapi m, xmlnode message) {
     int diff = 0;
     char str[11];
     int now = time(NULL);
-    xmlnode x = xmlnode_get_list_item(xmlnode_get_tags(message, "expire:x", m->si->std_namespace_prefixes), 0);
+    xmlnode x = xmlnode_get_first_tag(message, "expire:x", m->si->std_namespace_prefixes);
 
     /* messages without expire information will never expire */
     if (x == NULL)
@@ -357,7 +357,7 @@ static void mod_offline_out_available(mapi m, modoffline_session session_conf) {
 	return;
     }
 
-    if (j_atoi(xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(m->packet->x, "priority", m->si->std_namespace_prefixes), 0)), 0) < 0) {
+    if (j_atoi(xmlnode_get_data(xmlnode_get_first_tag(m->packet->x, "priority", m->si->std_namespace_prefixes)), 0) < 0) {
 	log_debug2(ZONE, LOGT_DELIVER, "negative priority, not delivering offline messages");
 	return;
     }
@@ -683,7 +683,7 @@ static mreturn mod_offline_session(mapi m, void *arg) {
 static mreturn mod_offline_deserialize(mapi m, void *arg) {
     modoffline_session session_data = mod_offline_new_session(m, arg);
 
-    if (xmlnode_get_list_item(xmlnode_get_tags(m->serialization_node, "state:xep0013", m->si->std_namespace_prefixes), 0) != NULL) {
+    if (xmlnode_get_first_tag(m->serialization_node, "state:xep0013", m->si->std_namespace_prefixes) != NULL) {
 	session_data->xep0013 = 1;
     }
 }
@@ -762,11 +762,11 @@ extern "C" void mod_offline(jsmi si) {
 	conf->store_type_groupchat = 0;
 	conf->store_type_error = 0;
     } else {
-	conf->store_type_normal = xmlnode_get_list_item(xmlnode_get_tags(cfg, "jsm:normal", si->std_namespace_prefixes), 0) == NULL ? 0 : 1;
-	conf->store_type_chat = xmlnode_get_list_item(xmlnode_get_tags(cfg, "jsm:chat", si->std_namespace_prefixes), 0) == NULL ? 0 : 1;
-	conf->store_type_headline = xmlnode_get_list_item(xmlnode_get_tags(cfg, "jsm:headline", si->std_namespace_prefixes), 0) == NULL ? 0 : 1;
-	conf->store_type_groupchat = xmlnode_get_list_item(xmlnode_get_tags(cfg, "jsm:groupchat", si->std_namespace_prefixes), 0) == NULL ? 0 : 1;
-	conf->store_type_error = xmlnode_get_list_item(xmlnode_get_tags(cfg, "jsm:error", si->std_namespace_prefixes), 0) == NULL ? 0 : 1;
+	conf->store_type_normal = xmlnode_get_first_tag(cfg, "jsm:normal", si->std_namespace_prefixes) == NULL ? 0 : 1;
+	conf->store_type_chat = xmlnode_get_first_tag(cfg, "jsm:chat", si->std_namespace_prefixes) == NULL ? 0 : 1;
+	conf->store_type_headline = xmlnode_get_first_tag(cfg, "jsm:headline", si->std_namespace_prefixes) == NULL ? 0 : 1;
+	conf->store_type_groupchat = xmlnode_get_first_tag(cfg, "jsm:groupchat", si->std_namespace_prefixes) == NULL ? 0 : 1;
+	conf->store_type_error = xmlnode_get_first_tag(cfg, "jsm:error", si->std_namespace_prefixes) == NULL ? 0 : 1;
     }
 
     log_debug2(ZONE, LOGT_INIT, "init");
@@ -774,7 +774,8 @@ extern "C" void mod_offline(jsmi si) {
     js_mapi_register(si,e_SESSION, mod_offline_session, NULL);
     js_mapi_register(si,e_DESERIALIZE, mod_offline_deserialize, NULL);
     js_mapi_register(si, e_DELETE, mod_offline_delete, NULL);
-    js_mapi_register(si, e_SERVER, mod_offline_server, NULL);
+    js_mapi_register_filtered(si, e_SERVER, JPACKET_IQ, NS_DISCO_INFO, mod_offline_server, NULL);
+    js_session_prefetch_ns(si, NS_OFFLINE);
 
     xmlnode_free(cfg);
 }
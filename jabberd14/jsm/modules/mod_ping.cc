@@ -171,7 +171,8 @@ static mreturn mod_ping_deliver(mapi m, void *arg) {
  * @param si the session manager instance
  */
 extern "C" void mod_ping(jsmi si) {
-    js_mapi_register(si, e_SERVER, mod_ping_server, NULL);
+    js_mapi_register_filtered(si, e_SERVER, JPACKET_IQ, NS_XMPP_PING, mod_ping_server, NULL);
+    js_mapi_register_filtered(si, e_SERVER, JPACKET_IQ, NS_DISCO_INFO, mod_ping_server, NULL);
     js_mapi_register(si, e_SESSION, mod_ping_session, NULL);
     js_mapi_register(si, e_DESERIALIZE, mod_ping_session, NULL);
     js_mapi_register(si, e_DELIVER, mod_ping_deliver, NULL);
@@ -147,12 +147,16 @@ static jid _mod_presence_whack(jid id, jid ids) {
  * as well as in the intersect list of JabberIDs. If intersect is a NULL pointer the presences are
  * broadcasted to all JabberIDs in the notify list.
  *
+ * The presence has to share its content (see xmlnode_dup_shared() and js_session_presence()),
+ * so that only its attributes are copied for each recipient. The same presence is passed
+ * for all lists, that get it.
+ *
  * @param s the session of the user owning the presence
  * @param notify list of JabberIDs that should be notified
- * @param x the presence that should be broadcasted
+ * @param shared the presence that should be broadcasted
  * @param intersect if non-NULL only send presence to the intersection of notify and intersect
  */
-static void _mod_presence_broadcast(session s, jid notify, xmlnode x, jid intersect) {
+static void _mod_presence_broadcast(session s, jid notify, xmlnode shared, jid intersect) {
     jid cur;
     xmlnode pres;
 
@@ -160,7 +164,8 @@ static void _mod_presence_broadcast(session s, jid notify, xmlnode x, jid inters
         if (intersect != NULL && !_mod_presence_search(cur, intersect, JID_USER|JID_SERVER|JID_RESOURCE))
 	    continue; /* perform insersection search, must be in both */
         s->c_out++;
-        pres = xmlnode_dup(x);
+
+        pres = xmlnode_dup(shared);
         xmlnode_put_attrib_ns(pres, "to", NULL, NULL, jid_full(cur));
         js_deliver(s->si, jpacket_new(pres), s);
     }
@@ -213,8 +218,7 @@ static mreturn mod_presence_in(mapi m, void *arg) {
         } else if (!mp->invisible && js_trust(m->user,m->packet->from) && !_mod_presence_search(m->packet->from, mp->I, JID_USER|JID_SERVER|JID_RESOURCE)) {
 	    /* compliment of I in T */
             log_debug2(ZONE, LOGT_DELIVER, "got a probe, responding to %s",jid_full(m->packet->from));
-            pres = xmlnode_dup(m->s->presence);
-            xmlnode_put_attrib_ns(pres, "to", NULL, NULL, jid_full(m->packet->from));
+            pres = js_session_presence(m->s, m->packet->from);
             js_session_from(m->s, jpacket_new(pres));
         } else if (mp->invisible && js_trust(m->user,m->packet->from) && _mod_presence_search(m->packet->from,mp->A, JID_USER|JID_SERVER|JID_RESOURCE)) {
 	    /* when invisible, intersection of A and T */
@@ -384,7 +388,7 @@ static void mod_peerpresence_store(mapi m) {
  * @return M_IGNORE if the stanza is no presence, M_PASS if the presence has a to attribute, is a probe, or is an error presence, M_HANDLED else
  */
 static mreturn mod_presence_out(mapi m, void *arg) {
-    xmlnode pnew, delay;
+    xmlnode pnew, delay, stamped, shared;
     modpres mp = (modpres)arg;
     session cur = NULL;
     int oldpri, newpri;
@@ -439,19 +443,20 @@ static mreturn mod_presence_out(mapi m, void *arg) {
         return M_HANDLED;
     }
 
-    /* our new presence, keep it */
-    xmlnode_free(m->s->presence);
-    m->s->presence = xmlnode_dup(m->packet->x);
+    /* our new presence, stamp and keep it (it must not be modified once it is installed) */
+    stamped = xmlnode_dup(m->packet->x);
+    delay = xmlnode_insert_tag_ns(stamped, "x", NULL, NS_DELAY);
+    xmlnode_put_attrib_ns(delay, "from", NULL, NULL, jid_full(m->s->id));
+    xmlnode_put_attrib_ns(delay, "stamp", NULL, NULL, jutil_timestamp());
+    js_session_set_presence(m->s, stamped);
     m->s->priority = jutil_priority(m->packet->x);
 
     /* store presence in xdb? */
     if (mp->conf->pres_to_xdb > 0)
 	mod_presence_store(m);
 
-    /* stamp the sessions presence */
-    delay = xmlnode_insert_tag_ns(m->s->presence, "x", NULL, NS_DELAY);
-    xmlnode_put_attrib_ns(delay, "from", NULL, NULL, jid_full(m->s->id));
-    xmlnode_put_attrib_ns(delay, "stamp", NULL, NULL, jutil_timestamp());
+    /* the broadcasted copies are sent without the stamp, they all share the content */
+    shared = xmlnode_dup_shared(m->packet->x);
 
     log_debug2(ZONE, LOGT_DELIVER, "presence oldp %d newp %d",oldpri,m->s->priority);
 
@@ -459,9 +464,9 @@ static mreturn mod_presence_out(mapi m, void *arg) {
     if (m->s->priority < -128) {
         /* jutil_priority returns -129 in case the "type" attribute is missing */
         if(!mp->invisible) /* bcc's don't get told if we were invisible */
-            _mod_presence_broadcast(m->s,mp->conf->bcc,m->packet->x,NULL);
-        _mod_presence_broadcast(m->s,mp->A,m->packet->x,NULL);
-        _mod_presence_broadcast(m->s,mp->I,m->packet->x,NULL);
+            _mod_presence_broadcast(m->s,mp->conf->bcc,shared,NULL);
+        _mod_presence_broadcast(m->s,mp->A,shared,NULL);
+        _mod_presence_broadcast(m->s,mp->I,shared,NULL);
 
         /* reset vars */
         mp->invisible = 0;
@@ -469,13 +474,15 @@ static mreturn mod_presence_out(mapi m, void *arg) {
             mp->A->next = NULL;
         mp->I = NULL;
 
+        xmlnode_free(shared);
         xmlnode_free(m->packet->x);
         return M_HANDLED;
     }
 
     /* available presence updates, intersection of A and T */
     if (oldpri >= -128 && !mp->invisible) {
-        _mod_presence_broadcast(m->s,mp->A,m->packet->x,js_trustees(m->user));
+        _mod_presence_broadcast(m->s,mp->A,shared,js_trustees(m->user));
+        xmlnode_free(shared);
         xmlnode_free(m->packet->x);
         return M_HANDLED;
     }
@@ -485,7 +492,6 @@ static mreturn mod_presence_out(mapi m, void *arg) {
 
     /* send us all presences of our other resources */
     for (cur = m->user->sessions; cur != NULL; cur=cur->next) {
-	pool pool_for_existing_presence = NULL;
 	xmlnode duplicated_presence = NULL;
 	jpacket packet = NULL;
 	
@@ -495,9 +501,7 @@ static mreturn mod_presence_out(mapi m, void *arg) {
 	}
 
 	/* send the presence to us: we need a new pool as js_session_to() will free the packet's pool  */
-	pool_for_existing_presence = pool_new();
-	duplicated_presence = xmlnode_dup_pool(pool_for_existing_presence, cur->presence);
-	xmlnode_put_attrib_ns(duplicated_presence, "to", NULL, NULL, jid_full(m->user->id));
+	duplicated_presence = js_session_presence(cur, m->user->id);
 	packet = jpacket_new(duplicated_presence);
 	js_session_to(m->s, packet);
     }
@@ -506,8 +510,9 @@ static mreturn mod_presence_out(mapi m, void *arg) {
     mod_presence_roster(m,mp->A);
 
     /* we broadcast this baby! */
-    _mod_presence_broadcast(m->s,mp->conf->bcc,m->packet->x,NULL);
-    _mod_presence_broadcast(m->s,mp->A,m->packet->x,NULL);
+    _mod_presence_broadcast(m->s,mp->conf->bcc,shared,NULL);
+    _mod_presence_broadcast(m->s,mp->A,shared,NULL);
+    xmlnode_free(shared);
     xmlnode_free(m->packet->x);
     return M_HANDLED;
 }
@@ -574,14 +579,16 @@ static mreturn mod_presence_avails(mapi m, void *arg) {
  */
 static mreturn mod_presence_avails_end(mapi m, void *arg) {
     modpres mp = (modpres)arg;
+    xmlnode shared = NULL;
 
     log_debug2(ZONE, LOGT_DELIVER, "avail tracker guarantee checker");
 
-    /* send  the current presence (which the server set to unavail) */
-    xmlnode_put_attrib_ns(m->s->presence, "from", NULL, NULL, jid_full(m->s->id));
-    _mod_presence_broadcast(m->s, mp->conf->bcc, m->s->presence, NULL);
-    _mod_presence_broadcast(m->s, mp->A, m->s->presence, NULL);
-    _mod_presence_broadcast(m->s, mp->I, m->s->presence, NULL);
+    /* send  the current presence (which the server set to unavail, including our address) */
+    shared = js_session_presence(m->s, NULL);
+    _mod_presence_broadcast(m->s, mp->conf->bcc, shared, NULL);
+    _mod_presence_broadcast(m->s, mp->A, shared, NULL);
+    _mod_presence_broadcast(m->s, mp->I, shared, NULL);
+    xmlnode_free(shared);
 
     /* store presence in xdb? */
     if (mp->conf->pres_to_xdb > 0)
@@ -346,8 +346,7 @@ static void mod_privacy_no_active_list(jsmi si, session s) {
 
     /* there are no blocked users now, send presence to trustees, that where blocked before */
     for (cur = blocked_trustees; cur != NULL; cur=cur->next) {
-	xmlnode presence = xmlnode_dup(s->presence);
-	xmlnode_put_attrib_ns(presence, "to", NULL, NULL, jid_full(cur));
+	xmlnode presence = js_session_presence(s, cur);
 	js_deliver(si, jpacket_new(presence), s);
     }
 
@@ -694,8 +693,7 @@ static int mod_privacy_activate_list(jsmi si, session s, xmlnode list) {
 	log_debug2(ZONE, LOGT_EXECFLOW, "... not blocked anymore. Send current presence.");
 
 	/* not blocked anymore. send current presence */
-	presence = xmlnode_dup(s->presence);
-	xmlnode_put_attrib_ns(presence, "to", NULL, NULL, jid_full(cur));
+	presence = js_session_presence(s, cur);
 	js_deliver(si, jpacket_new(presence), s);
     }
 
@@ -1632,4 +1630,5 @@ extern "C" void mod_privacy(jsmi si) {
     js_mapi_register(si, e_FILTER_OUT, mod_privacy_filter, (void*)1);
     js_mapi_register(si, e_ROSTERCHANGE, mod_privacy_rosterchange, NULL);
     js_mapi_register(si, e_SERVER, mod_privacy_server, NULL);
+    js_session_prefetch_ns(si, NS_PRIVACY);
 }
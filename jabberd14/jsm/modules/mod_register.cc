@@ -626,7 +626,8 @@ static mreturn _mod_register_iq_server(mapi m, void *arg) {
 extern "C" void mod_register(jsmi si) {
     log_debug2(ZONE, LOGT_INIT, "init");
     js_mapi_register(si, e_REGISTER, mod_register_new, NULL);
-    js_mapi_register(si, e_SERVER, _mod_register_iq_server, NULL);
+    js_mapi_register_filtered(si, e_SERVER, JPACKET_IQ, NS_REGISTER, _mod_register_iq_server, NULL);
+    js_mapi_register_filtered(si, e_SERVER, JPACKET_IQ, NS_DISCO_INFO, _mod_register_iq_server, NULL);
     js_mapi_register(si, e_DELETE, mod_register_delete, NULL);
     js_mapi_register(si, e_PRE_REGISTER, mod_register_check, NULL);
 }
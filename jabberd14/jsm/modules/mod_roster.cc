@@ -197,7 +197,7 @@ static void mod_roster_pforce(udata u, jid to, int uflag) {
         if (uflag)
             x = jutil_presnew(JPACKET__UNAVAILABLE,NULL,NULL);
         else
-            x = xmlnode_dup(s->presence);
+            x = js_session_presence(s, NULL);
         xmlnode_put_attrib_ns(x, "to", NULL, NULL, jid_full(to));
         js_session_from(s,jpacket_new(x));
     }
@@ -272,7 +272,7 @@ static mreturn mod_roster_out_s10n(mapi m) {
 		/* XMPP IM, sect. 9 states "None + Pending In", "None + Pending Out/In", and "To + Pending In" */
 		route = 1;
 		mod_roster_set_s10n(1, to, item); /* update subscription */
-		jid_append(js_trustees(m->user), m->packet->to); /* make them trusted now */
+		js_add_trustee(m->user, m->packet->to); /* make them trusted now */
 		xmlnode_hide_attrib_ns(item, "subscribe", NULL); /* reset "Pending In" */
 		xmlnode_hide_attrib_ns(item, "hidden", NULL); /* make it visible on the user's roster */
 		mod_roster_pforce(m->user, m->packet->to, 0); /* they are now subscribed to us, send them our presence */
@@ -621,7 +621,7 @@ static mreturn mod_roster_s10n(mapi m, void *arg) {
 		xmlnode_hide_attrib_ns(item, "ask", NULL);
 		mod_roster_set_s10n(from, 1, item);
 		push = 1;
-		jid_append(js_seen_jids(m->user), m->packet->from); /* make them seen now */
+		js_add_seen(m->user, m->packet->from); /* make them seen now */
 	    }
 	    break;
 	case JPACKET__UNSUBSCRIBE:
@@ -782,4 +782,5 @@ extern "C" void mod_roster(jsmi si) {
     js_mapi_register(si,e_DESERIALIZE, mod_roster_session, NULL);
     js_mapi_register(si,e_DELIVER,mod_roster_s10n,NULL);
     js_mapi_register(si, e_DELETE, mod_roster_delete, NULL);
+    js_session_prefetch_ns(si, NS_ROSTER);
 }
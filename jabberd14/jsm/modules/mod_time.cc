@@ -147,5 +147,6 @@ static mreturn mod_time_iq_server(mapi m, void *arg) {
  * @param si the session manager instance
  */
 extern "C" void mod_time(jsmi si) {
-    js_mapi_register(si,e_SERVER, mod_time_iq_server,NULL);
+    js_mapi_register_filtered(si, e_SERVER, JPACKET_IQ, NS_TIME, mod_time_iq_server, NULL);
+    js_mapi_register_filtered(si, e_SERVER, JPACKET_IQ, NS_DISCO_INFO, mod_time_iq_server, NULL);
 }
@@ -279,6 +279,6 @@ extern "C" void mod_vcard(jsmi si) {
     js_mapi_register(si,e_SESSION,mod_vcard_session,NULL);
     js_mapi_register(si,e_DESERIALIZE, mod_vcard_session, NULL);
     js_mapi_register(si,e_OFFLINE,mod_vcard_reply,NULL);
-    js_mapi_register(si,e_SERVER,mod_vcard_server,NULL);
+    js_mapi_register_filtered(si, e_SERVER, JPACKET_IQ, NS_VCARD, mod_vcard_server, NULL);
     js_mapi_register(si, e_DELETE, mod_vcard_delete, NULL);
 }
@@ -197,7 +197,8 @@ extern "C" void mod_version(jsmi si) {
 	mi->os = pstrdup(p, system.str().c_str());
     }
 
-    js_mapi_register(si,e_SERVER,mod_version_iq_server,(void *)mi);
+    js_mapi_register_filtered(si, e_SERVER, JPACKET_IQ, NS_VERSION, mod_version_iq_server, (void *)mi);
+    js_mapi_register_filtered(si, e_SERVER, JPACKET_IQ, NS_DISCO_INFO, mod_version_iq_server, (void *)mi);
     js_mapi_register(si,e_SHUTDOWN,mod_version_shutdown,(void *)mi);
     xmlnode_free(config);
 }
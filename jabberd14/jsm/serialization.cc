@@ -229,6 +229,7 @@ static void _jsm_deserialize_session(jsmi si, const jid user_jid, const char *re
     /* getting linked with the user */
     s->next = s->u->sessions;
     s->u->sessions = s;
+    js_user_sessions_changed(s->u);
 
     /* for sc protocol: get inserted in the hash */
     xhash_put(s->si->sc_sessions, s->sc_sm, u);
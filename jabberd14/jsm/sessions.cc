@@ -200,6 +200,7 @@ session js_session_new(jsmi si, dpacket dp) {
     /* make sure we're linked with the user */
     s->next = s->u->sessions;
     s->u->sessions = s;
+    js_user_sessions_changed(s->u);
     /*
     s->u->scount++;
     */
@@ -299,6 +300,7 @@ session js_sc_session_new(jsmi si, dpacket dp, xmlnode sc_session) {
     /* make sure we're linked with the user */
     s->next = s->u->sessions;
     s->u->sessions = s;
+    js_user_sessions_changed(s->u);
     /*
     s->u->scount++;
     */
@@ -347,11 +349,8 @@ void js_session_end(session s, char *reason) {
         x = jutil_presnew(JPACKET__UNAVAILABLE, NULL, messages_get(xmlnode_get_lang(s->presence), reason));
         xmlnode_put_attrib_ns(x, "from", NULL, NULL, jid_full(s->id));
 
-        /* free the old presence packet */
-        xmlnode_free(s->presence);
-
-        /* install the presence */
-        s->presence = x;
+        /* install the presence, the old one is freed */
+        js_session_set_presence(s, x);
 
     }
 
@@ -369,6 +368,9 @@ void js_session_end(session s, char *reason) {
         cur->next = s->next;
     }
 
+    /* without sessions the user may be removed from memory again */
+    js_user_sessions_changed(s->u);
+
     /* we don't have to find this session for session end requests anymore */
     if (s->sc_sm != NULL) {
 	xhash_zap(s->si->sc_sessions, s->sc_sm);
@@ -391,6 +393,10 @@ void js_session_end(session s, char *reason) {
 void _js_session_start(void *arg) {
     session s = (session)arg;
 
+    /* query what the modules will read at once, instead of one namespace after the other */
+    if (s->si->session_ns != NULL)
+	xdb_prefetch(s->si->xc, s->u->id, &(*s->si->session_ns)[0], s->si->session_ns->size());
+
     /* let the modules go to it */
     js_mapi_call(s->si, e_SESSION, NULL, s->u, s);
 
@@ -464,8 +470,8 @@ void _js_session_from(void *arg) {
 	}
     }
     /* don't store events */
-    if (store_history && xmlnode_get_list_item(xmlnode_get_tags(p->x, "*[@xmlns='" NS_EVENT "']", s->si->std_namespace_prefixes), 0) != NULL)
-	if (xmlnode_get_list_item(xmlnode_get_tags(p->x, "body", s->si->std_namespace_prefixes), 0) == NULL)
+    if (store_history && xmlnode_get_first_tag(p->x, "*[@xmlns='" NS_EVENT "']", s->si->std_namespace_prefixes) != NULL)
+	if (xmlnode_get_first_tag(p->x, "body", s->si->std_namespace_prefixes) == NULL)
 	    store_history = 0;
 
     if (store_history) {
@@ -569,8 +575,8 @@ void _js_session_to(void *arg)
 	}
     }
     /* don't store events */
-    if (store_history && xmlnode_get_list_item(xmlnode_get_tags(p->x, "*[@xmlns='" NS_EVENT "']", s->si->std_namespace_prefixes), 0) != NULL)
-	if (xmlnode_get_list_item(xmlnode_get_tags(p->x, "body", s->si->std_namespace_prefixes), 0) == NULL)
+    if (store_history && xmlnode_get_first_tag(p->x, "*[@xmlns='" NS_EVENT "']", s->si->std_namespace_prefixes) != NULL)
+	if (xmlnode_get_first_tag(p->x, "body", s->si->std_namespace_prefixes) == NULL)
 	    store_history = 0;
 
     if (store_history) {
@@ -618,7 +624,7 @@ void _js_session_end(void *arg) {
     s->u->ref--;
 
     /* free the session's presence state */
-    xmlnode_free(s->presence);
+    js_session_set_presence(s, NULL);
 
     /* free the session's memory pool */
     pool_free(s->p);
@@ -655,6 +661,48 @@ session js_session_get(udata user, char const* res) {
     return NULL;
 }
 
+/**
+ * replace the current presence of a session
+ *
+ * The presence must not be modified anymore, once copies have been requested using js_session_presence().
+ *
+ * @param s the session
+ * @param presence the new presence (the session takes ownership of it)
+ */
+void js_session_set_presence(session s, xmlnode presence) {
+    xmlnode_free(s->presence);
+    s->presence = presence;
+
+    /* the copies of the old presence cannot be used anymore */
+    xmlnode_free(s->presence_shared);
+    s->presence_shared = NULL;
+}
+
+/**
+ * get a copy of the current presence of a session to send it to an entity
+ *
+ * The content of the presence is serialized only once and shared by all copies, until
+ * the presence of the session is replaced. Only the attributes are copied for each copy.
+ *
+ * @param s the session
+ * @param to the entity the presence is sent to (NULL to not set the 'to' attribute)
+ * @return the copy of the presence, NULL if the session has no presence
+ */
+xmlnode js_session_presence(session s, jid to) {
+    xmlnode presence = NULL;
+
+    if (s->presence == NULL)
+	return NULL;
+
+    if (s->presence_shared == NULL)
+	s->presence_shared = xmlnode_dup_shared(s->presence);
+
+    presence = xmlnode_dup(s->presence_shared);
+    if (to != NULL)
+	xmlnode_put_attrib_ns(presence, "to", NULL, NULL, jid_full(to));
+    return presence;
+}
+
 /**
  * find the primary session for the user
  *
@@ -732,3 +780,39 @@ void js_session_from(session s, jpacket p)
     p->aux1 = (void *)s;
     mtq_send(s->q, p->p, _js_session_from, (void *)p);
 }
+
+/**
+ * pool cleaner that deletes the list of namespaces prefetched when a session starts
+ *
+ * @param arg the list to delete
+ */
+static void _js_session_prefetch_ns_free(void *arg) {
+    delete static_cast<std::vector<char const*>*>(arg);
+}
+
+/**
+ * register a namespace, that a module reads from the xdb when a session starts
+ *
+ * All registered namespaces are queried at once before the e_SESSION event is called,
+ * the first xdb_get() for each of them gets its result without waiting for the xdb again.
+ * Modules call this from their init function.
+ *
+ * @param si the session manager instance
+ * @param ns the namespace (has to be valid as long as the instance exists)
+ */
+void js_session_prefetch_ns(jsmi si, char const* ns) {
+    if (si == NULL || ns == NULL)
+	return;
+
+    if (si->session_ns == NULL) {
+	si->session_ns = new std::vector<char const*>;
+	pool_cleanup(si->p, _js_session_prefetch_ns_free, si->session_ns);
+    }
+
+    /* already registered by another module? */
+    for (std::vector<char const*>::const_iterator i = si->session_ns->begin(); i != si->session_ns->end(); ++i)
+	if (j_strcmp(*i, ns) == 0)
+	    return;
+
+    si->session_ns->push_back(ns);
+}
@@ -39,61 +39,184 @@
  */
 
 /**
- * structure used to pass a hashtable and a counter to _js_users_del()
+ * check if a user is in the list of users, that can be removed from memory
+ *
+ * @param si the session manager instance data
+ * @param u the user
+ * @return 1 if the user is in the list, 0 else
  */
-typedef struct ht_count_struct {
-    xht ht;		/**< hashtable containing the users of a host */
-    int *count;		/**< reference to the counter for the number of online users */
-} *ht_count, _ht_count;
+static int _js_users_listed(jsmi si, udata u) {
+    return u->newer != NULL || u->older != NULL || si->users.newest == u;
+}
 
 /**
- * call-back for deleting user from the hash table
- *  
- * This function is called periodically by the user data garbage collection
- * thread. It removes users aren't logged in from the global hashtable.
+ * remove a user from the list of users, that can be removed from memory
+ *
+ * @param si the session manager instance data
+ * @param u the user
+ */
+static void _js_users_unlist(jsmi si, udata u) {
+    if (u->newer != NULL)
+	u->newer->older = u->older;
+    else if (si->users.newest == u)
+	si->users.newest = u->older;
+
+    if (u->older != NULL)
+	u->older->newer = u->newer;
+    else if (si->users.oldest == u)
+	si->users.oldest = u->newer;
+
+    u->newer = NULL;
+    u->older = NULL;
+}
+
+/**
+ * mark a user as used, making it the newest in the list of users, that can be removed from memory
+ *
+ * @param si the session manager instance data
+ * @param u the user
+ */
+static void _js_users_touch(jsmi si, udata u) {
+    _js_users_unlist(si, u);
+
+    u->last_used = time(NULL);
+    u->older = si->users.newest;
+    if (si->users.newest != NULL)
+	si->users.newest->newer = u;
+    si->users.newest = u;
+    if (si->users.oldest == NULL)
+	si->users.oldest = u;
+}
+
+/**
+ * remove users from memory, starting with the least recently used ones
+ *
+ * Users are removed, if they have not been used for the configured idle time, or if there are more users
+ * in memory than configured and they have not been used in the current second.
+ *
+ * @param si the session manager instance data
+ * @param budget maximum number of users to check
+ */
+static void _js_users_trim(jsmi si, int budget) {
+    time_t now = time(NULL);
+
+    while (budget-- > 0 && si->users.oldest != NULL) {
+	udata u = si->users.oldest;
+	int over_limit = si->users.max > 0 && si->users.resident > si->users.max;
+
+	/* all other users have been used more recently */
+	if (now - u->last_used < si->users.idle && !(over_limit && u->last_used < now))
+	    break;
+
+	/* locked? keep it for now */
+	if (u->ref > 0) {
+	    _js_users_touch(si, u);
+	    continue;
+	}
+
+	log_debug2(ZONE, LOGT_SESSION, "freeing %s", u->id->get_node().c_str());
+
+	_js_users_unlist(si, u);
+	xht ht = static_cast<xht>(xhash_get(si->hosts, u->id->get_domain().c_str()));
+	if (ht != NULL && xhash_get(ht, u->id->get_node().c_str()) == u)
+	    xhash_zap(ht, u->id->get_node().c_str());
+	si->users.resident--;
+	si->users.evictions++;
+	pool_free(u->p);
+    }
+}
+
+/**
+ * update the list of users, that can be removed from memory, after the sessions of a user changed
+ *
+ * Users with sessions are not in the list, users without sessions are added as the most recently used.
+ *
+ * @param u the user
+ */
+void js_user_sessions_changed(udata u) {
+    if (u == NULL)
+	return;
+
+    if (u->sessions != NULL) {
+	_js_users_unlist(u->si, u);
+    } else {
+	_js_users_touch(u->si, u);
+    }
+}
+
+/**
+ * check if a user is cached to not exist
  *
- * @param h the hash table containing the users of the presently cleaned host
- * @param key the user
- * @param data the user's data
- * @param arg structure holding the hashtable of hosts and the user counter
+ * @param si the session manager instance data
+ * @param uid the bare JID of the user
+ * @return 1 if the user is known not to exist, 0 else
  */
-void _js_users_del(xht h, const char *key, void *data, void *arg)
-{
-    ht_count htc = (ht_count)arg;
-    udata u = (udata)data;	/* cast the pointer into udata */
-
-    /*
-     * if the reference count for this user's record
-     * is positive, or if there are active sessions
-     * we can't free it, so return immediately
-     */
-    if(u->ref > 0 || (u->sessions != NULL && ++*(htc->count)))
-        return;
-
-    log_debug2(ZONE, LOGT_SESSION, "freeing %s", u->id->get_node().c_str());
-
-    xhash_zap(htc->ht, key);
-    pool_free(u->p);
+static int _js_user_unknown(jsmi si, jid uid) {
+    if (si->unknown_users.users == NULL)
+	return 0;
+
+    xmppd::xhash<time_t>::iterator entry = si->unknown_users.users->find(jid_full(uid));
+    if (entry == si->unknown_users.users->end())
+	return 0;
+
+    /* expired? */
+    if (entry->second < time(NULL)) {
+	si->unknown_users.users->erase(entry);
+	return 0;
+    }
+
+    return 1;
 }
 
+/**
+ * remove the expired entries from the cache of users, that do not exist
+ *
+ * @param si the session manager instance data
+ */
+static void _js_user_unknown_expire(jsmi si) {
+    if (si->unknown_users.users == NULL)
+	return;
+
+    time_t now = time(NULL);
+    for (xmppd::xhash<time_t>::iterator entry = si->unknown_users.users->begin(); entry != si->unknown_users.users->end(); ++entry) {
+	if (entry->second < now)
+	    si->unknown_users.users->erase(entry);
+    }
+}
 
 /**
- * xhash_walker callback for walking the host hash tree
+ * remember, that a user does not exist
  *
- * @param h the hash table containing all hosts
- * @param key the host for which the callback ist called
- * @param data the hashtable containing the users of this host
- * @param arg pointer to the user counter
+ * @param si the session manager instance data
+ * @param uid the bare JID of the user
  */
-void _js_hosts_del(xht h, const char *key, void *data, void *arg)
-{
-    _ht_count htc;
-    htc.ht = (xht)data;
-    htc.count = (int*)arg;
+static void _js_user_unknown_add(jsmi si, jid uid) {
+    if (si->unknown_users.users == NULL)
+	return;
+
+    /* keep the cache bounded, if there are no expired entries to remove, start again with an empty cache */
+    if (si->unknown_users.users->size() >= static_cast<size_t>(si->unknown_users.max)) {
+	_js_user_unknown_expire(si);
+	if (si->unknown_users.users->size() >= static_cast<size_t>(si->unknown_users.max))
+	    si->unknown_users.users->clear();
+    }
+
+    (*si->unknown_users.users)[jid_full(uid)] = time(NULL) + si->unknown_users.ttl;
+}
 
-    log_debug2(ZONE, LOGT_SESSION, "checking users for host %s",(char*)key);
+/**
+ * forget, that a user has been looked up and did not exist
+ *
+ * This has to be called, when a user account has been created.
+ *
+ * @param si the session manager instance data
+ * @param id the user
+ */
+void js_user_known(jsmi si, jid id) {
+    if (si == NULL || id == NULL || si->unknown_users.users == NULL)
+	return;
 
-    xhash_walk(htc.ht, _js_users_del, &htc);
+    si->unknown_users.users->erase(jid_full(jid_user(id)));
 }
 
 #ifdef POOL_DEBUG
@@ -195,7 +318,10 @@ static void js_hosts_pool_debug_walk(xht hash, const char* key, void* value, voi
 #endif
 
 /**
- *  js_users_gc is a heartbeat that flushes old users from memory.  
+ *  js_users_gc is a heartbeat that flushes old users from memory.
+ *
+ *  Only a limited number of the least recently used users is checked on each call,
+ *  statistics are logged every five minutes.
  *
  *  @param arg the session manager internal data
  *  @return always r_DONE
@@ -203,10 +329,19 @@ static void js_hosts_pool_debug_walk(xht hash, const char* key, void* value, voi
 result js_users_gc(void *arg) {
     jsmi si = (jsmi)arg;
 
-    /* free user struct if we can */
-    int js__usercount = 0;
-    xhash_walk(si->hosts,_js_hosts_del, &js__usercount);
-    log_debug2(ZONE, LOGT_STATUS, "%d\ttotal users",js__usercount);
+    /* free user structs if we can */
+    _js_users_trim(si, si->users.batch);
+
+    /* time for statistics? */
+    time_t now = time(NULL);
+    if (now - si->users.stats_logged < 300)
+	return r_DONE;
+    si->users.stats_logged = now;
+
+    log_notice(si->i->id, "user cache: %lu users in memory, %lu loaded, %lu removed", si->users.resident, si->users.loads, si->users.evictions);
+
+    /* forget about expired unknown users */
+    _js_user_unknown_expire(si);
 
 #ifdef POOL_DEBUG
     js_pool_debug_stats* stats = new js_pool_debug_stats;
@@ -251,6 +386,9 @@ udata js_user(jsmi si, jid id, xht ht) {
     char *ustr;
     xmlnode x, y;
     jid uid;
+    static char const* const auth_namespaces[] = { NS_AUTH, NS_AUTH_CRYPT };
+    int failed = 0;
+    int failed_crypt = 0;
 
     if (si == NULL || id == NULL || !id->has_node())
 	return NULL;
@@ -274,21 +412,49 @@ udata js_user(jsmi si, jid id, xht ht) {
     log_debug2(ZONE, LOGT_SESSION, "js_user(%s,%X)",jid_full(uid),ht);
 
     /* try to get the user data from the hash table */
-    if ((cur = static_cast<udata>(xhash_get(ht,uid->get_node().c_str()))) != NULL)
+    if ((cur = static_cast<udata>(xhash_get(ht,uid->get_node().c_str()))) != NULL) {
+	if (_js_users_listed(si, cur))
+	    _js_users_touch(si, cur);
         return cur;
+    }
 
     /* debug message */
     log_debug2(ZONE, LOGT_SESSION, "## js_user not current ##");
 
+    /* did we check recently, that this user does not exist? */
+    if (_js_user_unknown(si, uid)) {
+	log_debug2(ZONE, LOGT_SESSION, "%s is cached to not exist", jid_full(uid));
+	return NULL;
+    }
+
     /* try to get the user auth data from xdb */
-    x = xdb_get(si->xc, uid, NS_AUTH);
+    xdb_get_multi(si->xc, uid, &auth_namespaces[0], 1, &x, &failed);
 
     /* try to get hashed user auth data from xdb, if there was no plain data */
-    y = (x == NULL) ? xdb_get(si->xc, uid, NS_AUTH_CRYPT) : NULL;
+    y = NULL;
+    if (x == NULL) {
+	xdb_get_multi(si->xc, uid, &auth_namespaces[1], 1, &y, &failed_crypt);
+	failed = failed || failed_crypt;
+    }
+
+    /* another thread could have loaded the user while we waited for the xdb */
+    if ((cur = static_cast<udata>(xhash_get(ht,uid->get_node().c_str()))) != NULL) {
+	xmlnode_free(x);
+	xmlnode_free(y);
+	if (_js_users_listed(si, cur))
+	    _js_users_touch(si, cur);
+	return cur;
+    }
 
     /* does the user exist? */
-    if (x == NULL && y == NULL)
+    if (x == NULL && y == NULL) {
+	/* only remember users, that the xdb reported to have no data, not errors or timeouts */
+	if (failed)
+	    log_notice(si->i->id, "could not check if %s exists, xdb query failed", jid_full(uid));
+	else
+	    _js_user_unknown_add(si, uid);
 	return NULL;
+    }
 
     /* create a udata struct */
     p = pool_heap(64);
@@ -307,6 +473,13 @@ udata js_user(jsmi si, jid id, xht ht) {
     /* got the user, add it to the user list */
     xhash_put(ht, newu->id->get_node().c_str(), newu);
     log_debug2(ZONE, LOGT_SESSION, "js_user debug %X %X", xhash_get(ht, newu->id->get_node().c_str()), newu);
+    _js_users_touch(si, newu);
+    si->users.resident++;
+    si->users.loads++;
+
+    /* too many users in memory? */
+    if (si->users.max > 0 && si->users.resident > si->users.max)
+	_js_users_trim(si, 8);
 
     return newu;
 }
@@ -319,6 +492,8 @@ udata js_user(jsmi si, jid id, xht ht) {
  * @return 1 if the call was handled by a module, 0 if not
  */
 int js_user_create(jsmi si, jid id) {
+    js_user_known(si, id);
+
     udata u = js_user(si, id, NULL); /* XXX: flag it as unconditional */
     if (u != NULL) {
 	return js_mapi_call(si, e_CREATE, NULL, u, NULL);
@@ -117,6 +117,115 @@ int js_islocal(jsmi si, jid id) {
     return 1;
 }
 
+/**
+ * get the key of a jid in the index of a trust or seen list
+ *
+ * A jid without node matches the whole domain, so it is indexed by its domain only.
+ *
+ * @param id the jid to get the key for
+ * @return the key
+ */
+static const char* _js_jidlist_key(jid id) {
+    return id->has_node() ? jid_full(id) : id->get_domain().c_str();
+}
+
+/**
+ * pool_cleanup() callback freeing the index of a trust or seen list
+ *
+ * @param arg the index to free
+ */
+static void _js_jidlist_free_index(void *arg) {
+    xhash_free(static_cast<xht>(arg));
+}
+
+/**
+ * add a jid to a trust or seen list and to its index
+ *
+ * New entries are added after the first entry, which is the user itself, so adding does not need to walk the list.
+ *
+ * @param list the list to add the jid to
+ * @param index the index of the list
+ * @param id the jid to add
+ */
+static void _js_jidlist_add(jid list, xht index, jid id) {
+    if (list == NULL || index == NULL || id == NULL)
+	return;
+
+    jid existing = static_cast<jid>(xhash_get(index, _js_jidlist_key(id)));
+    if (existing != NULL) {
+	/* different jids without node in the same domain share a key, only these need a look at the list */
+	if (jid_cmp(existing, id) != 0)
+	    jid_append(list, id);
+	return;
+    }
+
+    jid entry = jid_new(list->get_pool(), jid_full(id));
+    entry->next = list->next;
+    list->next = entry;
+    xhash_put(index, _js_jidlist_key(entry), entry);
+}
+
+/**
+ * remove a user from a trust or seen list and from its index
+ *
+ * @param list pointer to the list to remove the user from
+ * @param index the index of the list
+ * @param id the user to remove (all entries with the same node and domain are removed)
+ */
+static void _js_jidlist_remove(jid *list, xht index, jid id) {
+    jid iter = NULL;
+    jid previous = NULL;
+
+    /* sanity check */
+    if (id == NULL)
+	return;
+
+    /* scan list and remove */
+    for (iter = *list; iter != NULL; iter = iter->next) {
+	if (jid_cmpx(iter, id, JID_USER|JID_SERVER) != 0) {
+	    previous = iter;
+	    continue;
+	}
+
+	/* match ... remove this one */
+	xhash_zap(index, _js_jidlist_key(iter));
+
+	/* first entry in list? */
+	if (previous == NULL) {
+	    *list = iter->next;
+	} else {
+	    previous->next = iter->next;
+	}
+    }
+}
+
+/**
+ * check if a jid is matched by an entry of a trust or seen list
+ *
+ * An entry without node matches any jid of its domain, an entry without resource matches any resource of its user.
+ *
+ * @param index the index of the list
+ * @param id the jid to check
+ * @return 0 if it did not match, 1 if it did match
+ */
+static int _js_jidlist_match(xht index, jid id) {
+    if (xhash_get(index, id->get_domain().c_str()) != NULL)
+	return 1;
+    if (!id->has_node())
+	return 0;
+
+    /* bare jid if there is no resource, full jid else */
+    if (xhash_get(index, jid_full(id)) != NULL)
+	return 1;
+    if (!id->has_resource())
+	return 0;
+
+    std::string bare(id->get_node());
+    bare += '@';
+    bare += id->get_domain();
+    return xhash_get(index, bare.c_str()) != NULL ? 1 : 0;
+}
+
 /**
  * get the list of jids, that are subscribed to a given user, and the jids a given user is subscribed to
  *
@@ -132,6 +241,18 @@ static void _js_get_trustlists(udata u) {
     /* initialize with at least self */
     u->utrust = jid_user(u->id);
     u->useen = jid_user(u->id);
+    if (u->utrust_index == NULL) {
+	u->utrust_index = xhash_new(101);
+	u->useen_index = xhash_new(101);
+	pool_cleanup(u->p, _js_jidlist_free_index, u->utrust_index);
+	pool_cleanup(u->p, _js_jidlist_free_index, u->useen_index);
+    } else {
+	/* lists are generated again, after they have been emptied */
+	u->utrust_index->clear();
+	u->useen_index->clear();
+    }
+    xhash_put(u->utrust_index, _js_jidlist_key(u->utrust), u->utrust);
+    xhash_put(u->useen_index, _js_jidlist_key(u->useen), u->useen);
 
     /* fill in rest from roster */
     roster = xdb_get(u->si->xc, u->id, NS_ROSTER);
@@ -139,12 +260,12 @@ static void _js_get_trustlists(udata u) {
 	subscription = xmlnode_get_attrib_ns(cur, "subscription", NULL);
 
 	if (j_strcmp(subscription, "from") == 0) {
-            jid_append(u->utrust, jid_new(u->p, xmlnode_get_attrib_ns(cur, "jid", NULL)));
+            _js_jidlist_add(u->utrust, u->utrust_index, jid_new(u->p, xmlnode_get_attrib_ns(cur, "jid", NULL)));
 	} else if (j_strcmp(subscription, "both") == 0) {
-            jid_append(u->utrust, jid_new(u->p, xmlnode_get_attrib_ns(cur, "jid", NULL)));
-            jid_append(u->useen, jid_new(u->p, xmlnode_get_attrib_ns(cur, "jid", NULL)));
+            _js_jidlist_add(u->utrust, u->utrust_index, jid_new(u->p, xmlnode_get_attrib_ns(cur, "jid", NULL)));
+            _js_jidlist_add(u->useen, u->useen_index, jid_new(u->p, xmlnode_get_attrib_ns(cur, "jid", NULL)));
 	} else if (j_strcmp(subscription, "to") == 0) {
-            jid_append(u->useen, jid_new(u->p, xmlnode_get_attrib_ns(cur, "jid", NULL)));
+            _js_jidlist_add(u->useen, u->useen_index, jid_new(u->p, xmlnode_get_attrib_ns(cur, "jid", NULL)));
 	}
     }
     xmlnode_free(roster);
@@ -185,89 +306,59 @@ jid js_seen_jids(udata u) {
 }
 
 /**
- * remove a user from the list of trustees
+ * add a user to the list of trustees
  *
- * @param u from which user's trustees list the user 'id' should be removed
- * @param id which user should be removed
+ * @param u to which user's trustees list the user 'id' should be added
+ * @param id which user should be added
  */
-void js_remove_trustee(udata u, jid id) {
-    jid iter = NULL;
-    jid previous = NULL;
-
-    /* sanity check */
+void js_add_trustee(udata u, jid id) {
     if (u == NULL || id == NULL)
 	return;
 
-    /* scan list and remove */
-    for (iter = u->utrust; iter != NULL; iter = iter->next) {
-	if (jid_cmpx(iter, id, JID_USER|JID_SERVER) == 0) {
-	    /* match ... remove this one */
+    jid list = js_trustees(u);
+    _js_jidlist_add(list, u->utrust_index, id);
+}
 
-	    /* first entry in list? */
-	    if (previous == NULL) {
-		u->utrust = iter->next;
-	    } else {
-		previous->next = iter->next;
+/**
+ * add a user to the list of seen users
+ *
+ * @param u to which user's seen list the user 'id' should be added
+ * @param id which user should be added
+ */
+void js_add_seen(udata u, jid id) {
+    if (u == NULL || id == NULL)
+	return;
 
-	    }
-	}
-	previous = iter;
-    }
+    jid list = js_seen_jids(u);
+    _js_jidlist_add(list, u->useen_index, id);
 }
 
 /**
- * remove a user from the list of seen users
+ * remove a user from the list of trustees
  *
- * @param u from which user's seen list the user 'id' should be removed
+ * @param u from which user's trustees list the user 'id' should be removed
  * @param id which user should be removed
  */
-void js_remove_seen(udata u, jid id) {
-    jid iter = NULL;
-    jid previous = NULL;
-
+void js_remove_trustee(udata u, jid id) {
     /* sanity check */
-    if (u == NULL || id == NULL)
+    if (u == NULL || id == NULL || u->utrust == NULL)
 	return;
 
-    /* scan list and remove */
-    for (iter = u->useen; iter != NULL; iter = iter->next) {
-	if (jid_cmpx(iter, id, JID_USER|JID_SERVER) == 0) {
-	    /* match ... remove this one */
-
-	    /* first entry in list? */
-	    if (previous == NULL) {
-		u->useen = iter->next;
-	    } else {
-		previous->next = iter->next;
-
-	    }
-	}
-	previous = iter;
-    }
+    _js_jidlist_remove(&u->utrust, u->utrust_index, id);
 }
 
 /**
- * this tries to be a smarter jid matcher, where a "host" matches any "user@host" and "user@host" matches "user@host/resource"
+ * remove a user from the list of seen users
  *
- * @param id the jid that should be checked
- * @param match the jid that should be matched
- * @return 0 if it did not match, 1 if it did match
+ * @param u from which user's seen list the user 'id' should be removed
+ * @param id which user should be removed
  */
-int _js_jidscanner(jid id, jid match) {
-    for (;id != NULL; id = id->next) {
-	if (id->get_domain() != match->get_domain())
-	    continue;
-        if (!id->has_node())
-	    return 1;
-	if (id->get_node() != match->get_node())
-	    continue;
-        if (!id->has_resource())
-	    return 1;
-	if (id->get_resource() != match->get_resource())
-	    continue;
-        return 1;
-    }
-    return 0;
+void js_remove_seen(udata u, jid id) {
+    /* sanity check */
+    if (u == NULL || id == NULL || u->useen == NULL)
+	return;
+
+    _js_jidlist_remove(&u->useen, u->useen_index, id);
 }
 
 /**
@@ -282,7 +373,8 @@ int js_trust(udata u, jid id) {
 	return 0;
 
     /* first check user trusted ids */
-    if (_js_jidscanner(js_trustees(u), id))
+    js_trustees(u);
+    if (_js_jidlist_match(u->utrust_index, id))
 	return 1;
 
     /* then check global acl */
@@ -304,14 +396,9 @@ int js_seen(udata u, jid id) {
     if (u == NULL || id == NULL)
 	return 0;
 
-    /* first, check global seen ids */
-    /*
-    if (_js_jidscanner(u->si->gseen, id))
-	return 1;
-    */
-
-    /* then check user seen ids */
-    if (_js_jidscanner(js_seen_jids(u), id))
+    /* check user seen ids */
+    js_seen_jids(u);
+    if (_js_jidlist_match(u->useen_index, id))
 	return 1;
 
     return 0;
@@ -184,7 +184,7 @@ static result pthsock_client_packets(instance id, dpacket p, void *arg) {
     else if(cdcur->state == state_UNKNOWN && j_strcmp(xmlnode_get_attrib_ns(p->x, "type", NULL), "auth") == 0) {
 	/* look for our auth packet back */
         char *type = xmlnode_get_attrib_ns(xmlnode_get_firstchild(p->x), "type", NULL);
-        char *id   = xmlnode_get_attrib_ns(xmlnode_get_list_item(xmlnode_get_tags(p->x, "iq", s__i->std_namespace_prefixes), 0), "id", NULL);
+        char *id   = xmlnode_get_attrib_ns(xmlnode_get_first_tag(p->x, "iq", s__i->std_namespace_prefixes), "id", NULL);
         if ((j_strcmp(type, "result") == 0) && j_strcmp(cdcur->auth_id, id) == 0) {
 	    /* update the cdata status if it's a successfull auth */
             xmlnode x;
@@ -194,7 +194,7 @@ static result pthsock_client_packets(instance id, dpacket p, void *arg) {
             log_debug2(ZONE, LOGT_SESSION, "[%s] requesting Session Start for %s", ZONE, xmlnode_get_attrib_ns(p->x, "from", NULL));
             deliver(dpacket_new(x), s__i->i);
         } else if (j_strcmp(type,"error") == 0) {
-            log_record(jid_full(jid_user(cdcur->session_id)), "login", "fail", "%s %s %s", mio_ip(cdcur->m), xmlnode_get_attrib_ns(xmlnode_get_list_item(xmlnode_get_tags(p->x, "iq/error", s__i->std_namespace_prefixes), 0), "code", NULL), cdcur->session_id->get_resource().c_str());
+            log_record(jid_full(jid_user(cdcur->session_id)), "login", "fail", "%s %s %s", mio_ip(cdcur->m), xmlnode_get_attrib_ns(xmlnode_get_first_tag(p->x, "iq/error", s__i->std_namespace_prefixes), "code", NULL), cdcur->session_id->get_resource().c_str());
         }
     } else if (cdcur->state == state_UNKNOWN && j_strcmp(xmlnode_get_attrib_ns(p->x, "type", NULL), "session") == 0) {
 	/* got a session reply from the server */
@@ -376,8 +376,8 @@ static void pthsock_client_read(mio m, int flag, void *arg, xmlnode x, char* unu
 	    cd = (cdata)arg;
 	    if (cd->state == state_UNKNOWN) {
 		/* only allow auth and registration queries at this point */
-		xmlnode q_auth = xmlnode_get_list_item(xmlnode_get_tags(x, "auth:query", cd->si->std_namespace_prefixes), 0);
-		xmlnode q_register = xmlnode_get_list_item(xmlnode_get_tags(x, "register:query", cd->si->std_namespace_prefixes), 0);
+		xmlnode q_auth = xmlnode_get_first_tag(x, "auth:query", cd->si->std_namespace_prefixes);
+		xmlnode q_register = xmlnode_get_first_tag(x, "register:query", cd->si->std_namespace_prefixes);
 		if (j_strcmp(xmlnode_get_localname(x), "starttls") == 0 && j_strcmp(xmlnode_get_namespace(x), NS_XMPP_TLS) == 0) {
 		    /* starting TLS possible? */
 		    if (mio_ssl_starttls_possible(m, cd->session_id->get_domain().c_str())) {
@@ -409,26 +409,26 @@ static void pthsock_client_read(mio m, int flag, void *arg, xmlnode x, char* unu
 		} else if (q_auth != NULL) {
 		    if (j_strcmp(xmlnode_get_attrib_ns(x, "type", NULL), "set") == 0) {
 			/* if we are authing against the server */
-			xmlnode_put_attrib_ns(xmlnode_get_list_item(xmlnode_get_tags(q_auth, "auth:digest", cd->si->std_namespace_prefixes), 0), "sid", NULL, NULL, cd->sid);
+			xmlnode_put_attrib_ns(xmlnode_get_first_tag(q_auth, "auth:digest", cd->si->std_namespace_prefixes), "sid", NULL, NULL, cd->sid);
 			cd->auth_id = pstrdup(m->p, xmlnode_get_attrib_ns(x, "id", NULL));
 			if (cd->auth_id == NULL) {
 			    cd->auth_id = pstrdup(m->p, "pthsock_client_auth_ID");
 			    xmlnode_put_attrib_ns(x, "id", NULL, NULL, "pthsock_client_auth_ID");
 			}
-			jid_set(cd->session_id, xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(x, "auth:query/auth:username", cd->si->std_namespace_prefixes), 0)), JID_USER);
-			jid_set(cd->session_id, xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(x, "auth:query/auth:resource", cd->si->std_namespace_prefixes), 0)), JID_RESOURCE);
+			jid_set(cd->session_id, xmlnode_get_data(xmlnode_get_first_tag(x, "auth:query/auth:username", cd->si->std_namespace_prefixes)), JID_USER);
+			jid_set(cd->session_id, xmlnode_get_data(xmlnode_get_first_tag(x, "auth:query/auth:resource", cd->si->std_namespace_prefixes)), JID_RESOURCE);
 
 			x = pthsock_make_route(x, jid_full(cd->session_id), cd->client_id, "auth");
 			deliver(dpacket_new(x), cd->si->i);
 		    } else if(j_strcmp(xmlnode_get_attrib_ns(x, "type", NULL), "get") == 0) {
 			/* we are just doing an auth get */
 			/* just deliver the packet */
-			jid_set(cd->session_id, xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(x, "auth:query/auth:username", cd->si->std_namespace_prefixes), 0)), JID_USER);
+			jid_set(cd->session_id, xmlnode_get_data(xmlnode_get_first_tag(x, "auth:query/auth:username", cd->si->std_namespace_prefixes)), JID_USER);
 			x = pthsock_make_route(x, jid_full(cd->session_id), cd->client_id, "auth");
 			deliver(dpacket_new(x), cd->si->i);
 		    }
 		} else if (q_register != NULL) {
-		    jid_set(cd->session_id, xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(x, "register:query/register:username", cd->si->std_namespace_prefixes), 0)), JID_USER);
+		    jid_set(cd->session_id, xmlnode_get_data(xmlnode_get_first_tag(x, "register:query/register:username", cd->si->std_namespace_prefixes)), JID_USER);
 		    x = pthsock_make_route(x, jid_full(cd->session_id), cd->client_id, "auth");
 		    deliver(dpacket_new(x), cd->si->i);
 		}
@@ -587,13 +587,13 @@ extern "C" void pthsock_client(instance i, xmlnode x) {
             rate_points = j_atoi(xmlnode_get_attrib_ns(cur, "points", NULL), 0);
             set_rate = 1; /* set to true */
         } else if(j_strcmp(xmlnode_get_localname(cur), "karma") == 0) {
-            k->val     = j_atoi(xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(cur, "pthcsock:init", s__i->std_namespace_prefixes), 0)), KARMA_INIT);
-            k->max     = j_atoi(xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(cur, "pthcsock:max", s__i->std_namespace_prefixes), 0)), KARMA_MAX);
-            k->inc     = j_atoi(xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(cur, "pthcsock:inc", s__i->std_namespace_prefixes), 0)), KARMA_INC);
-            k->dec     = j_atoi(xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(cur, "pthcsock:dec", s__i->std_namespace_prefixes), 0)), KARMA_DEC);
-            k->restore = j_atoi(xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(cur, "pthcsock:restore", s__i->std_namespace_prefixes), 0)), KARMA_RESTORE);
-            k->penalty = j_atoi(xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(cur, "pthcsock:penalty", s__i->std_namespace_prefixes), 0)), KARMA_PENALTY);
-            k->reset_meter = j_atoi(xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(cur, "pthcsock:resetmeter", s__i->std_namespace_prefixes), 0)), KARMA_RESETMETER);
+            k->val     = j_atoi(xmlnode_get_data(xmlnode_get_first_tag(cur, "pthcsock:init", s__i->std_namespace_prefixes)), KARMA_INIT);
+            k->max     = j_atoi(xmlnode_get_data(xmlnode_get_first_tag(cur, "pthcsock:max", s__i->std_namespace_prefixes)), KARMA_MAX);
+            k->inc     = j_atoi(xmlnode_get_data(xmlnode_get_first_tag(cur, "pthcsock:inc", s__i->std_namespace_prefixes)), KARMA_INC);
+            k->dec     = j_atoi(xmlnode_get_data(xmlnode_get_first_tag(cur, "pthcsock:dec", s__i->std_namespace_prefixes)), KARMA_DEC);
+            k->restore = j_atoi(xmlnode_get_data(xmlnode_get_first_tag(cur, "pthcsock:restore", s__i->std_namespace_prefixes)), KARMA_RESTORE);
+            k->penalty = j_atoi(xmlnode_get_data(xmlnode_get_first_tag(cur, "pthcsock:penalty", s__i->std_namespace_prefixes)), KARMA_PENALTY);
+            k->reset_meter = j_atoi(xmlnode_get_data(xmlnode_get_first_tag(cur, "pthcsock:resetmeter", s__i->std_namespace_prefixes)), KARMA_RESETMETER);
             set_karma = 1; /* set to true */
         } else if (j_strcmp(xmlnode_get_localname(cur), "noregister") == 0) {
 	    s__i->register_feature = 0;
@@ -42,6 +42,9 @@
 
 #define FILES_PRIME 509
 
+/** maximum write-behind interval, requests have to be confirmed before the requester gives up (after 30 seconds by default) */
+#define XDB_FILE_WRITEBEHIND_MAX 5
+
 /**
  * an item in the hash of cached data
  */
@@ -49,6 +52,10 @@ typedef struct cacher_struct {
     char *fname;	/**< file name of the cached file */
     xmlnode file;	/**< content of the cached file */
     int lastset;	/**< when the data has been last accessed (set or get is counted, not just set) */
+    int journal_gen;	/**< generation of the file on disk, a journal is only valid for the same generation */
+    size_t base_size;	/**< size of the file on disk */
+    size_t log_size;	/**< size of the journal on disk, 0 if there is no journal */
+    int dirty;		/**< content has been modified, but not yet written (write-behind) */
 } *cacher, _cacher;
 
 /**
@@ -63,9 +70,19 @@ typedef struct xdbf_struct {
     xht cache;
     int sizelimit;
     int use_hashspool;
+    int journal;	/**< flag that modifications are appended to a journal instead of rewriting the file */
+    size_t journal_compact;	/**< size of a journal, at which it gets merged into the file */
+    int writebehind;	/**< interval in seconds in which modifications are written together, 0 to write immediately */
+    int fsync;		/**< flag that modifications are synced to disk before they are confirmed */
+    std::map<std::string, std::vector<dpacket> >* pending; /**< requests waiting for the next write-behind flush, by filename */
+    std::set<std::string>* unconfirmed; /**< sender and id of the requests in pending or in the running flush (see xdb_file_request_key()) */
+    int flushing;	/**< flag that a write-behind flush is running in an mtq thread */
+    pool flush_pool;	/**< memory pool of the running write-behind flush */
     xht std_ns_prefixes;
 } *xdbf, _xdbf;
 
+static int xdb_file_compact(xdbf xf, cacher c);
+
 /**
  * xhash_walker function. Called for each cached content. Decides if it has to be expired.
  *
@@ -79,7 +96,15 @@ void _xdb_file_purge(xht h, const char *key, void *data, void *arg) {
     cacher c = (cacher)data;
     int now = time(NULL);
 
+    /* modifications have not been written yet */
+    if (c->dirty)
+	return;
+
     if ((now - c->lastset) > xf->timeout) {
+	/* we have the content in memory, merge the journal now instead of replaying it on the next load */
+	if (c->log_size > 0)
+	    xdb_file_compact(xf, c);
+
         log_debug2(ZONE, LOGT_STORAGE, "purging %s",c->fname);
         xhash_zap(xf->cache,c->fname);
         xmlnode_free(c->file);
@@ -104,6 +129,296 @@ result xdb_file_purge(void *arg) {
     return r_DONE;
 }
 
+/**
+ * get the element inside a spool file, that contains the data for a resource
+ *
+ * @param file the content of the spool file
+ * @param resource the resource, NULL for data not specific to a resource
+ * @param std_ns_prefixes namespace prefixes, the default prefix has to be mapped to NS_JABBERD_XDB
+ * @return the element containing the data (the root element if resource is NULL)
+ */
+static xmlnode xdb_file_top(xmlnode file, char const* resource, xht std_ns_prefixes) {
+    xmlnode top = NULL;
+
+    if (resource == NULL)
+	return file;
+
+    /* if we're dealing w/ a resource, just get that element <res id='resource'/> inside <xdb/> */
+    std::ostringstream xpath;
+    xpath << "res[@id='" << resource << "']";
+    top = xmlnode_get_list_item(xmlnode_get_tags(file, xpath.str().c_str(), std_ns_prefixes), 0);
+    if (top == NULL) {
+	top = xmlnode_insert_tag_ns(file, "res", NULL, NS_JABBERD_XDB);
+	xmlnode_put_attrib_ns(top, "id", NULL, NULL, resource);
+    }
+
+    return top;
+}
+
+/**
+ * get the data stored for a namespace
+ *
+ * @param top the element containing the data (as returned by xdb_file_top())
+ * @param ns the namespace
+ * @param std_ns_prefixes namespace prefixes, the default prefix has to be mapped to NS_JABBERD_XDB
+ * @return the stored data, NULL if nothing is stored
+ */
+static xmlnode xdb_file_data(xmlnode top, char const* ns, xht std_ns_prefixes) {
+    std::ostringstream xpath;
+    xpath << "*[@xdbns='" << ns << "']";
+    return xmlnode_get_list_item(xmlnode_get_tags(top, xpath.str().c_str(), std_ns_prefixes), 0);
+}
+
+/**
+ * apply a set request to the content of a spool file
+ *
+ * @param host the host the request is for (just for generating log messages)
+ * @param top the element containing the data (as returned by xdb_file_top())
+ * @param ns the namespace that gets modified
+ * @param act the action (NULL to replace the data of the namespace)
+ * @param match the match attribute of the request
+ * @param matchpath the matchpath attribute of the request
+ * @param matchns the matchns attribute of the request
+ * @param request the element containing the new data as its first child
+ * @param std_ns_prefixes namespace prefixes, the default prefix has to be mapped to NS_JABBERD_XDB
+ * @return 1 if the data has been modified, 0 if not (check action), -1 on failure
+ */
+static int xdb_file_apply(char const* host, xmlnode top, char const* ns, char const* act, char const* match, char const* matchpath, char const* matchns, xmlnode request, xht std_ns_prefixes) {
+    xmlnode data = xdb_file_data(top, ns, std_ns_prefixes);
+    int ret = 1;
+
+    if (act == NULL) {
+	if (data != NULL)
+	    xmlnode_hide(data);
+
+	/* copy the new data into file */
+	data = xmlnode_insert_tag_node(top, xmlnode_get_firstchild(request));
+	xmlnode_put_attrib_ns(data, "xdbns", NULL, NULL, ns);
+	return 1;
+    }
+
+    xht namespaces = NULL;
+    pool value_strings = NULL; // pool for the value strings in the namespaces xhash
+
+    if (matchns != NULL) {
+	xmlnode namespacesxml = NULL;
+	namespacesxml = xmlnode_str(matchns, j_strlen(matchns));
+	value_strings = pool_new();
+	namespaces = xhash_from_xml(namespacesxml, value_strings);
+	xmlnode_free(namespacesxml);
+    }
+    switch (*act) {
+	case 'i': /* insert action */
+	    if (data == NULL) {
+		/* we're inserting into something that doesn't exist?!?!? */
+		data = xmlnode_insert_tag_ns(top, "foo", NULL, ns);
+		xmlnode_put_attrib_ns(data, "xdbns", NULL, NULL, ns);
+	    }
+	    if (matchpath != NULL) {
+		xmlnode_vector match_items = xmlnode_get_tags(data, matchpath, namespaces);
+
+		for (xmlnode_vector::iterator match_item = match_items.begin(); match_item != match_items.end(); ++match_item) {
+		    xmlnode_hide(*match_item);
+		}
+	    } else {
+		xmlnode_hide(xmlnode_get_tag(data, match)); /* any match is a goner */
+	    }
+	    /* insert the new chunk into the existing data */
+	    xmlnode_insert_tag_node(data, xmlnode_get_firstchild(request));
+	    break;
+	case 'c': /* check action */
+	    if (matchpath != NULL) {
+		data = xmlnode_get_list_item(xmlnode_get_tags(data, matchpath, namespaces), 0);
+	    } else if(match != NULL) {
+		data = xmlnode_get_tag(data, match);
+	    }
+	    if(j_strcmp(xmlnode_get_data(data),xmlnode_get_data(xmlnode_get_firstchild(request))) != 0) {
+		log_debug2(ZONE, LOGT_STORAGE|LOGT_DELIVER, "xdb check action returning error to signify unsuccessful check");
+		ret = -1;
+		break;
+	    }
+	    ret = 0;
+
+	    /*
+	     * XXX Is there a bug here?
+	     *
+	     * I suspect that the check action will always return r_ERR!
+	     * Up to this point the ret variable has not been changed, and if
+	     * we arrived here I cannot imagine how it should be changed afterwards.
+	     * This means that the function will return r_ERR too.
+	     * I expect this is a bug and something like "ret = 1;" should be inserted
+	     * at this point.
+	     *
+	     * The problem is that I am not completely sure what the check action is
+	     * supposed to do. What I imagine is:
+	     * It is intended to compare the content of xdb with the content of the
+	     * xdb request and return r_ERR if it is different and r_DONE if it
+	     * is the same.
+	     *
+	     * It is only used in jsm/modules/mod_auth_plain.c in the function
+	     * mod_auth_plain_jane(...) function. At this function there is already
+	     * a check if the password is the same some lines above ... so it
+	     * would make no sence to call the check action if it does what I said
+	     * above as it would be always result in being different - in which
+	     * case it is no surprize that we have no problem, that this function
+	     * always returns r_ERR (which would signal that it's different too).
+	     *
+	     * It should be checked if the xdb_act(...) in mod_auth_plain_jane(...)
+	     * is needed. If it isn't, we could remove the check action from
+	     * xdb completely.
+	     *
+	     * Please see also:
+	     * http://web.archive.org/web/20020601233959/http://jabberd.jabberstudio.org/1.4/142changelog.html
+	     * In that case it seems to be a bug here ...
+	     */
+	    break;
+	default:
+	    log_warn(host, "unable to handle unknown xdb action '%s'", act);
+	    ret = -1;
+    }
+    if (namespaces)
+	xhash_free(namespaces);
+    if (value_strings)
+	pool_free(value_strings);
+
+    return ret;
+}
+
+/**
+ * get the name of the journal for a spool file
+ *
+ * @param fname the filename of the spool file
+ * @return the filename of the journal
+ */
+static std::string xdb_file_journal_name(char const* fname) {
+    std::string journal(fname);
+    journal += ".log";
+    return journal;
+}
+
+/**
+ * append a record to the journal of a spool file
+ *
+ * Each record is the length of the serialized element in decimal, a newline, the serialized element
+ * and another newline. Torn records at the end of the journal (after a crash) are detected on replay.
+ *
+ * @param fname the filename of the journal
+ * @param record the element to append
+ * @param truncate true to start a new journal
+ * @return number of bytes written, 0 on failure
+ */
+static size_t xdb_file_journal_append(char const* fname, xmlnode record, bool truncate) {
+    std::string serialized = xmlnode_serialize_string(record, xmppd::ns_decl_list(), 0);
+    std::ostringstream buffer;
+    int fd = -1;
+    ssize_t written = 0;
+
+    buffer << serialized.length() << "\n" << serialized << "\n";
+
+    fd = open(fname, O_CREAT | O_WRONLY | O_APPEND | (truncate ? O_TRUNC : 0), 0600);
+    if (fd < 0)
+	return 0;
+
+    written = write(fd, buffer.str().c_str(), buffer.str().length());
+    close(fd);
+
+    return written == static_cast<ssize_t>(buffer.str().length()) ? written : 0;
+}
+
+/**
+ * replay the journal of a spool file
+ *
+ * A journal is only replayed if it has been started for the generation of the spool file, that is stored in
+ * the journal attribute of the root element. Stale journals (the file has been rewritten after the journal
+ * has been started) are removed. Torn records at the end get truncated.
+ *
+ * After a journal has been replayed, the generation of the loaded file is incremented, so that
+ * writing this content to the spool file invalidates the journal.
+ *
+ * @param host the host to load the file for (just for generating log messages)
+ * @param fname the filename of the spool file
+ * @param file the loaded spool file
+ * @param gen the generation of the spool file
+ * @return size of the replayed journal, 0 if there is no (valid) journal
+ */
+static size_t xdb_file_journal_replay(char const* host, char const* fname, xmlnode file, int gen) {
+    std::string journal_name = xdb_file_journal_name(fname);
+    std::string journal;
+    std::string::size_type pos = 0;
+    std::string::size_type good = 0;
+    xht std_ns_prefixes = NULL;
+    char buffer[BUFSIZ];
+    ssize_t len = 0;
+    int records = 0;
+    int fd = -1;
+
+    fd = open(journal_name.c_str(), O_RDONLY);
+    if (fd < 0)
+	return 0;
+    while ((len = read(fd, buffer, sizeof(buffer))) > 0)
+	journal.append(buffer, len);
+    close(fd);
+
+    std_ns_prefixes = xhash_new(3);
+    xhash_put(std_ns_prefixes, "", const_cast<char*>(NS_JABBERD_XDB));
+
+    while (pos < journal.length()) {
+	std::string::size_type eol = journal.find('\n', pos);
+	xmlnode record = NULL;
+	size_t reclen = 0;
+
+	if (eol == std::string::npos)
+	    break;
+	reclen = j_atoi(journal.substr(pos, eol - pos).c_str(), 0);
+	if (reclen == 0 || eol + 1 + reclen + 1 > journal.length())
+	    break;
+	record = xmlnode_str(journal.c_str() + eol + 1, reclen);
+	if (record == NULL)
+	    break;
+
+	/* the first record is the header of the journal */
+	if (records++ == 0) {
+	    if (j_strcmp(xmlnode_get_localname(record), "journal") != 0 || j_atoi(xmlnode_get_attrib_ns(record, "gen", NULL), -1) != gen) {
+		log_debug2(ZONE, LOGT_STORAGE, "removing stale journal %s", journal_name.c_str());
+		xmlnode_free(record);
+		unlink(journal_name.c_str());
+		xhash_free(std_ns_prefixes);
+		return 0;
+	    }
+	} else {
+	    char const* resource = xmlnode_get_attrib_ns(record, "res", NULL);
+	    xdb_file_apply(host, xdb_file_top(file, resource, std_ns_prefixes), xmlnode_get_attrib_ns(record, "ns", NULL), xmlnode_get_attrib_ns(record, "action", NULL), xmlnode_get_attrib_ns(record, "match", NULL), xmlnode_get_attrib_ns(record, "matchpath", NULL), xmlnode_get_attrib_ns(record, "matchns", NULL), record, std_ns_prefixes);
+	}
+	xmlnode_free(record);
+
+	pos = eol + 1 + reclen + 1;
+	good = pos;
+    }
+    xhash_free(std_ns_prefixes);
+
+    /* cut off a torn record */
+    if (good < journal.length()) {
+	log_warn(host, "xdb_file: truncating incomplete record at the end of journal %s", journal_name.c_str());
+	if (truncate(journal_name.c_str(), good) < 0)
+	    log_error(host, "xdb_file: could not truncate journal %s: %s", journal_name.c_str(), strerror(errno));
+    }
+
+    /* not even a header */
+    if (records == 0) {
+	unlink(journal_name.c_str());
+	return 0;
+    }
+
+    log_debug2(ZONE, LOGT_STORAGE, "replayed %i records from journal %s", records - 1, journal_name.c_str());
+
+    /* writing this content to the spool file has to invalidate the journal */
+    std::ostringstream next_gen;
+    next_gen << (gen + 1);
+    xmlnode_put_attrib_ns(file, "journal", NULL, NULL, next_gen.str().c_str());
+
+    return good;
+}
+
 /* this function acts as a loader, getting xml data from a file */
 /**
  * load an XML file
@@ -117,6 +432,9 @@ xmlnode xdb_file_load(char *host, char *fname, xht cache) {
     xmlnode data = NULL;
     cacher c;
     int fd;
+    int gen = 0;
+    size_t log_size = 0;
+    struct stat st;
 
     log_debug2(ZONE, LOGT_STORAGE, "loading %s",fname);
 
@@ -149,11 +467,18 @@ xmlnode xdb_file_load(char *host, char *fname, xht cache) {
 	}
     }
 
+    /* apply changes, that have been journaled but not yet written to the file */
+    gen = j_atoi(xmlnode_get_attrib_ns(data, "journal", NULL), 0);
+    log_size = xdb_file_journal_replay(host, fname, data, gen);
+
     log_debug2(ZONE, LOGT_STORAGE, "caching %s",fname);
     c = static_cast<cacher>(pmalloco(xmlnode_pool(data),sizeof(_cacher)));
     c->fname = pstrdup(xmlnode_pool(data),fname);
     c->lastset = time(NULL);
     c->file = data;
+    c->journal_gen = gen;
+    c->base_size = stat(fname, &st) == 0 ? st.st_size : 0;
+    c->log_size = log_size;
     xhash_put(cache,c->fname,c);
 
     return data;
@@ -269,6 +594,311 @@ char *xdb_file_full(int create, pool p, const char *spl, char const* host, const
     return pstrdup(p, filepath.str().c_str());
 }
 
+/**
+ * sync a file or directory to disk
+ *
+ * @param host the host the file belongs to (just for generating log messages)
+ * @param path the file or directory
+ * @return 0 on success, -1 on failure
+ */
+static int xdb_file_sync(char const* host, char const* path) {
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fsync(fd) < 0) {
+	log_error(host, "xdb_file: could not sync %s to disk: %s", path, strerror(errno));
+	if (fd >= 0)
+	    close(fd);
+	return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/**
+ * get the directory containing a file
+ *
+ * @param fname the filename
+ * @return the directory
+ */
+static std::string xdb_file_dirname(char const* fname) {
+    std::string dir(fname);
+    std::string::size_type slash = dir.rfind('/');
+
+    return slash == std::string::npos ? std::string(".") : dir.substr(0, slash);
+}
+
+/**
+ * write the cached content of a spool file (without a journal) to disk
+ *
+ * @param xf the xdb_file instance data
+ * @param fname the filename of the spool file
+ * @param file the content to write
+ * @return 1 on success, 0 if failed due to the size limit, -1 on failure
+ */
+static int xdb_file_write(xdbf xf, char const* fname, xmlnode file) {
+    return xf->fsync ? xmlnode2file_durable(fname, file, xf->sizelimit) : xmlnode2file_limited(fname, file, xf->sizelimit);
+}
+
+/**
+ * write the cached content of a spool file to disk and remove its journal
+ *
+ * @param xf the xdb_file instance data
+ * @param c the cached file
+ * @return 1 on success, 0 if failed due to the size limit, -1 on failure
+ */
+static int xdb_file_compact(xdbf xf, cacher c) {
+    std::ostringstream gen;
+    struct stat st;
+    int ret = 0;
+
+    /* writing the file starts a new generation, the old journal gets invalid by this */
+    gen << (c->journal_gen + 1);
+    xmlnode_put_attrib_ns(c->file, "journal", NULL, NULL, gen.str().c_str());
+
+    ret = xdb_file_write(xf, c->fname, c->file);
+    if (ret <= 0)
+	return ret;
+    if (xf->fsync)
+	xdb_file_sync(xf->i->id, xdb_file_dirname(c->fname).c_str());
+
+    log_debug2(ZONE, LOGT_STORAGE, "merged journal of %s (%i bytes)", c->fname, static_cast<int>(c->log_size));
+    unlink(xdb_file_journal_name(c->fname).c_str());
+    c->journal_gen++;
+    c->log_size = 0;
+    c->base_size = stat(c->fname, &st) == 0 ? st.st_size : 0;
+    return 1;
+}
+
+/**
+ * save a modification of a spool file by appending it to the journal of the file
+ *
+ * If the file would exceed the size limit, the journal is merged into the file, which checks the exact size.
+ *
+ * @param xf the xdb_file instance data
+ * @param c the cached file, already containing the modification
+ * @param id the JID the request has been addressed to
+ * @param ns the namespace that has been modified
+ * @param request the xdb request
+ * @return 1 on success, 0 if failed due to the size limit, -1 on failure
+ */
+static int xdb_file_journal_save(xdbf xf, cacher c, jid id, char const* ns, xmlnode request) {
+    std::string journal_name = xdb_file_journal_name(c->fname);
+    char const* attribs[] = { "action", "match", "matchpath", "matchns", NULL };
+    xmlnode record = NULL;
+    size_t written = 0;
+
+    if (xf->sizelimit > 0 && c->base_size + c->log_size >= static_cast<size_t>(xf->sizelimit))
+	return xdb_file_compact(xf, c);
+
+    /* start a new journal for the current generation of the file */
+    if (c->log_size == 0) {
+	std::ostringstream gen;
+
+	record = xmlnode_new_tag_ns("journal", NULL, NS_JABBERD_XDB);
+	gen << c->journal_gen;
+	xmlnode_put_attrib_ns(record, "gen", NULL, NULL, gen.str().c_str());
+	written = xdb_file_journal_append(journal_name.c_str(), record, true);
+	xmlnode_free(record);
+	if (written == 0)
+	    return -1;
+	c->log_size = written;
+
+	/* writing the cached content to the file has to invalidate this journal */
+	gen.str("");
+	gen << (c->journal_gen + 1);
+	xmlnode_put_attrib_ns(c->file, "journal", NULL, NULL, gen.str().c_str());
+    }
+
+    /* the record is the request without the addressing */
+    record = xmlnode_new_tag_ns("op", NULL, NS_JABBERD_XDB);
+    xmlnode_put_attrib_ns(record, "ns", NULL, NULL, ns);
+    if (id->has_resource())
+	xmlnode_put_attrib_ns(record, "res", NULL, NULL, id->get_resource().c_str());
+    for (int n = 0; attribs[n] != NULL; n++) {
+	char const* value = xmlnode_get_attrib_ns(request, attribs[n], NULL);
+	if (value != NULL)
+	    xmlnode_put_attrib_ns(record, attribs[n], NULL, NULL, value);
+    }
+    xmlnode_insert_tag_node(record, xmlnode_get_firstchild(request));
+
+    written = xdb_file_journal_append(journal_name.c_str(), record, false);
+    xmlnode_free(record);
+    if (written == 0)
+	return -1;
+
+    c->log_size += written;
+    return 1;
+}
+
+/**
+ * xhash_walker function, that merges long journals of cached files
+ *
+ * @param h the xhash containing the cached content of xdb_file
+ * @param key key in the hash (filename of the cached file)
+ * @param data value in the hash (type is ::cacher)
+ * @param arg pointer to the xdb_file internal component instance data
+ */
+static void _xdb_file_compact(xht h, const char *key, void *data, void *arg) {
+    xdbf xf = (xdbf)arg;
+    cacher c = (cacher)data;
+
+    if (c->log_size > xf->journal_compact)
+	xdb_file_compact(xf, c);
+}
+
+/**
+ * merge long journals of cached files into the files
+ *
+ * This function gets called regulary as a function, that is registered with heartbeat.
+ *
+ * @param arg pointer to xdb_file component instance data (type is ::xdbf)
+ * @return always r_DONE
+ */
+static result xdb_file_compact_beat(void *arg) {
+    xdbf xf = (xdbf)arg;
+
+    xhash_walk(xf->cache, _xdb_file_compact, (void *)xf);
+    return r_DONE;
+}
+
+/**
+ * send the result for a successfully processed xdb request
+ *
+ * @param p the request
+ */
+static void xdb_file_reply(dpacket p) {
+    xmlnode_put_attrib_ns(p->x, "type", NULL, NULL, "result");
+    xmlnode_put_attrib_ns(p->x, "to", NULL, NULL, xmlnode_get_attrib(p->x,"from"));
+    xmlnode_put_attrib_ns(p->x, "from", NULL, NULL, jid_full(p->id));
+    deliver(dpacket_new(p->x), NULL); /* dpacket_new() shouldn't ever return NULL */
+}
+
+/**
+ * get the key identifying a request in xdbf::unconfirmed
+ *
+ * A requester, that does not get a reply in time, sends the same request again, using the same id.
+ *
+ * @param p the request
+ * @return sender and id of the request
+ */
+static std::string xdb_file_request_key(dpacket p) {
+    std::string key(xmlnode_get_attrib_ns(p->x, "id", NULL) ? xmlnode_get_attrib_ns(p->x, "id", NULL) : "");
+    key += ' ';
+    key += xmlnode_get_attrib_ns(p->x, "from", NULL) ? xmlnode_get_attrib_ns(p->x, "from", NULL) : "";
+    return key;
+}
+
+/**
+ * write all modifications collected since the last call and confirm the requests
+ *
+ * Each modified file is written once (or its journal gets synced), and each directory gets
+ * synced only once, after all files have been written.
+ *
+ * @param xf xdb_file component instance data
+ * @param yield 1 to let other threads run after each file, 0 to write all files at once
+ */
+static void xdb_file_flush(xdbf xf, int yield) {
+    std::map<std::string, std::vector<dpacket> > batch;
+    std::map<std::string, int> results;
+    std::set<std::string> dirs;
+
+    if (xf->pending->empty())
+	return;
+    batch.swap(*(xf->pending));
+
+    log_debug2(ZONE, LOGT_STORAGE, "flushing %i files", static_cast<int>(batch.size()));
+
+    /* write the files */
+    for (std::map<std::string, std::vector<dpacket> >::iterator i = batch.begin(); i != batch.end(); ++i) {
+	cacher c = static_cast<cacher>(xhash_get(xf->cache, i->first.c_str()));
+	char const* host = i->second.front()->id->get_domain().c_str();
+	int ret = 1;
+
+	if (c != NULL && c->dirty) {
+	    ret = xdb_file_write(xf, c->fname, c->file);
+	    if (ret == 0)
+		log_notice(host, "xdb request failed, due to the size limit of %i to file %s", xf->sizelimit, c->fname);
+	    else if (ret < 0)
+		log_error(host, "xdb request failed, unable to save to file %s", c->fname);
+	    c->dirty = 0;
+
+	    /* forget the content (keep it if it has been written and we use a journal) */
+	    if (ret <= 0 || !xf->journal) {
+		xhash_zap(xf->cache, c->fname);
+		xmlnode_free(c->file);
+	    }
+	} else if (xf->journal && xf->fsync) {
+	    /* the modifications have already been appended to the journal */
+	    if (xdb_file_sync(host, xdb_file_journal_name(i->first.c_str()).c_str()) < 0)
+		ret = -1;
+	}
+
+	results[i->first] = ret;
+	if (ret > 0)
+	    dirs.insert(xdb_file_dirname(i->first.c_str()));
+
+	/* each file is written completely before other threads may modify the cache again */
+	if (yield)
+	    pth_yield(NULL);
+    }
+
+    /* make the renames and new journals durable */
+    if (xf->fsync) {
+	for (std::set<std::string>::iterator dir = dirs.begin(); dir != dirs.end(); ++dir)
+	    xdb_file_sync(xf->i->id, dir->c_str());
+    }
+
+    /* confirm or bounce the requests */
+    for (std::map<std::string, std::vector<dpacket> >::iterator i = batch.begin(); i != batch.end(); ++i) {
+	for (std::vector<dpacket>::iterator p = i->second.begin(); p != i->second.end(); ++p) {
+	    xf->unconfirmed->erase(xdb_file_request_key(*p));
+	    if (results[i->first] > 0)
+		xdb_file_reply(*p);
+	    else
+		deliver_fail(*p, "xdb_file could not save the data");
+	}
+    }
+}
+
+/**
+ * mtq callback running a write-behind flush
+ *
+ * @param arg pointer to xdb_file component instance data (type is ::xdbf)
+ */
+static void _xdb_file_flush_thread(void *arg) {
+    xdbf xf = (xdbf)arg;
+
+    xdb_file_flush(xf, 1);
+
+    xf->flushing = 0;
+    pool_free(xf->flush_pool);
+    xf->flush_pool = NULL;
+}
+
+/**
+ * start writing the modifications collected since the last flush
+ *
+ * Writing and syncing files takes time, it is done in an mtq thread and not in the heartbeat thread.
+ *
+ * This function gets called regulary as a function, that is registered with heartbeat.
+ *
+ * @param arg pointer to xdb_file component instance data (type is ::xdbf)
+ * @return always r_DONE
+ */
+static result xdb_file_flush_beat(void *arg) {
+    xdbf xf = (xdbf)arg;
+
+    /* a flush, that is still running, takes the modifications with the next beat */
+    if (xf->flushing || xf->pending->empty())
+	return r_DONE;
+
+    xf->flushing = 1;
+    xf->flush_pool = pool_new();
+    mtq_send(NULL, xf->flush_pool, _xdb_file_flush_thread, arg);
+    return r_DONE;
+}
+
 /**
  * handle packets (request) we get from the XML router inside of jabberd
  *
@@ -280,11 +910,10 @@ char *xdb_file_full(int create, pool p, const char *spl, char const* host, const
  * @return r_DONE if the request has been handled, r_ERR on failure
  */
 result xdb_file_phandler(instance i, dpacket p, void *arg) {
-    char *full, *ns, *act, *match;
-    char *matchpath = NULL;
-    char *matchns = NULL;
+    char *full, *ns;
     xdbf xf = (xdbf)arg;
     xmlnode file, top, data;
+    cacher c = NULL;
     int ret = 0, flag_set = 0;
 
     log_debug2(ZONE, LOGT_STORAGE|LOGT_DELIVER, "handling xdb request %s", xmlnode_serialize_string(p->x, xmppd::ns_decl_list(), 0));
@@ -310,143 +939,73 @@ result xdb_file_phandler(instance i, dpacket p, void *arg) {
         return r_ERR;
 
     /* load the data from disk/cache */
-    top = file = xdb_file_load(p->host, full, xf->cache);
+    file = xdb_file_load(p->host, full, xf->cache);
+    c = static_cast<cacher>(xhash_get(xf->cache, full));
 
-    /* if we're dealing w/ a resource, just get that element <res id='resource'/> inside <xdb/> */
-    if (p->id->has_resource()) {
-	std::ostringstream xpath;
-	xpath << "res[@id='" << p->id->get_resource() << "']";
-	top = xmlnode_get_list_item(xmlnode_get_tags(top, xpath.str().c_str(), xf->std_ns_prefixes), 0);
-	if (top == NULL) {
-            top = xmlnode_insert_tag_ns(file, "res", NULL, NS_JABBERD_XDB);
-            xmlnode_put_attrib_ns(top, "id", NULL, NULL, p->id->get_resource().c_str());
-        }
-    }
+    /* merge a long journal, that has been replayed while loading */
+    if (xf->journal && c != NULL && c->log_size > xf->journal_compact)
+	xdb_file_compact(xf, c);
 
-    /* just query the relevant namespace */
-    std::ostringstream xpath;
-    xpath << "*[@xdbns='" << ns << "']";
-    data = xmlnode_get_list_item(xmlnode_get_tags(top, xpath.str().c_str(), xf->std_ns_prefixes), 0);
+    /* if we're dealing w/ a resource, just get that element <res id='resource'/> inside <xdb/> */
+    top = xdb_file_top(file, p->id->has_resource() ? p->id->get_resource().c_str() : NULL, xf->std_ns_prefixes);
 
     if (flag_set) {
-	act = xmlnode_get_attrib_ns(p->x, "action", NULL);
-	match = xmlnode_get_attrib_ns(p->x, "match", NULL);
-	matchpath = xmlnode_get_attrib_ns(p->x, "matchpath", NULL);
-	matchns = xmlnode_get_attrib_ns(p->x, "matchns", NULL);
-        if (act != NULL) {
-	    xht namespaces = NULL;
-	    pool value_strings = NULL; // pool for the value strings in the namespaces xhash
-
-	    if (matchns != NULL) {
-		xmlnode namespacesxml = NULL;
-		namespacesxml = xmlnode_str(matchns, j_strlen(matchns));
-		value_strings = pool_new();
-		namespaces = xhash_from_xml(namespacesxml, value_strings);
-		xmlnode_free(namespacesxml);
+	int modified = 0;
+
+	/* a resent request, that is still waiting for the write-behind flush: it gets the reply of the first one */
+	if (xf->writebehind > 0 && xmlnode_get_attrib_ns(p->x, "id", NULL) != NULL && xf->unconfirmed->find(xdb_file_request_key(p)) != xf->unconfirmed->end()) {
+	    log_debug2(ZONE, LOGT_STORAGE, "dropping resent request %s, it is not confirmed yet", xdb_file_request_key(p).c_str());
+	    pool_free(p->p);
+	    return r_DONE;
+	}
+
+	modified = xdb_file_apply(p->host, top, ns, xmlnode_get_attrib_ns(p->x, "action", NULL), xmlnode_get_attrib_ns(p->x, "match", NULL), xmlnode_get_attrib_ns(p->x, "matchpath", NULL), xmlnode_get_attrib_ns(p->x, "matchns", NULL), p->x, xf->std_ns_prefixes);
+	if (modified < 0)
+	    return r_ERR;
+
+	/* write-behind: the file is written and the request confirmed by xdb_file_flush() */
+	if (modified > 0 && xf->writebehind > 0 && c != NULL && (!xf->journal || xf->fsync)) {
+	    if (!xf->journal)
+		c->dirty = 1;
+	    else if (xdb_file_journal_save(xf, c, p->id, ns, p->x) <= 0) {
+		log_error(p->id->get_domain().c_str(), "xdb request failed, unable to save to file %s", full);
+		xhash_zap(xf->cache,full);
+		xmlnode_free(file);
+		return r_ERR;
 	    }
-            switch (*act) {
-		case 'i': /* insert action */
-		    if (data == NULL) {
-			/* we're inserting into something that doesn't exist?!?!? */
-			data = xmlnode_insert_tag_ns(top, "foo", NULL, ns);
-			xmlnode_put_attrib_ns(data, "xdbns", NULL, NULL, ns);
-		    }
-		    if (matchpath != NULL) {
-			xmlnode_vector match_items = xmlnode_get_tags(data, matchpath, namespaces);
-
-			for (xmlnode_vector::iterator match_item = match_items.begin(); match_item != match_items.end(); ++match_item) {
-			    xmlnode_hide(*match_item);
-			}
-		    } else {
-			xmlnode_hide(xmlnode_get_tag(data, match)); /* any match is a goner */
-		    }
-		    /* insert the new chunk into the existing data */
-		    xmlnode_insert_tag_node(data, xmlnode_get_firstchild(p->x));
-		    break;
-		case 'c': /* check action */
-		    if (matchpath != NULL) {
-			data = xmlnode_get_list_item(xmlnode_get_tags(data, matchpath, namespaces), 0);
-		    } else if(match != NULL) {
-			data = xmlnode_get_tag(data, match);
-		    }
-		    if(j_strcmp(xmlnode_get_data(data),xmlnode_get_data(xmlnode_get_firstchild(p->x))) != 0) {
-			log_debug2(ZONE, LOGT_STORAGE|LOGT_DELIVER, "xdb check action returning error to signify unsuccessful check");
-			if (namespaces)
-			    xhash_free(namespaces);
-			if (value_strings)
-			    pool_free(value_strings);
-			return r_ERR;
-		    }
-		    flag_set = 0;
-
-		    /*
-		     * XXX Is there a bug here?
-		     *
-		     * I suspect that the check action will always return r_ERR!
-		     * Up to this point the ret variable has not been changed, and if
-		     * we arrived here I cannot imagine how it should be changed afterwards.
-		     * This means that the function will return r_ERR too.
-		     * I expect this is a bug and something like "ret = 1;" should be inserted
-		     * at this point.
-		     *
-		     * The problem is that I am not completely sure what the check action is
-		     * supposed to do. What I imagine is:
-		     * It is intended to compare the content of xdb with the content of the
-		     * xdb request and return r_ERR if it is different and r_DONE if it
-		     * is the same.
-		     *
-		     * It is only used in jsm/modules/mod_auth_plain.c in the function
-		     * mod_auth_plain_jane(...) function. At this function there is already
-		     * a check if the password is the same some lines above ... so it
-		     * would make no sence to call the check action if it does what I said
-		     * above as it would be always result in being different - in which
-		     * case it is no surprize that we have no problem, that this function
-		     * always returns r_ERR (which would signal that it's different too).
-		     *
-		     * It should be checked if the xdb_act(...) in mod_auth_plain_jane(...)
-		     * is needed. If it isn't, we could remove the check action from
-		     * xdb completely.
-		     *
-		     * Please see also:
-		     * http://web.archive.org/web/20020601233959/http://jabberd.jabberstudio.org/1.4/142changelog.html
-		     * In that case it seems to be a bug here ...
-		     */
-		    break;
-		default:
-		    log_warn(p->host, "unable to handle unknown xdb action '%s'", act);
-		    if (namespaces)
-			xhash_free(namespaces);
-		    if (value_strings)
-			pool_free(value_strings);
-		    return r_ERR;
-            }
-	    if (namespaces)
-		xhash_free(namespaces);
-	    if (value_strings)
-		pool_free(value_strings);
-        } else {
-            if (data != NULL)
-                xmlnode_hide(data);
-
-            /* copy the new data into file */
-            data = xmlnode_insert_tag_node(top, xmlnode_get_firstchild(p->x));
-            xmlnode_put_attrib_ns(data, "xdbns", NULL, NULL, ns);
-        }
+	    (*(xf->pending))[full].push_back(p);
+	    xf->unconfirmed->insert(xdb_file_request_key(p));
+	    return r_DONE;
+	}
 
         /* save the file if we still want to */
-	if (flag_set) {
-	    int tmp = xmlnode2file_limited(full,file,xf->sizelimit);
+	if (modified > 0) {
+	    int tmp = xf->journal && c != NULL ? xdb_file_journal_save(xf, c, p->id, ns, p->x) : xdb_file_write(xf, full, file);
+	    if (tmp > 0 && xf->fsync) {
+		if (xf->journal && c != NULL)
+		    tmp = xdb_file_sync(p->id->get_domain().c_str(), xdb_file_journal_name(full).c_str()) < 0 ? -1 : 1;
+		if (tmp > 0)
+		    xdb_file_sync(p->id->get_domain().c_str(), xdb_file_dirname(full).c_str());
+	    }
 	    if (tmp == 0)
 		log_notice(p->id->get_domain().c_str(), "xdb request failed, due to the size limit of %i to file %s", xf->sizelimit, full);
 	    else if (tmp < 0)
 		log_error(p->id->get_domain().c_str(), "xdb request failed, unable to save to file %s", full);
 	    else
 		ret = 1;
+
+	    /* the cached content has been modified, but not saved: forget it */
+	    if (tmp <= 0 && xf->journal) {
+		xhash_zap(xf->cache,full);
+		xmlnode_free(file);
+	    }
 	}
     } else {
         /* a get always returns, data or not */
         ret = 1;
 
+	/* just query the relevant namespace */
+	data = xdb_file_data(top, ns, xf->std_ns_prefixes);
         if (data != NULL) {
 	    /* cool, send em back a copy of the data */
             xmlnode_hide_attrib_ns(xmlnode_insert_tag_node(p->x, data), "xdbns", NULL);
@@ -454,13 +1013,11 @@ result xdb_file_phandler(instance i, dpacket p, void *arg) {
     }
 
     if (ret) {
-        xmlnode_put_attrib_ns(p->x, "type", NULL, NULL, "result");
-        xmlnode_put_attrib_ns(p->x, "to", NULL, NULL, xmlnode_get_attrib(p->x,"from"));
-        xmlnode_put_attrib_ns(p->x, "from", NULL, NULL, jid_full(p->id));
-        deliver(dpacket_new(p->x), NULL); /* dpacket_new() shouldn't ever return NULL */
+	xdb_file_reply(p);
 
         /* remove the cache'd item if it was a set or we're not configured to cache */
-        if (xf->timeout == 0 || flag_set) {
+	/* (with a journal the cached content is what we would read from disk anyway, unwritten content has to be kept) */
+        if ((xf->timeout == 0 || (flag_set && !xf->journal)) && (c == NULL || !c->dirty)) {
             log_debug2(ZONE, LOGT_STORAGE, "decaching %s",full);
             xhash_zap(xf->cache,full);
             xmlnode_free(file);
@@ -478,7 +1035,17 @@ result xdb_file_phandler(instance i, dpacket p, void *arg) {
  */
 void xdb_file_cleanup(void *arg) {
     xdbf xf = (xdbf)arg;
+
+    /* let a running flush finish first, the files must not be written by two flushes at once */
+    while (xf->flushing)
+	pth_sleep(1);
+
+    /* do not lose collected modifications */
+    xdb_file_flush(xf, 0);
+
     xhash_free(xf->cache);
+    delete xf->pending;
+    delete xf->unconfirmed;
 }
 
 /**
@@ -656,6 +1223,24 @@ extern "C" void xdb_file(instance i, xmlnode x) {
     xf->cache = xhash_new(j_atoi(xmlnode_get_list_item_data(xmlnode_get_tags(config, "conf:maxfiles", xf->std_ns_prefixes), 0), FILES_PRIME));
     xf->use_hashspool = xmlnode_get_list_item(xmlnode_get_tags(config, "conf:use_hierarchical_spool", xf->std_ns_prefixes), 0) ? 1 : 0;
 
+    /* append modifications to a journal instead of rewriting the file? */
+    node_ptr = xmlnode_get_list_item(xmlnode_get_tags(config, "conf:journal", xf->std_ns_prefixes), 0);
+    if (node_ptr != NULL) {
+	xf->journal = 1;
+	xf->journal_compact = j_atoi(xmlnode_get_attrib_ns(node_ptr, "compact", NULL), 65536);
+    }
+
+    /* collect modifications and write them together? */
+    xf->writebehind = j_atoi(xmlnode_get_list_item_data(xmlnode_get_tags(config, "conf:writebehind", xf->std_ns_prefixes), 0), 0);
+    if (xf->writebehind > XDB_FILE_WRITEBEHIND_MAX) {
+	/* requesters give up on unconfirmed requests (after 30 seconds by default), this must not happen */
+	log_warn(i->id, "xdb_file: limiting writebehind to %i seconds", XDB_FILE_WRITEBEHIND_MAX);
+	xf->writebehind = XDB_FILE_WRITEBEHIND_MAX;
+    }
+    xf->fsync = xmlnode_get_list_item(xmlnode_get_tags(config, "conf:fsync", xf->std_ns_prefixes), 0) ? 1 : 0;
+    xf->pending = new std::map<std::string, std::vector<dpacket> >;
+    xf->unconfirmed = new std::set<std::string>;
+
     /* if we are using the hashed directory layout, we might have to convert an existing spool */
     if (xf->use_hashspool)
 	xdb_convert_spool(spl);
@@ -667,6 +1252,14 @@ extern "C" void xdb_file(instance i, xmlnode x) {
     if (timeout > 0) /* 0 is expired immediately, -1 is cached forever */
         register_beat(timeout, xdb_file_purge, (void *)xf);
 
+    /* register the write-behind flush */
+    if (xf->writebehind > 0)
+	register_beat(xf->writebehind, xdb_file_flush_beat, (void *)xf);
+
+    /* register a regular merge of long journals */
+    if (xf->journal)
+	register_beat(60, xdb_file_compact_beat, (void *)xf);
+
     /* we do not need this xmlnode anymore */
     xmlnode_free(config);
 
@@ -27,6 +27,7 @@
 #include <list>
 #include <vector>
 #include <map>
+#include <set>
 
 /** the namespace of variables in templates in the configuration */
 #define NS_XDBSQL "http://jabberd.org/ns/xdbsql"
@@ -51,41 +52,84 @@
  * @brief xdb module that handles the requests using a SQL database
  *
  * xdb_sql is an implementation of a xdb module for jabberd14, that handles
- * the xdb requests using an underlying SQL database. Currently only mysql
- * is supported.
+ * the xdb requests using an underlying SQL database. Currently mysql
+ * and postgresql are supported.
+ *
+ * Requests are processed in mtq threads using a pool of connections to the
+ * database server (configured using &lt;connections/&gt;), so that a slow
+ * query does not stall the processing of other xdb requests.
+ */
+
+/**
+ * a configured SQL query template
  */
+typedef struct xdbsql_query_struct {
+    xdbsql_query_struct() : id(0), params(0) {};
+
+    std::vector<std::string> tokens;	/**< preprocessed template, even entries are literals, odd entries are variables */
+    int		id;			/**< number of this template, used to name the prepared statement */
+    std::string	prepared;		/**< the template with placeholders for the variables, empty if it cannot be prepared */
+    int		params;			/**< number of placeholders in prepared */
+} _xdbsql_query;
 
 /**
  * structure that holds the information how to handle a namespace
  */
 typedef struct xdbsql_ns_def_struct {
-    std::list< std::vector<std::string> > get_query; /**< SQL query to handle get requests */
+    std::list<_xdbsql_query> get_query; /**< SQL query to handle get requests */
     xmlnode		get_result;	/**< template for results for get requests */
-    std::list< std::vector<std::string> > set_query; /**< SQL query to handle set requests */
-    std::list< std::vector<std::string> > delete_query; /**< SQL query to delete old values */
+    std::list<_xdbsql_query> set_query; /**< SQL query to handle set requests */
+    std::list<_xdbsql_query> delete_query; /**< SQL query to delete old values */
 } *xdbsql_ns_def, _xdbsql_ns_def;
 
+/**
+ * one connection to the database server, xdb_sql keeps a pool of them
+ */
+typedef struct xdbsql_conn_struct {
+    xdbsql_conn_struct() : busy(0)
+#ifdef HAVE_MYSQL
+	, mysql(NULL)
+#endif
+#ifdef HAVE_POSTGRESQL
+	, postgresql(NULL)
+#endif
+	{};
+
+    int		busy;			/**< if a request is currently processed using this connection */
+#ifdef HAVE_MYSQL
+    MYSQL	*mysql;			/**< our database handle */
+    std::map<int, MYSQL_STMT*> mysql_stmts; /**< statements prepared on this connection (NULL if preparing failed) */
+#endif
+#ifdef HAVE_POSTGRESQL
+    PGconn	*postgresql;		/**< our postgresql connection handle */
+    std::map<int, int> postgresql_prepared; /**< statements prepared on this connection (0 if preparing failed) */
+#endif
+} *xdbsql_conn, _xdbsql_conn;
+
 /**
  * structure that holds the data used by xdb_sql internally
  */
 typedef struct xdbsql_struct {
     xdbsql_struct() :
 #ifdef HAVE_MYSQL
-	use_mysql(0), mysql(NULL), mysql_user(NULL), mysql_password(NULL), mysql_host(NULL),
+	use_mysql(0), mysql_user(NULL), mysql_password(NULL), mysql_host(NULL),
 	mysql_database(NULL), mysql_port(0), mysql_socket(NULL), mysql_flag(0),
 #endif
 #ifdef HAVE_POSTGRESQL
-	use_postgresql(0), postgresql(NULL), postgresql_conninfo(NULL),
+	use_postgresql(0), postgresql_conninfo(NULL),
 #endif
-	onconnect(NULL), namespace_prefixes(NULL), std_namespace_prefixes(NULL) {};
+	onconnect(NULL), namespace_prefixes(NULL), std_namespace_prefixes(NULL), queries(0) {};
 
     std::map<std::string, _xdbsql_ns_def > namespace_defs; /**< definitions of queries for the different namespaces */
     char	*onconnect;		/**< SQL query that should be executed after we connected to the database server */
     xht		namespace_prefixes;	/**< prefixes for the namespaces (key = prefix, value = ns_iri) */
     xht		std_namespace_prefixes;	/**< prefixes used by the component itself for the namespaces */
+    std::vector<xdbsql_conn> connections; /**< pool of connections to the database server */
+    int		queries;		/**< number of query templates, used to number them */
+    std::list<dpacket> waiting;		/**< requests waiting for a free connection (or for a request of the same owner) */
+    std::map<std::string, int> active_owners; /**< owners that have a request in progress, to keep requests of an owner in order */
 #ifdef HAVE_MYSQL
     int		use_mysql;		/**< if we want to use the mysql driver */
-    MYSQL	*mysql;			/**< our database handle */
     char	*mysql_user;		/**< username for mysql server */
     char	*mysql_password;	/**< password for mysql server */
     char	*mysql_host;		/**< hostname of the mysql server */
@@ -96,27 +140,63 @@ typedef struct xdbsql_struct {
 #endif
 #ifdef HAVE_POSTGRESQL
     int		use_postgresql;		/**< if we want to use the postgresql driver */
-    PGconn	*postgresql;		/**< our postgresql connection handle */
     char	*postgresql_conninfo;	/**< settings used to connect to postgresql */
 #endif
 } *xdbsql, _xdbsql;
 
-/* forward declaration */
-static int xdb_sql_execute(instance i, xdbsql xq, char *query, xmlnode xmltemplate, xmlnode result);
+/**
+ * a request that is processed in a worker thread
+ */
+typedef struct xdbsql_job_struct {
+    instance	i;			/**< the instance we are running in */
+    xdbsql	xq;			/**< instance internal data */
+    xdbsql_conn	conn;			/**< the connection used to process the request */
+    xdbsql_ns_def ns_def;		/**< how to handle the namespace of the request */
+    dpacket	p;			/**< the xdb request */
+} *xdbsql_job, _xdbsql_job;
+
+/* forward declarations */
+static int xdb_sql_execute(instance i, xdbsql xq, xdbsql_conn conn, char *query, xmlnode xmltemplate, xmlnode result);
+static void xdb_sql_prepare_all(instance i, xdbsql xq, xdbsql_conn conn);
+
+/**
+ * close the statements prepared on a mysql connection
+ *
+ * Used when the connection is closed or reestablished, as the server forgets the statements.
+ *
+ * @param conn the connection
+ */
+static void xdb_sql_mysql_forget_prepared(xdbsql_conn conn) {
+#ifdef HAVE_MYSQL
+    for (std::map<int, MYSQL_STMT*>::iterator stmt = conn->mysql_stmts.begin(); stmt != conn->mysql_stmts.end(); ++stmt) {
+	if (stmt->second != NULL) {
+	    mysql_stmt_close(stmt->second);
+	}
+    }
+    conn->mysql_stmts.clear();
+#endif
+}
 
 /**
  * connect to the mysql server
  *
  * @param i the instance we are running in
  * @param xq our internal instance data
+ * @param conn the connection to establish
  */
-static void xdb_sql_mysql_connect(instance i, xdbsql xq) {
+static void xdb_sql_mysql_connect(instance i, xdbsql xq, xdbsql_conn conn) {
 #ifdef HAVE_MYSQL
+    /* prepared statements do not survive a reconnect */
+    xdb_sql_mysql_forget_prepared(conn);
+
     /* connect to the database */
-    if (mysql_real_connect(xq->mysql, xq->mysql_host, xq->mysql_user, xq->mysql_password, xq->mysql_database, xq->mysql_port, xq->mysql_socket, xq->mysql_flag) == NULL) {
-	log_error(i->id, "failed to connect to mysql server: %s", mysql_error(xq->mysql));
-    } else if (xq->onconnect) {
-	xdb_sql_execute(i, xq, xq->onconnect, NULL, NULL);
+    if (mysql_real_connect(conn->mysql, xq->mysql_host, xq->mysql_user, xq->mysql_password, xq->mysql_database, xq->mysql_port, xq->mysql_socket, xq->mysql_flag) == NULL) {
+	log_error(i->id, "failed to connect to mysql server: %s", mysql_error(conn->mysql));
+    } else {
+	if (xq->onconnect) {
+	    xdb_sql_execute(i, xq, conn, xq->onconnect, NULL, NULL);
+	}
+	xdb_sql_prepare_all(i, xq, conn);
     }
 #else
     log_debug2(ZONE, LOGT_STRANGE, "xdb_sql_mysql_connect called, but not compiled in.");
@@ -165,6 +245,35 @@ static void xdb_sql_stream_add_escaped(std::ostream &destination, char *new_stri
     xdb_sql_stream_add_escaped(destination, first_to_escape+1);
 }
 
+/**
+ * get the value of a template variable
+ *
+ * @param variable the variable (a path in the xdb query)
+ * @param xdb_query the xdb query
+ * @param namespaces the mapping from namespace prefixes to namespace IRIs
+ * @return value of the variable, allocated from the pool of xdb_query
+ */
+static char *xdb_sql_variable_value(const std::string &variable, xmlnode xdb_query, xht namespaces) {
+    char *subst = NULL;
+    xmlnode selected = NULL;
+
+    /* XXX handle multiple results */
+    selected = xmlnode_get_list_item(xmlnode_get_tags(xdb_query, variable.c_str(), namespaces), 0);
+    switch (xmlnode_get_type(selected)) {
+	case NTYPE_TAG:
+	    subst = xmlnode_serialize_string(selected, xmppd::ns_decl_list(), 0);
+	    break;
+	case NTYPE_ATTRIB:
+	case NTYPE_CDATA:
+	    subst = xmlnode_get_data(selected);
+	    break;
+    }
+
+    log_debug2(ZONE, LOGT_STORAGE, "%s replaced by %s", variable.c_str(), subst);
+
+    return pstrdup(xdb_query->p, subst!=NULL ? subst : "");
+}
+
 /**
  * use the template for a query to construct a real query
  *
@@ -193,24 +302,7 @@ static char *xdb_sql_construct_query(const std::vector<std::string> &sqltemplate
 	    result_stream << *p;
 	} else {
 	    /* substitute token */
-	    char *subst = NULL;
-	    xmlnode selected = NULL;
-
-	    /* XXX handle multiple results */
-	    selected = xmlnode_get_list_item(xmlnode_get_tags(xdb_query, p->c_str(), namespaces), 0);
-	    switch (xmlnode_get_type(selected)) {
-		case NTYPE_TAG:
-		    subst = xmlnode_serialize_string(selected, xmppd::ns_decl_list(), 0);
-		    break;
-		case NTYPE_ATTRIB:
-		case NTYPE_CDATA:
-		    subst = xmlnode_get_data(selected);
-		    break;
-	    }
-
-	    log_debug2(ZONE, LOGT_STORAGE, "%s replaced by %s", p->c_str(), subst);
-
-	    xdb_sql_stream_add_escaped(result_stream, pstrdup(xdb_query->p, subst!=NULL ? subst : ""));
+	    xdb_sql_stream_add_escaped(result_stream, xdb_sql_variable_value(*p, xdb_query, namespaces));
 	}
 
 	/* next token */
@@ -251,33 +343,196 @@ static xmlnode xdb_sql_find_node_recursive(xmlnode root, const char *name, const
     return NULL;
 }
 
+/**
+ * instantiate the result template for a row of a SQL result, and add it to the result
+ *
+ * @param i the instance we are running in
+ * @param xmltemplate template to construct the result
+ * @param result where to add the results
+ * @param values the values of the fields in the row
+ * @param lengths the lengths of the values
+ * @param num_fields the number of fields in the row
+ */
+static void xdb_sql_add_row(instance i, xmlnode xmltemplate, xmlnode result, char **values, unsigned long *lengths, unsigned int num_fields) {
+    int row_okay = 1;
+    xmlnode variable = NULL;
+    xmlnode new_instance = NULL;
+
+    log_debug2(ZONE, LOGT_STORAGE, "we got a result row with %u fields", num_fields);
+
+    /* instantiate a copy of the template */
+    new_instance = xmlnode_dup_pool(result->p, xmltemplate);
+
+    /* find variables in the template and replace them with values */
+    while (variable = xdb_sql_find_node_recursive(new_instance, "value", NS_JABBERD_XDBSQL)) {
+	xmlnode parent = xmlnode_get_parent(variable);
+	int value = j_atoi(xmlnode_get_attrib_ns(variable, "value", NULL), 0);
+	int parsed = j_strcmp(xmlnode_get_attrib_ns(variable, "parsed", NULL), "parsed") == 0;
+
+	/* hide the template variable */
+	xmlnode_hide(variable);
+
+	/* insert the value */
+	if (value > 0 && value <= num_fields) {
+	    if (parsed) {
+		xmlnode fieldvalue = xmlnode_str(values[value-1], lengths[value-1]);
+		if (fieldvalue == NULL) {
+		    log_warn(i->id, "could not parse: %s", values[value-1]);
+		    row_okay = 0;
+		    continue;
+		}
+		xmlnode fieldcopy = xmlnode_dup_pool(result->p, fieldvalue);
+		xmlnode_free(fieldvalue);
+		xmlnode_insert_tag_node(parent, fieldcopy);
+	    } else {
+		xmlnode_insert_cdata(parent, values[value-1], lengths[value-1]);
+	    }
+	}
+    }
+
+    /* insert the result */
+    if (row_okay) {
+	log_debug2(ZONE, LOGT_STORAGE, "the row results in: %s", xmlnode_serialize_string(new_instance, xmppd::ns_decl_list(), 0));
+	xmlnode_insert_node(result, xmlnode_get_firstchild(new_instance));
+    } else {
+	log_warn(i->id, "ignoring a row in a SQL result, due to problems with it");
+    }
+}
+
+/**
+ * prepare a query template on a mysql connection
+ *
+ * @param i the instance we are running in
+ * @param conn the connection to prepare the statement on
+ * @param query the query template
+ */
+static void xdb_sql_mysql_prepare(instance i, xdbsql_conn conn, const _xdbsql_query &query) {
+#ifdef HAVE_MYSQL
+    MYSQL_STMT *stmt = mysql_stmt_init(conn->mysql);
+
+    if (stmt != NULL && mysql_stmt_prepare(stmt, query.prepared.c_str(), query.prepared.length()) != 0) {
+	log_warn(i->id, "cannot prepare statement, it is executed unprepared: %s: %s", query.prepared.c_str(), mysql_stmt_error(stmt));
+	mysql_stmt_close(stmt);
+	stmt = NULL;
+    }
+
+    conn->mysql_stmts[query.id] = stmt;
+#endif
+}
+
+/**
+ * execute a prepared query template using mysql
+ *
+ * @param i the instance we are running in
+ * @param xq instance internal data
+ * @param conn the connection to use
+ * @param query the query template
+ * @param values the values for the placeholders
+ * @param xmltemplate template to construct the result
+ * @param result where to add the results
+ * @return 0 on success, positive on failure, negative if the statement has to be executed unprepared
+ */
+static int xdb_sql_execute_mysql_prepared(instance i, xdbsql xq, xdbsql_conn conn, const _xdbsql_query &query, char **values, xmlnode xmltemplate, xmlnode result) {
+#ifdef HAVE_MYSQL
+    std::map<int, MYSQL_STMT*>::iterator prepared = conn->mysql_stmts.find(query.id);
+    MYSQL_STMT *stmt = prepared == conn->mysql_stmts.end() ? NULL : prepared->second;
+    MYSQL_RES *metadata = NULL;
+    std::vector<MYSQL_BIND> params(query.params);
+    std::vector<unsigned long> param_lengths(query.params);
+
+    if (stmt == NULL) {
+	return -1;
+    }
+
+    /* bind the values */
+    for (int n = 0; n < query.params; n++) {
+	std::memset(&params[n], 0, sizeof(MYSQL_BIND));
+	param_lengths[n] = j_strlen(values[n]);
+	params[n].buffer_type = MYSQL_TYPE_STRING;
+	params[n].buffer = values[n];
+	params[n].buffer_length = param_lengths[n];
+	params[n].length = &param_lengths[n];
+    }
+    if (mysql_stmt_bind_param(stmt, params.empty() ? NULL : &params[0]) != 0 || mysql_stmt_execute(stmt) != 0) {
+	unsigned int query_errno = mysql_stmt_errno(stmt);
+	if (query_errno == CR_SERVER_LOST || query_errno == CR_SERVER_GONE_ERROR) {
+	    /* xdb_sql_execute_mysql() will reconnect */
+	    return -1;
+	}
+	log_error(i->id, "mysql statement (%s) failed: %s", query.prepared.c_str(), mysql_stmt_error(stmt));
+	return 1;
+    }
+
+    /* does the statement have a result set? */
+    metadata = mysql_stmt_result_metadata(stmt);
+    if (metadata != NULL) {
+	unsigned int num_fields = mysql_num_fields(metadata);
+	std::vector<MYSQL_BIND> fields(num_fields);
+	std::vector<unsigned long> lengths(num_fields);
+	std::vector<char*> row(num_fields);
+
+	/* we first fetch the lengths of the fields only, then the values */
+	for (unsigned int n = 0; n < num_fields; n++) {
+	    std::memset(&fields[n], 0, sizeof(MYSQL_BIND));
+	    fields[n].buffer_type = MYSQL_TYPE_STRING;
+	    fields[n].length = &lengths[n];
+	}
+	mysql_stmt_bind_result(stmt, num_fields ? &fields[0] : NULL);
+	mysql_stmt_store_result(stmt);
+
+	for (int ret = mysql_stmt_fetch(stmt); ret == 0 || ret == MYSQL_DATA_TRUNCATED; ret = mysql_stmt_fetch(stmt)) {
+	    for (unsigned int n = 0; n < num_fields; n++) {
+		row[n] = static_cast<char*>(pmalloco(result->p, lengths[n] + 1));
+		if (lengths[n] > 0) {
+		    fields[n].buffer = row[n];
+		    fields[n].buffer_length = lengths[n] + 1;
+		    mysql_stmt_fetch_column(stmt, &fields[n], n, 0);
+		    fields[n].buffer = NULL;
+		    fields[n].buffer_length = 0;
+		}
+	    }
+	    xdb_sql_add_row(i, xmltemplate, result, num_fields ? &row[0] : NULL, num_fields ? &lengths[0] : NULL, num_fields);
+	}
+
+	mysql_free_result(metadata);
+    }
+    mysql_stmt_free_result(stmt);
+
+    return 0;
+#else
+    log_debug2(ZONE, LOGT_STRANGE, "xdb_sql_execute_mysql_prepared called, but not compiled in.");
+    return -1;
+#endif
+}
+
 /**
  * execute a sql query using mysql
  *
  * @param i the instance we are running in
  * @param xq instance internal data
+ * @param conn the connection to use
  * @param query the SQL query to execute
  * @param xmltemplate template to construct the result
  * @param result where to add the results
  * @return 0 on success, non zero on failure
  */
-static int xdb_sql_execute_mysql(instance i, xdbsql xq, char *query, xmlnode xmltemplate, xmlnode result) {
+static int xdb_sql_execute_mysql(instance i, xdbsql xq, xdbsql_conn conn, char *query, xmlnode xmltemplate, xmlnode result) {
 #ifdef HAVE_MYSQL
     int ret = 0;
     MYSQL_RES *res = NULL;
     MYSQL_ROW row = NULL;
     
     /* try to execute the query */
-    ret = mysql_query(xq->mysql, query);
+    ret = mysql_query(conn->mysql, query);
 
     /* failed and we need to reconnect? */
     if (ret) {
-	unsigned int query_errno = mysql_errno(xq->mysql);
+	unsigned int query_errno = mysql_errno(conn->mysql);
 	if (query_errno == CR_SERVER_LOST || query_errno == CR_SERVER_GONE_ERROR) {
 	    log_debug2(ZONE, LOGT_STORAGE, "connection lost, trying to reconnect to MySQL server");
-	    xdb_sql_mysql_connect(i, xq);
+	    xdb_sql_mysql_connect(i, xq, conn);
 
-	    ret = mysql_query(xq->mysql, query);
+	    ret = mysql_query(conn->mysql, query);
 
 	    if (ret == 0) {
 		log_notice(i->id, "connection to MySQL server %s:%i had been lost, and has been reestablished", xq->mysql_host , xq->mysql_port);
@@ -287,60 +542,18 @@ static int xdb_sql_execute_mysql(instance i, xdbsql xq, char *query, xmlnode xml
 
     /* still an error? log and return */
     if (ret != 0) {
-	log_error(i->id, "mysql query (%s) failed: %s", query, mysql_error(xq->mysql));
+	log_error(i->id, "mysql query (%s) failed: %s", query, mysql_error(conn->mysql));
 	return 1;
     }
 
     /* the mysql query succeded: fetch results */
-    while (res = mysql_store_result(xq->mysql)) {
+    while (res = mysql_store_result(conn->mysql)) {
 	/* how many fields are in the rows */
 	unsigned int num_fields = mysql_num_fields(res);
 
 	/* fetch rows of the result */
 	while (row = mysql_fetch_row(res)) {
-	    int row_okay = 1;
-	    xmlnode variable = NULL;
-	    xmlnode new_instance = NULL;
-
-	    log_debug2(ZONE, LOGT_STORAGE, "we got a result row with %u fields", num_fields);
-	    
-	    /* instantiate a copy of the template */
-	    new_instance = xmlnode_dup_pool(result->p, xmltemplate);
-
-	    /* find variables in the template and replace them with values */
-	    while (variable = xdb_sql_find_node_recursive(new_instance, "value", NS_JABBERD_XDBSQL)) {
-		xmlnode parent = xmlnode_get_parent(variable);
-		int value = j_atoi(xmlnode_get_attrib_ns(variable, "value", NULL), 0);
-		int parsed = j_strcmp(xmlnode_get_attrib_ns(variable, "parsed", NULL), "parsed") == 0;
-
-		/* hide the template variable */
-		xmlnode_hide(variable);
-
-		/* insert the value */
-		if (value > 0 && value <= num_fields) {
-		    if (parsed) {
-			xmlnode fieldvalue = xmlnode_str(row[value-1], j_strlen(row[value-1]));
-			if (fieldvalue == NULL) {
-			    log_warn(i->id, "could not parse: %s", row[value-1]);
-			    row_okay = 0;
-			    continue;
-			}
-			xmlnode fieldcopy = xmlnode_dup_pool(result->p, fieldvalue);
-			xmlnode_free(fieldvalue);
-			xmlnode_insert_tag_node(parent, fieldcopy);
-		    } else {
-			xmlnode_insert_cdata(parent, row[value-1], (unsigned int)-1);
-		    }
-		}
-	    }
-
-	    /* insert the result */
-	    if (row_okay) {
-		log_debug2(ZONE, LOGT_STORAGE, "the row results in: %s", xmlnode_serialize_string(new_instance, xmppd::ns_decl_list(), 0));
-		xmlnode_insert_node(result, xmlnode_get_firstchild(new_instance));
-	    } else {
-		log_warn(i->id, "ignoring a row in a SQL result, due to problems with it");
-	    }
+	    xdb_sql_add_row(i, xmltemplate, result, row, mysql_fetch_lengths(res), num_fields);
 	}
 
 	/* free the result again */
@@ -354,46 +567,189 @@ static int xdb_sql_execute_mysql(instance i, xdbsql xq, char *query, xmlnode xml
 #endif
 }
 
+#ifdef HAVE_POSTGRESQL
 /**
- * execute a sql query using postgresql
+ * wait for the socket of a PostgreSQL connection to get ready, without blocking other threads
+ *
+ * The wait is done by the MIO readiness backend, that is not limited to file descriptors below FD_SETSIZE.
+ *
+ * @param conn the PostgreSQL connection
+ * @param writeable 0 to wait until we can read from the socket, else to wait until we can write to it
+ * @return 0 if the socket is ready, non-zero if we cannot wait for it
+ */
+static int xdb_sql_postgresql_wait(PGconn *conn, int writeable) {
+    int fd = PQsocket(conn);
+
+    if (fd < 0)
+	return 1;
+
+    if (mio_wait_fd(fd, writeable, NULL) != 0) {
+	log_warn(NULL, "cannot wait for PostgreSQL socket %i: %s", fd, strerror(errno));
+	return 1;
+    }
+    return 0;
+}
+
+/**
+ * reestablish a lost connection to the PostgreSQL server
  *
  * @param i the instance we are running in
  * @param xq instance internal data
- * @param query the SQL query to execute
- * @param xmltemplate template to construct the result
- * @param result where to add the results
+ * @param conn the connection to reset
  * @return 0 on success, non zero on failure
  */
-static int xdb_sql_execute_postgresql(instance i, xdbsql xq, char *query, xmlnode xmltemplate, xmlnode result) {
-#ifdef HAVE_POSTGRESQL
-    PGresult *res = NULL;
-    ExecStatusType status = static_cast<ExecStatusType>(0);
-    int row = 0;
-    int fields = 0;
+static int xdb_sql_postgresql_reset(instance i, xdbsql xq, xdbsql_conn conn) {
+    PostgresPollingStatusType status = PGRES_POLLING_WRITING;
 
-    /* are we still connected? */
-    if (PQstatus(xq->postgresql) != CONNECTION_OK) {
-	log_warn(i->id, "resetting connection to the PostgreSQL server");
-	
-	/* reset the connection */
-	PQreset(xq->postgresql);
-
-	/* are we now connected? */
-	if (PQstatus(xq->postgresql) != CONNECTION_OK) {
-	    log_error(i->id, "cannot reset connection: %s", PQerrorMessage(xq->postgresql));
-	    return 1;
-	} else if (xq->onconnect) {
-	    xdb_sql_execute(i, xq, xq->onconnect, NULL, NULL);
+    log_warn(i->id, "resetting connection to the PostgreSQL server");
+
+    if (PQresetStart(conn->postgresql)) {
+	while (status != PGRES_POLLING_OK && status != PGRES_POLLING_FAILED) {
+	    if (xdb_sql_postgresql_wait(conn->postgresql, status == PGRES_POLLING_WRITING) != 0)
+		break;
+	    status = PQresetPoll(conn->postgresql);
 	}
     }
 
-    /* try to execute the query */
-    res = PQexec(xq->postgresql, query);
-    if (res == NULL) {
-	log_error(i->id, "cannot execute PostgreSQL query: %s", PQerrorMessage(xq->postgresql));
+    /* are we now connected? */
+    if (PQstatus(conn->postgresql) != CONNECTION_OK) {
+	log_error(i->id, "cannot reset connection: %s", PQerrorMessage(conn->postgresql));
 	return 1;
     }
 
+    PQsetnonblocking(conn->postgresql, 1);
+    if (xq->onconnect) {
+	xdb_sql_execute(i, xq, conn, xq->onconnect, NULL, NULL);
+    }
+
+    /* the server forgot the statements we prepared before */
+    conn->postgresql_prepared.clear();
+    xdb_sql_prepare_all(i, xq, conn);
+    return 0;
+}
+
+/**
+ * wait for the result of a command, that has been sent to the PostgreSQL server
+ *
+ * Instead of blocking the process while the server is processing the command,
+ * only the calling thread waits for the socket.
+ *
+ * @param conn the connection the command has been sent on
+ * @return the result of the command (like PQexec() the last one, if there are multiple), NULL on failure
+ */
+static PGresult *xdb_sql_postgresql_result(xdbsql_conn conn) {
+    PGresult *res = NULL;
+    PGresult *next = NULL;
+    int flushed = 0;
+
+    /* send the command to the server */
+    while ((flushed = PQflush(conn->postgresql)) == 1) {
+	if (xdb_sql_postgresql_wait(conn->postgresql, 1) != 0)
+	    return NULL;
+    }
+    if (flushed < 0)
+	return NULL;
+
+    /* collect the results */
+    while (1) {
+	while (PQisBusy(conn->postgresql)) {
+	    if (xdb_sql_postgresql_wait(conn->postgresql, 0) != 0 || !PQconsumeInput(conn->postgresql)) {
+		if (res != NULL)
+		    PQclear(res);
+		return NULL;
+	    }
+	}
+
+	next = PQgetResult(conn->postgresql);
+	if (next == NULL)
+	    break;
+
+	/* keep the last result, but do not hide an error by later results */
+	if (res != NULL && PQresultStatus(res) == PGRES_FATAL_ERROR) {
+	    PQclear(next);
+	} else {
+	    if (res != NULL)
+		PQclear(res);
+	    res = next;
+	}
+    }
+
+    return res;
+}
+
+/**
+ * send a query to the PostgreSQL server and wait for its result
+ *
+ * This replaces PQexec(), without blocking other threads.
+ *
+ * @param conn the connection to use
+ * @param query the SQL query to execute
+ * @return the result of the query, NULL on failure
+ */
+static PGresult *xdb_sql_postgresql_exec(xdbsql_conn conn, char const* query) {
+    if (!PQsendQuery(conn->postgresql, query))
+	return NULL;
+
+    return xdb_sql_postgresql_result(conn);
+}
+
+/**
+ * get the name of the prepared statement for a query template
+ *
+ * @param query the query template
+ * @return name of the prepared statement
+ */
+static std::string xdb_sql_postgresql_stmt_name(const _xdbsql_query &query) {
+    std::ostringstream name;
+
+    name << "xdbsql" << query.id;
+    return name.str();
+}
+
+/**
+ * prepare a query template on a PostgreSQL connection
+ *
+ * This has to be done outside of a transaction, as a failing prepare would abort it.
+ *
+ * @param i the instance we are running in
+ * @param conn the connection to prepare the statement on
+ * @param query the query template
+ */
+static void xdb_sql_postgresql_prepare(instance i, xdbsql_conn conn, const _xdbsql_query &query) {
+    PGresult *res = NULL;
+    int prepared = 0;
+
+    if (PQsendPrepare(conn->postgresql, xdb_sql_postgresql_stmt_name(query).c_str(), query.prepared.c_str(), query.params, NULL)) {
+	res = xdb_sql_postgresql_result(conn);
+    }
+    prepared = res != NULL && PQresultStatus(res) == PGRES_COMMAND_OK;
+
+    if (!prepared) {
+	log_warn(i->id, "cannot prepare statement, it is executed unprepared: %s: %s", query.prepared.c_str(), res != NULL ? PQresultErrorMessage(res) : PQerrorMessage(conn->postgresql));
+    }
+    if (res != NULL) {
+	PQclear(res);
+    }
+
+    conn->postgresql_prepared[query.id] = prepared;
+}
+
+/**
+ * process the result of a PostgreSQL query
+ *
+ * @param i the instance we are running in
+ * @param res the result (gets freed)
+ * @param xmltemplate template to construct the result
+ * @param result where to add the results
+ * @return 0 on success, non zero on failure
+ */
+static int xdb_sql_postgresql_handle_result(instance i, PGresult *res, xmlnode xmltemplate, xmlnode result) {
+    ExecStatusType status = static_cast<ExecStatusType>(0);
+    int row = 0;
+    int fields = 0;
+    std::vector<char*> values;
+    std::vector<unsigned long> lengths;
+
     /* get the status of the execution */
     status = PQresultStatus(res);
     switch (status) {
@@ -412,42 +768,51 @@ static int xdb_sql_execute_postgresql(instance i, xdbsql xq, char *query, xmlnod
 
     /* the postgresql query succeded: fetch results */
     fields = PQnfields(res);
+    values.resize(fields);
+    lengths.resize(fields);
     for (row = 0; row < PQntuples(res); row++) {
-	xmlnode variable = NULL;
-	xmlnode new_instance = NULL;
-
-	/* instantiate a copy of the template */
-	new_instance = xmlnode_dup_pool(result->p, xmltemplate);
-
-	/* find variables in the template and replace them with values */
-	while (variable = xdb_sql_find_node_recursive(new_instance, "value", NS_JABBERD_XDBSQL)) {
-	    xmlnode parent = xmlnode_get_parent(variable);
-	    int value = j_atoi(xmlnode_get_attrib_ns(variable, "value", NULL), 0);
-	    int parsed = j_strcmp(xmlnode_get_attrib_ns(variable, "parsed", NULL), "parsed") == 0;
-
-	    /* hide the template variable */
-	    xmlnode_hide(variable);
-
-	    /* insert the value */
-	    if (value > 0 && value <= fields) {
-		if (parsed) {
-		    xmlnode fieldvalue = xmlnode_str(PQgetvalue(res, row, value-1), PQgetlength(res, row, value-1));
-		    xmlnode fieldcopy = xmlnode_dup_pool(result->p, fieldvalue);
-		    xmlnode_free(fieldvalue);
-		    xmlnode_insert_tag_node(parent, fieldcopy);
-		} else {
-		    xmlnode_insert_cdata(parent, PQgetvalue(res, row, value-1), PQgetlength(res, row, value-1));
-		}
-	    }
+	for (int field = 0; field < fields; field++) {
+	    values[field] = PQgetvalue(res, row, field);
+	    lengths[field] = PQgetlength(res, row, field);
 	}
-
-	/* insert the result */
-	log_debug2(ZONE, LOGT_STORAGE, "the row results in: %s", xmlnode_serialize_string(new_instance, xmppd::ns_decl_list(), 0));
-	xmlnode_insert_node(result, xmlnode_get_firstchild(new_instance));
+	xdb_sql_add_row(i, xmltemplate, result, fields ? &values[0] : NULL, fields ? &lengths[0] : NULL, fields);
     }
 
     PQclear(res);
     return 0;
+}
+#endif
+
+/**
+ * execute a sql query using postgresql
+ *
+ * @param i the instance we are running in
+ * @param xq instance internal data
+ * @param conn the connection to use
+ * @param query the SQL query to execute
+ * @param xmltemplate template to construct the result
+ * @param result where to add the results
+ * @return 0 on success, non zero on failure
+ */
+static int xdb_sql_execute_postgresql(instance i, xdbsql xq, xdbsql_conn conn, char *query, xmlnode xmltemplate, xmlnode result) {
+#ifdef HAVE_POSTGRESQL
+    PGresult *res = NULL;
+
+    /* are we still connected? */
+    if (PQstatus(conn->postgresql) != CONNECTION_OK) {
+	if (xdb_sql_postgresql_reset(i, xq, conn)) {
+	    return 1;
+	}
+    }
+
+    /* try to execute the query */
+    res = xdb_sql_postgresql_exec(conn, query);
+    if (res == NULL) {
+	log_error(i->id, "cannot execute PostgreSQL query: %s", PQerrorMessage(conn->postgresql));
+	return 1;
+    }
+
+    return xdb_sql_postgresql_handle_result(i, res, xmltemplate, result);
 #else
     log_debug2(ZONE, LOGT_STRANGE, "xdb_sql_execute_postgresql called, but not compiled in.");
     return 1;
@@ -455,31 +820,170 @@ static int xdb_sql_execute_postgresql(instance i, xdbsql xq, char *query, xmlnod
 }
 
 
+/**
+ * execute a prepared query template using postgresql
+ *
+ * @param i the instance we are running in
+ * @param xq instance internal data
+ * @param conn the connection to use
+ * @param query the query template
+ * @param values the values for the placeholders
+ * @param xmltemplate template to construct the result
+ * @param result where to add the results
+ * @return 0 on success, positive on failure, negative if the statement has to be executed unprepared
+ */
+static int xdb_sql_execute_postgresql_prepared(instance i, xdbsql xq, xdbsql_conn conn, const _xdbsql_query &query, char **values, xmlnode xmltemplate, xmlnode result) {
+#ifdef HAVE_POSTGRESQL
+    PGresult *res = NULL;
+    std::map<int, int>::iterator prepared;
+
+    /* are we still connected? */
+    if (PQstatus(conn->postgresql) != CONNECTION_OK) {
+	if (xdb_sql_postgresql_reset(i, xq, conn)) {
+	    return 1;
+	}
+    }
+
+    /* has the statement been prepared on this connection? */
+    prepared = conn->postgresql_prepared.find(query.id);
+    if (prepared == conn->postgresql_prepared.end() || !prepared->second) {
+	return -1;
+    }
+
+    /* execute it */
+    if (PQsendQueryPrepared(conn->postgresql, xdb_sql_postgresql_stmt_name(query).c_str(), query.params, values, NULL, NULL, 0)) {
+	res = xdb_sql_postgresql_result(conn);
+    }
+    if (res == NULL) {
+	log_error(i->id, "cannot execute PostgreSQL statement: %s", PQerrorMessage(conn->postgresql));
+	return 1;
+    }
+
+    return xdb_sql_postgresql_handle_result(i, res, xmltemplate, result);
+#else
+    log_debug2(ZONE, LOGT_STRANGE, "xdb_sql_execute_postgresql_prepared called, but not compiled in.");
+    return -1;
+#endif
+}
+
 /**
  * execute a sql query
  *
  * @param i the instance we are running in
  * @param xq instance internal data
+ * @param conn the connection to use
  * @param query the SQL query to execute
  * @param xmltemplate template to construct the result
  * @param result where to add the results
  * @return 0 on success, non zero on failure
  */
-static int xdb_sql_execute(instance i, xdbsql xq, char *query, xmlnode xmltemplate, xmlnode result) {
+static int xdb_sql_execute(instance i, xdbsql xq, xdbsql_conn conn, char *query, xmlnode xmltemplate, xmlnode result) {
 #ifdef HAVE_MYSQL
     if (xq->use_mysql) {
-	return xdb_sql_execute_mysql(i, xq, query, xmltemplate, result);
+	return xdb_sql_execute_mysql(i, xq, conn, query, xmltemplate, result);
     }
 #endif
 #ifdef HAVE_POSTGRESQL
     if (xq->use_postgresql) {
-	return xdb_sql_execute_postgresql(i, xq, query, xmltemplate, result);
+	return xdb_sql_execute_postgresql(i, xq, conn, query, xmltemplate, result);
     }
 #endif
     log_error(i->id, "SQL query %s has not been handled by any sql driver", query);
     return 1;
 }
 
+/**
+ * execute a query template for a xdb query
+ *
+ * If the template has been prepared on the connection, the prepared statement is
+ * executed with the values of the variables bound to it, else the SQL query is
+ * constructed from the template.
+ *
+ * @param i the instance we are running in
+ * @param xq instance internal data
+ * @param conn the connection to use
+ * @param query the query template
+ * @param xdb_query the xdb query
+ * @param xmltemplate template to construct the result
+ * @param result where to add the results
+ * @return 0 on success, non zero on failure
+ */
+static int xdb_sql_execute_template(instance i, xdbsql xq, xdbsql_conn conn, const _xdbsql_query &query, xmlnode xdb_query, xmlnode xmltemplate, xmlnode result) {
+    char *sql = NULL;
+
+    if (!query.prepared.empty()) {
+	std::vector<char*> values;
+	int ret = -1;
+
+	for (std::vector<std::string>::size_type n = 1; n < query.tokens.size(); n += 2) {
+	    values.push_back(xdb_sql_variable_value(query.tokens[n], xdb_query, xq->namespace_prefixes));
+	}
+
+	log_debug2(ZONE, LOGT_STORAGE, "executing prepared statement %i: %s", query.id, query.prepared.c_str());
+#ifdef HAVE_MYSQL
+	if (xq->use_mysql) {
+	    ret = xdb_sql_execute_mysql_prepared(i, xq, conn, query, values.empty() ? NULL : &values[0], xmltemplate, result);
+	}
+#endif
+#ifdef HAVE_POSTGRESQL
+	if (xq->use_postgresql) {
+	    ret = xdb_sql_execute_postgresql_prepared(i, xq, conn, query, values.empty() ? NULL : &values[0], xmltemplate, result);
+	}
+#endif
+	if (ret >= 0) {
+	    return ret;
+	}
+    }
+
+    /* not prepared, construct the query */
+    sql = xdb_sql_construct_query(query.tokens, xdb_query, xq->namespace_prefixes);
+    log_debug2(ZONE, LOGT_STORAGE, "using the following SQL statement: %s", sql);
+    return xdb_sql_execute(i, xq, conn, sql, xmltemplate, result);
+}
+
+/**
+ * prepare a list of query templates on a connection
+ *
+ * @param i the instance we are running in
+ * @param xq instance internal data
+ * @param conn the connection to prepare the statements on
+ * @param queries the query templates
+ */
+static void xdb_sql_prepare_list(instance i, xdbsql xq, xdbsql_conn conn, const std::list<_xdbsql_query> &queries) {
+    for (std::list<_xdbsql_query>::const_iterator query = queries.begin(); query != queries.end(); ++query) {
+	if (query->prepared.empty()) {
+	    continue;
+	}
+#ifdef HAVE_MYSQL
+	if (xq->use_mysql) {
+	    xdb_sql_mysql_prepare(i, conn, *query);
+	}
+#endif
+#ifdef HAVE_POSTGRESQL
+	if (xq->use_postgresql) {
+	    xdb_sql_postgresql_prepare(i, conn, *query);
+	}
+#endif
+    }
+}
+
+/**
+ * prepare all query templates on a connection
+ *
+ * Called after the connection has been (re)established.
+ *
+ * @param i the instance we are running in
+ * @param xq instance internal data
+ * @param conn the connection to prepare the statements on
+ */
+static void xdb_sql_prepare_all(instance i, xdbsql xq, xdbsql_conn conn) {
+    for (std::map<std::string, _xdbsql_ns_def>::iterator def = xq->namespace_defs.begin(); def != xq->namespace_defs.end(); ++def) {
+	xdb_sql_prepare_list(i, xq, conn, def->second.get_query);
+	xdb_sql_prepare_list(i, xq, conn, def->second.set_query);
+	xdb_sql_prepare_list(i, xq, conn, def->second.delete_query);
+    }
+}
+
 /**
  * modify xdb query to be a result, that can be sent back
  *
@@ -492,41 +996,41 @@ static void xdb_sql_makeresult(dpacket p) {
 }
 
 /**
- * callback function that is called by jabberd to handle xdb requests
+ * find the definition how to handle a namespace
+ *
+ * @param xq instance internal data
+ * @param ns the namespace
+ * @return the definition, NULL if the namespace is not configured
+ */
+static xdbsql_ns_def xdb_sql_get_ns_def(xdbsql xq, char const* ns) {
+    std::map<std::string, _xdbsql_ns_def>::iterator def = xq->namespace_defs.find(ns);
+
+    if (def == xq->namespace_defs.end()) {
+	def = xq->namespace_defs.find("*");
+    }
+
+    return def == xq->namespace_defs.end() ? NULL : &def->second;
+}
+
+/**
+ * process a xdb request using one of our database connections
+ *
+ * This is called from a mtq thread. On success the packet has been modified to be the result.
  *
  * @param i the instance we are for jabberd
+ * @param xq instance internal data
+ * @param conn the database connection to use
+ * @param ns_def how to handle the namespace of the request
  * @param p the packet containing the xdb query
- * @param arg pointer to our own internal data
  * @return r_DONE if we could handle the request, r_ERR otherwise
  */
-static result xdb_sql_phandler(instance i, dpacket p, void *arg) {
-    xdbsql xq = (xdbsql)arg;	/* xdb_sql internal data */
-    char *ns = NULL;		/* namespace of the query */
-    _xdbsql_ns_def ns_def; 	/* pointer to the namespace definitions */
+static result xdb_sql_process(instance i, xdbsql xq, xdbsql_conn conn, xdbsql_ns_def ns_def, dpacket p) {
+    char *ns = xmlnode_get_attrib_ns(p->x, "ns", NULL); /* namespace of the query */
     int is_set_request = 0;	/* if this is a set request */
     char *action = NULL;	/* xdb-set action */
     char *match = NULL;		/* xdb-set match */
     char *matchpath = NULL;	/* xdb-set matchpath */
-    std::list< std::vector<std::string> >::iterator iter;
-
-    log_debug2(ZONE, LOGT_STORAGE|LOGT_DELIVER, "handling xdb request %s", xmlnode_serialize_string(p->x, xmppd::ns_decl_list(), 0));
-
-    /* get the namespace of the request */
-    ns = xmlnode_get_attrib_ns(p->x, "ns", NULL);
-    if (ns == NULL) {
-	log_debug2(ZONE, LOGT_STORAGE|LOGT_STRANGE, "xdb_sql got a xdb request without namespace");
-	return r_ERR;
-    }
-
-    /* check if we know how to handle this namespace */
-    if (xq->namespace_defs.find(ns) != xq->namespace_defs.end()) {
-	ns_def = xq->namespace_defs[ns];
-    } else if (xq->namespace_defs.find("*") != xq->namespace_defs.end()) {
-	ns_def = xq->namespace_defs["*"];
-    } else {
-	log_error(i->id, "xdb_sql got a xdb request for an unconfigured namespace %s, use this handler only for selected namespaces.", ns);
-	return r_ERR;
-    }
+    std::list<_xdbsql_query>::iterator iter;
 
     /* check the type of xdb request */
     is_set_request = (j_strcmp(xmlnode_get_attrib_ns(p->x, "type", NULL), "set") == 0);
@@ -537,58 +1041,47 @@ static result xdb_sql_phandler(instance i, dpacket p, void *arg) {
 	matchpath = xmlnode_get_attrib_ns(p->x, "matchpath", NULL);
 
 	if (action == NULL) {
-	    char *query = NULL;
-	    
 	    /* just a boring set */
 
 	    /* start the transaction */
-	    xdb_sql_execute(i, xq, "BEGIN", NULL, NULL);
+	    xdb_sql_execute(i, xq, conn, "BEGIN", NULL, NULL);
 
 	    /* delete old values */
-	    for (iter=ns_def.delete_query.begin(); iter!=ns_def.delete_query.end(); ++iter) {
-		query = xdb_sql_construct_query(*iter, p->x, xq->namespace_prefixes);
-		log_debug2(ZONE, LOGT_STORAGE, "using the following SQL statement for deletion: %s", query);
-		if (xdb_sql_execute(i, xq, query, NULL, NULL)) {
+	    for (iter=ns_def->delete_query.begin(); iter!=ns_def->delete_query.end(); ++iter) {
+		if (xdb_sql_execute_template(i, xq, conn, *iter, p->x, NULL, NULL)) {
 		    /* SQL query failed */
-		    xdb_sql_execute(i, xq, "ROLLBACK", NULL, NULL);
+		    xdb_sql_execute(i, xq, conn, "ROLLBACK", NULL, NULL);
 		    return r_ERR;
 		}
 	    }
 
 	    /* insert new values (if there are any) */
 	    if (xmlnode_get_firstchild(p->x) != NULL) {
-		for (iter=ns_def.set_query.begin(); iter!=ns_def.set_query.end(); ++iter) {
-		    query = xdb_sql_construct_query(*iter, p->x, xq->namespace_prefixes);
-		    log_debug2(ZONE, LOGT_STORAGE, "using the following SQL statement for insertion: %s", query);
-		    if (xdb_sql_execute(i, xq, query, NULL, NULL)) {
+		for (iter=ns_def->set_query.begin(); iter!=ns_def->set_query.end(); ++iter) {
+		    if (xdb_sql_execute_template(i, xq, conn, *iter, p->x, NULL, NULL)) {
 			/* SQL query failed */
-			xdb_sql_execute(i, xq, "ROLLBACK", NULL, NULL);
+			xdb_sql_execute(i, xq, conn, "ROLLBACK", NULL, NULL);
 			return r_ERR;
 		    }
 		}
 	    }
 
 	    /* commit the transaction */
-	    xdb_sql_execute(i, xq, "COMMIT", NULL, NULL);
+	    xdb_sql_execute(i, xq, conn, "COMMIT", NULL, NULL);
 
-	    /* send result back */
+	    /* make it the result, it gets sent back by _xdb_sql_job() */
 	    xdb_sql_makeresult(p);
-	    deliver(dpacket_new(p->x), NULL);
 	    return r_DONE;
 	} else if (j_strcmp(action, "insert") == 0) {
-	    char *query = NULL;
-
 	    /* start the transaction */
-	    xdb_sql_execute(i, xq, "BEGIN", NULL, NULL);
+	    xdb_sql_execute(i, xq, conn, "BEGIN", NULL, NULL);
 
 	    /* delete matches */
 	    if (match != NULL || matchpath != NULL) {
-		for (iter=ns_def.delete_query.begin(); iter!=ns_def.delete_query.end(); ++iter) {
-		    query = xdb_sql_construct_query(*iter, p->x, xq->namespace_prefixes);
-		    log_debug2(ZONE, LOGT_STORAGE, "using the following SQL statement for insert/match[path] deletion: %s", query);
-		    if (xdb_sql_execute(i, xq, query, NULL, NULL)) {
+		for (iter=ns_def->delete_query.begin(); iter!=ns_def->delete_query.end(); ++iter) {
+		    if (xdb_sql_execute_template(i, xq, conn, *iter, p->x, NULL, NULL)) {
 			/* SQL query failed */
-			xdb_sql_execute(i, xq, "ROLLBACK", NULL, NULL);
+			xdb_sql_execute(i, xq, conn, "ROLLBACK", NULL, NULL);
 			return r_ERR;
 		    }
 		}
@@ -596,23 +1089,20 @@ static result xdb_sql_phandler(instance i, dpacket p, void *arg) {
 
 	    /* insert new values if there are any */
 	    if (xmlnode_get_firstchild(p->x) != NULL) {
-		for (iter=ns_def.set_query.begin(); iter!=ns_def.set_query.end(); ++iter) {
-		    query = xdb_sql_construct_query(*iter, p->x, xq->namespace_prefixes);
-		    log_debug2(ZONE, LOGT_STORAGE, "using the following SQL statement for insertion: %s", query);
-		    if (xdb_sql_execute(i, xq, query, NULL, NULL)) {
+		for (iter=ns_def->set_query.begin(); iter!=ns_def->set_query.end(); ++iter) {
+		    if (xdb_sql_execute_template(i, xq, conn, *iter, p->x, NULL, NULL)) {
 			/* SQL query failed */
-			xdb_sql_execute(i, xq, "ROLLBACK", NULL, NULL);
+			xdb_sql_execute(i, xq, conn, "ROLLBACK", NULL, NULL);
 			return r_ERR;
 		    }
 		}
 	    }
 
 	    /* commit the transaction */
-	    xdb_sql_execute(i, xq, "COMMIT", NULL, NULL);
+	    xdb_sql_execute(i, xq, conn, "COMMIT", NULL, NULL);
 
-	    /* send result back */
+	    /* make it the result, it gets sent back by _xdb_sql_job() */
 	    xdb_sql_makeresult(p);
-	    deliver(dpacket_new(p->x), NULL);
 	    return r_DONE;
 	} else {
 	    /* not supported action, probably check */
@@ -620,7 +1110,6 @@ static result xdb_sql_phandler(instance i, dpacket p, void *arg) {
 	    return r_ERR;
 	}
     } else {
-	char *query = NULL;
 	char *group_element = NULL;
 	char *group_ns_iri = NULL;
 	char *group_prefix = NULL;
@@ -629,37 +1118,190 @@ static result xdb_sql_phandler(instance i, dpacket p, void *arg) {
 	/* get request */
 
 	/* start the transaction */
-	xdb_sql_execute(i, xq, "BEGIN", NULL, NULL);
+	xdb_sql_execute(i, xq, conn, "BEGIN", NULL, NULL);
 
 	/* get the record(s) */
-	group_element = xmlnode_get_attrib_ns(ns_def.get_result, "group", NULL);
-	group_ns_iri = xmlnode_get_attrib_ns(ns_def.get_result, "groupiri", NULL);
-	group_prefix = xmlnode_get_attrib_ns(ns_def.get_result, "groupprefix", NULL);
+	group_element = xmlnode_get_attrib_ns(ns_def->get_result, "group", NULL);
+	group_ns_iri = xmlnode_get_attrib_ns(ns_def->get_result, "groupiri", NULL);
+	group_prefix = xmlnode_get_attrib_ns(ns_def->get_result, "groupprefix", NULL);
 	if (group_element != NULL) {
 	    result_element = xmlnode_insert_tag_ns(result_element, group_element, group_prefix, group_ns_iri);
 	    xmlnode_put_attrib(result_element, "ns", ns);
 	}
 
-	for (iter=ns_def.get_query.begin(); iter!=ns_def.get_query.end(); ++iter) {
-	    query = xdb_sql_construct_query(*iter, p->x, xq->namespace_prefixes);
-	    log_debug2(ZONE, LOGT_STORAGE, "using the following SQL statement for selection: %s", query);
-	    if (xdb_sql_execute(i, xq, query, ns_def.get_result, result_element)) {
+	for (iter=ns_def->get_query.begin(); iter!=ns_def->get_query.end(); ++iter) {
+	    if (xdb_sql_execute_template(i, xq, conn, *iter, p->x, ns_def->get_result, result_element)) {
 		/* SQL query failed */
-		xdb_sql_execute(i, xq, "ROLLBACK", NULL, NULL);
+		xdb_sql_execute(i, xq, conn, "ROLLBACK", NULL, NULL);
 		return r_ERR;
 	    }
 	}
 
 	/* commit the transaction */
-	xdb_sql_execute(i, xq, "COMMIT", NULL, NULL);
+	xdb_sql_execute(i, xq, conn, "COMMIT", NULL, NULL);
 
 	/* construct the result */
 	xdb_sql_makeresult(p);
-	deliver(dpacket_new(p->x), NULL);
 	return r_DONE;
     }
 }
 
+/* forward declaration */
+static void xdb_sql_dispatch_waiting(instance i, xdbsql xq);
+
+/**
+ * mtq callback that processes a request and delivers the result
+ *
+ * @param arg the xdbsql_job to process
+ */
+static void _xdb_sql_job(void *arg) {
+    xdbsql_job job = static_cast<xdbsql_job>(arg);
+    instance i = job->i;
+    xdbsql xq = job->xq;
+    xdbsql_conn conn = job->conn;
+    dpacket p = job->p;		/* job is allocated from the packet's pool, do not use it after delivering */
+    std::string owner = jid_full(p->id);
+
+    result r = xdb_sql_process(i, xq, conn, job->ns_def, p);
+
+    /* the connection and the owner are free for the next request */
+    conn->busy = 0;
+    if (--xq->active_owners[owner] <= 0) {
+	xq->active_owners.erase(owner);
+    }
+
+    if (r == r_DONE) {
+	deliver(dpacket_new(p->x), NULL);
+    } else {
+	deliver_fail(p, N_("Internal Delivery Error"));
+    }
+
+    xdb_sql_dispatch_waiting(i, xq);
+}
+
+/**
+ * start processing a request, if a connection is available
+ *
+ * Requests of the same owner are never processed in parallel, so that the
+ * order of requests for an owner is kept.
+ *
+ * @param i the instance we are running in
+ * @param xq instance internal data
+ * @param p the packet containing the xdb query
+ * @return 0 if processing the request has been started, 1 if it has to wait
+ */
+static int xdb_sql_dispatch(instance i, xdbsql xq, dpacket p) {
+    std::string owner = jid_full(p->id);
+    xdbsql_conn conn = NULL;
+
+    /* is there already a request of this owner in progress? */
+    if (xq->active_owners.find(owner) != xq->active_owners.end()) {
+	return 1;
+    }
+
+    /* find a connection, that is not in use */
+    for (std::vector<xdbsql_conn>::iterator cur = xq->connections.begin(); cur != xq->connections.end(); ++cur) {
+	if (!(*cur)->busy) {
+	    conn = *cur;
+	    break;
+	}
+    }
+    if (conn == NULL) {
+	return 1;
+    }
+
+    /* hand it to a thread */
+    xdbsql_job job = static_cast<xdbsql_job>(pmalloco(p->p, sizeof(_xdbsql_job)));
+    job->i = i;
+    job->xq = xq;
+    job->conn = conn;
+    job->ns_def = xdb_sql_get_ns_def(xq, xmlnode_get_attrib_ns(p->x, "ns", NULL));
+    job->p = p;
+    conn->busy = 1;
+    xq->active_owners[owner]++;
+    mtq_send(NULL, p->p, _xdb_sql_job, job);
+
+    return 0;
+}
+
+/**
+ * check if there is a connection, that is not in use
+ *
+ * @param xq instance internal data
+ * @return 1 if there is a free connection, 0 else
+ */
+static int xdb_sql_has_free_connection(xdbsql xq) {
+    for (std::vector<xdbsql_conn>::iterator cur = xq->connections.begin(); cur != xq->connections.end(); ++cur) {
+	if (!(*cur)->busy)
+	    return 1;
+    }
+    return 0;
+}
+
+/**
+ * start processing waiting requests, as long as there are free connections
+ *
+ * Requests are started in the order they have been received. A request is never started
+ * before an older request of the same owner, that is still waiting.
+ *
+ * @param i the instance we are running in
+ * @param xq instance internal data
+ */
+static void xdb_sql_dispatch_waiting(instance i, xdbsql xq) {
+    std::list<dpacket>::iterator cur = xq->waiting.begin();
+    std::set<std::string> blocked;	/* owners that have an older request still waiting */
+
+    while (cur != xq->waiting.end()) {
+	std::string owner = jid_full((*cur)->id);
+
+	/* nothing can be started without a free connection */
+	if (!xdb_sql_has_free_connection(xq))
+	    return;
+
+	if (blocked.find(owner) == blocked.end() && xdb_sql_dispatch(i, xq, *cur) == 0) {
+	    cur = xq->waiting.erase(cur);
+	} else {
+	    blocked.insert(owner);
+	    ++cur;
+	}
+    }
+}
+
+/**
+ * callback function that is called by jabberd to handle xdb requests
+ *
+ * @param i the instance we are for jabberd
+ * @param p the packet containing the xdb query
+ * @param arg pointer to our own internal data
+ * @return r_DONE if we could handle the request, r_ERR otherwise
+ */
+static result xdb_sql_phandler(instance i, dpacket p, void *arg) {
+    xdbsql xq = (xdbsql)arg;	/* xdb_sql internal data */
+    char *ns = NULL;		/* namespace of the query */
+
+    log_debug2(ZONE, LOGT_STORAGE|LOGT_DELIVER, "handling xdb request %s", xmlnode_serialize_string(p->x, xmppd::ns_decl_list(), 0));
+
+    /* get the namespace of the request */
+    ns = xmlnode_get_attrib_ns(p->x, "ns", NULL);
+    if (ns == NULL) {
+	log_debug2(ZONE, LOGT_STORAGE|LOGT_STRANGE, "xdb_sql got a xdb request without namespace");
+	return r_ERR;
+    }
+
+    /* check if we know how to handle this namespace */
+    if (xdb_sql_get_ns_def(xq, ns) == NULL) {
+	log_error(i->id, "xdb_sql got a xdb request for an unconfigured namespace %s, use this handler only for selected namespaces.", ns);
+	return r_ERR;
+    }
+
+    /* queue it behind older requests, and process what can be processed */
+    xq->waiting.push_back(p);
+    xdb_sql_dispatch_waiting(i, xq);
+    if (!xq->waiting.empty())
+	log_debug2(ZONE, LOGT_STORAGE, "%i xdb requests waiting for a connection or an older request of the same owner", static_cast<int>(xq->waiting.size()));
+    return r_DONE;
+}
+
 /**
  * init the mysql driver
  *
@@ -669,11 +1311,6 @@ static result xdb_sql_phandler(instance i, dpacket p, void *arg) {
  */
 static void xdb_sql_mysql_init(instance i, xdbsql xq, xmlnode config) {
 #ifdef HAVE_MYSQL
-    /* create a MYSQL handle */
-    if (xq->mysql == NULL) {
-	xq->mysql = mysql_init(NULL);
-    }
-
     /* process our own configuration */
     xq->mysql_user = pstrdup(i->p, xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(config, "xdbsql:mysql/xdbsql:user", xq->std_namespace_prefixes), 0)));
     xq->mysql_password = pstrdup(i->p, xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(config, "xdbsql:mysql/xdbsql:password", xq->std_namespace_prefixes), 0)));
@@ -683,8 +1320,13 @@ static void xdb_sql_mysql_init(instance i, xdbsql xq, xmlnode config) {
     xq->mysql_socket = pstrdup(i->p, xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(config, "xdbsql:mysql/xdbsql:socket", xq->std_namespace_prefixes), 0)));
     xq->mysql_flag = j_atoi(xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(config, "xdbsql:mysql/xdbsql:flag", xq->std_namespace_prefixes), 0)), 0);
 
-    /* connect to the database server */
-    xdb_sql_mysql_connect(i, xq);
+    /* create a MYSQL handle for each connection, and connect to the database server */
+    for (std::vector<xdbsql_conn>::iterator conn = xq->connections.begin(); conn != xq->connections.end(); ++conn) {
+	if ((*conn)->mysql == NULL) {
+	    (*conn)->mysql = mysql_init(NULL);
+	}
+	xdb_sql_mysql_connect(i, xq, *conn);
+    }
 #else
     log_debug2(ZONE, LOGT_STRANGE, "xdb_sql_mysql_init called, but not compiled in.");
 #endif
@@ -703,13 +1345,22 @@ static void xdb_sql_postgresql_init(instance i, xdbsql xq, xmlnode config) {
     xq->postgresql_conninfo = pstrdup(i->p, xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(config, "xdbsql:postgresql/xdbsql:conninfo", xq->std_namespace_prefixes), 0)));
 
     /* connect to the database server */
-    xq->postgresql = PQconnectdb(xq->postgresql_conninfo);
+    for (std::vector<xdbsql_conn>::iterator conn = xq->connections.begin(); conn != xq->connections.end(); ++conn) {
+	(*conn)->postgresql = PQconnectdb(xq->postgresql_conninfo);
 
-    /* did we connect? */
-    if (PQstatus(xq->postgresql) != CONNECTION_OK) {
-	log_error(i->id, "failed to connect to postgresql server: %s", PQerrorMessage(xq->postgresql));
-    } else if (xq->onconnect) {
-	xdb_sql_execute(i, xq, xq->onconnect, NULL, NULL);
+	/* did we connect? */
+	if (PQstatus((*conn)->postgresql) != CONNECTION_OK) {
+	    log_error(i->id, "failed to connect to postgresql server: %s", PQerrorMessage((*conn)->postgresql));
+	    continue;
+	}
+
+	/* we are waiting for results using pth, the connection must not block */
+	PQsetnonblocking((*conn)->postgresql, 1);
+
+	if (xq->onconnect) {
+	    xdb_sql_execute(i, xq, *conn, xq->onconnect, NULL, NULL);
+	}
+	xdb_sql_prepare_all(i, xq, *conn);
     }
 #else
     log_debug2(ZONE, LOGT_STRANGE, "xdb_sql_postgresql_init called, but not compiled in.");
@@ -778,6 +1429,94 @@ static void xdb_sql_query_preprocess(instance i, char *query, std::vector<std::s
     }
 }
 
+/**
+ * create the statement, that gets prepared for a query template
+ *
+ * Variables, that are the only content of a single quoted string literal, are
+ * replaced by placeholders for bind parameters. If a variable is used in any other
+ * way, the template is not prepared and queries are constructed from it instead.
+ *
+ * @param xq our instance internal data
+ * @param query the query template, the prepared statement is stored in it
+ */
+static void xdb_sql_query_make_prepared(xdbsql xq, _xdbsql_query &query) {
+    std::ostringstream prepared;
+    std::vector<std::string>::size_type count = query.tokens.size();
+    int in_string = 0;		/* if we are inside a string literal */
+    int opened = 0;		/* if the last character of the previous literal started a string literal */
+    int params = 0;
+
+    /* a template without literal after the last variable has an unterminated variable */
+    if (count % 2 == 0) {
+	return;
+    }
+
+    for (std::vector<std::string>::size_type n = 0; n < count; n++) {
+	const std::string &token = query.tokens[n];
+
+	if (n % 2 == 0) {
+	    /* literal: the quotes around the neighbouring variables are replaced by placeholders */
+	    std::string::size_type start = 0;
+	    std::string::size_type end = n+1 < count ? token.length()-1 : token.length();
+
+	    /* backslashes may escape quotes, we cannot handle this */
+	    if (token.find('\\') != std::string::npos) {
+		return;
+	    }
+
+	    /* the quote after a variable has to end the string literal (and not be an escaped quote) */
+	    if (n > 0) {
+		if (token.empty() || token[0] != '\'' || (token.length() > 1 && token[1] == '\'')) {
+		    return;
+		}
+		in_string = 0;
+		start = 1;
+	    }
+
+	    /* find the string literals, and check that the quote before the next variable starts one */
+	    opened = 0;
+	    for (std::string::size_type c = start; c < token.length(); c++) {
+		opened = 0;
+		if (token[c] != '\'') {
+		    continue;
+		}
+		if (!in_string) {
+		    in_string = 1;
+		    opened = 1;
+		} else if (c+1 < token.length() && token[c+1] == '\'') {
+		    c++;
+		} else {
+		    in_string = 0;
+		}
+	    }
+	    if (n+1 < count && (!opened || start > end)) {
+		return;
+	    }
+
+	    prepared << token.substr(start, end-start);
+	    continue;
+	}
+
+	/* variable */
+	params++;
+#ifdef HAVE_POSTGRESQL
+	if (xq->use_postgresql) {
+	    prepared << '$' << params;
+	    continue;
+	}
+#endif
+	prepared << '?';
+    }
+
+    if (in_string) {
+	return;
+    }
+
+    query.prepared = prepared.str();
+    query.params = params;
+    log_debug2(ZONE, LOGT_INIT|LOGT_STORAGE, "template %i gets prepared as: %s", query.id, query.prepared.c_str());
+}
+
 /**
  * get (potentially) multiple SQL queries for a single acction, prepare them and add them to the list of queries
  *
@@ -787,13 +1526,15 @@ static void xdb_sql_query_preprocess(instance i, char *query, std::vector<std::s
  * @param dest where to store the result
  * @param path which definition to handle
  */
-static void _xdb_sql_create_preprocessed_sql_list(instance i, xdbsql xq, xmlnode handler, std::list< std::vector<std::string> > &dest, const char *path) {
+static void _xdb_sql_create_preprocessed_sql_list(instance i, xdbsql xq, xmlnode handler, std::list<_xdbsql_query> &dest, const char *path) {
     xmlnode_vector definitions = xmlnode_get_tags(handler, path, xq->std_namespace_prefixes);
 
     for (xmlnode_vector::iterator definition = definitions.begin(); definition != definitions.end(); ++definition) {
-	std::vector<std::string> parsed_definition;
+	_xdbsql_query parsed_definition;
 
-	xdb_sql_query_preprocess(i, xmlnode_get_data(*definition), parsed_definition);
+	xdb_sql_query_preprocess(i, xmlnode_get_data(*definition), parsed_definition.tokens);
+	parsed_definition.id = ++xq->queries;
+	xdb_sql_query_make_prepared(xq, parsed_definition);
 	dest.push_back(parsed_definition);
     }
 
@@ -857,9 +1598,27 @@ static void xdb_sql_handler_read(instance i, xdbsql xq, xmlnode config) {
 static void xdb_sql_cleanup(void *arg) {
     xdbsql xq = reinterpret_cast<xdbsql>(arg); // sorry, but I have to use the reinterpret_cast as we get it as a void*
 
-    if (xq != NULL) {
-	delete xq;
+    if (xq == NULL) {
+	return;
+    }
+
+    /* close the connections to the database server */
+    for (std::vector<xdbsql_conn>::iterator conn = xq->connections.begin(); conn != xq->connections.end(); ++conn) {
+#ifdef HAVE_MYSQL
+	xdb_sql_mysql_forget_prepared(*conn);
+	if ((*conn)->mysql != NULL) {
+	    mysql_close((*conn)->mysql);
+	}
+#endif
+#ifdef HAVE_POSTGRESQL
+	if ((*conn)->postgresql != NULL) {
+	    PQfinish((*conn)->postgresql);
+	}
+#endif
+	delete *conn;
     }
+
+    delete xq;
 }
 
 /**
@@ -873,6 +1632,7 @@ extern "C" void xdb_sql(instance i, xmlnode x) {
     xmlnode config = NULL;	/* our configuration */
     xdbsql xq = NULL;		/* pointer to instance internal data */
     char *driver = NULL;	/* database driver to use */
+    int connections = 0;	/* number of connections to the database server */
 
     /* output a first sign of life ... :) */
     log_debug2(ZONE, LOGT_INIT, "xdb_sql loading");
@@ -910,6 +1670,16 @@ extern "C" void xdb_sql(instance i, xmlnode x) {
     xq->onconnect = xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(config, "xdbsql:onconnect", xq->std_namespace_prefixes), 0));
     log_debug2(ZONE, LOGT_EXECFLOW, "using the following query on SQL connection establishment: %s", xq->onconnect);
 
+    /* how many connections should we open? */
+    connections = j_atoi(xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(config, "xdbsql:connections", xq->std_namespace_prefixes), 0)), 1);
+    if (connections < 1) {
+	connections = 1;
+    }
+    for (int n = 0; n < connections; n++) {
+	xq->connections.push_back(new _xdbsql_conn);
+    }
+    log_debug2(ZONE, LOGT_INIT, "using %i connection(s) to the SQL server", connections);
+
     /* use which driver? */
     driver = xmlnode_get_data(xmlnode_get_list_item(xmlnode_get_tags(config, "xdbsql:driver", xq->std_namespace_prefixes), 0));
     if (driver == NULL) {
@@ -919,20 +1689,30 @@ extern "C" void xdb_sql(instance i, xmlnode x) {
 #ifdef HAVE_MYSQL
     } else if (j_strcmp(driver, "mysql") == 0) {
 	xq->use_mysql = 1;		/* use mysql for the queries */
-	xdb_sql_mysql_init(i, xq, config);
 #endif
 #ifdef HAVE_POSTGRESQL
     } else if (j_strcmp(driver, "postgresql") == 0) {
 	xq->use_postgresql = 1;		/* use postgresql for the queries */
-	xdb_sql_postgresql_init(i, xq, config);
 #endif
     } else {
 	log_error(i->id, "Your xdb_sql is compiled without support for the selected database driver '%s'.", driver);
     }
 
-    /* read the handler defintions */
+    /* read the handler defintions (before connecting, as they get prepared on connect) */
     xdb_sql_handler_read(i, xq, config);
 
+    /* connect to the database server */
+#ifdef HAVE_MYSQL
+    if (xq->use_mysql) {
+	xdb_sql_mysql_init(i, xq, config);
+    }
+#endif
+#ifdef HAVE_POSTGRESQL
+    if (xq->use_postgresql) {
+	xdb_sql_postgresql_init(i, xq, config);
+    }
+#endif
+
     /* register our packet handler */
     register_phandler(i, o_DELIVER, xdb_sql_phandler, (void *)xq);
 